@@ -290,6 +290,29 @@ CREATE ACCESS METHOD hnsw TYPE INDEX HANDLER hnswhandler;
 
 COMMENT ON ACCESS METHOD hnsw IS 'hnsw index access method';
 
+-- index maintenance functions
+
+CREATE FUNCTION ivfflat_rebalance(index regclass, split_factor float8 DEFAULT 4, merge_factor float8 DEFAULT 0.25) RETURNS integer
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION hnsw_merge_pending(index regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION hnsw_resume_build(index regclass) RETURNS bigint
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+
+-- batch search functions
+
+CREATE FUNCTION vector_knn_batch(index regclass, queries vector[], k integer, OUT query_idx integer, OUT tid tid, OUT distance float8) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C STABLE STRICT;
+
+-- build stats
+
+CREATE FUNCTION vector_build_stats(OUT index regclass, OUT phase text, OUT participant integer, OUT duration float8, OUT tuples bigint, OUT distances bigint, OUT memory bigint, OUT spills bigint) RETURNS SETOF record
+	AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+
+CREATE VIEW vector_build_stats AS SELECT * FROM vector_build_stats();
+
 -- access method private functions
 
 CREATE FUNCTION ivfflat_halfvec_support(internal) RETURNS internal
@@ -321,6 +344,7 @@ CREATE OPERATOR CLASS vector_ops
 CREATE OPERATOR CLASS vector_l2_ops
 	DEFAULT FOR TYPE vector USING ivfflat AS
 	OPERATOR 1 <-> (vector, vector) FOR ORDER BY float_ops,
+	OPERATOR 2 <<->> (vector, range_query_params),
 	FUNCTION 1 vector_l2_squared_distance(vector, vector),
 	FUNCTION 3 l2_distance(vector, vector);
 
@@ -63,37 +63,85 @@ static uint32 IPTBinarySearch(IPTNode* node, ItemPointerData key)
     return low;
 }
 
-ItemPointerData IPTSearch(Relation index, BlockNumber rootPage, ItemPointerData key)
+void IPTInitSearchCache(IPTSearchCache* cache)
 {
-    Buffer  buf;
-    Page    page;
-    IPTNode *node;
-    ItemPointerData result;
-    if (rootPage >= RelationGetNumberOfBlocks(index))
-    {
-        ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
-    }
-    buf = ReadBuffer(index, rootPage);
-    LockBuffer(buf, BUFFER_LOCK_SHARE);
-    page = BufferGetPage(buf);
-    node = PageGetIPTNode(page);
-    if (IsLeafNode(node))
+    cache->nblocks = 0;
+    for (int i = 0; i < IPT_CACHED_LEVELS; i++)
+        cache->bufs[i] = InvalidBuffer;
+}
+
+void IPTReleaseSearchCache(IPTSearchCache* cache)
+{
+    for (int i = 0; i < IPT_CACHED_LEVELS; i++)
     {
-        uint32 pos = IPTBinarySearch(node, key);
-        result = node->values[pos];
-        UnlockReleaseBuffer(buf);
-        return result;
+        if (BufferIsValid(cache->bufs[i]))
+            ReleaseBuffer(cache->bufs[i]);
+        cache->bufs[i] = InvalidBuffer;
     }
-    else
+}
+
+/*
+ * Search from the root to a leaf
+ *
+ * With a cache, the pages of the upper levels stay pinned, so most searches
+ * do not need a buffer mapping lookup for them
+ */
+ItemPointerData IPTSearch(Relation index, BlockNumber rootPage, ItemPointerData key, IPTSearchCache* cache)
+{
+    BlockNumber pageBlk = rootPage;
+
+    for (int level = 0;; level++)
     {
-        uint32 pos = IPTBinarySearch(node, key);
-        BlockNumber nextPage = ItemPointerGetBlockNumber(&node->values[pos]);
-        UnlockReleaseBuffer(buf);
-        return IPTSearch(index, nextPage, key);
+        Buffer  buf;
+        Page    page;
+        IPTNode *node;
+        uint32  pos;
+        bool    cached = cache != NULL && level < IPT_CACHED_LEVELS;
+
+        if (cached)
+        {
+            /* Only check the size again when it may have grown */
+            if (pageBlk >= cache->nblocks)
+                cache->nblocks = RelationGetNumberOfBlocks(index);
+            if (pageBlk >= cache->nblocks)
+            {
+                ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
+            }
+            cache->bufs[level] = ReleaseAndReadBuffer(cache->bufs[level], index, pageBlk);
+            buf = cache->bufs[level];
+        }
+        else
+        {
+            /* ReadBuffer reports blocks past the end of the relation */
+            buf = ReadBuffer(index, pageBlk);
+        }
+
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        node = PageGetIPTNode(page);
+        pos = IPTBinarySearch(node, key);
+
+        if (IsLeafNode(node))
+        {
+            ItemPointerData result = node->values[pos];
+
+            if (cached)
+                LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+            else
+                UnlockReleaseBuffer(buf);
+            return result;
+        }
+
+        pageBlk = ItemPointerGetBlockNumber(&node->values[pos]);
+
+        if (cached)
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        else
+            UnlockReleaseBuffer(buf);
     }
 }
 
-static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerData key, ItemPointerData value, ItemPointer popKey, ItemPointer popValue, List** occupied)
+static void IPTInsert_internal(Relation index, BlockNumber nblocks, BlockNumber pageBlk, ItemPointerData key, ItemPointerData value, ItemPointer popKey, ItemPointer popValue, List** occupied)
 {
     ItemPointerData nextLevelPopKey, nextLevelPopValue;
     Buffer buf;
@@ -104,7 +152,8 @@ static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerD
     GenericXLogState* state = GenericXLogStart(index);
     ItemPointerSetInvalid(&nextLevelPopKey);
     ItemPointerSetInvalid(&nextLevelPopValue);
-    if (pageBlk >= RelationGetNumberOfBlocks(index))
+    /* Pages are only added below the visited levels, so the size is checked once */
+    if (pageBlk >= nblocks)
     {
         ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
     }
@@ -130,6 +179,14 @@ static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerD
             UnlockReleaseBuffer(buf);
             return;
         }
+        /* Replace the value of an existing key */
+        if (pos < node->num_keys && ItemPointerEquals(&node->keys[pos], &key))
+        {
+            node->values[pos] = value;
+            GenericXLogFinish(state);
+            UnlockReleaseBuffer(buf);
+            return;
+        }
         memmove(&node->keys[pos+1], &node->keys[pos], sizeof(ItemPointerData)*(node->num_keys - pos));
         memmove(&node->values[pos+1], &node->values[pos], sizeof(ItemPointerData)*(node->num_keys - pos));
         node->keys[pos] = key;
@@ -154,7 +211,8 @@ static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerD
             memcpy(&newNode->keys[0], &node->keys[pos], sizeof(ItemPointerData)*(newNode->num_keys));
             memcpy(&newNode->values[0], &node->values[pos], sizeof(ItemPointerData)*(newNode->num_keys));
             node->num_keys = pos;
-            ItemPointerSet(popKey, ItemPointerGetBlockNumber(&newNode->keys[0]), ItemPointerGetOffsetNumber(&newNode->keys[0]));
+            /* Like bulk loading, a key equal to the separator is in the left node */
+            ItemPointerSet(popKey, ItemPointerGetBlockNumber(&node->keys[pos-1]), ItemPointerGetOffsetNumber(&node->keys[pos-1]));
             ItemPointerSet(popValue, BufferGetBlockNumber(newBuf), FirstOffsetNumber);
             GenericXLogFinish(newState);
             // MarkBufferDirty(newBuf);
@@ -164,7 +222,7 @@ static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerD
     else
     {
         nextPage = ItemPointerGetBlockNumber(&node->values[pos]);
-        IPTInsert_internal(index, nextPage, key, value, &nextLevelPopKey, &nextLevelPopValue, occupied);
+        IPTInsert_internal(index, nblocks, nextPage, key, value, &nextLevelPopKey, &nextLevelPopValue, occupied);
         if (!ItemPointerIsValid(&nextLevelPopKey))
         {
             GenericXLogAbort(state);
@@ -207,6 +265,9 @@ static void IPTInsert_internal(Relation index, BlockNumber pageBlk, ItemPointerD
     UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Insert a key, or replace its value if it exists
+ */
 void IPTInsert(Relation index, BlockNumber rootPageBlk, ItemPointerData key, ItemPointerData value, BlockNumber* updatedRootPage)
 {
     ItemPointerData nextLevelPopKey, nextLevelPopValue;
@@ -215,7 +276,7 @@ void IPTInsert(Relation index, BlockNumber rootPageBlk, ItemPointerData key, Ite
     ListCell        * lc;
     ItemPointerSetInvalid(&nextLevelPopKey);
     ItemPointerSetInvalid(&nextLevelPopValue);
-    IPTInsert_internal(index, rootPageBlk, key, value, &nextLevelPopKey, &nextLevelPopValue, &occupied);
+    IPTInsert_internal(index, RelationGetNumberOfBlocks(index), rootPageBlk, key, value, &nextLevelPopKey, &nextLevelPopValue, &occupied);
     if (ItemPointerIsValid(&nextLevelPopKey))
     {
         /* Create new root page to store the popped value*/
@@ -247,6 +308,136 @@ void IPTInsert(Relation index, BlockNumber rootPageBlk, ItemPointerData key, Ite
     // }
 }
 
+/*
+ * Bulk loading for builds
+ *
+ * Nodes are filled left to right from keys in ascending order and are not
+ * WAL-logged. Keys of internal nodes are the largest key of each child except
+ * the last, so a search for a key equal to a separator goes to the left child.
+ * The last node written becomes the root page, which keeps its block number.
+ */
+#define IPT_BULK_LEAF_KEYS (MAX_KEYS - 1)
+#define IPT_BULK_CHILDREN MAX_KEYS
+
+void IPTBulkInit(IPTBulkState* state, Relation index, ForkNumber forkNum, BlockNumber rootPage)
+{
+    state->index = index;
+    state->forkNum = forkNum;
+    state->rootPage = rootPage;
+    memset(&state->leaf, 0, sizeof(IPTNode));
+    state->leaf.type = IPTNODE_LEAF;
+    state->maxnodes = 64;
+    state->nnodes = 0;
+    state->maxKeys = palloc(sizeof(ItemPointerData) * state->maxnodes);
+    state->blknos = palloc(sizeof(BlockNumber) * state->maxnodes);
+}
+
+static BlockNumber IPTBulkWriteNode(IPTBulkState* state, IPTNode* node, bool root)
+{
+    Buffer      buf;
+    Page        page;
+    BlockNumber blkno;
+
+    if (root)
+    {
+        buf = ReadBufferExtended(state->index, state->forkNum, state->rootPage, RBM_NORMAL, NULL);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+    }
+    else
+        buf = IPTNewBuffer(state->index, state->forkNum);
+
+    page = BufferGetPage(buf);
+    IPTInitPage(buf, page);
+    memcpy(PageGetIPTNode(page), node, sizeof(IPTNode));
+
+    blkno = BufferGetBlockNumber(buf);
+    MarkBufferDirty(buf);
+    UnlockReleaseBuffer(buf);
+    return blkno;
+}
+
+static void IPTBulkPush(IPTBulkState* state, ItemPointerData maxKey, BlockNumber blkno)
+{
+    if (state->nnodes == state->maxnodes)
+    {
+        state->maxnodes *= 2;
+        state->maxKeys = repalloc_huge(state->maxKeys, sizeof(ItemPointerData) * state->maxnodes);
+        state->blknos = repalloc_huge(state->blknos, sizeof(BlockNumber) * state->maxnodes);
+    }
+
+    state->maxKeys[state->nnodes] = maxKey;
+    state->blknos[state->nnodes] = blkno;
+    state->nnodes++;
+}
+
+void IPTBulkAdd(IPTBulkState* state, ItemPointerData key, ItemPointerData value)
+{
+    IPTNode    *leaf = &state->leaf;
+
+    /* Write a full leaf only once another follows, so a single leaf becomes the root */
+    if (leaf->num_keys == IPT_BULK_LEAF_KEYS)
+    {
+        IPTBulkPush(state, leaf->keys[leaf->num_keys - 1], IPTBulkWriteNode(state, leaf, false));
+        leaf->num_keys = 0;
+    }
+
+    leaf->keys[leaf->num_keys] = key;
+    leaf->values[leaf->num_keys] = value;
+    leaf->num_keys++;
+}
+
+void IPTBulkFinish(IPTBulkState* state)
+{
+    IPTNode    *node;
+
+    if (state->nnodes == 0)
+    {
+        IPTBulkWriteNode(state, &state->leaf, true);
+        return;
+    }
+
+    IPTBulkPush(state, state->leaf.keys[state->leaf.num_keys - 1], IPTBulkWriteNode(state, &state->leaf, false));
+
+    node = palloc(sizeof(IPTNode));
+
+    /* Add internal levels until there is one node */
+    while (state->nnodes > 1)
+    {
+        ItemPointerData *childKeys = state->maxKeys;
+        BlockNumber *childBlknos = state->blknos;
+        int64       nchildren = state->nnodes;
+        bool        root = nchildren <= IPT_BULK_CHILDREN;
+
+        state->nnodes = 0;
+        state->maxKeys = palloc(sizeof(ItemPointerData) * state->maxnodes);
+        state->blknos = palloc(sizeof(BlockNumber) * state->maxnodes);
+
+        for (int64 i = 0; i < nchildren; i += IPT_BULK_CHILDREN)
+        {
+            int         n = Min(IPT_BULK_CHILDREN, nchildren - i);
+
+            memset(node, 0, sizeof(IPTNode));
+            node->type = IPTNODE_INTERNAL;
+            node->num_keys = n - 1;
+            for (int j = 0; j < n; j++)
+            {
+                if (j < n - 1)
+                    node->keys[j] = childKeys[i + j];
+                ItemPointerSet(&node->values[j], childBlknos[i + j], FirstOffsetNumber);
+            }
+
+            IPTBulkPush(state, childKeys[i + n - 1], IPTBulkWriteNode(state, node, root));
+        }
+
+        pfree(childKeys);
+        pfree(childBlknos);
+    }
+
+    pfree(node);
+    pfree(state->maxKeys);
+    pfree(state->blknos);
+}
+
 void IPTDelete(Relation index, BlockNumber rootPage, ItemPointerData key)
 {
     elog(ERROR, "Unimplemented IPTDeleted");
@@ -32,13 +32,40 @@ typedef struct IPTNode
     ItemPointerData values[TREE_ORDER + 1]; 
 } IPTNode;
 
+/* Pages kept pinned between searches, one per level from the root */
+#define IPT_CACHED_LEVELS 4
+
+typedef struct IPTSearchCache
+{
+    BlockNumber nblocks;    /* relation size when last checked */
+    Buffer      bufs[IPT_CACHED_LEVELS];
+} IPTSearchCache;
+
+/* Bottom-up build from keys added in ascending order */
+typedef struct IPTBulkState
+{
+    Relation    index;
+    ForkNumber  forkNum;
+    BlockNumber rootPage;
+    IPTNode     leaf;
+    ItemPointerData *maxKeys;   /* largest key of each written node */
+    BlockNumber *blknos;
+    int64       nnodes;
+    int64       maxnodes;
+} IPTBulkState;
+
 Buffer IPTNewBuffer(Relation index, ForkNumber fork_num);
 void   IPTInitPage(Buffer buf, Page page);
 
 
-ItemPointerData IPTSearch(Relation index, BlockNumber rootPage, ItemPointerData key);
+void IPTInitSearchCache(IPTSearchCache* cache);
+void IPTReleaseSearchCache(IPTSearchCache* cache);
+ItemPointerData IPTSearch(Relation index, BlockNumber rootPage, ItemPointerData key, IPTSearchCache* cache);
 void IPTInsert(Relation index, BlockNumber rootPage, ItemPointerData key, ItemPointerData value, BlockNumber* updatedRootPage);
 void IPTDelete(Relation index, BlockNumber rootPage, ItemPointerData key);
+void IPTBulkInit(IPTBulkState* state, Relation index, ForkNumber forkNum, BlockNumber rootPage);
+void IPTBulkAdd(IPTBulkState* state, ItemPointerData key, ItemPointerData value);
+void IPTBulkFinish(IPTBulkState* state);
 
 
 #endif
\ No newline at end of file
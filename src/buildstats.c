@@ -0,0 +1,237 @@
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "buildstats.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+#include "vector.h"
+
+int64		vector_distance_count = 0;
+
+/* Stats of the last build in this process */
+static Oid	buildIndexOid = InvalidOid;
+static VectorBuildPhaseStats *buildPhases = NULL;
+static int	buildPhasesLength = 0;
+static int	buildPhasesMaxlen = 0;
+
+/* Phase being timed */
+static int	currentPhase = -1;
+static const char *currentPhaseName = NULL;
+static instr_time phaseStart;
+static int64 phaseDistances;
+
+/*
+ * Get the stats of a phase, adding them if needed
+ */
+static int
+GetPhaseStats(const char *phase, int participant)
+{
+	VectorBuildPhaseStats *stats;
+
+	for (int i = 0; i < buildPhasesLength; i++)
+	{
+		if (buildPhases[i].participant == participant && strcmp(buildPhases[i].phase, phase) == 0)
+			return i;
+	}
+
+	if (buildPhasesLength == buildPhasesMaxlen)
+	{
+		buildPhasesMaxlen = Max(buildPhasesMaxlen * 2, VECTOR_BUILD_MAX_PHASES);
+
+		if (buildPhases == NULL)
+			buildPhases = MemoryContextAlloc(TopMemoryContext, sizeof(VectorBuildPhaseStats) * buildPhasesMaxlen);
+		else
+			buildPhases = repalloc(buildPhases, sizeof(VectorBuildPhaseStats) * buildPhasesMaxlen);
+	}
+
+	stats = &buildPhases[buildPhasesLength];
+	memset(stats, 0, sizeof(VectorBuildPhaseStats));
+	strlcpy(stats->phase, phase, NAMEDATALEN);
+	stats->participant = participant;
+
+	return buildPhasesLength++;
+}
+
+/*
+ * Start collecting stats for a build, replacing those of the last build
+ */
+void
+VectorBuildStatsBegin(Relation index)
+{
+	buildIndexOid = RelationGetRelid(index);
+	buildPhasesLength = 0;
+	currentPhase = -1;
+	currentPhaseName = NULL;
+}
+
+/*
+ * Switch to a phase, or stop timing if phase is NULL
+ *
+ * Time and distances are added to the phase that was running, and its name
+ * is returned so nested phases can switch back
+ */
+const char *
+VectorBuildStatsPhase(const char *phase)
+{
+	const char *prev = currentPhaseName;
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	if (currentPhase >= 0)
+	{
+		VectorBuildPhaseStats *stats = &buildPhases[currentPhase];
+		instr_time	duration = now;
+
+		INSTR_TIME_SUBTRACT(duration, phaseStart);
+		stats->duration += INSTR_TIME_GET_MILLISEC(duration);
+		stats->distances += vector_distance_count - phaseDistances;
+	}
+
+	/* The leader is participant 0 */
+	currentPhase = phase != NULL ? GetPhaseStats(phase, ParallelWorkerNumber + 1) : -1;
+	currentPhaseName = phase;
+	phaseStart = now;
+	phaseDistances = vector_distance_count;
+
+	return prev;
+}
+
+/*
+ * Add tuples to the current phase
+ */
+void
+VectorBuildStatsTuples(int64 tuples)
+{
+	if (currentPhase >= 0)
+		buildPhases[currentPhase].tuples += tuples;
+}
+
+/*
+ * Record the memory used by the current phase, keeping the peak
+ */
+void
+VectorBuildStatsMemory(Size memory)
+{
+	if (currentPhase >= 0)
+		buildPhases[currentPhase].memory = Max(buildPhases[currentPhase].memory, (int64) memory);
+}
+
+/*
+ * Count data that did not fit into memory during the current phase
+ */
+void
+VectorBuildStatsSpill(void)
+{
+	if (currentPhase >= 0)
+		buildPhases[currentPhase].spills++;
+}
+
+/*
+ * Initialize stats in shared memory for parallel workers
+ */
+void
+VectorBuildStatsInitShared(VectorBuildSharedStats * shared, int nworkers)
+{
+	memset(shared, 0, VECTOR_BUILD_SHARED_STATS_SIZE(nworkers));
+	shared->nworkers = nworkers;
+}
+
+/*
+ * Within a worker, copy its stats to shared memory
+ *
+ * Each worker has its own slots, so no locking is needed
+ */
+void
+VectorBuildStatsPublish(VectorBuildSharedStats * shared)
+{
+	VectorBuildPhaseStats *slots;
+
+	Assert(ParallelWorkerNumber >= 0 && ParallelWorkerNumber < shared->nworkers);
+
+	VectorBuildStatsPhase(NULL);
+
+	if (buildPhasesLength == 0)
+		return;
+
+	slots = &shared->phases[ParallelWorkerNumber * VECTOR_BUILD_MAX_PHASES];
+	memcpy(slots, buildPhases, sizeof(VectorBuildPhaseStats) * Min(buildPhasesLength, VECTOR_BUILD_MAX_PHASES));
+}
+
+/*
+ * Within the leader, add stats of workers once they have finished
+ */
+void
+VectorBuildStatsCollect(VectorBuildSharedStats * shared)
+{
+	for (int i = 0; i < shared->nworkers * VECTOR_BUILD_MAX_PHASES; i++)
+	{
+		VectorBuildPhaseStats *workerStats = &shared->phases[i];
+		VectorBuildPhaseStats *stats;
+
+		if (workerStats->phase[0] == '\0')
+			continue;
+
+		stats = &buildPhases[GetPhaseStats(workerStats->phase, workerStats->participant)];
+		stats->duration += workerStats->duration;
+		stats->tuples += workerStats->tuples;
+		stats->distances += workerStats->distances;
+		stats->memory = Max(stats->memory, workerStats->memory);
+		stats->spills += workerStats->spills;
+	}
+}
+
+/*
+ * Get stats for each phase of the last build in this session
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(vector_build_stats);
+Datum
+vector_build_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldCtx;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* Materialize results */
+	oldCtx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldCtx);
+
+	for (int i = 0; i < buildPhasesLength; i++)
+	{
+		VectorBuildPhaseStats *stats = &buildPhases[i];
+		Datum		values[8];
+		bool		nulls[8] = {false, false, false, false, false, false, false, false};
+
+		values[0] = ObjectIdGetDatum(buildIndexOid);
+		values[1] = CStringGetTextDatum(stats->phase);
+		values[2] = Int32GetDatum(stats->participant);
+		values[3] = Float8GetDatum(stats->duration);
+		values[4] = Int64GetDatum(stats->tuples);
+		values[5] = Int64GetDatum(stats->distances);
+		values[6] = Int64GetDatum(stats->memory);
+		values[7] = Int64GetDatum(stats->spills);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,43 @@
+#ifndef BUILDSTATS_H
+#define BUILDSTATS_H
+
+#include "postgres.h"
+
+#include "utils/relcache.h"
+
+/* Phases a participant can record */
+#define VECTOR_BUILD_MAX_PHASES	8
+
+#define VECTOR_BUILD_SHARED_STATS_SIZE(_nworkers)	(offsetof(VectorBuildSharedStats, phases) + sizeof(VectorBuildPhaseStats) * (_nworkers) * VECTOR_BUILD_MAX_PHASES)
+
+/* Distances computed by this process */
+extern int64 vector_distance_count;
+
+typedef struct VectorBuildPhaseStats
+{
+	char		phase[NAMEDATALEN];
+	int			participant;
+	double		duration;
+	int64		tuples;
+	int64		distances;
+	int64		memory;
+	int64		spills;
+}			VectorBuildPhaseStats;
+
+/* Stats of parallel workers, which are collected by the leader */
+typedef struct VectorBuildSharedStats
+{
+	int			nworkers;
+	VectorBuildPhaseStats phases[FLEXIBLE_ARRAY_MEMBER];
+}			VectorBuildSharedStats;
+
+void		VectorBuildStatsBegin(Relation index);
+const char *VectorBuildStatsPhase(const char *phase);
+void		VectorBuildStatsTuples(int64 tuples);
+void		VectorBuildStatsMemory(Size memory);
+void		VectorBuildStatsSpill(void);
+void		VectorBuildStatsInitShared(VectorBuildSharedStats * shared, int nworkers);
+void		VectorBuildStatsPublish(VectorBuildSharedStats * shared);
+void		VectorBuildStatsCollect(VectorBuildSharedStats * shared);
+
+#endif
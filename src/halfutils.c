@@ -21,6 +21,8 @@
 
 float		(*HalfvecL2SquaredDistance) (int dim, half * ax, half * bx);
 float		(*HalfvecInnerProduct) (int dim, half * ax, half * bx);
+void		(*HalfvecL2SquaredDistance4) (int dim, half * ax, half ** bx, float *distances);
+void		(*HalfvecInnerProduct4) (int dim, half * ax, half ** bx, float *distances);
 double		(*HalfvecCosineSimilarity) (int dim, half * ax, half * bx);
 float		(*HalfvecL1Distance) (int dim, half * ax, half * bx);
 
@@ -76,6 +78,82 @@ HalfvecL2SquaredDistanceF16c(int dim, half * ax, half * bx)
 }
 #endif
 
+static void
+HalfvecL2SquaredDistance4Default(int dim, half * ax, half ** bx, float *distances)
+{
+	half	   *b0 = bx[0];
+	half	   *b1 = bx[1];
+	half	   *b2 = bx[2];
+	half	   *b3 = bx[3];
+	float		d0 = 0.0;
+	float		d1 = 0.0;
+	float		d2 = 0.0;
+	float		d3 = 0.0;
+
+	/* Auto-vectorized, with each element of ax converted once */
+	for (int i = 0; i < dim; i++)
+	{
+		float		axi = HalfToFloat4(ax[i]);
+		float		diff0 = axi - HalfToFloat4(b0[i]);
+		float		diff1 = axi - HalfToFloat4(b1[i]);
+		float		diff2 = axi - HalfToFloat4(b2[i]);
+		float		diff3 = axi - HalfToFloat4(b3[i]);
+
+		d0 += diff0 * diff0;
+		d1 += diff1 * diff1;
+		d2 += diff2 * diff2;
+		d3 += diff3 * diff3;
+	}
+
+	distances[0] = d0;
+	distances[1] = d1;
+	distances[2] = d2;
+	distances[3] = d3;
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+HalfvecL2SquaredDistance4F16c(int dim, half * ax, half ** bx, float *distances)
+{
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist[4];
+
+	for (int j = 0; j < 4; j++)
+		dist[j] = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m128i		axi = _mm_loadu_si128((__m128i *) (ax + i));
+		__m256		axs = _mm256_cvtph_ps(axi);
+
+		for (int j = 0; j < 4; j++)
+		{
+			__m128i		bxi = _mm_loadu_si128((__m128i *) (bx[j] + i));
+			__m256		bxs = _mm256_cvtph_ps(bxi);
+			__m256		diff = _mm256_sub_ps(axs, bxs);
+
+			dist[j] = _mm256_fmadd_ps(diff, diff, dist[j]);
+		}
+	}
+
+	for (int j = 0; j < 4; j++)
+	{
+		_mm256_storeu_ps(s, dist[j]);
+
+		distances[j] = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+		for (int k = i; k < dim; k++)
+		{
+			float		diff = HalfToFloat4(ax[k]) - HalfToFloat4(bx[j][k]);
+
+			distances[j] += diff * diff;
+		}
+	}
+}
+#endif
+
 static float
 HalfvecInnerProductDefault(int dim, half * ax, half * bx)
 {
@@ -119,6 +197,73 @@ HalfvecInnerProductF16c(int dim, half * ax, half * bx)
 }
 #endif
 
+static void
+HalfvecInnerProduct4Default(int dim, half * ax, half ** bx, float *distances)
+{
+	half	   *b0 = bx[0];
+	half	   *b1 = bx[1];
+	half	   *b2 = bx[2];
+	half	   *b3 = bx[3];
+	float		d0 = 0.0;
+	float		d1 = 0.0;
+	float		d2 = 0.0;
+	float		d3 = 0.0;
+
+	/* Auto-vectorized, with each element of ax converted once */
+	for (int i = 0; i < dim; i++)
+	{
+		float		axi = HalfToFloat4(ax[i]);
+
+		d0 += axi * HalfToFloat4(b0[i]);
+		d1 += axi * HalfToFloat4(b1[i]);
+		d2 += axi * HalfToFloat4(b2[i]);
+		d3 += axi * HalfToFloat4(b3[i]);
+	}
+
+	distances[0] = d0;
+	distances[1] = d1;
+	distances[2] = d2;
+	distances[3] = d3;
+}
+
+#ifdef HALFVEC_DISPATCH
+TARGET_F16C static void
+HalfvecInnerProduct4F16c(int dim, half * ax, half ** bx, float *distances)
+{
+	int			i;
+	float		s[8];
+	int			count = (dim / 8) * 8;
+	__m256		dist[4];
+
+	for (int j = 0; j < 4; j++)
+		dist[j] = _mm256_setzero_ps();
+
+	for (i = 0; i < count; i += 8)
+	{
+		__m128i		axi = _mm_loadu_si128((__m128i *) (ax + i));
+		__m256		axs = _mm256_cvtph_ps(axi);
+
+		for (int j = 0; j < 4; j++)
+		{
+			__m128i		bxi = _mm_loadu_si128((__m128i *) (bx[j] + i));
+			__m256		bxs = _mm256_cvtph_ps(bxi);
+
+			dist[j] = _mm256_fmadd_ps(axs, bxs, dist[j]);
+		}
+	}
+
+	for (int j = 0; j < 4; j++)
+	{
+		_mm256_storeu_ps(s, dist[j]);
+
+		distances[j] = s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7];
+
+		for (int k = i; k < dim; k++)
+			distances[j] += HalfToFloat4(ax[k]) * HalfToFloat4(bx[j][k]);
+	}
+}
+#endif
+
 static double
 HalfvecCosineSimilarityDefault(int dim, half * ax, half * bx)
 {
@@ -282,6 +427,8 @@ HalfvecInit(void)
 	 */
 	HalfvecL2SquaredDistance = HalfvecL2SquaredDistanceDefault;
 	HalfvecInnerProduct = HalfvecInnerProductDefault;
+	HalfvecL2SquaredDistance4 = HalfvecL2SquaredDistance4Default;
+	HalfvecInnerProduct4 = HalfvecInnerProduct4Default;
 	HalfvecCosineSimilarity = HalfvecCosineSimilarityDefault;
 	HalfvecL1Distance = HalfvecL1DistanceDefault;
 
@@ -290,6 +437,8 @@ HalfvecInit(void)
 	{
 		HalfvecL2SquaredDistance = HalfvecL2SquaredDistanceF16c;
 		HalfvecInnerProduct = HalfvecInnerProductF16c;
+		HalfvecL2SquaredDistance4 = HalfvecL2SquaredDistance4F16c;
+		HalfvecInnerProduct4 = HalfvecInnerProduct4F16c;
 		HalfvecCosineSimilarity = HalfvecCosineSimilarityF16c;
 		/* Does not require FMA, but keep logic simple */
 		HalfvecL1Distance = HalfvecL1DistanceF16c;
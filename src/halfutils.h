@@ -12,6 +12,8 @@
 
 extern float (*HalfvecL2SquaredDistance) (int dim, half * ax, half * bx);
 extern float (*HalfvecInnerProduct) (int dim, half * ax, half * bx);
+extern void (*HalfvecL2SquaredDistance4) (int dim, half * ax, half ** bx, float *distances);
+extern void (*HalfvecInnerProduct4) (int dim, half * ax, half ** bx, float *distances);
 extern double (*HalfvecCosineSimilarity) (int dim, half * ax, half * bx);
 extern float (*HalfvecL1Distance) (int dim, half * ax, half * bx);
 
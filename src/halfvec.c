@@ -599,6 +599,82 @@ halfvec_negative_inner_product(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) -HalfvecInnerProduct(a->dim, a->x, b->x));
 }
 
+/*
+ * Get the L2 squared distances from a half vector to many half vectors
+ *
+ * Vectors in an index have the same dimensions, so they are checked once
+ */
+void
+HalfvecL2SquaredDistances(HalfVector * a, Datum *values, int n, double *distances)
+{
+	half	   *bx[4];
+	float		d[4];
+	int			i = 0;
+
+	if (n == 0)
+		return;
+
+	CheckDims(a, DatumGetHalfVector(values[0]));
+
+	for (; i + 4 <= n; i += 4)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Assert(DatumGetHalfVector(values[i + j])->dim == a->dim);
+			bx[j] = DatumGetHalfVector(values[i + j])->x;
+		}
+
+		HalfvecL2SquaredDistance4(a->dim, a->x, bx, d);
+
+		for (int j = 0; j < 4; j++)
+			distances[i + j] = (double) d[j];
+	}
+
+	for (; i < n; i++)
+	{
+		Assert(DatumGetHalfVector(values[i])->dim == a->dim);
+		distances[i] = (double) HalfvecL2SquaredDistance(a->dim, a->x, DatumGetHalfVector(values[i])->x);
+	}
+}
+
+/*
+ * Get the negative inner products of a half vector with many half vectors
+ *
+ * Vectors in an index have the same dimensions, so they are checked once
+ */
+void
+HalfvecNegativeInnerProducts(HalfVector * a, Datum *values, int n, double *distances)
+{
+	half	   *bx[4];
+	float		d[4];
+	int			i = 0;
+
+	if (n == 0)
+		return;
+
+	CheckDims(a, DatumGetHalfVector(values[0]));
+
+	for (; i + 4 <= n; i += 4)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Assert(DatumGetHalfVector(values[i + j])->dim == a->dim);
+			bx[j] = DatumGetHalfVector(values[i + j])->x;
+		}
+
+		HalfvecInnerProduct4(a->dim, a->x, bx, d);
+
+		for (int j = 0; j < 4; j++)
+			distances[i + j] = (double) -d[j];
+	}
+
+	for (; i < n; i++)
+	{
+		Assert(DatumGetHalfVector(values[i])->dim == a->dim);
+		distances[i] = (double) -HalfvecInnerProduct(a->dim, a->x, DatumGetHalfVector(values[i])->x);
+	}
+}
+
 /*
  * Get the cosine distance between two half vectors
  */
@@ -66,5 +66,7 @@ typedef struct HalfVector
 }			HalfVector;
 
 HalfVector *InitHalfVector(int dim);
+void		HalfvecL2SquaredDistances(HalfVector * a, Datum *values, int n, double *distances);
+void		HalfvecNegativeInnerProducts(HalfVector * a, Datum *values, int n, double *distances);
 
 #endif
@@ -25,13 +25,38 @@ static const struct config_enum_entry hnsw_iterative_scan_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry hnsw_ef_search_mode_options[] = {
+	{"fixed", HNSW_EF_SEARCH_FIXED, false},
+	{"adaptive", HNSW_EF_SEARCH_ADAPTIVE, false},
+	{NULL, 0, false}
+};
+
 int			hnsw_ef_search;
+int			hnsw_ef_search_mode;
 int			hnsw_iterative_scan;
 int			hnsw_max_scan_tuples;
 double		hnsw_scan_mem_multiplier;
+int			hnsw_upper_cache_mem;
+bool		hnsw_partitioned_build;
+bool		hnsw_compact_build;
+int			hnsw_build_checkpoint_tuples;
+int			hnsw_pending_list_limit;
 int			hnsw_lock_tranche_id;
 static relopt_kind hnsw_relopt_kind;
 
+static relopt_enum_elt_def hnsw_quantization_options[] = {
+	{"none", HNSW_QUANTIZATION_NONE},
+	{"sq8", HNSW_QUANTIZATION_SQ8},
+	{"binary", HNSW_QUANTIZATION_BINARY},
+	{(const char *) NULL}
+};
+
+static relopt_enum_elt_def hnsw_layout_options[] = {
+	{"insertion", HNSW_LAYOUT_INSERTION},
+	{"bfs", HNSW_LAYOUT_BFS},
+	{(const char *) NULL}
+};
+
 /*
  * Assign a tranche ID for our LWLocks. This only needs to be done by one
  * backend, as the tranche ID is remembered in shared memory.
@@ -74,11 +99,23 @@ HnswInit(void)
 					  HNSW_DEFAULT_M, HNSW_MIN_M, HNSW_MAX_M, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "ef_construction", "Size of the dynamic candidate list for construction",
 					  HNSW_DEFAULT_EF_CONSTRUCTION, HNSW_MIN_EF_CONSTRUCTION, HNSW_MAX_EF_CONSTRUCTION, AccessExclusiveLock);
+	add_enum_reloption(hnsw_relopt_kind, "quantization", "Quantization of vectors in the graph",
+					   hnsw_quantization_options, HNSW_QUANTIZATION_NONE,
+					   "Valid values are \"none\", \"sq8\", and \"binary\".", AccessExclusiveLock);
+	add_enum_reloption(hnsw_relopt_kind, "layout", "Order of elements on index pages",
+					   hnsw_layout_options, HNSW_LAYOUT_INSERTION,
+					   "Valid values are \"insertion\" and \"bfs\".", AccessExclusiveLock);
+	add_bool_reloption(hnsw_relopt_kind, "fastupdate", "Enables fast update technique for hnsw",
+					   false, AccessExclusiveLock);
 
 	DefineCustomIntVariable("hnsw.ef_search", "Sets the size of the dynamic candidate list for search",
 							"Valid range is 1..1000.", &hnsw_ef_search,
 							HNSW_DEFAULT_EF_SEARCH, HNSW_MIN_EF_SEARCH, HNSW_MAX_EF_SEARCH, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	DefineCustomEnumVariable("hnsw.ef_search_mode", "Sets the mode for the dynamic candidate list",
+							 NULL, &hnsw_ef_search_mode,
+							 HNSW_EF_SEARCH_FIXED, hnsw_ef_search_mode_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	DefineCustomEnumVariable("hnsw.iterative_scan", "Sets the mode for iterative scans",
 							 NULL, &hnsw_iterative_scan,
 							 HNSW_ITERATIVE_SCAN_OFF, hnsw_iterative_scan_options, PGC_USERSET, 0, NULL, NULL, NULL);
@@ -93,6 +130,27 @@ HnswInit(void)
 							 NULL, &hnsw_scan_mem_multiplier,
 							 1, 1, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	/* Shared by all hnsw indexes in the backend */
+	DefineCustomIntVariable("hnsw.upper_cache_mem", "Sets the max memory to use for caching upper layers",
+							"Zero disables the cache.", &hnsw_upper_cache_mem,
+							65536, 0, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("hnsw.partitioned_build", "Builds graphs that do not fit into maintenance_work_mem in partitions",
+							 NULL, &hnsw_partitioned_build,
+							 false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("hnsw.compact_build", "Keeps quantized vectors in memory during builds",
+							 NULL, &hnsw_compact_build,
+							 false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.build_checkpoint_tuples", "Sets the number of tuples between checkpoints of builds",
+							"Zero disables checkpoints.", &hnsw_build_checkpoint_tuples,
+							0, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("hnsw.pending_list_limit", "Sets the max size of the pending list for fastupdate",
+							NULL, &hnsw_pending_list_limit,
+							4096, 64, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("hnsw");
 }
 
@@ -108,6 +166,12 @@ hnswbuildphasename(int64 phasenum)
 			return "initializing";
 		case PROGRESS_HNSW_PHASE_LOAD:
 			return "loading tuples";
+		case PROGRESS_HNSW_PHASE_FLUSH:
+			return "flushing graph";
+		case PROGRESS_HNSW_PHASE_WRITE:
+			return "writing pages";
+		case PROGRESS_HNSW_PHASE_MAP:
+			return "mapping heap tids";
 		default:
 			return NULL;
 	}
@@ -231,6 +295,9 @@ hnswoptions(Datum reloptions, bool validate)
 	static const relopt_parse_elt tab[] = {
 		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
 		{"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
+		{"quantization", RELOPT_TYPE_ENUM, offsetof(HnswOptions, quantization)},
+		{"layout", RELOPT_TYPE_ENUM, offsetof(HnswOptions, layout)},
+		{"fastupdate", RELOPT_TYPE_BOOL, offsetof(HnswOptions, fastupdate)},
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
@@ -5,9 +5,12 @@
 
 #include "access/genam.h"
 #include "access/parallel.h"
+#include "buildstats.h"
+#include "datatype/timestamp.h"
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
+#include "port/atomics.h"
 #include "utils/relptr.h"
 #include "utils/sampling.h"
 #include "vector.h"
@@ -33,6 +36,7 @@
 /* Must correspond to page numbers since page lock is used */
 #define HNSW_UPDATE_LOCK 	0
 #define HNSW_SCAN_LOCK		1
+#define HNSW_PENDING_LOCK	2	/* only used as a lock tag for merges */
 
 /* HNSW parameters */
 #define HNSW_DEFAULT_M	16
@@ -44,29 +48,56 @@
 #define HNSW_DEFAULT_EF_SEARCH	40
 #define HNSW_MIN_EF_SEARCH		1
 #define HNSW_MAX_EF_SEARCH		1000
+#define HNSW_MIN_PATIENCE		8
 
 /* Tuple types */
 #define HNSW_ELEMENT_TUPLE_TYPE  1
 #define HNSW_NEIGHBOR_TUPLE_TYPE 2
+#define HNSW_PENDING_TUPLE_TYPE 3
 
 /* Make graph robust against non-HOT updates */
 #define HNSW_HEAPTIDS 10
 
+/* Elements with more than one heap TID are mapped to a marker */
+#define HnswHeapTidMapIsMulti(tid)	(ItemPointerGetBlockNumberNoCheck(&(tid)) == InvalidBlockNumber)
+
+/* Distances computed at once when pruning neighbors */
+#define HNSW_PRUNE_BATCH_SIZE 8
+
 #define HNSW_UPDATE_ENTRY_GREATER 1
 #define HNSW_UPDATE_ENTRY_ALWAYS 2
+#define HNSW_UPDATE_UPPER 3		/* upper layers changed, keep entry point */
 
 /* Build phases */
 /* PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE is 1 */
 #define PROGRESS_HNSW_PHASE_LOAD		2
+#define PROGRESS_HNSW_PHASE_FLUSH		3
+#define PROGRESS_HNSW_PHASE_WRITE		4
+#define PROGRESS_HNSW_PHASE_MAP		5
+
+/* Page writing states of a parallel build */
+#define HNSW_WRITE_WAITING	0
+#define HNSW_WRITE_PAGES	1
+#define HNSW_WRITE_DONE		2
+
+/* Chunks of graph pages written by one participant */
+#define HNSW_WRITE_CHUNK_PAGES	128
+#define HNSW_MAX_WRITE_CHUNKS	1024
 
 #define HNSW_MAX_SIZE (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(HnswPageOpaqueData)) - sizeof(ItemIdData))
 #define HNSW_TUPLE_ALLOC_SIZE BLCKSZ
 
 #define HNSW_ELEMENT_TUPLE_SIZE(size)	MAXALIGN(offsetof(HnswElementTupleData, data) + (size))
+#define HNSW_PENDING_TUPLE_SIZE(size)	MAXALIGN(offsetof(HnswPendingTupleData, data) + (size))
 #define HNSW_NEIGHBOR_TUPLE_SIZE(level, m)	MAXALIGN(offsetof(HnswNeighborTupleData, indextids) + ((level) + 2) * (m) * sizeof(ItemPointerData))
 
 #define HNSW_NEIGHBOR_ARRAY_SIZE(lm)	(offsetof(HnswNeighborArray, items) + sizeof(HnswCandidate) * (lm))
 
+#define HNSW_HEAP_INITIAL_CAPACITY	64
+
+/* Visited stamps per block, higher offsets use a hash table */
+#define HNSW_VISITED_SLOTS	32
+
 #define HnswPageGetOpaque(page)	((HnswPageOpaque) PageGetSpecialPointer(page))
 #define HnswPageGetMeta(page)	((HnswMetaPageData *) PageGetContents(page))
 
@@ -111,11 +142,36 @@
 
 /* Variables */
 extern int	hnsw_ef_search;
+extern int	hnsw_ef_search_mode;
 extern int	hnsw_iterative_scan;
 extern int	hnsw_max_scan_tuples;
 extern double hnsw_scan_mem_multiplier;
+extern int	hnsw_upper_cache_mem;
+extern bool hnsw_partitioned_build;
+extern bool hnsw_compact_build;
+extern int	hnsw_build_checkpoint_tuples;
+extern int	hnsw_pending_list_limit;
 extern int	hnsw_lock_tranche_id;
 
+typedef enum HnswQuantization
+{
+	HNSW_QUANTIZATION_NONE,
+	HNSW_QUANTIZATION_SQ8,
+	HNSW_QUANTIZATION_BINARY
+}			HnswQuantization;
+
+typedef enum HnswLayout
+{
+	HNSW_LAYOUT_INSERTION,
+	HNSW_LAYOUT_BFS
+}			HnswLayout;
+
+typedef enum HnswEfSearchMode
+{
+	HNSW_EF_SEARCH_FIXED,
+	HNSW_EF_SEARCH_ADAPTIVE
+}			HnswEfSearchMode;
+
 typedef enum HnswIterativeScanMode
 {
 	HNSW_ITERATIVE_SCAN_OFF,
@@ -173,18 +229,45 @@ struct HnswNeighborArray
 
 typedef struct HnswSearchCandidate
 {
-	pairingheap_node c_node;
 	pairingheap_node w_node;
 	HnswElementPtr element;
 	double		distance;
+	bool		returned;		/* only expanded when resumed */
 }			HnswSearchCandidate;
 
+/* Distance is inline to avoid chasing pointers when comparing */
+typedef struct HnswHeapItem
+{
+	double		distance;
+	HnswSearchCandidate *sc;
+}			HnswHeapItem;
+
+/* Array-based binary heap with the nearest or furthest candidate first */
+typedef struct HnswHeap
+{
+	HnswHeapItem *items;
+	int			length;
+	int			capacity;
+	bool		furthest;
+}			HnswHeap;
+
+/* Bump allocator for search candidates */
+typedef struct HnswCandidateArena
+{
+	HnswSearchCandidate *chunk;
+	int			used;
+	int			size;
+}			HnswCandidateArena;
+
 /* HNSW index options */
 typedef struct HnswOptions
 {
 	int32		vl_len_;		/* varlena header (do not touch directly!) */
 	int			m;				/* number of connections */
 	int			efConstruction; /* size of dynamic candidate list */
+	int			quantization;	/* quantization of vectors in the graph */
+	int			layout;			/* order of elements on pages */
+	bool		fastupdate;		/* use the pending list for inserts */
 }			HnswOptions;
 
 typedef struct HnswGraph
@@ -196,7 +279,6 @@ typedef struct HnswGraph
 
 	/* Entry state */
 	LWLock		entryLock;
-	LWLock		entryWaitLock;
 	HnswElementPtr entryPoint;
 
 	/* Allocations state */
@@ -207,14 +289,32 @@ typedef struct HnswGraph
 	/* Flushed state */
 	LWLock		flushLock;
 	bool		flushed;
+	int			partitions;
 }			HnswGraph;
 
+typedef struct HnswWriteChunk
+{
+	HnswElementPtr start;		/* first element */
+	BlockNumber blkno;			/* first page */
+	BlockNumber nblocks;
+}			HnswWriteChunk;
+
+typedef struct HnswPageLayout
+{
+	BlockNumber blkno;			/* first graph page */
+	BlockNumber nblocks;
+	int			nchunks;
+	pg_atomic_uint32 nextchunk;
+	HnswWriteChunk chunks[HNSW_MAX_WRITE_CHUNKS];
+}			HnswPageLayout;
+
 typedef struct HnswShared
 {
 	/* Immutable state */
 	Oid			heaprelid;
 	Oid			indexrelid;
 	bool		isconcurrent;
+	bool		compact;
 
 	/* Worker progress */
 	ConditionVariable workersdonecv;
@@ -226,6 +326,12 @@ typedef struct HnswShared
 	int			nparticipantsdone;
 	double		reltuples;
 	HnswGraph	graphData;
+
+	/* Page writing */
+	ConditionVariable layoutcv;
+	int			writeState;
+	int			nparticipantswritten;
+	HnswPageLayout layout;
 }			HnswShared;
 
 #define ParallelTableScanFromHnswShared(shared) \
@@ -238,6 +344,7 @@ typedef struct HnswLeader
 	HnswShared *hnswshared;
 	Snapshot	snapshot;
 	char	   *hnswarea;
+	VectorBuildSharedStats *buildstats;
 }			HnswLeader;
 
 typedef struct HnswAllocator
@@ -253,16 +360,44 @@ typedef struct HnswTypeInfo
 	void		(*checkValue) (Pointer v);
 }			HnswTypeInfo;
 
+/* Pages kept pinned between reads of a scan */
+typedef struct HnswPageCache
+{
+	BlockNumber nblocks;		/* relation size when last checked */
+	Buffer		elementBuf;
+	Buffer		neighborBuf;
+	IPTSearchCache ipt;
+}			HnswPageCache;
+
+/* Distance functions that can skip the function manager */
+typedef enum HnswDistanceKind
+{
+	HNSW_DISTANCE_FMGR,
+	HNSW_DISTANCE_VECTOR_L2,
+	HNSW_DISTANCE_VECTOR_IP,
+	HNSW_DISTANCE_HALFVEC_L2,
+	HNSW_DISTANCE_HALFVEC_IP,
+	HNSW_DISTANCE_SQ8_L2,
+	HNSW_DISTANCE_SQ8_IP,
+	HNSW_DISTANCE_BINARY_L2,
+	HNSW_DISTANCE_BINARY_IP
+}			HnswDistanceKind;
+
 typedef struct HnswSupport
 {
 	FmgrInfo   *procinfo;
 	FmgrInfo   *normprocinfo;
 	Oid			collation;
+	HnswDistanceKind distance;
+	HnswQuantization quantization;
+	HnswPageCache *pages;		/* NULL to not keep pages pinned */
+	struct HnswDistanceCache *distances;	/* NULL to not reuse distances */
 }			HnswSupport;
 
 typedef struct HnswQuery
 {
 	Datum		value;
+	int			patience;		/* ground layer expansions without change, 0 to disable */
 }			HnswQuery;
 
 typedef struct HnswBuildState
@@ -278,13 +413,23 @@ typedef struct HnswBuildState
 	int			dimensions;
 	int			m;
 	int			efConstruction;
+	HnswLayout	layout;
+	bool		partitioned;
+	bool		compact;		/* keep sq8 codes in memory */
+	bool		resumable;		/* scan in order and checkpoint */
+	int			checkpointTuples;
 
 	/* Statistics */
 	double		indtuples;
 	double		reltuples;
 
+	/* Checkpoints */
+	BlockNumber scanBlkno;
+	double		checkpointIndtuples;
+
 	/* Support functions */
 	HnswSupport support;
+	HnswSupport graphSupport;	/* for distances in memory */
 
 	/* Variables */
 	HnswGraph	graphData;
@@ -315,6 +460,16 @@ typedef struct HnswMetaPageData
 	int16		entryLevel;
 	BlockNumber insertPage;
 	BlockNumber IPTrootPage;
+	uint8		quantization;
+	uint32		upperVersion;	/* changed when upper layers change */
+	BlockNumber pendingHead;
+	BlockNumber pendingTail;
+	BlockNumber pendingFree;	/* merged pages to reuse */
+	uint32		pendingPages;
+	uint32		pendingTuples;
+	BlockNumber buildBlkno;		/* heap block to resume build from */
+	int64		buildVacuums;	/* vacuums of the table at the checkpoint, -1 if unknown */
+	TimestampTz buildStatsReset;	/* reset time of the vacuum count */
 }			HnswMetaPageData;
 
 typedef HnswMetaPageData * HnswMetaPage;
@@ -342,6 +497,19 @@ typedef struct HnswElementTupleData
 
 typedef HnswElementTupleData * HnswElementTuple;
 
+/* Quantized vector stored in element tuples instead of the vector */
+typedef struct HnswCodeData
+{
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int16		dim;			/* number of dimensions */
+	uint8		quantization;
+	uint8		unused;
+	float		scale;			/* max absolute value for sq8, norm for binary */
+	uint8		data[FLEXIBLE_ARRAY_MEMBER];
+}			HnswCodeData;
+
+typedef HnswCodeData * HnswCode;
+
 typedef struct HnswNeighborTupleData
 {
 	uint8		type;
@@ -352,11 +520,23 @@ typedef struct HnswNeighborTupleData
 
 typedef HnswNeighborTupleData * HnswNeighborTuple;
 
-typedef union
+typedef struct HnswPendingTupleData
+{
+	uint8		type;
+	uint8		unused;
+	uint16		unused2;
+	ItemPointerData heaptid;
+	Vector		data;
+}			HnswPendingTupleData;
+
+typedef HnswPendingTupleData * HnswPendingTuple;
+
+typedef struct visited_hash
 {
 	struct pointerhash_hash *pointers;
 	struct offsethash_hash *offsets;
-	struct tidhash_hash *tids;
+	struct tidhash_hash *tids;	/* overflow when stamps are used */
+	struct HnswVisitedLease *lease; /* NULL if stamps are not used */
 }			visited_hash;
 
 typedef union
@@ -380,9 +560,13 @@ typedef struct HnswScanOpaqueData
 	MemoryContext tmpCtx;
 	bool 		range_query;
 	float 		range_threshold;
+	struct tidhash_hash *pendingTids;	/* heap TIDs in the pending list */
 
 	/* Support functions */
 	HnswSupport support;
+
+	/* Pages */
+	HnswPageCache pages;
 }			HnswScanOpaqueData;
 
 typedef HnswScanOpaqueData * HnswScanOpaque;
@@ -415,6 +599,14 @@ typedef struct HnswVacuumState
 /* Methods */
 int			HnswGetM(Relation index);
 int			HnswGetEfConstruction(Relation index);
+HnswQuantization HnswGetQuantization(Relation index);
+HnswLayout	HnswGetLayout(Relation index);
+bool		HnswGetFastUpdate(Relation index);
+Datum		HnswQuantizeValue(Datum value, HnswQuantization quantization);
+Datum		HnswDequantizeValue(Datum value);
+void		HnswCodeDistances(Datum a, Datum *values, int n, HnswDistanceKind kind, double *distances);
+void		HnswGetDistances(Datum a, Datum *values, int n, HnswSupport * support, double *distances);
+List	   *HnswSearchUpperCache(HnswQuery * q, Relation index, HnswSupport * support);
 FmgrInfo   *HnswOptionalProcInfo(Relation index, uint16 procnum);
 void		HnswInitSupport(HnswSupport * support, Relation index);
 Datum		HnswNormValue(const HnswTypeInfo * typeInfo, Oid collation, Datum value);
@@ -432,19 +624,29 @@ HnswElement HnswInitElement(char *base, ItemPointer tid, int m, double ml, int m
 HnswElement HnswInitElementFromBlock(BlockNumber blkno, OffsetNumber offno);
 void		HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint, Relation index, HnswSupport * support, int m, int efConstruction, bool existing);
 HnswSearchCandidate *HnswEntryCandidate(char *base, HnswElement em, HnswQuery * q, Relation rel, HnswSupport * support, bool loadVec);
+void		HnswExtendMetaPage(Page page);
 void		HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, BlockNumber insertPage, BlockNumber IPTRootPage, ForkNumber forkNum, bool building);
+bool		HnswSwapEntryPoint(Relation index, HnswElement expected, HnswElement element, HnswElement * current, bool building);
 void		HnswSetNeighborTuple(char *base, HnswNeighborTuple ntup, HnswElement e, int m);
 void		HnswAddHeapTid(HnswElement element, ItemPointer heaptid);
+ItemPointerData HnswHeapTidMapValue(ItemPointer heaptids, int length);
 HnswNeighborArray *HnswInitNeighborArray(int lm, HnswAllocator * allocator);
 void		HnswInitNeighbors(char *base, HnswElement element, int m, HnswAllocator * alloc);
 bool		HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPointer heaptid, bool building);
+void		HnswInsertTuplesOnDisk(Relation index, HnswSupport * support, Datum *values, ItemPointer heaptids, int n);
 void		HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool checkExisting, bool building);
+void		HnswMergeNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool building);
+void		HnswInsertPending(Relation index, Datum value, ItemPointer heaptid);
+int64		HnswMergePending(Relation index, bool wait);
+List	   *HnswSearchPending(HnswQuery * q, Relation index, HnswSupport * support, struct tidhash_hash **tids);
 void		HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHeaptids, bool loadVec);
 void		HnswLoadElement(HnswElement element, double *distance, HnswQuery * q, Relation index, HnswSupport * support, bool loadVec, double *maxDistance);
 bool		HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo * typeInfo, HnswSupport * support);
 void		HnswSetElementTuple(char *base, HnswElementTuple etup, HnswElement element);
 void		HnswUpdateConnection(char *base, HnswNeighborArray * neighbors, HnswElement newElement, float distance, int lm, int *updateIdx, Relation index, HnswSupport * support);
-bool		HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, int m, int lm, int lc);
+bool		HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, HnswPageCache * pages, int m, int lm, int lc);
+void		HnswInitPageCache(HnswPageCache * pages);
+void		HnswReleasePageCache(HnswPageCache * pages);
 void		HnswInitLockTranche(void);
 const		HnswTypeInfo *HnswGetTypeInfo(Relation index);
 PGDLLEXPORT void HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc);
@@ -517,4 +719,25 @@ typedef struct OffsetHashEntry
 #define SH_DECLARE
 #include "lib/simplehash.h"
 
+typedef struct DistanceHashEntry
+{
+	uintptr_t	ptr;
+	char		status;
+	float		distance;
+}			DistanceHashEntry;
+
+#define SH_PREFIX distancehash
+#define SH_ELEMENT_TYPE DistanceHashEntry
+#define SH_KEY_TYPE uintptr_t
+#define SH_SCOPE extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
+/* Distances from an element being inserted in memory to its candidates */
+typedef struct HnswDistanceCache
+{
+	HnswElement element;
+	distancehash_hash *distances;
+}			HnswDistanceCache;
+
 #endif
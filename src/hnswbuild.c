@@ -31,6 +31,30 @@
  * WAL-log the individual inserts. If the graph fit completely in memory and
  * was fully built in the in-memory phase, the on-disk phase is skipped.
  *
+ * With hnsw.partitioned_build, the on-disk phase is replaced by partitions.
+ * When the graph no longer fits, it is written to disk as a partition, and a
+ * new graph is built in memory from the remaining tuples. Each partition
+ * after the first is connected to the partitions already on disk by
+ * searching for its upper layer elements in them (see MergePartition()).
+ *
+ * To materialize a graph, the page and offset of every tuple is computed from
+ * tuple sizes first (see LayoutGraphPages()). Since neighbors then have known
+ * TIDs, each page is written once, in chunks that participants of a parallel
+ * build claim independently. The map from element TIDs to heap TIDs is loaded
+ * bottom-up afterwards. Elements with duplicates are mapped to a marker, so
+ * filtered scans check all their heap TIDs (see HnswHeapTidMapValue()).
+ *
+ * With hnsw.compact_build, elements hold sq8 codes instead of vectors, and
+ * distances in memory are between codes. This fits several times more
+ * elements into maintenance_work_mem. Vectors are read from the heap again
+ * when pages are written, so the index itself is not quantized.
+ *
+ * With hnsw.build_checkpoint_tuples, the heap is scanned in order by one
+ * process, and partitions are flushed between heap pages. After each flush,
+ * the pages are synced and the metapage records the heap block to resume from
+ * (see CheckpointBuild()). An interrupted concurrent build leaves an invalid
+ * index, which hnsw_resume_build() continues from that block.
+ *
  * After we have finished building the graph, we perform one more scan through
  * the index and write all the pages to the WAL.
  */
@@ -38,26 +62,38 @@
 
 #include <math.h>
 
+#include "access/htup_details.h"
 #include "access/parallel.h"
 #include "access/table.h"
 #include "access/tableam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "access/xloginsert.h"
 #include "catalog/index.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_index.h"
 #include "catalog/pg_type_d.h"
 #include "commands/progress.h"
+#include "executor/executor.h"
+#include "fmgr.h"
 #include "hnsw.h"
 #include "miscadmin.h"
 #include "optimizer/optimizer.h"
+#include "pgstat.h"
 #include "storage/bufmgr.h"
+#include "storage/smgr.h"
 #include "tcop/tcopprot.h"
+#include "utils/acl.h"
 #include "utils/datum.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
 
 #if PG_VERSION_NUM >= 140000
 #include "utils/backend_progress.h"
-#else
-#include "pgstat.h"
 #endif
 
 #if PG_VERSION_NUM >= 140000
@@ -68,6 +104,20 @@
 #define PARALLEL_KEY_HNSW_SHARED		UINT64CONST(0xA000000000000001)
 #define PARALLEL_KEY_HNSW_AREA			UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000003)
+#define PARALLEL_KEY_BUILD_STATS		UINT64CONST(0xA000000000000004)
+
+/* Reads vectors from the heap for compact builds */
+typedef struct HnswValueFetch
+{
+	Relation	heap;
+	IndexInfo  *indexInfo;
+	const		HnswTypeInfo *typeInfo;
+	HnswSupport support;
+	IndexFetchTableData *scan;
+	TupleTableSlot *slot;
+	EState	   *estate;
+	MemoryContext tmpCtx;
+}			HnswValueFetch;
 
 /*
  * Create the metapage
@@ -105,6 +155,16 @@ CreateMetaPage(HnswBuildState * buildstate)
 	metap->entryLevel = -1;
 	metap->insertPage = InvalidBlockNumber;
 	metap->IPTrootPage = BufferGetBlockNumber(iptbuf);
+	metap->quantization = buildstate->support.quantization;
+	metap->upperVersion = 0;
+	metap->pendingHead = InvalidBlockNumber;
+	metap->pendingTail = InvalidBlockNumber;
+	metap->pendingFree = InvalidBlockNumber;
+	metap->pendingPages = 0;
+	metap->pendingTuples = 0;
+	metap->buildBlkno = InvalidBlockNumber;
+	metap->buildVacuums = -1;
+	metap->buildStatsReset = 0;
 
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(HnswMetaPageData)) - (char *) page;
@@ -116,85 +176,149 @@ CreateMetaPage(HnswBuildState * buildstate)
 }
 
 /*
- * Add a new page
+ * Get the IPT root page
  */
-static void
-HnswBuildAppendPage(Relation index, Buffer *buf, Page *page, ForkNumber forkNum)
-{
-	/* Add a new page */
-	Buffer		newbuf = HnswNewBuffer(index, forkNum);
-
-	/* Update previous page */
-	HnswPageGetOpaque(*page)->nextblkno = BufferGetBlockNumber(newbuf);
-
-	/* Commit */
-	MarkBufferDirty(*buf);
-	UnlockReleaseBuffer(*buf);
-
-	/* Can take a while, so ensure we can interrupt */
-	/* Needs to be called when no buffer locks are held */
-	LockBuffer(newbuf, BUFFER_LOCK_UNLOCK);
-	CHECK_FOR_INTERRUPTS();
-	LockBuffer(newbuf, BUFFER_LOCK_EXCLUSIVE);
-
-	/* Prepare new page */
-	*buf = newbuf;
-	*page = BufferGetPage(*buf);
-	HnswInitPage(*buf, *page);
-}
-
-static BlockNumber GetIPTRootPage(Relation index)
+static BlockNumber
+GetIPTRootPage(Relation index)
 {
 	Buffer		buf;
 	Page		page;
 	HnswMetaPage metap;
-	BlockNumber insertPage;
+	BlockNumber rootPage;
 
 	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
 	LockBuffer(buf, BUFFER_LOCK_SHARE);
 	page = BufferGetPage(buf);
 	metap = HnswPageGetMeta(page);
 
-	insertPage = metap->IPTrootPage;
-	
+	rootPage = metap->IPTrootPage;
 
 	UnlockReleaseBuffer(buf);
 
-	return insertPage;
+	return rootPage;
 }
 
+/*
+ * Free space of a page with the given bounds, like PageGetFreeSpace()
+ */
+static inline Size
+LayoutFreeSpace(Size lower, Size upper)
+{
+	Size		space = upper - lower;
+
+	if (space < sizeof(ItemIdData))
+		return 0;
+	return space - sizeof(ItemIdData);
+}
 
 /*
- * Create graph pages
+ * Get the size of the value written for an element
+ *
+ * Compact builds keep sq8 codes in memory, but write the vectors
+ */
+static inline Size
+GraphValueSize(char *base, HnswElement element, bool compact)
+{
+	Pointer		valuePtr = HnswPtrAccess(base, element->value);
+
+	if (compact)
+		return VECTOR_SIZE(((HnswCode) valuePtr)->dim);
+
+	return VARSIZE_ANY(valuePtr);
+}
+
+/*
+ * Start reading vectors from the heap
  */
 static void
-CreateGraphPages(HnswBuildState * buildstate)
+InitValueFetch(HnswValueFetch * fetch, Relation heap, Relation index)
 {
-	Relation	index = buildstate->index;
-	ForkNumber	forkNum = buildstate->forkNum;
-	Size		maxSize;
-	HnswElementTuple etup;
-	HnswNeighborTuple ntup;
-	BlockNumber insertPage;
-	HnswElement entryPoint;
-	Buffer		buf;
-	Page		page;
-	HnswElementPtr iter = buildstate->graph->head;
-	char	   *base = buildstate->hnswarea;
-	BlockNumber IPTRootPage = InvalidBlockNumber, updatedIPTRootPage = InvalidBlockNumber;
+	fetch->heap = heap;
+	fetch->indexInfo = BuildIndexInfo(index);
+	fetch->typeInfo = HnswGetTypeInfo(index);
+	HnswInitSupport(&fetch->support, index);
+	fetch->scan = table_index_fetch_begin(heap);
+	fetch->slot = table_slot_create(heap, NULL);
+	fetch->estate = CreateExecutorState();
+	GetPerTupleExprContext(fetch->estate)->ecxt_scantuple = fetch->slot;
+	fetch->tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+										  "Hnsw build fetch context",
+										  ALLOCSET_DEFAULT_SIZES);
+}
 
-	IPTRootPage = GetIPTRootPage(index);
-	/* Calculate sizes */
-	maxSize = HNSW_MAX_SIZE;
+/*
+ * Finish reading vectors from the heap
+ */
+static void
+EndValueFetch(HnswValueFetch * fetch)
+{
+	table_index_fetch_end(fetch->scan);
+	ExecDropSingleTupleTableSlot(fetch->slot);
+	FreeExecutorState(fetch->estate);
+	MemoryContextDelete(fetch->tmpCtx);
+}
 
-	/* Allocate once */
-	etup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
-	ntup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+/*
+ * Read the vector of an element from the heap
+ *
+ * The value is valid until the next call
+ */
+static Pointer
+FetchValue(HnswValueFetch * fetch, char *base, HnswElement element)
+{
+	ItemPointerData tid = element->heaptids[0];
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	bool		call_again = false;
+	bool		all_dead = false;
+	Datum		value;
+	MemoryContext oldCtx;
 
-	/* Prepare first page */
-	buf = HnswNewBuffer(index, forkNum);
-	page = BufferGetPage(buf);
-	HnswInitPage(buf, page);
+	MemoryContextReset(fetch->tmpCtx);
+	ResetPerTupleExprContext(fetch->estate);
+	oldCtx = MemoryContextSwitchTo(fetch->tmpCtx);
+
+	/* Follows HOT chains, whose members have the same indexed value */
+	if (table_index_fetch_tuple(fetch->scan, &tid, SnapshotAny, fetch->slot, &call_again, &all_dead))
+	{
+		FormIndexDatum(fetch->indexInfo, fetch->slot, fetch->estate, values, isnull);
+
+		if (isnull[0] || !HnswFormIndexValue(&value, values, isnull, fetch->typeInfo, &fetch->support))
+			value = HnswDequantizeValue(HnswGetValue(base, element));
+	}
+	else
+	{
+		/* Row was pruned during the build, so it is never returned */
+		value = HnswDequantizeValue(HnswGetValue(base, element));
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+
+	return DatumGetPointer(value);
+}
+
+/*
+ * Assign a page and offset to each element and its neighbor tuple
+ *
+ * This follows how tuples were added page by page, so only sizes are needed.
+ * Pages are split into chunks that start with an element tuple, so each chunk
+ * can be written independently.
+ */
+static void
+LayoutGraphPages(HnswBuildState * buildstate, BlockNumber firstBlkno, HnswPageLayout * layout)
+{
+	Size		maxSize = HNSW_MAX_SIZE;
+	Size		emptyUpper = BLCKSZ - MAXALIGN(sizeof(HnswPageOpaqueData));
+	Size		lower = SizeOfPageHeaderData;
+	Size		upper = emptyUpper;
+	OffsetNumber offno = InvalidOffsetNumber;
+	BlockNumber blkno = firstBlkno;
+	BlockNumber chunkPages = HNSW_WRITE_CHUNK_PAGES;
+	HnswElementPtr iter = buildstate->graph->head;
+	char	   *base = buildstate->hnswarea;
+
+	layout->blkno = firstBlkno;
+	layout->nchunks = 0;
 
 	while (!HnswPtrIsNull(base, iter))
 	{
@@ -202,17 +326,9 @@ CreateGraphPages(HnswBuildState * buildstate)
 		Size		etupSize;
 		Size		ntupSize;
 		Size		combinedSize;
-		Pointer		valuePtr = HnswPtrAccess(base, element->value);
-		ItemPointerData IPTKey, IPTvalue;
-
-		/* Update iterator */
-		iter = element->next;
-
-		/* Zero memory for each element */
-		MemSet(etup, 0, HNSW_TUPLE_ALLOC_SIZE);
 
 		/* Calculate sizes */
-		etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
+		etupSize = HNSW_ELEMENT_TUPLE_SIZE(GraphValueSize(base, element, buildstate->compact));
 		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, buildstate->m);
 		combinedSize = etupSize + ntupSize + sizeof(ItemIdData);
 
@@ -222,15 +338,42 @@ CreateGraphPages(HnswBuildState * buildstate)
 					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
 					 errmsg("index tuple too large")));
 
-		HnswSetElementTuple(base, etup, element);
-
 		/* Keep element and neighbors on the same page if possible */
-		if (PageGetFreeSpace(page) < etupSize || (combinedSize <= maxSize && PageGetFreeSpace(page) < combinedSize))
-			HnswBuildAppendPage(index, &buf, &page, forkNum);
+		if (offno != InvalidOffsetNumber && (LayoutFreeSpace(lower, upper) < etupSize || (combinedSize <= maxSize && LayoutFreeSpace(lower, upper) < combinedSize)))
+		{
+			blkno++;
+			lower = SizeOfPageHeaderData;
+			upper = emptyUpper;
+			offno = InvalidOffsetNumber;
+		}
+
+		/* Start a chunk at a page with an element first */
+		if (offno == InvalidOffsetNumber && (layout->nchunks == 0 || blkno - layout->chunks[layout->nchunks - 1].blkno >= chunkPages))
+		{
+			/* Merge pairs of chunks when out of space */
+			if (layout->nchunks == HNSW_MAX_WRITE_CHUNKS)
+			{
+				for (int i = 0; i < HNSW_MAX_WRITE_CHUNKS / 2; i++)
+					layout->chunks[i] = layout->chunks[i * 2];
+				layout->nchunks = HNSW_MAX_WRITE_CHUNKS / 2;
+				chunkPages *= 2;
+			}
+
+			if (layout->nchunks == 0 || blkno - layout->chunks[layout->nchunks - 1].blkno >= chunkPages)
+			{
+				HnswPtrStore(base, layout->chunks[layout->nchunks].start, element);
+				layout->chunks[layout->nchunks].blkno = blkno;
+				layout->nchunks++;
+			}
+		}
+
+		/* Add element */
+		element->blkno = blkno;
+		element->offno = OffsetNumberNext(offno);
+		offno = element->offno;
+		lower += sizeof(ItemIdData);
+		upper -= etupSize;
 
-		/* Calculate offsets */
-		element->blkno = BufferGetBlockNumber(buf);
-		element->offno = OffsetNumberNext(PageGetMaxOffsetNumber(page));
 		if (combinedSize <= maxSize)
 		{
 			element->neighborPage = element->blkno;
@@ -242,112 +385,643 @@ CreateGraphPages(HnswBuildState * buildstate)
 			element->neighborOffno = FirstOffsetNumber;
 		}
 
-		ItemPointerSet(&etup->neighbortid, element->neighborPage, element->neighborOffno);
+		/* Add new page if needed */
+		if (LayoutFreeSpace(lower, upper) < ntupSize)
+		{
+			blkno++;
+			lower = SizeOfPageHeaderData;
+			upper = emptyUpper;
+			offno = InvalidOffsetNumber;
+		}
+
+		/* Add neighbors */
+		offno = OffsetNumberNext(offno);
+		lower += sizeof(ItemIdData);
+		upper -= ntupSize;
+
+		iter = element->next;
+	}
+
+	/* An empty graph still has a page for inserts */
+	layout->nblocks = blkno - firstBlkno + 1;
+
+	for (int i = 0; i < layout->nchunks; i++)
+	{
+		BlockNumber end = i + 1 < layout->nchunks ? layout->chunks[i + 1].blkno : firstBlkno + layout->nblocks;
+
+		layout->chunks[i].nblocks = end - layout->chunks[i].blkno;
+	}
+
+	pg_atomic_init_u32(&layout->nextchunk, 0);
+}
+
+/*
+ * Get a graph page for writing, releasing the previous one
+ */
+static Page
+GetWritePage(Relation index, ForkNumber forkNum, HnswPageLayout * layout, BlockNumber blkno, Buffer *buf)
+{
+	Page		page;
+
+	if (BufferIsValid(*buf))
+	{
+		if (BufferGetBlockNumber(*buf) == blkno)
+			return BufferGetPage(*buf);
+
+		MarkBufferDirty(*buf);
+		UnlockReleaseBuffer(*buf);
+	}
+
+	/* Can take a while, so ensure we can interrupt */
+	/* Needs to be called when no buffer locks are held */
+	CHECK_FOR_INTERRUPTS();
+
+	/* Pages were added by the leader */
+	*buf = ReadBufferExtended(index, forkNum, blkno, RBM_ZERO_AND_LOCK, NULL);
+	page = BufferGetPage(*buf);
+	HnswInitPage(*buf, page);
+
+	if (blkno + 1 < layout->blkno + layout->nblocks)
+		HnswPageGetOpaque(page)->nextblkno = blkno + 1;
+
+	return page;
+}
+
+/*
+ * Write chunks of graph pages until none are left
+ *
+ * Each participant of a parallel build claims chunks, so pages are formatted
+ * and written in parallel. With a fetch state, vectors are read from the heap.
+ */
+static void
+WriteGraphChunks(Relation index, ForkNumber forkNum, int m, char *base, HnswPageLayout * layout, HnswValueFetch * fetch)
+{
+	HnswElementTuple etup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+	HnswNeighborTuple ntup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+	int64		written = 0;
+
+	for (;;)
+	{
+		uint32		i = pg_atomic_fetch_add_u32(&layout->nextchunk, 1);
+		HnswWriteChunk *chunk;
+		HnswElementPtr iter;
+		Buffer		buf = InvalidBuffer;
+
+		if (i >= (uint32) layout->nchunks)
+			break;
+
+		chunk = &layout->chunks[i];
+		iter = chunk->start;
+
+		while (!HnswPtrIsNull(base, iter))
+		{
+			HnswElement element = HnswPtrAccess(base, iter);
+			Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+			Pointer		valuePtr;
+			Size		etupSize;
+			Page		page;
+
+			if (element->blkno >= chunk->blkno + chunk->nblocks)
+				break;
+
+			/* Update iterator */
+			iter = element->next;
+
+			if (fetch != NULL)
+				valuePtr = FetchValue(fetch, base, element);
+			else
+				valuePtr = HnswPtrAccess(base, element->value);
+			etupSize = HNSW_ELEMENT_TUPLE_SIZE(VARSIZE_ANY(valuePtr));
+
+			/* Zero memory for each element */
+			MemSet(etup, 0, HNSW_TUPLE_ALLOC_SIZE);
+			MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
+
+			HnswSetElementTuple(base, etup, element);
+			if (fetch != NULL)
+				memcpy(&etup->data, valuePtr, VARSIZE_ANY(valuePtr));
+			ItemPointerSet(&etup->neighbortid, element->neighborPage, element->neighborOffno);
+
+			/* Add element */
+			page = GetWritePage(index, forkNum, layout, element->blkno, &buf);
+			if (PageAddItem(page, (Item) etup, etupSize, InvalidOffsetNumber, false, false) != element->offno)
+				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+			/* Add neighbors, which are known since all elements have a page */
+			HnswSetNeighborTuple(base, ntup, element, m);
+			page = GetWritePage(index, forkNum, layout, element->neighborPage, &buf);
+			if (PageAddItem(page, (Item) ntup, ntupSize, InvalidOffsetNumber, false, false) != element->neighborOffno)
+				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+			written++;
+		}
+
+		/* Commit */
+		if (BufferIsValid(buf))
+		{
+			MarkBufferDirty(buf);
+			UnlockReleaseBuffer(buf);
+		}
+	}
+
+	pfree(etup);
+	pfree(ntup);
+
+	VectorBuildStatsTuples(written);
+}
+
+/*
+ * Map element TIDs to heap TIDs
+ *
+ * Elements are in TID order, so an empty map is loaded bottom-up
+ */
+static BlockNumber
+WriteItemPointerMap(HnswBuildState * buildstate, bool empty)
+{
+	Relation	index = buildstate->index;
+	HnswElementPtr iter = buildstate->graph->head;
+	char	   *base = buildstate->hnswarea;
+	BlockNumber rootPage = GetIPTRootPage(index);
+	BlockNumber updatedRootPage = InvalidBlockNumber;
+	IPTBulkState bulkstate;
+	int64		mapped = 0;
+
+	if (empty)
+		IPTBulkInit(&bulkstate, index, buildstate->forkNum, rootPage);
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement element = HnswPtrAccess(base, iter);
+		ItemPointerData key;
+
+		iter = element->next;
+
+		ItemPointerSet(&key, element->blkno, element->offno);
+
+		if (empty)
+			IPTBulkAdd(&bulkstate, key, HnswHeapTidMapValue(element->heaptids, element->heaptidsLength));
+		else
+		{
+			IPTInsert(index, rootPage, key, HnswHeapTidMapValue(element->heaptids, element->heaptidsLength), &updatedRootPage);
+			if (BlockNumberIsValid(updatedRootPage))
+			{
+				rootPage = updatedRootPage;
+				updatedRootPage = InvalidBlockNumber;
+			}
+		}
+
+		mapped++;
+	}
+
+	if (empty && !HnswPtrIsNull(base, buildstate->graph->head))
+		IPTBulkFinish(&bulkstate);
+
+	VectorBuildStatsTuples(mapped);
+
+	return rootPage;
+}
+
+/*
+ * Create graph pages
+ *
+ * The layout is computed first, and then the pages are formatted and written
+ * in chunks. In a parallel build, the workers help with writing.
+ */
+static void
+CreateGraphPages(HnswBuildState * buildstate, int updateEntry)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+	HnswShared *hnswshared = buildstate->hnswleader != NULL ? buildstate->hnswleader->hnswshared : NULL;
+	HnswPageLayout *layout = hnswshared != NULL ? &hnswshared->layout : palloc(sizeof(HnswPageLayout));
+	char	   *base = buildstate->hnswarea;
+	BlockNumber prevInsertPage = InvalidBlockNumber;
+	BlockNumber insertPage;
+	BlockNumber IPTRootPage;
+	HnswElement entryPoint;
+
+	/* Link pages of earlier partitions to the new pages */
+	if (buildstate->graph->partitions > 0)
+	{
+		Buffer		buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		prevInsertPage = HnswPageGetMeta(BufferGetPage(buf))->insertPage;
+		UnlockReleaseBuffer(buf);
+	}
+
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_WRITE);
+	VectorBuildStatsPhase("writing pages");
+
+	LayoutGraphPages(buildstate, RelationGetNumberOfBlocksInFork(index, forkNum), layout);
+
+	/* Add all pages first, so participants do not extend the relation */
+	for (BlockNumber i = 0; i < layout->nblocks; i++)
+	{
+		Buffer		buf = HnswNewBuffer(index, forkNum);
+
+		if (layout->nchunks == 0)
+		{
+			HnswInitPage(buf, BufferGetPage(buf));
+			MarkBufferDirty(buf);
+		}
+		UnlockReleaseBuffer(buf);
+	}
+
+	if (hnswshared != NULL)
+	{
+		/* Wake up workers waiting for the layout */
+		SpinLockAcquire(&hnswshared->mutex);
+		hnswshared->writeState = HNSW_WRITE_PAGES;
+		SpinLockRelease(&hnswshared->mutex);
+		ConditionVariableBroadcast(&hnswshared->layoutcv);
+	}
+
+	if (buildstate->compact)
+	{
+		HnswValueFetch fetch;
+
+		InitValueFetch(&fetch, buildstate->heap, index);
+		WriteGraphChunks(index, forkNum, buildstate->m, base, layout, &fetch);
+		EndValueFetch(&fetch);
+	}
+	else
+		WriteGraphChunks(index, forkNum, buildstate->m, base, layout, NULL);
+
+	if (hnswshared != NULL)
+	{
+		int			nworkers = buildstate->hnswleader->pcxt->nworkers_launched;
+
+		/* Wait for workers to finish their chunks */
+		for (;;)
+		{
+			SpinLockAcquire(&hnswshared->mutex);
+			if (hnswshared->nparticipantswritten == nworkers)
+			{
+				SpinLockRelease(&hnswshared->mutex);
+				break;
+			}
+			SpinLockRelease(&hnswshared->mutex);
+
+			ConditionVariableSleep(&hnswshared->workersdonecv,
+								   WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+		}
+
+		ConditionVariableCancelSleep();
+	}
+
+	if (BlockNumberIsValid(prevInsertPage))
+	{
+		Buffer		buf = ReadBufferExtended(index, forkNum, prevInsertPage, RBM_NORMAL, NULL);
+
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		HnswPageGetOpaque(BufferGetPage(buf))->nextblkno = layout->blkno;
+		MarkBufferDirty(buf);
+		UnlockReleaseBuffer(buf);
+	}
+
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_MAP);
+	VectorBuildStatsPhase("mapping heap tids");
+
+	IPTRootPage = WriteItemPointerMap(buildstate, buildstate->graph->partitions == 0);
+
+	insertPage = layout->blkno + layout->nblocks - 1;
+	entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
+	HnswUpdateMetaPage(index, updateEntry, entryPoint, insertPage, IPTRootPage, forkNum, true);
+
+	if (hnswshared == NULL)
+		pfree(layout);
+}
+
+/*
+ * Reorder elements by breadth-first search over the ground layer
+ *
+ * Pages are written in list order, so this places most neighbors on the same
+ * page as their source or a nearby one
+ */
+static void
+ReorderGraph(HnswBuildState * buildstate)
+{
+	char	   *base = buildstate->hnswarea;
+	HnswGraph  *graph = buildstate->graph;
+	HnswElementPtr iter = graph->head;
+	HnswElement *queue;
+	pointerhash_hash *visited;
+	int64		length = 0;
+	int64		head = 0;
+	int64		tail = 0;
+	bool		found;
+	MemoryContext reorderCtx;
+	MemoryContext oldCtx;
+
+	/* Count elements */
+	while (!HnswPtrIsNull(base, iter))
+	{
+		length++;
+		iter = HnswPtrAccess(base, iter)->next;
+	}
+
+	if (length < 2)
+		return;
+
+	/* Cannot use tmpCtx since this can be called while inserting a tuple */
+	reorderCtx = AllocSetContextCreate(CurrentMemoryContext,
+									   "Hnsw build reorder context",
+									   ALLOCSET_DEFAULT_SIZES);
+	oldCtx = MemoryContextSwitchTo(reorderCtx);
+
+	queue = palloc_extended(sizeof(HnswElement) * length, MCXT_ALLOC_HUGE);
+	visited = pointerhash_create(CurrentMemoryContext, Min(length, PG_UINT32_MAX / 2), NULL);
+
+	/* Start from the entry point */
+	queue[tail] = HnswPtrAccess(base, graph->entryPoint);
+	pointerhash_insert(visited, (uintptr_t) queue[tail], &found);
+	tail++;
+
+	iter = graph->head;
+	while (head < length)
+	{
+		HnswElement element;
+		HnswNeighborArray *neighbors;
+
+		/* Continue with elements not reachable from the entry point */
+		if (head == tail)
+		{
+			do
+			{
+				element = HnswPtrAccess(base, iter);
+				iter = element->next;
+				pointerhash_insert(visited, (uintptr_t) element, &found);
+			} while (found);
+
+			queue[tail++] = element;
+		}
+
+		element = queue[head++];
+		neighbors = HnswGetNeighbors(base, element, 0);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswElement neighbor = HnswPtrAccess(base, neighbors->items[i].element);
+
+			pointerhash_insert(visited, (uintptr_t) neighbor, &found);
+			if (found)
+				continue;
+
+			if (tail == length)
+				elog(ERROR, "hnsw graph is not valid");
+
+			queue[tail++] = neighbor;
+		}
+	}
+
+	/* Relink the list */
+	HnswPtrStore(base, graph->head, queue[0]);
+	for (int64 i = 0; i < length - 1; i++)
+		HnswPtrStore(base, queue[i]->next, queue[i + 1]);
+	HnswPtrStore(base, queue[length - 1]->next, (HnswElement) NULL);
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(reorderCtx);
+}
+
+/*
+ * Connect a partition to the partitions already on disk
+ *
+ * Only elements in upper layers are searched for on disk, which bounds the
+ * cost of merging to about 1 / m of the partition. Their connections at all
+ * layers are merged in both directions, so searches can cross partitions at
+ * every layer.
+ */
+static void
+MergePartition(HnswBuildState * buildstate, HnswElement entryPoint)
+{
+	Relation	index = buildstate->index;
+	HnswSupport *support = &buildstate->support;
+	int			m = buildstate->m;
+	int			efConstruction = buildstate->efConstruction;
+	char	   *base = buildstate->hnswarea;
+	HnswElementPtr iter = buildstate->graph->head;
+	MemoryContext mergeCtx = AllocSetContextCreate(CurrentMemoryContext,
+												   "Hnsw build merge context",
+												   ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(mergeCtx);
+
+	while (!HnswPtrIsNull(base, iter))
+	{
+		HnswElement partitionElement = HnswPtrAccess(base, iter);
+		HnswElement element;
+
+		/* Update iterator */
+		iter = partitionElement->next;
+
+		if (partitionElement->level == 0)
+			continue;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/* Load element from disk */
+		element = HnswInitElementFromBlock(partitionElement->blkno, partitionElement->offno);
+		HnswLoadElement(element, NULL, NULL, index, support, true, NULL);
+		HnswInitNeighbors(NULL, element, m, NULL);
+
+		/* Find neighbors for element, skipping itself */
+		HnswFindElementNeighbors(NULL, element, entryPoint, index, support, m, efConstruction, true);
+
+		/* Connect element to neighbors and neighbors to element */
+		HnswMergeNeighborsOnDisk(index, support, element, m, true);
+		HnswUpdateNeighborsOnDisk(index, support, element, m, true, true);
+
+		MemoryContextReset(mergeCtx);
+	}
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(mergeCtx);
+
+	/* Use the entry point of the partition if it is higher */
+	entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
+	HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, entryPoint, InvalidBlockNumber, InvalidBlockNumber, buildstate->forkNum, true);
+}
+
+/*
+ * Flush pages
+ */
+static void
+FlushPages(HnswBuildState * buildstate)
+{
+	HnswGraph  *graph = buildstate->graph;
+	char	   *base = buildstate->hnswarea;
+	const char *prevPhase;
+
+#ifdef HNSW_MEMORY
+	elog(INFO, "memory: %zu MB", graph->memoryUsed / (1024 * 1024));
+#endif
 
-		/* Add element */
-		if (PageAddItem(page, (Item) etup, etupSize, InvalidOffsetNumber, false, false) != element->offno)
-			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	VectorBuildStatsMemory(graph->memoryUsed);
 
-		/* Add new page if needed */
-		if (PageGetFreeSpace(page) < ntupSize)
-			HnswBuildAppendPage(index, &buf, &page, forkNum);
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_FLUSH);
+	prevPhase = VectorBuildStatsPhase("flushing graph");
 
-		/* Add placeholder for neighbors */
-		if (PageAddItem(page, (Item) ntup, ntupSize, InvalidOffsetNumber, false, false) != element->neighborOffno)
-			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	if (buildstate->layout == HNSW_LAYOUT_BFS)
+		ReorderGraph(buildstate);
 
-		ItemPointerSet(&IPTKey, element->blkno, element->offno);
-		IPTvalue = element->heaptids[0];
-		IPTInsert(index, IPTRootPage, IPTKey, IPTvalue, &updatedIPTRootPage);
-		if (BlockNumberIsValid(updatedIPTRootPage))
-		{
-			IPTRootPage = updatedIPTRootPage;
-			updatedIPTRootPage = InvalidBlockNumber;
-		}
+	if (graph->partitions == 0)
+	{
+		CreateMetaPage(buildstate);
+		CreateGraphPages(buildstate, HNSW_UPDATE_ENTRY_ALWAYS);
 	}
+	else if (!HnswPtrIsNull(base, graph->head))
+	{
+		/* Get entry point of partitions on disk before adding pages */
+		HnswElement entryPoint = HnswGetEntryPoint(buildstate->index);
 
-	insertPage = BufferGetBlockNumber(buf);
+		CreateGraphPages(buildstate, 0);
 
-	/* Commit */
-	MarkBufferDirty(buf);
-	UnlockReleaseBuffer(buf);
+		pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_FLUSH);
+		VectorBuildStatsPhase("flushing graph");
+		MergePartition(buildstate, entryPoint);
+	}
 
-	entryPoint = HnswPtrAccess(base, buildstate->graph->entryPoint);
-	HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_ALWAYS, entryPoint, insertPage, IPTRootPage, forkNum, true);
+	graph->partitions++;
+	graph->flushed = true;
+	MemoryContextReset(buildstate->graphCtx);
 
-	pfree(etup);
-	pfree(ntup);
+	VectorBuildStatsPhase(prevPhase);
 }
 
 /*
- * Write neighbor tuples
+ * Flush the graph as a partition and start a new one in memory
  */
 static void
-WriteNeighborTuples(HnswBuildState * buildstate)
+FlushPartition(HnswBuildState * buildstate)
 {
-	Relation	index = buildstate->index;
-	ForkNumber	forkNum = buildstate->forkNum;
-	int			m = buildstate->m;
-	HnswElementPtr iter = buildstate->graph->head;
+	HnswGraph  *graph = buildstate->graph;
 	char	   *base = buildstate->hnswarea;
-	HnswNeighborTuple ntup;
 
-	/* Allocate once */
-	ntup = palloc0(HNSW_TUPLE_ALLOC_SIZE);
+	ereport(DEBUG1,
+			(errmsg("flushing hnsw graph partition %d after " INT64_FORMAT " tuples", graph->partitions + 1, (int64) graph->indtuples)));
 
-	while (!HnswPtrIsNull(base, iter))
-	{
-		HnswElement element = HnswPtrAccess(base, iter);
-		Buffer		buf;
-		Page		page;
-		Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(element->level, m);
+	VectorBuildStatsSpill();
+	FlushPages(buildstate);
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_LOAD);
 
-		/* Update iterator */
-		iter = element->next;
+	/* Other processes wait on the flush lock, so nothing references the graph */
+	HnswPtrStore(base, graph->head, (HnswElement) NULL);
+	HnswPtrStore(base, graph->entryPoint, (HnswElement) NULL);
+	graph->memoryUsed = 0;
+	graph->flushed = false;
 
-		/* Zero memory for each element */
-		MemSet(ntup, 0, HNSW_TUPLE_ALLOC_SIZE);
+	/* Keep avoiding the base address for relptr, as in HnswBeginParallel */
+#if PG_VERSION_NUM < 140005
+	if (base != NULL)
+		graph->memoryUsed += MAXALIGN(1);
+#endif
+}
 
-		/* Can take a while, so ensure we can interrupt */
-		/* Needs to be called when no buffer locks are held */
-		CHECK_FOR_INTERRUPTS();
-		if (element->neighborPage >= RelationGetNumberOfBlocks(index))
-		{
-			ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
-		}
-		buf = ReadBufferExtended(index, forkNum, element->neighborPage, RBM_NORMAL, NULL);
-		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
-		page = BufferGetPage(buf);
+/*
+ * Write the pages of a build to disk
+ *
+ * Pages are not WAL-logged until the build finishes, so a checkpoint must
+ * only point to pages that are on disk
+ */
+static void
+SyncBuildPages(Relation index, ForkNumber forkNum)
+{
+	FlushRelationBuffers(index);
+#if PG_VERSION_NUM >= 150000
+	smgrimmedsync(RelationGetSmgr(index), forkNum);
+#else
+	RelationOpenSmgr(index);
+	smgrimmedsync(index->rd_smgr, forkNum);
+#endif
+}
 
-		HnswSetNeighborTuple(base, ntup, element, m);
+/*
+ * Get the number of times a table was vacuumed
+ *
+ * Returns -1 if vacuums are not counted. Counts are lost after a crash or a
+ * reset, which changes the reset time.
+ */
+static int64
+GetVacuumCount(Oid relid, TimestampTz *statsReset)
+{
+	PgStat_StatTabEntry *tabentry;
+	PgStat_StatDBEntry *dbentry;
 
-		if (!PageIndexTupleOverwrite(page, element->neighborOffno, (Item) ntup, ntupSize))
-			elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+	*statsReset = 0;
 
-		/* Commit */
-		MarkBufferDirty(buf);
-		UnlockReleaseBuffer(buf);
-	}
+	if (!pgstat_track_counts)
+		return -1;
 
-	pfree(ntup);
+	/* Do not use counts cached earlier in the transaction */
+	pgstat_clear_snapshot();
+
+	/* Archiver stats are reset after a crash, and database stats by resets */
+	*statsReset = pgstat_fetch_stat_archiver()->stat_reset_timestamp;
+	dbentry = pgstat_fetch_stat_dbentry(MyDatabaseId);
+	if (dbentry != NULL)
+		*statsReset = Max(*statsReset, dbentry->stat_reset_timestamp);
+
+	tabentry = pgstat_fetch_stat_tabentry(relid);
+	if (tabentry == NULL)
+		return 0;
+
+	return tabentry->vacuum_count + tabentry->autovacuum_count;
 }
 
 /*
- * Flush pages
+ * Set the heap block to resume the build from
+ *
+ * InvalidBlockNumber marks the index as not resumable, which is done before
+ * pages of earlier partitions change. The vacuum count of the table is
+ * recorded, since vacuum skips the invalid index and can reuse heap TIDs
+ * that the checkpointed graph still has.
  */
 static void
-FlushPages(HnswBuildState * buildstate)
+SetBuildCheckpoint(Relation index, ForkNumber forkNum, BlockNumber scanBlkno)
 {
-#ifdef HNSW_MEMORY
-	elog(INFO, "memory: %zu MB", buildstate->graph->memoryUsed / (1024 * 1024));
-#endif
+	Buffer		buf;
+	int64		vacuums = -1;
+	TimestampTz statsReset = 0;
 
-	CreateMetaPage(buildstate);
-	CreateGraphPages(buildstate);
-	WriteNeighborTuples(buildstate);
+	if (BlockNumberIsValid(scanBlkno))
+		vacuums = GetVacuumCount(index->rd_index->indrelid, &statsReset);
 
-	buildstate->graph->flushed = true;
-	MemoryContextReset(buildstate->graphCtx);
+	SyncBuildPages(index, forkNum);
+
+	buf = ReadBufferExtended(index, forkNum, HNSW_METAPAGE_BLKNO, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	HnswPageGetMeta(BufferGetPage(buf))->buildBlkno = scanBlkno;
+	HnswPageGetMeta(BufferGetPage(buf))->buildVacuums = vacuums;
+	HnswPageGetMeta(BufferGetPage(buf))->buildStatsReset = statsReset;
+	MarkBufferDirty(buf);
+	UnlockReleaseBuffer(buf);
+
+	SyncBuildPages(index, forkNum);
+}
+
+/*
+ * Flush the graph as a partition and record where the heap scan can resume
+ *
+ * Called between heap pages, so all tuples before scanBlkno are on disk
+ */
+static void
+CheckpointBuild(HnswBuildState * buildstate, BlockNumber scanBlkno)
+{
+	Relation	index = buildstate->index;
+	ForkNumber	forkNum = buildstate->forkNum;
+
+	if (buildstate->graph->partitions > 0)
+		SetBuildCheckpoint(index, forkNum, InvalidBlockNumber);
+
+	FlushPartition(buildstate);
+
+	SetBuildCheckpoint(index, forkNum, scanBlkno);
+	buildstate->checkpointIndtuples = buildstate->graph->indtuples;
+
+	ereport(DEBUG1,
+			(errmsg("hnsw build checkpoint at heap block %u", scanBlkno)));
 }
 
 /*
@@ -442,6 +1116,65 @@ UpdateNeighborsInMemory(char *base, HnswSupport * support, HnswElement e, int m)
 	}
 }
 
+/*
+ * Connect two elements in memory at the given layers
+ */
+static void
+ConnectInMemory(char *base, HnswSupport * support, HnswElement a, HnswElement b, int fromLevel, int toLevel, int m)
+{
+	Datum		value = HnswGetValue(base, b);
+	double		distance;
+
+	HnswGetDistances(HnswGetValue(base, a), &value, 1, support, &distance);
+
+	for (int lc = fromLevel; lc <= toLevel; lc++)
+	{
+		int			lm = HnswGetLayerM(m, lc);
+
+		LWLockAcquire(&a->lock, LW_EXCLUSIVE);
+		HnswUpdateConnection(base, HnswGetNeighbors(base, a, lc), b, distance, lm, NULL, NULL, support);
+		LWLockRelease(&a->lock);
+
+		LWLockAcquire(&b->lock, LW_EXCLUSIVE);
+		HnswUpdateConnection(base, HnswGetNeighbors(base, b, lc), a, distance, lm, NULL, NULL, support);
+		LWLockRelease(&b->lock);
+	}
+}
+
+/*
+ * Update the entry point after the element is linked
+ *
+ * Inserts do not block each other while searching, so the entry point may
+ * have changed since it was read. Connect the element to the new entry point
+ * at the layers its search did not reach before trying again.
+ */
+static void
+UpdateEntryPointInMemory(char *base, HnswGraph * graph, HnswSupport * support, HnswElement element, HnswElement entryPoint, int m)
+{
+	LWLock	   *entryLock = &graph->entryLock;
+	int			linkedLevel = entryPoint == NULL ? -1 : entryPoint->level;
+
+	for (;;)
+	{
+		HnswElement current;
+
+		LWLockAcquire(entryLock, LW_EXCLUSIVE);
+		current = HnswPtrAccess(base, graph->entryPoint);
+		if (current == entryPoint)
+		{
+			if (current == NULL || element->level > current->level)
+				HnswPtrStore(base, graph->entryPoint, element);
+			LWLockRelease(entryLock);
+			return;
+		}
+		LWLockRelease(entryLock);
+
+		ConnectInMemory(base, support, element, current, linkedLevel + 1, Min(element->level, current->level), m);
+		linkedLevel = Min(element->level, current->level);
+		entryPoint = current;
+	}
+}
+
 /*
  * Update graph in memory
  */
@@ -451,9 +1184,12 @@ UpdateGraphInMemory(HnswSupport * support, HnswElement element, int m, int efCon
 	HnswGraph  *graph = buildstate->graph;
 	char	   *base = buildstate->hnswarea;
 
-	/* Look for duplicate */
-	// if (FindDuplicateInMemory(base, element))
-	// 	return;
+	/*
+	 * Look for duplicate. Compact builds hold sq8 codes, and equal codes may
+	 * be different vectors.
+	 */
+	if (!buildstate->compact && FindDuplicateInMemory(base, element))
+		return;
 
 	/* Add element */
 	AddElementInMemory(base, graph, element);
@@ -461,9 +1197,9 @@ UpdateGraphInMemory(HnswSupport * support, HnswElement element, int m, int efCon
 	/* Update neighbors */
 	UpdateNeighborsInMemory(base, support, element, m);
 
-	/* Update entry point if needed (already have lock) */
+	/* Update entry point if needed */
 	if (entryPoint == NULL || element->level > entryPoint->level)
-		HnswPtrStore(base, graph->entryPoint, element);
+		UpdateEntryPointInMemory(base, graph, support, element, entryPoint, m);
 }
 
 /*
@@ -473,45 +1209,23 @@ static void
 InsertTupleInMemory(HnswBuildState * buildstate, HnswElement element)
 {
 	HnswGraph  *graph = buildstate->graph;
-	HnswSupport *support = &buildstate->support;
+	HnswSupport *support = &buildstate->graphSupport;
 	HnswElement entryPoint;
 	LWLock	   *entryLock = &graph->entryLock;
-	LWLock	   *entryWaitLock = &graph->entryWaitLock;
 	int			efConstruction = buildstate->efConstruction;
 	int			m = buildstate->m;
 	char	   *base = buildstate->hnswarea;
 
-	/* Wait if another process needs exclusive lock on entry lock */
-	LWLockAcquire(entryWaitLock, LW_EXCLUSIVE);
-	LWLockRelease(entryWaitLock);
-
 	/* Get entry point */
 	LWLockAcquire(entryLock, LW_SHARED);
 	entryPoint = HnswPtrAccess(base, graph->entryPoint);
-
-	/* Prevent concurrent inserts when likely updating entry point */
-	if (entryPoint == NULL || element->level > entryPoint->level)
-	{
-		/* Release shared lock */
-		LWLockRelease(entryLock);
-
-		/* Tell other processes to wait and get exclusive lock */
-		LWLockAcquire(entryWaitLock, LW_EXCLUSIVE);
-		LWLockAcquire(entryLock, LW_EXCLUSIVE);
-		LWLockRelease(entryWaitLock);
-
-		/* Get latest entry point after lock is acquired */
-		entryPoint = HnswPtrAccess(base, graph->entryPoint);
-	}
+	LWLockRelease(entryLock);
 
 	/* Find neighbors for element */
 	HnswFindElementNeighbors(base, element, entryPoint, NULL, support, m, efConstruction, false);
 
 	/* Update graph in memory */
 	UpdateGraphInMemory(support, element, m, efConstruction, entryPoint, buildstate);
-
-	/* Release entry lock */
-	LWLockRelease(entryLock);
 }
 
 /*
@@ -529,14 +1243,12 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	LWLock	   *flushLock = &graph->flushLock;
 	char	   *base = buildstate->hnswarea;
 	Datum		value;
+	Datum		graphValue;
 
 	/* Form index value */
 	if (!HnswFormIndexValue(&value, values, isnull, buildstate->typeInfo, support))
 		return false;
 
-	/* Get datum size */
-	valueSize = VARSIZE_ANY(DatumGetPointer(value));
-
 	/* Ensure graph not flushed when inserting */
 	LWLockAcquire(flushLock, LW_SHARED);
 
@@ -548,6 +1260,15 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 		return HnswInsertTupleOnDisk(index, support, value, heaptid, true);
 	}
 
+	/* Vectors are read from the heap again when writing pages */
+	if (buildstate->compact)
+		graphValue = HnswQuantizeValue(value, HNSW_QUANTIZATION_SQ8);
+	else
+		graphValue = value;
+
+	/* Get datum size */
+	valueSize = VARSIZE_ANY(DatumGetPointer(graphValue));
+
 	/*
 	 * In a parallel build, the HnswElement is allocated from the shared
 	 * memory area, so we need to coordinate with other processes.
@@ -558,13 +1279,24 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	 * Check that we have enough memory available for the new element now that
 	 * we have the allocator lock, and flush pages if needed.
 	 */
-	if (graph->memoryUsed >= graph->memoryTotal)
+	if (graph->memoryUsed >= graph->memoryTotal && !buildstate->resumable)
 	{
 		LWLockRelease(&graph->allocatorLock);
 
 		LWLockRelease(flushLock);
 		LWLockAcquire(flushLock, LW_EXCLUSIVE);
 
+		if (!graph->flushed && buildstate->partitioned)
+		{
+			/* Another process may have flushed the partition already */
+			if (graph->memoryUsed >= graph->memoryTotal)
+				FlushPartition(buildstate);
+
+			LWLockRelease(flushLock);
+
+			return InsertTuple(index, values, isnull, heaptid, buildstate);
+		}
+
 		if (!graph->flushed)
 		{
 			ereport(NOTICE,
@@ -572,7 +1304,9 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 					 errdetail("Building will take significantly more time."),
 					 errhint("Increase maintenance_work_mem to speed up builds.")));
 
+			VectorBuildStatsSpill();
 			FlushPages(buildstate);
+			pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_LOAD);
 		}
 
 		LWLockRelease(flushLock);
@@ -592,7 +1326,7 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid, Hn
 	LWLockRelease(&graph->allocatorLock);
 
 	/* Copy the datum */
-	memcpy(valuePtr, DatumGetPointer(value), valueSize);
+	memcpy(valuePtr, DatumGetPointer(graphValue), valueSize);
 	HnswPtrStore(base, element->value, valuePtr);
 
 	/* Create a lock for the element */
@@ -625,9 +1359,21 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
 	/* Use memory context */
 	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
 
+	/* Checkpoint between heap pages, which are scanned in order */
+	if (buildstate->resumable && ItemPointerGetBlockNumber(tid) != buildstate->scanBlkno)
+	{
+		if (graph->memoryUsed >= graph->memoryTotal ||
+			(buildstate->checkpointTuples > 0 && graph->indtuples - buildstate->checkpointIndtuples >= buildstate->checkpointTuples))
+			CheckpointBuild(buildstate, ItemPointerGetBlockNumber(tid));
+
+		buildstate->scanBlkno = ItemPointerGetBlockNumber(tid);
+	}
+
 	/* Insert tuple */
 	if (InsertTuple(index, values, isnull, tid, buildstate))
 	{
+		VectorBuildStatsTuples(1);
+
 		/* Update progress */
 		SpinLockAcquire(&graph->lock);
 		pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++graph->indtuples);
@@ -653,10 +1399,10 @@ InitGraph(HnswGraph * graph, char *base, Size memoryTotal)
 	graph->memoryUsed = 0;
 	graph->memoryTotal = memoryTotal;
 	graph->flushed = false;
+	graph->partitions = 0;
 	graph->indtuples = 0;
 	SpinLockInit(&graph->lock);
 	LWLockInitialize(&graph->entryLock, hnsw_lock_tranche_id);
-	LWLockInitialize(&graph->entryWaitLock, hnsw_lock_tranche_id);
 	LWLockInitialize(&graph->allocatorLock, hnsw_lock_tranche_id);
 	LWLockInitialize(&graph->flushLock, hnsw_lock_tranche_id);
 }
@@ -712,6 +1458,10 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 
 	buildstate->m = HnswGetM(index);
 	buildstate->efConstruction = HnswGetEfConstruction(index);
+	buildstate->layout = HnswGetLayout(index);
+	buildstate->partitioned = hnsw_partitioned_build;
+	buildstate->checkpointTuples = hnsw_build_checkpoint_tuples;
+	buildstate->resumable = buildstate->checkpointTuples > 0 && heap != NULL;
 	buildstate->dimensions = TupleDescAttr(index->rd_att, 0)->atttypmod;
 
 	/* Disallow varbit since require fixed dimensions */
@@ -738,10 +1488,31 @@ InitBuildState(HnswBuildState * buildstate, Relation heap, Relation index, Index
 
 	buildstate->reltuples = 0;
 	buildstate->indtuples = 0;
+	buildstate->scanBlkno = 0;
+	buildstate->checkpointIndtuples = 0;
 
 	/* Get support functions */
 	HnswInitSupport(&buildstate->support, index);
 
+	/* Only unquantized vectors can be compacted */
+	buildstate->compact = hnsw_compact_build && heap != NULL &&
+		(buildstate->support.distance == HNSW_DISTANCE_VECTOR_L2 ||
+		 buildstate->support.distance == HNSW_DISTANCE_VECTOR_IP);
+
+	/* Distances in memory are between sq8 codes for compact builds */
+	buildstate->graphSupport = buildstate->support;
+	if (buildstate->compact)
+	{
+		buildstate->graphSupport.quantization = HNSW_QUANTIZATION_SQ8;
+		if (buildstate->support.distance == HNSW_DISTANCE_VECTOR_L2)
+			buildstate->graphSupport.distance = HNSW_DISTANCE_SQ8_L2;
+		else
+			buildstate->graphSupport.distance = HNSW_DISTANCE_SQ8_IP;
+	}
+
+	/* Pruning in memory reuses distances from the search */
+	buildstate->graphSupport.distances = palloc0(sizeof(HnswDistanceCache));
+
 	InitGraph(&buildstate->graphData, NULL, (Size) maintenance_work_mem * 1024L);
 	buildstate->graph = &buildstate->graphData;
 	buildstate->ml = HnswGetMl(buildstate->m);
@@ -849,6 +1620,57 @@ HnswParallelScanAndInsert(Relation heapRel, Relation indexRel, HnswShared * hnsw
 	FreeBuildState(&buildstate);
 }
 
+/*
+ * Within a worker, help the leader write graph pages
+ */
+static void
+HnswParallelWritePages(Relation heapRel, Relation indexRel, HnswShared * hnswshared, char *hnswarea)
+{
+	int			writeState;
+
+	/* Wait for the leader to compute the layout */
+	for (;;)
+	{
+		SpinLockAcquire(&hnswshared->mutex);
+		writeState = hnswshared->writeState;
+		SpinLockRelease(&hnswshared->mutex);
+
+		if (writeState != HNSW_WRITE_WAITING)
+			break;
+
+		ConditionVariableSleep(&hnswshared->layoutcv,
+							   WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+	}
+
+	ConditionVariableCancelSleep();
+
+	/* Graph was written without the workers */
+	if (writeState == HNSW_WRITE_DONE)
+		return;
+
+	VectorBuildStatsPhase("writing pages");
+
+	if (hnswshared->compact)
+	{
+		HnswValueFetch fetch;
+
+		InitValueFetch(&fetch, heapRel, indexRel);
+		WriteGraphChunks(indexRel, MAIN_FORKNUM, HnswGetM(indexRel), hnswarea, &hnswshared->layout, &fetch);
+		EndValueFetch(&fetch);
+	}
+	else
+		WriteGraphChunks(indexRel, MAIN_FORKNUM, HnswGetM(indexRel), hnswarea, &hnswshared->layout, NULL);
+
+	VectorBuildStatsPhase(NULL);
+
+	/* Notify leader */
+	SpinLockAcquire(&hnswshared->mutex);
+	hnswshared->nparticipantswritten++;
+	SpinLockRelease(&hnswshared->mutex);
+
+	ConditionVariableSignal(&hnswshared->workersdonecv);
+}
+
 /*
  * Perform work within a launched parallel process
  */
@@ -892,7 +1714,15 @@ HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	hnswarea = shm_toc_lookup(toc, PARALLEL_KEY_HNSW_AREA, false);
 
 	/* Perform inserts */
+	VectorBuildStatsBegin(indexRel);
+	VectorBuildStatsPhase("loading tuples");
 	HnswParallelScanAndInsert(heapRel, indexRel, hnswshared, hnswarea, false);
+	VectorBuildStatsPhase(NULL);
+
+	/* Write pages */
+	HnswParallelWritePages(heapRel, indexRel, hnswshared, hnswarea);
+
+	VectorBuildStatsPublish(shm_toc_lookup(toc, PARALLEL_KEY_BUILD_STATS, false));
 
 	/* Close relations within worker */
 	index_close(indexRel, indexLockmode);
@@ -905,9 +1735,21 @@ HnswParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 static void
 HnswEndParallel(HnswLeader * hnswleader)
 {
+	HnswShared *hnswshared = hnswleader->hnswshared;
+
+	/* Release workers still waiting to write pages */
+	SpinLockAcquire(&hnswshared->mutex);
+	if (hnswshared->writeState == HNSW_WRITE_WAITING)
+		hnswshared->writeState = HNSW_WRITE_DONE;
+	SpinLockRelease(&hnswshared->mutex);
+	ConditionVariableBroadcast(&hnswshared->layoutcv);
+
 	/* Shutdown worker processes */
 	WaitForParallelWorkersToFinish(hnswleader->pcxt);
 
+	/* Add stats of workers before shared memory goes away */
+	VectorBuildStatsCollect(hnswleader->buildstats);
+
 	/* Free last reference to MVCC snapshot, if one was used */
 	if (IsMVCCSnapshot(hnswleader->snapshot))
 		UnregisterSnapshot(hnswleader->snapshot);
@@ -947,8 +1789,10 @@ HnswBeginParallel(HnswBuildState * buildstate, bool isconcurrent, int request)
 	Size		esthnswshared;
 	Size		esthnswarea;
 	Size		estother;
+	Size		estbuildstats;
 	HnswShared *hnswshared;
 	char	   *hnswarea;
+	VectorBuildSharedStats *buildstats;
 	HnswLeader *hnswleader = (HnswLeader *) palloc0(sizeof(HnswLeader));
 	bool		leaderparticipates = true;
 	int			querylen;
@@ -981,7 +1825,9 @@ HnswBeginParallel(HnswBuildState * buildstate, bool isconcurrent, int request)
 		esthnswarea -= estother;
 
 	shm_toc_estimate_chunk(&pcxt->estimator, esthnswarea);
-	shm_toc_estimate_keys(&pcxt->estimator, 2);
+	estbuildstats = VECTOR_BUILD_SHARED_STATS_SIZE(request);
+	shm_toc_estimate_chunk(&pcxt->estimator, estbuildstats);
+	shm_toc_estimate_keys(&pcxt->estimator, 3);
 
 	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
 	if (debug_query_string)
@@ -1012,11 +1858,15 @@ HnswBeginParallel(HnswBuildState * buildstate, bool isconcurrent, int request)
 	hnswshared->heaprelid = RelationGetRelid(buildstate->heap);
 	hnswshared->indexrelid = RelationGetRelid(buildstate->index);
 	hnswshared->isconcurrent = isconcurrent;
+	hnswshared->compact = buildstate->compact;
 	ConditionVariableInit(&hnswshared->workersdonecv);
+	ConditionVariableInit(&hnswshared->layoutcv);
 	SpinLockInit(&hnswshared->mutex);
 	/* Initialize mutable state */
 	hnswshared->nparticipantsdone = 0;
 	hnswshared->reltuples = 0;
+	hnswshared->writeState = HNSW_WRITE_WAITING;
+	hnswshared->nparticipantswritten = 0;
 	table_parallelscan_initialize(buildstate->heap,
 								  ParallelTableScanFromHnswShared(hnswshared),
 								  snapshot);
@@ -1033,8 +1883,12 @@ HnswBeginParallel(HnswBuildState * buildstate, bool isconcurrent, int request)
 	hnswshared->graphData.memoryUsed += MAXALIGN(1);
 #endif
 
+	buildstats = (VectorBuildSharedStats *) shm_toc_allocate(pcxt->toc, estbuildstats);
+	VectorBuildStatsInitShared(buildstats, request);
+
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_SHARED, hnswshared);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_HNSW_AREA, hnswarea);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_BUILD_STATS, buildstats);
 
 	/* Store query string for workers */
 	if (debug_query_string)
@@ -1055,6 +1909,7 @@ HnswBeginParallel(HnswBuildState * buildstate, bool isconcurrent, int request)
 	hnswleader->hnswshared = hnswshared;
 	hnswleader->snapshot = snapshot;
 	hnswleader->hnswarea = hnswarea;
+	hnswleader->buildstats = buildstats;
 
 	/* If no workers were successfully launched, back out (do serial build) */
 	if (pcxt->nworkers_launched == 0)
@@ -1107,9 +1962,11 @@ BuildGraph(HnswBuildState * buildstate, ForkNumber forkNum)
 	int			parallel_workers = 0;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_HNSW_PHASE_LOAD);
+	VectorBuildStatsPhase("loading tuples");
 
 	/* Calculate parallel workers */
-	if (buildstate->heap != NULL)
+	/* Resumable builds need the heap to be scanned in order */
+	if (buildstate->heap != NULL && !buildstate->resumable)
 		parallel_workers = ComputeParallelWorkers(buildstate->heap, buildstate->index);
 
 	/* Attempt to launch parallel worker scan when required */
@@ -1121,6 +1978,10 @@ BuildGraph(HnswBuildState * buildstate, ForkNumber forkNum)
 	{
 		if (buildstate->hnswleader)
 			buildstate->reltuples = ParallelHeapScan(buildstate);
+		else if (buildstate->resumable)
+			buildstate->reltuples = table_index_build_range_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
+																 false, false, true, buildstate->scanBlkno, InvalidBlockNumber,
+																 BuildCallback, (void *) buildstate, NULL);
 		else
 			buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
 														   true, true, BuildCallback, (void *) buildstate, NULL);
@@ -1130,7 +1991,13 @@ BuildGraph(HnswBuildState * buildstate, ForkNumber forkNum)
 
 	/* Flush pages */
 	if (!buildstate->graph->flushed)
+	{
+		/* Earlier partitions change, so the build can no longer resume */
+		if (buildstate->resumable && buildstate->graph->partitions > 0)
+			SetBuildCheckpoint(buildstate->index, buildstate->forkNum, InvalidBlockNumber);
+
 		FlushPages(buildstate);
+	}
 
 	/* End parallel build */
 	if (buildstate->hnswleader)
@@ -1148,12 +2015,16 @@ BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 	SeedRandom(42);
 #endif
 
+	VectorBuildStatsBegin(index);
+
 	InitBuildState(buildstate, heap, index, indexInfo, forkNum);
 
 	BuildGraph(buildstate, forkNum);
 
+	VectorBuildStatsPhase("writing pages");
 	if (RelationNeedsWAL(index) || forkNum == INIT_FORKNUM)
 		log_newpage_range(index, forkNum, 0, RelationGetNumberOfBlocksInFork(index, forkNum), true);
+	VectorBuildStatsPhase(NULL);
 
 	FreeBuildState(buildstate);
 }
@@ -1187,3 +2058,156 @@ hnswbuildempty(Relation index)
 
 	BuildIndex(NULL, index, indexInfo, &buildstate, INIT_FORKNUM);
 }
+
+/*
+ * Mark a resumed index as valid
+ *
+ * Snapshots taken before the transaction commits do not use the index, since
+ * tuples they can see may be missing from it
+ */
+static void
+MarkIndexValid(Relation heap, Oid indexOid)
+{
+	Relation	pg_index = table_open(IndexRelationId, RowExclusiveLock);
+	HeapTuple	indexTuple = SearchSysCacheCopy1(INDEXRELID, ObjectIdGetDatum(indexOid));
+	Form_pg_index indexForm;
+
+	if (!HeapTupleIsValid(indexTuple))
+		elog(ERROR, "cache lookup failed for index %u", indexOid);
+
+	indexForm = (Form_pg_index) GETSTRUCT(indexTuple);
+	indexForm->indisready = true;
+	indexForm->indisvalid = true;
+	indexForm->indcheckxmin = true;
+	CatalogTupleUpdate(pg_index, &indexTuple->t_self, indexTuple);
+
+	heap_freetuple(indexTuple);
+	table_close(pg_index, RowExclusiveLock);
+
+	/* Make the index visible to the planner */
+	CacheInvalidateRelcache(heap);
+}
+
+/*
+ * Resume an interrupted build from its last checkpoint
+ *
+ * Builds interrupted within CREATE INDEX CONCURRENTLY leave an invalid index.
+ * The heap scan continues from the checkpoint, and rows changed since then
+ * are added like in the validation phase of a concurrent build.
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_resume_build);
+Datum
+hnsw_resume_build(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	Oid			heapOid;
+	Relation	heap;
+	Relation	index;
+	IndexInfo  *indexInfo;
+	HnswBuildState buildstate;
+	Buffer		buf;
+	BlockNumber scanBlkno;
+	int64		vacuums = -1;
+	TimestampTz statsReset = 0;
+	TimestampTz currentStatsReset;
+	Snapshot	snapshot;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("Builds cannot be resumed during recovery.")));
+
+	heapOid = IndexGetRelation(indexOid, true);
+	if (!OidIsValid(heapOid))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", get_rel_name(indexOid))));
+
+	/* Same locks as CREATE INDEX, so rows do not change while resuming */
+	heap = table_open(heapOid, ShareLock);
+	index = index_open(indexOid, AccessExclusiveLock);
+
+	if (index->rd_indam->ambuild != hnswbuild)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexOid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexOid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(index));
+
+	if (index->rd_index->indisvalid || !index->rd_index->indislive)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("index \"%s\" is not an interrupted build", RelationGetRelationName(index))));
+
+	/* Get checkpoint */
+	scanBlkno = InvalidBlockNumber;
+	if (RelationGetNumberOfBlocks(index) > 0)
+	{
+		buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		if (HnswPageGetMeta(BufferGetPage(buf))->magicNumber == HNSW_MAGIC_NUMBER)
+		{
+			scanBlkno = HnswPageGetMeta(BufferGetPage(buf))->buildBlkno;
+			vacuums = HnswPageGetMeta(BufferGetPage(buf))->buildVacuums;
+			statsReset = HnswPageGetMeta(BufferGetPage(buf))->buildStatsReset;
+		}
+		UnlockReleaseBuffer(buf);
+	}
+
+	if (!BlockNumberIsValid(scanBlkno))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("index \"%s\" has no build checkpoint", RelationGetRelationName(index)),
+				 errhint("Use REINDEX to rebuild the index.")));
+
+	/*
+	 * Vacuum skips the invalid index, so it may have removed rows that the
+	 * checkpointed graph has and let new rows reuse their heap TIDs.
+	 * validate_index would treat those rows as indexed. A changed reset time
+	 * means counts were lost.
+	 */
+	if (vacuums < 0 || vacuums != GetVacuumCount(heapOid, &currentStatsReset) ||
+		statsReset != currentStatsReset)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("table of index \"%s\" may have been vacuumed since the build checkpoint", RelationGetRelationName(index)),
+				 errhint("Use REINDEX to rebuild the index.")));
+
+	ereport(DEBUG1,
+			(errmsg("resuming hnsw build at heap block %u", scanBlkno)));
+
+	/* Continue the heap scan with partitions merged into the graph on disk */
+	VectorBuildStatsBegin(index);
+	indexInfo = BuildIndexInfo(index);
+	InitBuildState(&buildstate, heap, index, indexInfo, MAIN_FORKNUM);
+	buildstate.resumable = true;
+	buildstate.scanBlkno = scanBlkno;
+	buildstate.graph->partitions = 1;
+
+	BuildGraph(&buildstate, MAIN_FORKNUM);
+
+	VectorBuildStatsPhase("writing pages");
+	if (RelationNeedsWAL(index))
+		log_newpage_range(index, MAIN_FORKNUM, 0, RelationGetNumberOfBlocks(index), true);
+	VectorBuildStatsPhase(NULL);
+
+	FreeBuildState(&buildstate);
+
+	/* Add rows that changed before the scan position */
+	snapshot = RegisterSnapshot(GetLatestSnapshot());
+	validate_index(heapOid, indexOid, snapshot);
+	UnregisterSnapshot(snapshot);
+
+	MarkIndexValid(heap, indexOid);
+
+	index_close(index, NoLock);
+	table_close(heap, NoLock);
+
+	PG_RETURN_INT64((int64) buildstate.indtuples);
+}
@@ -0,0 +1,414 @@
+#include "postgres.h"
+
+#include "hnsw.h"
+#include "storage/bufmgr.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/* Element in the upper layers */
+typedef struct HnswUpperElement
+{
+	ItemPointerData indextid;
+	uint8		level;
+	int			neighbors;		/* offset of (level * m) neighbors */
+	Pointer		value;			/* NULL if deleted */
+}			HnswUpperElement;
+
+/* Backend-local copy of the upper layers of an index */
+typedef struct HnswUpperCache
+{
+	Oid			indexOid;		/* hash key */
+	uint32		version;
+	bool		fits;			/* false if the upper layers do not fit */
+	int			m;
+	Size		size;
+	MemoryContext ctx;
+	int			length;
+	HnswUpperElement *elements; /* entry point first */
+	int		   *neighbors;		/* element offsets, -1 for none */
+}			HnswUpperCache;
+
+/* Maps index TIDs to element offsets while loading */
+typedef struct HnswUpperCacheTid
+{
+	ItemPointerData indextid;	/* hash key */
+	int			offset;
+}			HnswUpperCacheTid;
+
+static HTAB *upperCache = NULL;
+static Size upperCacheSize = 0;
+
+/*
+ * Free a cache entry
+ */
+static void
+RemoveUpperCacheEntry(HnswUpperCache * entry)
+{
+	upperCacheSize -= entry->size;
+	MemoryContextDelete(entry->ctx);
+	hash_search(upperCache, &entry->indexOid, HASH_REMOVE, NULL);
+}
+
+/*
+ * Free all cache entries
+ */
+static void
+ResetUpperCache(void)
+{
+	HASH_SEQ_STATUS status;
+	HnswUpperCache *entry;
+
+	hash_seq_init(&status, upperCache);
+	while ((entry = (HnswUpperCache *) hash_seq_search(&status)) != NULL)
+		RemoveUpperCacheEntry(entry);
+
+	Assert(upperCacheSize == 0);
+}
+
+/*
+ * Invalidate entries when the index is rebuilt, truncated, or dropped
+ */
+static void
+UpperCacheRelcacheCallback(Datum arg, Oid relid)
+{
+	HnswUpperCache *entry;
+
+	if (upperCache == NULL)
+		return;
+
+	if (!OidIsValid(relid))
+	{
+		ResetUpperCache();
+		return;
+	}
+
+	entry = (HnswUpperCache *) hash_search(upperCache, &relid, HASH_FIND, NULL);
+	if (entry != NULL)
+		RemoveUpperCacheEntry(entry);
+}
+
+/*
+ * Get the offset of an element, adding it if needed
+ */
+static int
+GetUpperElement(HnswUpperCache * cache, HTAB *tids, ItemPointer indextid, int *capacity)
+{
+	HnswUpperCacheTid *tid;
+	bool		found;
+
+	tid = (HnswUpperCacheTid *) hash_search(tids, indextid, HASH_ENTER, &found);
+	if (found)
+		return tid->offset;
+
+	if (cache->length == *capacity)
+	{
+		*capacity *= 2;
+		cache->elements = repalloc(cache->elements, sizeof(HnswUpperElement) * *capacity);
+	}
+
+	tid->offset = cache->length++;
+	cache->elements[tid->offset].indextid = *indextid;
+	cache->elements[tid->offset].value = NULL;
+	cache->size += sizeof(HnswUpperElement) + sizeof(HnswUpperCacheTid);
+	return tid->offset;
+}
+
+/*
+ * Load the upper layers reachable from the entry point
+ *
+ * Returns false if they do not fit in maxSize
+ */
+static bool
+LoadUpperCache(Relation index, HnswUpperCache * cache, BlockNumber entryBlkno, OffsetNumber entryOffno, Size maxSize)
+{
+	HASHCTL		hash_ctl;
+	HTAB	   *tids;
+	ItemPointerData entryTid;
+	int			capacity = 64;
+	int			neighborsCapacity = 64 * cache->m;
+	int			neighborsLength = 0;
+	int			m = cache->m;
+
+	hash_ctl.keysize = sizeof(ItemPointerData);
+	hash_ctl.entrysize = sizeof(HnswUpperCacheTid);
+	hash_ctl.hcxt = CurrentMemoryContext;
+	tids = hash_create("Hnsw upper cache tids", capacity, &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	cache->length = 0;
+	cache->elements = palloc(sizeof(HnswUpperElement) * capacity);
+	cache->neighbors = palloc(sizeof(int) * neighborsCapacity);
+
+	ItemPointerSet(&entryTid, entryBlkno, entryOffno);
+	GetUpperElement(cache, tids, &entryTid, &capacity);
+
+	/* Elements are loaded in the order they are reached */
+	for (int i = 0; i < cache->length; i++)
+	{
+		HnswUpperElement *element = &cache->elements[i];
+		ItemPointerData neighbortid;
+		Buffer		buf;
+		Page		page;
+		HnswElementTuple etup;
+		HnswNeighborTuple ntup;
+		int			level;
+
+		if (cache->size > maxSize)
+			return false;
+
+		/* Read element */
+		buf = ReadBuffer(index, ItemPointerGetBlockNumber(&element->indextid));
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(&element->indextid)));
+
+		if (!HnswIsElementTuple(etup))
+			elog(ERROR, "hnsw index is not valid");
+
+		level = etup->level;
+		neighbortid = etup->neighbortid;
+		element->level = level;
+		element->neighbors = neighborsLength;
+
+		/* Deleted elements are kept as links only */
+		if (!etup->deleted)
+		{
+			Size		valueSize = VARSIZE_ANY(&etup->data);
+
+			element->value = palloc(valueSize);
+			memcpy(element->value, &etup->data, valueSize);
+			cache->size += valueSize;
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		if (neighborsLength + level * m > neighborsCapacity)
+		{
+			neighborsCapacity = Max(neighborsCapacity * 2, neighborsLength + level * m);
+			cache->neighbors = repalloc(cache->neighbors, sizeof(int) * neighborsCapacity);
+		}
+
+		for (int j = 0; j < level * m; j++)
+			cache->neighbors[neighborsLength + j] = -1;
+
+		neighborsLength += level * m;
+		cache->size += sizeof(int) * level * m;
+
+		if (level == 0 || element->value == NULL)
+			continue;
+
+		/* Read neighbors */
+		buf = ReadBuffer(index, ItemPointerGetBlockNumber(&neighbortid));
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(&neighbortid)));
+
+		if (HnswIsNeighborTuple(ntup) && ntup->count == (level + 2) * m)
+		{
+			for (int lc = level; lc >= 1; lc--)
+			{
+				ItemPointer indextids = ntup->indextids + (level - lc) * m;
+
+				for (int j = 0; j < m; j++)
+				{
+					if (!ItemPointerIsValid(&indextids[j]))
+						break;
+
+					/* Elements array may move */
+					cache->neighbors[cache->elements[i].neighbors + (lc - 1) * m + j] = GetUpperElement(cache, tids, &indextids[j], &capacity);
+				}
+			}
+		}
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	hash_destroy(tids);
+
+	return true;
+}
+
+/*
+ * Get cached upper layers for an index, loading them if needed
+ */
+static HnswUpperCache *
+GetUpperCache(Relation index, Size maxSize)
+{
+	Oid			indexOid = RelationGetRelid(index);
+	HnswUpperCache *entry;
+	HnswUpperCache cache;
+	Buffer		buf;
+	HnswMetaPage metap;
+	BlockNumber entryBlkno;
+	OffsetNumber entryOffno;
+	int			entryLevel;
+	MemoryContext oldCtx;
+	bool		found;
+
+	if (upperCache == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		if (CacheMemoryContext == NULL)
+			CreateCacheMemoryContext();
+
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(HnswUpperCache);
+		hash_ctl.hcxt = CacheMemoryContext;
+		upperCache = hash_create("Hnsw upper cache", 16, &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(UpperCacheRelcacheCallback, (Datum) 0);
+	}
+
+	/* Get the version and entry point */
+	MemSet(&cache, 0, sizeof(HnswUpperCache));
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(buf));
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	cache.version = metap->upperVersion;
+	cache.m = metap->m;
+	entryBlkno = metap->entryBlkno;
+	entryOffno = metap->entryOffno;
+	entryLevel = metap->entryLevel;
+	UnlockReleaseBuffer(buf);
+
+	entry = (HnswUpperCache *) hash_search(upperCache, &indexOid, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		if (entry->version == cache.version)
+			return entry->fits ? entry : NULL;
+
+		RemoveUpperCacheEntry(entry);
+	}
+
+	if (!BlockNumberIsValid(entryBlkno) || entryLevel <= 0)
+		return NULL;
+
+	/* Load into query memory so an error does not leak cache memory */
+	cache.indexOid = indexOid;
+	cache.size = sizeof(HnswUpperCache);
+	cache.ctx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Hnsw upper cache entry",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	oldCtx = MemoryContextSwitchTo(cache.ctx);
+	cache.fits = LoadUpperCache(index, &cache, entryBlkno, entryOffno, maxSize);
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Remember that this version does not fit */
+	if (!cache.fits)
+	{
+		MemoryContextReset(cache.ctx);
+		cache.size = sizeof(HnswUpperCache);
+		cache.length = 0;
+		cache.elements = NULL;
+		cache.neighbors = NULL;
+	}
+
+	/* Make room */
+	if (upperCacheSize + cache.size > maxSize)
+		ResetUpperCache();
+
+	MemoryContextSetParent(cache.ctx, CacheMemoryContext);
+
+	entry = (HnswUpperCache *) hash_search(upperCache, &indexOid, HASH_ENTER, &found);
+	Assert(!found);
+	memcpy(entry, &cache, sizeof(HnswUpperCache));
+	upperCacheSize += entry->size;
+
+	return entry->fits ? entry : NULL;
+}
+
+/*
+ * Search the upper layers in the cache
+ *
+ * Returns the entry points for the ground layer, or NIL if the cache cannot
+ * be used
+ */
+List *
+HnswSearchUpperCache(HnswQuery * q, Relation index, HnswSupport * support)
+{
+	Size		maxSize = (Size) hnsw_upper_cache_mem * 1024L;
+	HnswUpperCache *cache;
+	HnswUpperElement *current;
+	HnswElement element;
+	Datum	   *values;
+	int		   *offsets;
+	double	   *distances;
+	double		distance;
+	int			m;
+
+	if (maxSize == 0 || DatumGetPointer(q->value) == NULL)
+		return NIL;
+
+	cache = GetUpperCache(index, maxSize);
+	if (cache == NULL)
+		return NIL;
+
+	m = cache->m;
+	current = &cache->elements[0];
+	if (current->value == NULL)
+		return NIL;
+
+	values = palloc(sizeof(Datum) * m);
+	offsets = palloc(sizeof(int) * m);
+	distances = palloc(sizeof(double) * m);
+
+	values[0] = PointerGetDatum(current->value);
+	HnswGetDistances(q->value, values, 1, support, &distance);
+
+	/* Greedy search like ef = 1 */
+	for (int lc = current->level; lc >= 1; lc--)
+	{
+		for (;;)
+		{
+			HnswUpperElement *closest = NULL;
+			int			length = 0;
+
+			for (int j = 0; j < m; j++)
+			{
+				int			offset = cache->neighbors[current->neighbors + (lc - 1) * m + j];
+				HnswUpperElement *neighbor;
+
+				if (offset < 0)
+					break;
+
+				neighbor = &cache->elements[offset];
+
+				/* Make robust to issues */
+				if (neighbor->value == NULL || neighbor->level < lc)
+					continue;
+
+				values[length] = PointerGetDatum(neighbor->value);
+				offsets[length] = offset;
+				length++;
+			}
+
+			HnswGetDistances(q->value, values, length, support, distances);
+
+			for (int j = 0; j < length; j++)
+			{
+				if (distances[j] < distance)
+				{
+					distance = distances[j];
+					closest = &cache->elements[offsets[j]];
+				}
+			}
+
+			if (closest == NULL)
+				break;
+
+			current = closest;
+		}
+	}
+
+	/* Load heap TIDs and neighbor info from the index */
+	element = HnswInitElementFromBlock(ItemPointerGetBlockNumber(&current->indextid), ItemPointerGetOffsetNumber(&current->indextid));
+	return list_make1(HnswEntryCandidate(NULL, element, q, index, support, false));
+}
@@ -4,11 +4,32 @@
 
 #include "access/generic_xlog.h"
 #include "hnsw.h"
+#include "miscadmin.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
 #include "utils/datum.h"
 #include "utils/memutils.h"
 
+/* Connection from an element of a batch to a neighbor on disk */
+typedef struct HnswBatchUpdate
+{
+	HnswElement neighbor;
+	HnswElement element;
+	int			lc;
+	float		distance;
+}			HnswBatchUpdate;
+
+/* Slot of a neighbor tuple to set to an element of a batch */
+typedef struct HnswBatchWrite
+{
+	BlockNumber neighborPage;
+	OffsetNumber neighborOffno;
+	int			startIdx;
+	int			lm;
+	int			idx;			/* -2 for any free slot */
+	HnswElement element;
+}			HnswBatchWrite;
+
 /*
  * Get the insert page
  */
@@ -352,7 +373,7 @@ AddElementOnDisk(Relation index, HnswElement e, int m, BlockNumber insertPage, B
 		*updatedInsertPage = newInsertPage;
 
 	ItemPointerSet(&IPTkey, e->blkno, e->offno);
-	IPTvalue = e->heaptids[0];
+	IPTvalue = HnswHeapTidMapValue(e->heaptids, e->heaptidsLength);
 	IPTInsert(index, IPTRootPage, IPTkey, IPTvalue, updatedIPTRootPage);
 }
 
@@ -367,7 +388,7 @@ HnswLoadNeighbors(HnswElement element, Relation index, int m, int lm, int lc)
 	// ItemPointerData indextids[HNSW_MAX_M * 2];
 	ItemPointerData indextids[HNSW_MAX_M * 2];
 
-	if (!HnswLoadNeighborTids(element, indextids, index, m, lm, lc))
+	if (!HnswLoadNeighborTids(element, indextids, index, NULL, m, lm, lc))
 		return neighbors;
 
 	for (int i = 0; i < lm; i++)
@@ -445,6 +466,7 @@ GetUpdateIndex(HnswElement element, HnswElement newElement, float distance, int
 		HnswQuery	q;
 
 		q.value = HnswGetValue(base, element);
+		q.patience = 0;
 
 		LoadElementsForInsert(neighbors, &q, &idx, index, support);
 
@@ -595,6 +617,49 @@ HnswUpdateNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e,
 	MemoryContextDelete(updateCtx);
 }
 
+/*
+ * Merge candidate neighbors into the neighbors of an existing element
+ *
+ * Unlike overwriting the neighbor tuple, this keeps existing connections that
+ * are not pruned by the new ones
+ */
+void
+HnswMergeNeighborsOnDisk(Relation index, HnswSupport * support, HnswElement e, int m, bool building)
+{
+	char	   *base = NULL;
+
+	/* Use separate memory context to improve performance for larger vectors */
+	MemoryContext updateCtx = GenerationContextCreate(CurrentMemoryContext,
+													  "Hnsw merge update context",
+#if PG_VERSION_NUM >= 150000
+													  128 * 1024, 128 * 1024,
+#endif
+													  128 * 1024);
+
+	for (int lc = e->level; lc >= 0; lc--)
+	{
+		int			lm = HnswGetLayerM(m, lc);
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+		for (int i = 0; i < neighbors->length; i++)
+		{
+			HnswCandidate *hc = &neighbors->items[i];
+			HnswElement neighborElement = HnswPtrAccess(base, hc->element);
+			int			idx;
+
+			idx = GetUpdateIndex(e, neighborElement, hc->distance, m, lm, lc, index, support, updateCtx);
+
+			/* Candidate was not selected as a neighbor */
+			if (idx == -1)
+				continue;
+
+			UpdateNeighborOnDisk(e, neighborElement, idx, m, lm, lc, index, true, building);
+		}
+	}
+
+	MemoryContextDelete(updateCtx);
+}
+
 /*
  * Add a heap TID to an existing element
  */
@@ -606,6 +671,8 @@ AddDuplicateOnDisk(Relation index, HnswElement element, HnswElement dup, bool bu
 	GenericXLogState *state;
 	HnswElementTuple etup;
 	int			i;
+	ItemPointerData IPTkey,
+				IPTvalue;
 
 	/* Read page */
 	if (dup->blkno >= RelationGetNumberOfBlocks(index))
@@ -631,6 +698,15 @@ AddDuplicateOnDisk(Relation index, HnswElement element, HnswElement dup, bool bu
 	{
 		if (!ItemPointerIsValid(&etup->heaptids[i]))
 			break;
+
+		/* Already added by a pending list merge that failed */
+		if (ItemPointerEquals(&etup->heaptids[i], &element->heaptids[0]))
+		{
+			if (!building)
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buf);
+			return true;
+		}
 	}
 
 	/* Either being deleted or we lost our chance to another backend */
@@ -644,6 +720,7 @@ AddDuplicateOnDisk(Relation index, HnswElement element, HnswElement dup, bool bu
 
 	/* Add heap TID, modifying the tuple on the page directly */
 	etup->heaptids[i] = element->heaptids[0];
+	IPTvalue = HnswHeapTidMapValue(etup->heaptids, i + 1);
 
 	/* Commit */
 	if (building)
@@ -652,6 +729,20 @@ AddDuplicateOnDisk(Relation index, HnswElement element, HnswElement dup, bool bu
 		GenericXLogFinish(state);
 	UnlockReleaseBuffer(buf);
 
+	/* Filters now need to check the heap TIDs in the element tuple */
+	if (i == 1)
+	{
+		BlockNumber IPTRootPage;
+		BlockNumber newIPTRootPage = InvalidBlockNumber;
+
+		GetInsertPage(index, &IPTRootPage);
+		ItemPointerSet(&IPTkey, dup->blkno, dup->offno);
+
+		/* Replacing a value does not split nodes */
+		IPTInsert(index, IPTRootPage, IPTkey, IPTvalue, &newIPTRootPage);
+		Assert(!BlockNumberIsValid(newIPTRootPage));
+	}
+
 	return true;
 }
 
@@ -682,6 +773,65 @@ FindDuplicateOnDisk(Relation index, HnswElement element, bool building)
 	return false;
 }
 
+/*
+ * Connect an element to an entry point added by a concurrent insert
+ *
+ * The search for neighbors did not reach the layers above linkedLevel, so
+ * the entry point is the only candidate there
+ */
+static void
+ConnectToEntryPoint(Relation index, HnswSupport * support, HnswElement element, HnswElement entryPoint, int linkedLevel, int m, bool building)
+{
+	char	   *base = NULL;
+	int			level = Min(element->level, entryPoint->level);
+	HnswQuery	q;
+	double		distance;
+
+	q.value = HnswGetValue(base, element);
+	q.patience = 0;
+
+	HnswLoadElement(entryPoint, &distance, &q, index, support, true, NULL);
+
+	HnswInitNeighbors(base, element, m, NULL);
+	for (int lc = linkedLevel + 1; lc <= level; lc++)
+	{
+		HnswNeighborArray *neighbors = HnswGetNeighbors(base, element, lc);
+		HnswCandidate *hc = &neighbors->items[neighbors->length++];
+
+		HnswPtrStore(base, hc->element, entryPoint);
+		hc->distance = distance;
+	}
+
+	/* Connect element to entry point and entry point to element */
+	HnswMergeNeighborsOnDisk(index, support, element, m, building);
+	HnswUpdateNeighborsOnDisk(index, support, element, m, true, building);
+}
+
+/*
+ * Update the entry point after the element is linked
+ *
+ * Inserts do not block each other while searching, so the entry point may
+ * have changed since it was read. Searches tolerate a stale entry point, but
+ * elements that both went above it need to be connected.
+ */
+static void
+UpdateEntryPointOnDisk(Relation index, HnswSupport * support, HnswElement element, HnswElement entryPoint, int m, bool building)
+{
+	int			linkedLevel = entryPoint == NULL ? -1 : entryPoint->level;
+	HnswElement current;
+
+	while (!HnswSwapEntryPoint(index, entryPoint, element, &current, building))
+	{
+		if (current != NULL && current->level > linkedLevel)
+		{
+			ConnectToEntryPoint(index, support, element, current, linkedLevel, m, building);
+			linkedLevel = Min(element->level, current->level);
+		}
+
+		entryPoint = current;
+	}
+}
+
 /*
  * Update graph on disk
  */
@@ -694,8 +844,8 @@ UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, in
 	BlockNumber insertPage = InvalidBlockNumber;
 
 	/* Look for duplicate */
-	// if (FindDuplicateOnDisk(index, element, building))
-	// 	return;
+	if (FindDuplicateOnDisk(index, element, building))
+		return;
 
 	insertPage = GetInsertPage(index, &IPTRootPage);
 
@@ -711,7 +861,9 @@ UpdateGraphOnDisk(Relation index, HnswSupport * support, HnswElement element, in
 
 	/* Update entry point if needed */
 	if (entryPoint == NULL || element->level > entryPoint->level)
-		HnswUpdateMetaPage(index, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM, building);
+		UpdateEntryPointOnDisk(index, support, element, entryPoint, m, building);
+	else if (element->level > 0)
+		HnswUpdateMetaPage(index, HNSW_UPDATE_UPPER, NULL, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM, building);
 }
 
 /*
@@ -724,15 +876,15 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 	HnswElement element;
 	int			m;
 	int			efConstruction = HnswGetEfConstruction(index);
-	LOCKMODE	lockmode = ShareLock;
 	char	   *base = NULL;
 
 	/*
 	 * Get a shared lock. This allows vacuum to ensure no in-flight inserts
 	 * before repairing graph. Use a page lock so it does not interfere with
-	 * buffer lock (or reads when vacuuming).
+	 * buffer lock (or reads when vacuuming). Inserts that update the entry
+	 * point swap it on the metapage instead of taking an exclusive lock.
 	 */
-	LockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	LockPage(index, HNSW_UPDATE_LOCK, ShareLock);
 
 	/* Get m and entry point */
 	HnswGetMetaPageInfo(index, &m, &entryPoint, NULL);
@@ -741,20 +893,6 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 	element = HnswInitElement(base, heaptid, m, HnswGetMl(m), HnswGetMaxLevel(m), NULL);
 	HnswPtrStore(base, element->value, DatumGetPointer(value));
 
-	/* Prevent concurrent inserts when likely updating entry point */
-	if (entryPoint == NULL || element->level > entryPoint->level)
-	{
-		/* Release shared lock */
-		UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-		/* Get exclusive lock */
-		lockmode = ExclusiveLock;
-		LockPage(index, HNSW_UPDATE_LOCK, lockmode);
-
-		/* Get latest entry point after lock is acquired */
-		entryPoint = HnswGetEntryPoint(index);
-	}
-
 	/* Find neighbors for element */
 	HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, false);
 
@@ -762,11 +900,514 @@ HnswInsertTupleOnDisk(Relation index, HnswSupport * support, Datum value, ItemPo
 	UpdateGraphOnDisk(index, support, element, m, efConstruction, entryPoint, building);
 
 	/* Release lock */
-	UnlockPage(index, HNSW_UPDATE_LOCK, lockmode);
+	UnlockPage(index, HNSW_UPDATE_LOCK, ShareLock);
 
 	return true;
 }
 
+/*
+ * Find a duplicate element in the batch
+ */
+static bool
+FindDuplicateInBatch(HnswElement element, HnswElement * batch, int n)
+{
+	char	   *base = NULL;
+	Datum		value = HnswGetValue(base, element);
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement dup = batch[i];
+
+		if (dup->heaptidsLength == HNSW_HEAPTIDS)
+			continue;
+
+		if (datumIsEqual(value, HnswGetValue(base, dup), false, -1))
+		{
+			HnswAddHeapTid(dup, &element->heaptids[0]);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Update connections of an element in memory
+ */
+static void
+UpdateBatchConnection(HnswNeighborArray * neighbors, HnswElement newElement, float distance, int lm, int *updateIdx, HnswSupport * support)
+{
+	/* Appended candidates have no cached closer state */
+	if (neighbors->length < lm)
+		neighbors->closerSet = false;
+
+	HnswUpdateConnection(NULL, neighbors, newElement, distance, lm, updateIdx, NULL, support);
+}
+
+/*
+ * Connect an element to the elements of the batch before it
+ *
+ * Neither side is on disk yet, so both are updated in memory
+ */
+static void
+LinkInBatch(HnswElement element, HnswElement * batch, double *distances, int n, int m, HnswSupport * support)
+{
+	char	   *base = NULL;
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement other = batch[i];
+
+		for (int lc = Min(element->level, other->level); lc >= 0; lc--)
+		{
+			int			lm = HnswGetLayerM(m, lc);
+
+			UpdateBatchConnection(HnswGetNeighbors(base, element, lc), other, distances[i], lm, NULL, support);
+			UpdateBatchConnection(HnswGetNeighbors(base, other, lc), element, distances[i], lm, NULL, support);
+		}
+	}
+}
+
+/*
+ * Compare batch updates by neighbor tuple and layer
+ */
+static int
+CompareBatchUpdates(const void *a, const void *b)
+{
+	const HnswBatchUpdate *ua = (const HnswBatchUpdate *) a;
+	const HnswBatchUpdate *ub = (const HnswBatchUpdate *) b;
+
+	if (ua->neighbor->neighborPage != ub->neighbor->neighborPage)
+		return ua->neighbor->neighborPage < ub->neighbor->neighborPage ? -1 : 1;
+	if (ua->neighbor->neighborOffno != ub->neighbor->neighborOffno)
+		return ua->neighbor->neighborOffno < ub->neighbor->neighborOffno ? -1 : 1;
+	return ub->lc - ua->lc;
+}
+
+/*
+ * Compare batch writes by neighbor tuple
+ */
+static int
+CompareBatchWrites(const void *a, const void *b)
+{
+	const HnswBatchWrite *wa = (const HnswBatchWrite *) a;
+	const HnswBatchWrite *wb = (const HnswBatchWrite *) b;
+
+	if (wa->neighborPage != wb->neighborPage)
+		return wa->neighborPage < wb->neighborPage ? -1 : 1;
+	if (wa->neighborOffno != wb->neighborOffno)
+		return wa->neighborOffno < wb->neighborOffno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Compare elements by neighbor tuple
+ */
+static int
+CompareNeighborTids(const void *a, const void *b)
+{
+	HnswElement ea = *((const HnswElement *) a);
+	HnswElement eb = *((const HnswElement *) b);
+
+	if (ea->neighborPage != eb->neighborPage)
+		return ea->neighborPage < eb->neighborPage ? -1 : 1;
+	if (ea->neighborOffno != eb->neighborOffno)
+		return ea->neighborOffno < eb->neighborOffno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Get the slots of a neighbor tuple that elements of the batch take
+ *
+ * All updates are for the same neighbor and layer, so the neighbor tuple and
+ * its elements are read once for all of them
+ */
+static int
+GetBatchWrites(HnswBatchUpdate * updates, int n, int m, Relation index, HnswSupport * support, HnswBatchWrite * writes)
+{
+	char	   *base = NULL;
+	HnswElement neighbor = updates[0].neighbor;
+	int			lc = updates[0].lc;
+	int			lm = HnswGetLayerM(m, lc);
+	HnswNeighborArray *neighbors = HnswLoadNeighbors(neighbor, index, m, lm, lc);
+	HnswElement *slots = palloc0(lm * sizeof(HnswElement));
+	bool	   *appended = palloc0(lm * sizeof(bool));
+	bool		loaded = false;
+	int			nwrites = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswBatchUpdate *update = &updates[i];
+		int			idx = -1;
+
+		/* Load elements once the new ones no longer fit */
+		if (neighbors->length == lm && !loaded)
+		{
+			HnswQuery	q;
+
+			q.value = HnswGetValue(base, neighbor);
+			q.patience = 0;
+
+			for (int j = 0; j < neighbors->length; j++)
+			{
+				HnswCandidate *hc = &neighbors->items[j];
+				double		distance;
+
+				if (slots[j] != NULL)
+					continue;
+
+				HnswLoadElement(HnswPtrAccess(base, hc->element), &distance, &q, index, support, true, NULL);
+				hc->distance = distance;
+			}
+
+			loaded = true;
+		}
+
+		/* Replace element if being deleted */
+		for (int j = 0; loaded && j < neighbors->length; j++)
+		{
+			if (slots[j] == NULL && HnswPtrAccess(base, neighbors->items[j].element)->heaptidsLength == 0)
+			{
+				HnswPtrStore(base, neighbors->items[j].element, update->element);
+				neighbors->items[j].distance = update->distance;
+				neighbors->closerSet = false;
+				idx = j;
+				break;
+			}
+		}
+
+		if (idx == -1)
+			UpdateBatchConnection(neighbors, update->element, update->distance, lm, &idx, support);
+
+		if (idx == -2)
+		{
+			idx = neighbors->length - 1;
+			appended[idx] = true;
+		}
+
+		/* New element was not selected as a neighbor */
+		if (idx == -1)
+			continue;
+
+		slots[idx] = update->element;
+	}
+
+	for (int i = 0; i < lm; i++)
+	{
+		HnswBatchWrite *write;
+
+		if (slots[i] == NULL)
+			continue;
+
+		write = &writes[nwrites++];
+		write->neighborPage = neighbor->neighborPage;
+		write->neighborOffno = neighbor->neighborOffno;
+		write->startIdx = (neighbor->level - lc) * m;
+		write->lm = lm;
+		write->idx = appended[i] ? -2 : i;
+		write->element = slots[i];
+	}
+
+	return nwrites;
+}
+
+/*
+ * Write slots of neighbor tuples, one page at a time
+ */
+static void
+WriteBatchNeighbors(Relation index, HnswBatchWrite * writes, int n)
+{
+	qsort(writes, n, sizeof(HnswBatchWrite), CompareBatchWrites);
+
+	for (int i = 0; i < n;)
+	{
+		BlockNumber blkno = writes[i].neighborPage;
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+		bool		updated = false;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		for (; i < n && writes[i].neighborPage == blkno; i++)
+		{
+			HnswBatchWrite *write = &writes[i];
+			HnswNeighborTuple ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, write->neighborOffno));
+			int			idx = -1;
+
+			if (write->idx == -2)
+			{
+				/* Find free offset if still exists */
+				for (int j = 0; j < write->lm; j++)
+				{
+					if (!ItemPointerIsValid(&ntup->indextids[write->startIdx + j]))
+					{
+						idx = write->startIdx + j;
+						break;
+					}
+				}
+			}
+			else
+				idx = write->startIdx + write->idx;
+
+			/* Make robust to issues */
+			if (idx >= 0 && idx < ntup->count)
+			{
+				ItemPointerSet(&ntup->indextids[idx], write->element->blkno, write->element->offno);
+				updated = true;
+			}
+		}
+
+		/* Commit */
+		if (updated)
+			GenericXLogFinish(state);
+		else
+			GenericXLogAbort(state);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Rewrite neighbor tuples of elements that were added before their neighbors
+ */
+static void
+WriteBatchNeighborTuples(Relation index, HnswElement * elements, int n, int m)
+{
+	char	   *base = NULL;
+
+	qsort(elements, n, sizeof(HnswElement), CompareNeighborTids);
+
+	for (int i = 0; i < n;)
+	{
+		BlockNumber blkno = elements[i]->neighborPage;
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		for (; i < n && elements[i]->neighborPage == blkno; i++)
+		{
+			HnswElement e = elements[i];
+			Size		ntupSize = HNSW_NEIGHBOR_TUPLE_SIZE(e->level, m);
+			HnswNeighborTuple ntup = palloc0(ntupSize);
+			HnswNeighborTuple existing = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, e->neighborOffno));
+
+			HnswSetNeighborTuple(base, ntup, e, m);
+
+			/* Keep the version of a reused offset */
+			ntup->version = existing->version;
+
+			if (!PageIndexTupleOverwrite(page, e->neighborOffno, (Item) ntup, ntupSize))
+				elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+		}
+
+		/* Commit */
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Add the elements of a batch and connect neighbors on disk to them
+ */
+static void
+UpdateGraphOnDiskBatch(Relation index, HnswSupport * support, HnswElement * batch, int n, int m)
+{
+	char	   *base = NULL;
+	HnswBatchUpdate *updates;
+	HnswBatchWrite *writes;
+	HnswElement *rewrite = palloc(n * sizeof(HnswElement));
+	int			nupdates = 0;
+	int			nwrites = 0;
+	int			nrewrite = 0;
+	int			maxUpdates = 0;
+	BlockNumber insertPage;
+	BlockNumber IPTRootPage;
+	BlockNumber newInsertPage = InvalidBlockNumber;
+	BlockNumber newIPTRootPage = InvalidBlockNumber;
+
+	for (int i = 0; i < n; i++)
+		maxUpdates += (batch[i]->level + 2) * m;
+	updates = palloc(maxUpdates * sizeof(HnswBatchUpdate));
+
+	/* Collect connections to neighbors on disk before any element is added */
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement e = batch[i];
+
+		for (int lc = e->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+
+			for (int j = 0; j < neighbors->length; j++)
+			{
+				HnswCandidate *hc = &neighbors->items[j];
+				HnswElement neighbor = HnswPtrAccess(base, hc->element);
+				HnswBatchUpdate *update;
+
+				/* Elements of the batch are already connected */
+				if (!OffsetNumberIsValid(neighbor->offno))
+					continue;
+
+				update = &updates[nupdates++];
+				update->neighbor = neighbor;
+				update->element = e;
+				update->lc = lc;
+				update->distance = hc->distance;
+			}
+		}
+	}
+
+	/* Add elements */
+	insertPage = GetInsertPage(index, &IPTRootPage);
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement e = batch[i];
+		BlockNumber updatedInsertPage = InvalidBlockNumber;
+		BlockNumber updatedIPTRootPage = InvalidBlockNumber;
+
+		AddElementOnDisk(index, e, m, insertPage, IPTRootPage, &updatedInsertPage, &updatedIPTRootPage, false);
+
+		if (BlockNumberIsValid(updatedInsertPage))
+			insertPage = newInsertPage = updatedInsertPage;
+		if (BlockNumberIsValid(updatedIPTRootPage))
+			IPTRootPage = newIPTRootPage = updatedIPTRootPage;
+
+		/* Neighbors added later in the batch were written as invalid */
+		for (int lc = e->level; lc >= 0; lc--)
+		{
+			HnswNeighborArray *neighbors = HnswGetNeighbors(base, e, lc);
+			bool		found = false;
+
+			for (int j = 0; j < neighbors->length; j++)
+			{
+				if (!OffsetNumberIsValid(HnswPtrAccess(base, neighbors->items[j].element)->offno))
+				{
+					found = true;
+					break;
+				}
+			}
+
+			if (found)
+			{
+				rewrite[nrewrite++] = e;
+				break;
+			}
+		}
+	}
+
+	/* Update insert page if needed */
+	if (BlockNumberIsValid(newInsertPage) || BlockNumberIsValid(newIPTRootPage))
+		HnswUpdateMetaPage(index, 0, NULL, newInsertPage, newIPTRootPage, MAIN_FORKNUM, false);
+
+	if (nrewrite > 0)
+		WriteBatchNeighborTuples(index, rewrite, nrewrite, m);
+
+	/* Update neighbors on disk */
+	qsort(updates, nupdates, sizeof(HnswBatchUpdate), CompareBatchUpdates);
+	writes = palloc(nupdates * sizeof(HnswBatchWrite));
+	for (int i = 0; i < nupdates;)
+	{
+		int			start = i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (i++; i < nupdates && CompareBatchUpdates(&updates[start], &updates[i]) == 0; i++)
+			;
+
+		nwrites += GetBatchWrites(&updates[start], i - start, m, index, support, &writes[nwrites]);
+	}
+
+	if (nwrites > 0)
+		WriteBatchNeighbors(index, writes, nwrites);
+}
+
+/*
+ * Insert a batch of tuples into the index
+ *
+ * Neighbors are found for the whole batch before any page is written. Each
+ * tuple is searched for in the graph on disk, and the batch is connected
+ * among itself in memory with exact distances. Connections to neighbors on
+ * disk are then grouped, so each neighbor tuple is read once and each page is
+ * written once per batch.
+ */
+void
+HnswInsertTuplesOnDisk(Relation index, HnswSupport * support, Datum *values, ItemPointer heaptids, int n)
+{
+	HnswElement entryPoint;
+	HnswElement top = NULL;
+	HnswElement *batch = palloc(n * sizeof(HnswElement));
+	Datum	   *batchValues = palloc(n * sizeof(Datum));
+	double	   *distances = palloc(n * sizeof(double));
+	int			nbatch = 0;
+	int			m;
+	int			efConstruction = HnswGetEfConstruction(index);
+	char	   *base = NULL;
+
+	/* Same lock as a single insert, held for the whole batch */
+	LockPage(index, HNSW_UPDATE_LOCK, ShareLock);
+
+	/* Get m and entry point */
+	HnswGetMetaPageInfo(index, &m, &entryPoint, NULL);
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswElement element;
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		/* Create an element that is not on disk yet */
+		element = HnswInitElement(base, &heaptids[i], m, HnswGetMl(m), HnswGetMaxLevel(m), NULL);
+		HnswPtrStore(base, element->value, DatumGetPointer(values[i]));
+		element->blkno = InvalidBlockNumber;
+		element->offno = InvalidOffsetNumber;
+
+		/* Find neighbors for element on disk */
+		HnswFindElementNeighbors(base, element, entryPoint, index, support, m, efConstruction, false);
+
+		/* Look for duplicate */
+		if (FindDuplicateOnDisk(index, element, false) || FindDuplicateInBatch(element, batch, nbatch))
+			continue;
+
+		/* Find neighbors for element in the batch */
+		if (nbatch > 0)
+		{
+			HnswGetDistances(values[i], batchValues, nbatch, support, distances);
+			LinkInBatch(element, batch, distances, nbatch, m, support);
+		}
+
+		batch[nbatch] = element;
+		batchValues[nbatch] = values[i];
+		nbatch++;
+
+		if (top == NULL || element->level > top->level)
+			top = element;
+	}
+
+	if (nbatch > 0)
+	{
+		/* Update graph on disk */
+		UpdateGraphOnDiskBatch(index, support, batch, nbatch, m);
+
+		/* Update entry point if needed */
+		if (entryPoint == NULL || top->level > entryPoint->level)
+			UpdateEntryPointOnDisk(index, support, top, entryPoint, m, false);
+		else if (top->level > 0)
+			HnswUpdateMetaPage(index, HNSW_UPDATE_UPPER, NULL, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM, false);
+	}
+
+	/* Release lock */
+	UnlockPage(index, HNSW_UPDATE_LOCK, ShareLock);
+}
+
 /*
  * Insert a tuple into the index
  */
@@ -783,7 +1424,10 @@ HnswInsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heaptid
 	if (!HnswFormIndexValue(&value, values, isnull, typeInfo, &support))
 		return;
 
-	HnswInsertTupleOnDisk(index, &support, value, heaptid, false);
+	if (HnswGetFastUpdate(index))
+		HnswInsertPending(index, value, heaptid);
+	else
+		HnswInsertTupleOnDisk(index, &support, value, heaptid, false);
 }
 
 /*
@@ -0,0 +1,607 @@
+#include "postgres.h"
+
+#include "access/generic_xlog.h"
+#include "catalog/pg_class_d.h"
+#include "hnsw.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/* Tuples to merge at once, rounded up to whole pages */
+#define HNSW_MERGE_BATCH_SIZE	256
+
+/*
+ * The pending list holds vectors inserted with fastupdate until they are
+ * merged into the graph. Pages are chained from the metapage separately from
+ * the graph, so vacuum and inserts into the graph never see them.
+ *
+ * A merge first seals the list by starting a new tail page, so inserts can
+ * continue while the sealed pages are added to the graph. Scans search the
+ * list exhaustively and skip graph results for heap TIDs still in the list.
+ * Merged pages are reused for the list once no scan can be reading them.
+ *
+ * Tuples are added to the graph in batches. Neighbors are found for a whole
+ * batch before its pages are written, and connections to existing elements
+ * are grouped by neighbor tuple (see HnswInsertTuplesOnDisk()). Tuples are
+ * marked dead on their page once their batch is in the graph, so a merge that
+ * stops with an error can be restarted without adding tuples twice. Elements
+ * of a failed batch that were not connected yet cannot be reached by scans.
+ *
+ * The list works like the delta of an LSM tree. Inserts that find it over
+ * hnsw.pending_list_limit merge only its oldest page, and autoanalyze and
+ * vacuum merge the rest in the background.
+ */
+
+/*
+ * Check if a pending list block is set
+ *
+ * Metapages of indexes built before the pending list existed have zeros
+ */
+static inline bool
+PendingBlockIsValid(BlockNumber blkno)
+{
+	return BlockNumberIsValid(blkno) && blkno != HNSW_METAPAGE_BLKNO;
+}
+
+/*
+ * Get an empty page for the pending list, reusing merged pages if possible
+ *
+ * The metapage must be locked and registered in state
+ */
+static Buffer
+GetPendingBuffer(Relation index, GenericXLogState *state, HnswMetaPage metap, Page *page)
+{
+	Buffer		buf;
+
+	if (PendingBlockIsValid(metap->pendingFree))
+	{
+		buf = ReadBuffer(index, metap->pendingFree);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		metap->pendingFree = HnswPageGetOpaque(BufferGetPage(buf))->nextblkno;
+	}
+	else
+	{
+		LockRelationForExtension(index, ExclusiveLock);
+		buf = HnswNewBuffer(index, MAIN_FORKNUM);
+		UnlockRelationForExtension(index, ExclusiveLock);
+	}
+
+	*page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+	HnswInitPage(buf, *page);
+
+	return buf;
+}
+
+/*
+ * Seal the pending list so no more tuples are added to its current pages
+ *
+ * Returns false if the list is empty
+ */
+static bool
+SealPending(Relation index, BlockNumber *head, BlockNumber *tail, uint32 *pages)
+{
+	Buffer		metabuf;
+	Buffer		buf;
+	Buffer		newbuf;
+	Page		page;
+	Page		newpage;
+	HnswMetaPage metap;
+	GenericXLogState *state;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	metap = HnswPageGetMeta(BufferGetPage(metabuf));
+
+	if (metap->pendingPages == 0 || metap->pendingTuples == 0)
+	{
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	state = GenericXLogStart(index);
+	metap = HnswPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+
+	*head = metap->pendingHead;
+	*tail = metap->pendingTail;
+	*pages = metap->pendingPages;
+
+	buf = ReadBuffer(index, *tail);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	/* New inserts go to the new tail */
+	newbuf = GetPendingBuffer(index, state, metap, &newpage);
+	HnswPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+	metap->pendingTail = BufferGetBlockNumber(newbuf);
+	metap->pendingPages++;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(metabuf);
+
+	return true;
+}
+
+/*
+ * Remove merged pages from the pending list
+ */
+static void
+RemovePending(Relation index, BlockNumber tail, uint32 pages, int64 merged)
+{
+	Buffer		metabuf;
+	Buffer		buf;
+	HnswMetaPage metap;
+	GenericXLogState *state;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	metap = HnswPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+
+	/* Sealed tail always has a next page */
+	buf = ReadBuffer(index, tail);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metap->pendingHead = HnswPageGetOpaque(BufferGetPage(buf))->nextblkno;
+	UnlockReleaseBuffer(buf);
+
+	metap->pendingPages -= pages;
+	metap->pendingTuples -= merged;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/*
+ * Add merged pages to the free list
+ */
+static void
+FreePending(Relation index, BlockNumber head, BlockNumber tail)
+{
+	Buffer		metabuf;
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	GenericXLogState *state;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	metap = HnswPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+
+	buf = ReadBuffer(index, tail);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+
+	/* Pages are already chained from head to tail */
+	HnswPageGetOpaque(page)->nextblkno = PendingBlockIsValid(metap->pendingFree) ? metap->pendingFree : InvalidBlockNumber;
+	metap->pendingFree = head;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/*
+ * Mark pending tuples as merged
+ *
+ * Tuples are ordered by page, so each page is written once
+ */
+static void
+MarkMerged(Relation index, BlockNumber *blknos, OffsetNumber *offnos, int n)
+{
+	for (int i = 0; i < n;)
+	{
+		BlockNumber blkno = blknos[i];
+		Buffer		buf;
+		Page		page;
+		GenericXLogState *state;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		for (; i < n && blknos[i] == blkno; i++)
+			ItemIdMarkDead(PageGetItemId(page, offnos[i]));
+
+		/* Commit */
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Insert the tuples on pages from head to tail into the graph
+ *
+ * Tuples are inserted in batches of whole pages. Tuples merged by an earlier
+ * merge that failed are skipped.
+ */
+static int64
+MergePages(Relation index, BlockNumber head, BlockNumber tail)
+{
+	HnswSupport support;
+	BlockNumber blkno = head;
+	int64		merged = 0;
+	int			maxTuples = HNSW_MERGE_BATCH_SIZE + MaxOffsetNumber;
+	Datum	   *values = palloc(maxTuples * sizeof(Datum));
+	ItemPointerData *heaptids = palloc(maxTuples * sizeof(ItemPointerData));
+	BlockNumber *blknos = palloc(maxTuples * sizeof(BlockNumber));
+	OffsetNumber *offnos = palloc(maxTuples * sizeof(OffsetNumber));
+	int			n = 0;
+	MemoryContext mergeCtx;
+	MemoryContext oldCtx;
+
+	HnswInitSupport(&support, index);
+
+	mergeCtx = AllocSetContextCreate(CurrentMemoryContext,
+									 "Hnsw merge temporary context",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		BlockNumber nextblkno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Copy values since inserts take a while */
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		nextblkno = HnswPageGetOpaque(page)->nextblkno;
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			ItemId		itemid = PageGetItemId(page, offno);
+			HnswPendingTuple ptup = (HnswPendingTuple) PageGetItem(page, itemid);
+
+			merged++;
+
+			if (ItemIdIsDead(itemid))
+				continue;
+
+			values[n] = PointerGetDatum(MemoryContextAlloc(mergeCtx, VARSIZE_ANY(&ptup->data)));
+			memcpy(DatumGetPointer(values[n]), &ptup->data, VARSIZE_ANY(&ptup->data));
+			heaptids[n] = ptup->heaptid;
+			blknos[n] = blkno;
+			offnos[n] = offno;
+			n++;
+		}
+
+		UnlockReleaseBuffer(buf);
+
+		if (n > 0 && (n >= HNSW_MERGE_BATCH_SIZE || blkno == tail))
+		{
+			oldCtx = MemoryContextSwitchTo(mergeCtx);
+			HnswInsertTuplesOnDisk(index, &support, values, heaptids, n);
+			MemoryContextSwitchTo(oldCtx);
+
+			MarkMerged(index, blknos, offnos, n);
+			MemoryContextReset(mergeCtx);
+			n = 0;
+		}
+
+		if (blkno == tail)
+			break;
+
+		blkno = nextblkno;
+	}
+
+	MemoryContextDelete(mergeCtx);
+	pfree(values);
+	pfree(heaptids);
+	pfree(blknos);
+	pfree(offnos);
+
+	return merged;
+}
+
+/*
+ * Unlink merged pages and reuse them once no scan can be reading them
+ */
+static void
+RecyclePages(Relation index, BlockNumber head, BlockNumber tail, uint32 pages, int64 merged)
+{
+	RemovePending(index, tail, pages, merged);
+
+	/* Wait for in-flight scans that may be reading the merged pages */
+	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
+
+	FreePending(index, head, tail);
+}
+
+/*
+ * Merge the pending list into the graph
+ *
+ * Returns the number of tuples merged
+ */
+int64
+HnswMergePending(Relation index, bool wait)
+{
+	BlockNumber head;
+	BlockNumber tail;
+	uint32		pages;
+	int64		merged;
+
+	/* Only one merge at a time */
+	if (wait)
+		LockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+	else if (!ConditionalLockPage(index, HNSW_PENDING_LOCK, ExclusiveLock))
+		return 0;
+
+	if (!SealPending(index, &head, &tail, &pages))
+	{
+		UnlockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+		return 0;
+	}
+
+	merged = MergePages(index, head, tail);
+	RecyclePages(index, head, tail, pages, merged);
+
+	UnlockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+
+	return merged;
+}
+
+/*
+ * Merge the oldest page of the pending list into the graph
+ *
+ * Inserts only add tuples to the tail page, so pages before it can be merged
+ * without sealing the list. This bounds the work done by a single insert.
+ */
+static void
+MergePendingStep(Relation index)
+{
+	Buffer		metabuf;
+	HnswMetaPage metap;
+	BlockNumber head;
+	uint32		pages;
+	int64		merged;
+
+	/* Skip if another backend is already merging */
+	if (!ConditionalLockPage(index, HNSW_PENDING_LOCK, ExclusiveLock))
+		return;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(metabuf));
+	head = metap->pendingHead;
+	pages = metap->pendingPages;
+	UnlockReleaseBuffer(metabuf);
+
+	if (pages > 1)
+	{
+		merged = MergePages(index, head, head);
+		RecyclePages(index, head, head, 1, merged);
+	}
+
+	UnlockPage(index, HNSW_PENDING_LOCK, ExclusiveLock);
+}
+
+/*
+ * Add a tuple to the pending list
+ */
+void
+HnswInsertPending(Relation index, Datum value, ItemPointer heaptid)
+{
+	Size		valueSize = VARSIZE_ANY(DatumGetPointer(value));
+	Size		ptupSize = HNSW_PENDING_TUPLE_SIZE(valueSize);
+	HnswPendingTuple ptup;
+	Buffer		metabuf;
+	Buffer		buf;
+	Buffer		newbuf = InvalidBuffer;
+	Page		metapage;
+	Page		page;
+	HnswMetaPage metap;
+	GenericXLogState *state;
+	bool		merge;
+
+	if (ptupSize > HNSW_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("index tuple too large")));
+
+	ptup = palloc0(ptupSize);
+	ptup->type = HNSW_PENDING_TUPLE_TYPE;
+	ptup->heaptid = *heaptid;
+	memcpy(&ptup->data, DatumGetPointer(value), valueSize);
+
+	/* The metapage lock serializes changes to the list */
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	metap = HnswPageGetMeta(metapage);
+
+	if (metap->pendingPages == 0)
+	{
+		/* Older metapages end before the pending list fields */
+		HnswExtendMetaPage(metapage);
+
+		/* Start the list */
+		buf = GetPendingBuffer(index, state, metap, &page);
+		metap->pendingHead = BufferGetBlockNumber(buf);
+		metap->pendingTail = metap->pendingHead;
+		metap->pendingPages = 1;
+	}
+	else
+	{
+		buf = ReadBuffer(index, metap->pendingTail);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+
+		/* Add a new tail page if needed */
+		if (PageGetFreeSpace(page) < ptupSize)
+		{
+			Page		newpage;
+
+			newbuf = GetPendingBuffer(index, state, metap, &newpage);
+			HnswPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(newbuf);
+			metap->pendingTail = BufferGetBlockNumber(newbuf);
+			metap->pendingPages++;
+			page = newpage;
+		}
+	}
+
+	if (PageAddItem(page, (Item) ptup, ptupSize, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(index));
+
+	metap->pendingTuples++;
+	merge = (Size) metap->pendingPages * BLCKSZ > (Size) hnsw_pending_list_limit * 1024L;
+
+	/* Commit */
+	GenericXLogFinish(state);
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+	UnlockReleaseBuffer(buf);
+	UnlockReleaseBuffer(metabuf);
+
+	/* Compact in small steps to keep insert latency predictable */
+	if (merge)
+		MergePendingStep(index);
+}
+
+/*
+ * Search the pending list exhaustively
+ *
+ * Returns unsorted candidates. Elements have an invalid block number, and
+ * their heap TIDs are added to tids so scans can skip them in graph results
+ * while a merge is running. Must be called with the scan lock held.
+ */
+List *
+HnswSearchPending(HnswQuery * q, Relation index, HnswSupport * support, tidhash_hash **tids)
+{
+	Buffer		metabuf;
+	HnswMetaPage metap;
+	BlockNumber blkno;
+	uint32		ntuples;
+	List	   *w = NIL;
+	char	   *base = NULL;
+	Datum	   *values;
+	double	   *distances;
+
+	metabuf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(metabuf));
+	blkno = metap->pendingPages > 0 ? metap->pendingHead : InvalidBlockNumber;
+	ntuples = metap->pendingTuples;
+	UnlockReleaseBuffer(metabuf);
+
+	if (ntuples == 0)
+		return NIL;
+
+	*tids = tidhash_create(CurrentMemoryContext, ntuples, NULL);
+	values = palloc(sizeof(Datum) * MaxOffsetNumber);
+	distances = palloc(sizeof(double) * MaxOffsetNumber);
+
+	while (PendingBlockIsValid(blkno))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+		int			n = 0;
+
+		buf = ReadBuffer(index, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			HnswPendingTuple ptup = (HnswPendingTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+			values[n++] = PointerGetDatum(&ptup->data);
+		}
+
+		if (DatumGetPointer(q->value) == NULL)
+			memset(distances, 0, sizeof(double) * n);
+		else
+			HnswGetDistances(q->value, values, n, support, distances);
+
+		for (int i = 0; i < n; i++)
+		{
+			HnswPendingTuple ptup = (HnswPendingTuple) PageGetItem(page, PageGetItemId(page, FirstOffsetNumber + i));
+			HnswElement element = HnswInitElementFromBlock(InvalidBlockNumber, InvalidOffsetNumber);
+			HnswSearchCandidate *sc = palloc(sizeof(HnswSearchCandidate));
+			bool		found;
+
+			element->heaptidsLength = 0;
+			element->level = 0;
+			element->deleted = 0;
+			HnswAddHeapTid(element, &ptup->heaptid);
+
+			HnswPtrStore(base, sc->element, element);
+			sc->distance = distances[i];
+			sc->returned = false;
+			w = lappend(w, sc);
+
+			tidhash_insert(*tids, ptup->heaptid, &found);
+		}
+
+		blkno = HnswPageGetOpaque(page)->nextblkno;
+		UnlockReleaseBuffer(buf);
+	}
+
+	pfree(values);
+	pfree(distances);
+
+	return w;
+}
+
+/*
+ * Merge the pending list of an hnsw index into the graph
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(hnsw_merge_pending);
+Datum
+hnsw_merge_pending(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	Relation	index;
+	int64		merged;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("Pending list cannot be merged during recovery.")));
+
+	index = index_open(indexOid, RowExclusiveLock);
+
+	if (index->rd_indam->ambuild != hnswbuild)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw index", RelationGetRelationName(index))));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexOid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexOid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(index));
+
+	if (RELATION_IS_OTHER_TEMP(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot merge pending list of temporary indexes of other sessions")));
+
+	/* Ensure index is valid */
+	HnswGetMetaPageInfo(index, NULL, NULL, NULL);
+
+	merged = HnswMergePending(index, true);
+
+	index_close(index, RowExclusiveLock);
+
+	PG_RETURN_INT64(merged);
+}
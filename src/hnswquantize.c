@@ -0,0 +1,170 @@
+#include "postgres.h"
+
+#include <math.h>
+
+#include "bitutils.h"
+#include "hnsw.h"
+#include "vector.h"
+
+#define HNSW_CODE_SIZE(_quantization, _dim)	(offsetof(HnswCodeData, data) + ((_quantization) == HNSW_QUANTIZATION_SQ8 ? (_dim) : ((_dim) + 7) / 8))
+
+/*
+ * Quantize a vector
+ *
+ * sq8 scales each vector by its max absolute value so no training is needed,
+ * and binary keeps the sign of each dimension along with the norm
+ */
+Datum
+HnswQuantizeValue(Datum value, HnswQuantization quantization)
+{
+	Vector	   *vec = DatumGetVector(value);
+	int			dim = vec->dim;
+	Size		size = HNSW_CODE_SIZE(quantization, dim);
+	HnswCode	code = (HnswCode) palloc0(size);
+
+	SET_VARSIZE(code, size);
+	code->dim = dim;
+	code->quantization = quantization;
+
+	if (quantization == HNSW_QUANTIZATION_SQ8)
+	{
+		int8	   *x = (int8 *) code->data;
+		float		maxAbs = 0;
+
+		for (int i = 0; i < dim; i++)
+			maxAbs = Max(maxAbs, fabsf(vec->x[i]));
+
+		code->scale = maxAbs / 127;
+
+		if (maxAbs > 0)
+		{
+			for (int i = 0; i < dim; i++)
+				x[i] = (int8) rintf(vec->x[i] * 127 / maxAbs);
+		}
+	}
+	else
+	{
+		double		norm = 0.0;
+
+		for (int i = 0; i < dim; i++)
+		{
+			norm += (double) vec->x[i] * (double) vec->x[i];
+
+			if (vec->x[i] > 0)
+				code->data[i / 8] |= 0x80 >> (i % 8);
+		}
+
+		code->scale = (float) sqrt(norm);
+	}
+
+	return PointerGetDatum(code);
+}
+
+/*
+ * Approximate the vector of a sq8 code
+ */
+Datum
+HnswDequantizeValue(Datum value)
+{
+	HnswCode	code = (HnswCode) DatumGetPointer(value);
+	int8	   *x = (int8 *) code->data;
+	Vector	   *vec;
+
+	Assert(code->quantization == HNSW_QUANTIZATION_SQ8);
+
+	vec = InitVector(code->dim);
+	for (int i = 0; i < code->dim; i++)
+		vec->x[i] = code->scale * x[i];
+
+	return PointerGetDatum(vec);
+}
+
+/*
+ * Get the distance between sq8 codes
+ */
+static double
+Sq8Distance(HnswCode a, HnswCode b, bool innerProduct)
+{
+	int8	   *ax = (int8 *) a->data;
+	int8	   *bx = (int8 *) b->data;
+
+	if (innerProduct)
+	{
+		/* Cannot overflow for max dimensions */
+		int32		dot = 0;
+
+		/* Auto-vectorized */
+		for (int i = 0; i < a->dim; i++)
+			dot += (int32) ax[i] * (int32) bx[i];
+
+		return -((double) a->scale * b->scale * dot);
+	}
+	else
+	{
+		float		distance = 0.0;
+
+		/* Auto-vectorized */
+		for (int i = 0; i < a->dim; i++)
+		{
+			float		diff = a->scale * ax[i] - b->scale * bx[i];
+
+			distance += diff * diff;
+		}
+
+		return (double) distance;
+	}
+}
+
+/*
+ * Get the distance between binary codes
+ *
+ * Estimates the angle from the Hamming distance
+ */
+static double
+BinaryDistance(HnswCode a, HnswCode b, bool innerProduct)
+{
+	uint64		hamming = BitHammingDistance((a->dim + 7) / 8, a->data, b->data, 0);
+	double		ip = (double) a->scale * b->scale * cos(M_PI * hamming / a->dim);
+
+	if (innerProduct)
+		return -ip;
+
+	return (double) a->scale * a->scale + (double) b->scale * b->scale - 2 * ip;
+}
+
+/*
+ * Get the distances from a code to many codes
+ */
+void
+HnswCodeDistances(Datum a, Datum *values, int n, HnswDistanceKind kind, double *distances)
+{
+	HnswCode	ac = (HnswCode) DatumGetPointer(a);
+
+	for (int i = 0; i < n; i++)
+	{
+		HnswCode	bc = (HnswCode) DatumGetPointer(values[i]);
+
+		if (ac->dim != bc->dim)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("different vector dimensions %d and %d", ac->dim, bc->dim)));
+
+		switch (kind)
+		{
+			case HNSW_DISTANCE_SQ8_L2:
+				distances[i] = Sq8Distance(ac, bc, false);
+				break;
+			case HNSW_DISTANCE_SQ8_IP:
+				distances[i] = Sq8Distance(ac, bc, true);
+				break;
+			case HNSW_DISTANCE_BINARY_L2:
+				distances[i] = BinaryDistance(ac, bc, false);
+				break;
+			case HNSW_DISTANCE_BINARY_IP:
+				distances[i] = BinaryDistance(ac, bc, true);
+				break;
+			default:
+				elog(ERROR, "unexpected distance kind for quantized codes");
+		}
+	}
+}
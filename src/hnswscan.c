@@ -10,6 +10,54 @@
 #include "utils/float.h"
 #include "utils/memutils.h"
 
+/*
+ * Search the upper layers for entry points to the ground layer
+ */
+static List *
+SearchUpperLayers(IndexScanDesc scan, HnswElement entryPoint, int m)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	HnswSupport *support = &so->support;
+	HnswQuery  *q = &so->q;
+	char	   *base = NULL;
+	List	   *ep;
+
+	/* Use cached upper layers when available */
+	if (entryPoint->level > 0)
+	{
+		ep = HnswSearchUpperCache(q, index, support);
+		if (ep != NIL)
+			return ep;
+	}
+
+	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
+
+	for (int lc = entryPoint->level; lc >= 1; lc--)
+		ep = HnswSearchLayer(base, q, ep, 1, lc, index, support, m, false, NULL, NULL, NULL, true, NULL);
+
+	return ep;
+}
+
+/*
+ * Get the size of the dynamic candidate list for the ground layer
+ *
+ * The adaptive mode lets hard queries search further, but stops once the
+ * candidates have not changed for a quarter of ef_search expansions
+ */
+static int
+GetEfSearch(HnswQuery * q)
+{
+	if (hnsw_ef_search_mode == HNSW_EF_SEARCH_ADAPTIVE)
+	{
+		q->patience = Max(hnsw_ef_search / 4, HNSW_MIN_PATIENCE);
+		return Min(hnsw_ef_search * 2, HNSW_MAX_EF_SEARCH);
+	}
+
+	q->patience = 0;
+	return hnsw_ef_search;
+}
+
 /*
  * Algorithm 5 from paper
  */
@@ -20,7 +68,6 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	Relation	index = scan->indexRelation;
 	HnswSupport *support = &so->support;
 	List	   *ep;
-	List	   *w;
 	int			m;
 	HnswElement entryPoint;
 	char	   *base = NULL;
@@ -35,15 +82,9 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	if (entryPoint == NULL)
 		return NIL;
 
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
-
-	for (int lc = entryPoint->level; lc >= 1; lc--)
-	{
-		w = HnswSearchLayer(base, q, ep, 1, lc, index, support, m, false, NULL, NULL, NULL, true, NULL);
-		ep = w;
-	}
+	ep = SearchUpperLayers(scan, entryPoint, m);
 
-	return HnswSearchLayer(base, q, ep, hnsw_ef_search, 0, index, support, m, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples);
+	return HnswSearchLayer(base, q, ep, GetEfSearch(q), 0, index, support, m, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples);
 }
 
 /*
@@ -77,6 +118,103 @@ ResumeScanItems(IndexScanDesc scan)
 	return HnswSearchLayer(base, &so->q, ep, batch_size, 0, index, &so->support, so->m, false, NULL, &so->v, &so->discarded, false, &so->tuples);
 }
 
+/*
+ * Compare candidate distances with the furthest first
+ */
+static int
+CompareFurthestCandidates(const ListCell *a, const ListCell *b)
+{
+	HnswSearchCandidate *sca = lfirst(a);
+	HnswSearchCandidate *scb = lfirst(b);
+
+	if (sca->distance < scb->distance)
+		return 1;
+
+	if (sca->distance > scb->distance)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Get candidates from the pending list
+ *
+ * Filtered scans only get candidates that pass the filter. The list must be
+ * read before the graph, since a merge can add a tuple to the graph after
+ * the graph is searched and remove it from the list before it is read.
+ */
+static List *
+GetPendingItems(IndexScanDesc scan, Datum value, itempointer_hash * bitmap, hook_evaluateTID evaluate_func, ExprState *qual, ExprContext *econtext)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+	List	   *pending;
+	ListCell   *lc;
+	char	   *base = NULL;
+
+	so->q.value = value;
+	pending = HnswSearchPending(&so->q, scan->indexRelation, &so->support, &so->pendingTids);
+	if (pending == NIL)
+		return NIL;
+
+	if (bitmap != NULL)
+	{
+		foreach(lc, pending)
+		{
+			HnswSearchCandidate *sc = lfirst(lc);
+
+			if (!itempointer_lookup(bitmap, HnswPtrAccess(base, sc->element)->heaptids[0]))
+				pending = foreach_delete_current(pending, lc);
+		}
+	}
+
+	if (evaluate_func != NULL && pending != NIL)
+	{
+		int			length = list_length(pending);
+		ItemPointer *tids = palloc(sizeof(ItemPointer) * length);
+		bool	   *results = palloc(sizeof(bool) * length);
+		int			i = 0;
+
+		foreach(lc, pending)
+			tids[i++] = &HnswPtrAccess(base, ((HnswSearchCandidate *) lfirst(lc))->element)->heaptids[0];
+
+		evaluate_func(tids, results, length, scan, qual, econtext);
+
+		i = 0;
+		foreach(lc, pending)
+		{
+			if (!results[i++])
+				pending = foreach_delete_current(pending, lc);
+		}
+	}
+
+	return pending;
+}
+
+/*
+ * Add candidates from the pending list to the scan items
+ */
+static List *
+AddPendingItems(List *w, List *pending)
+{
+	if (pending == NIL)
+		return w;
+
+	w = list_concat(pending, w);
+	list_sort(w, CompareFurthestCandidates);
+	return w;
+}
+
+/*
+ * Check if a graph result is also returned from the pending list
+ *
+ * Happens while a merge is adding the pending list to the graph
+ */
+static inline bool
+InPendingList(HnswScanOpaque so, HnswElement element, ItemPointer heaptid)
+{
+	return so->pendingTids != NULL && BlockNumberIsValid(element->blkno) && tidhash_lookup(so->pendingTids, *heaptid) != NULL;
+}
+
 /*
  * Get scan value
  */
@@ -133,11 +271,44 @@ GetScanValue(IndexScanDesc scan, bool *range_query, float *range_threshold)
 				value = HnswNormValue(so->typeInfo, so->support.collation, value);
 		}
 	}
-	
+
+	/* Search the graph with a code */
+	if (DatumGetPointer(value) != NULL && so->support.quantization != HNSW_QUANTIZATION_NONE)
+		value = HnswQuantizeValue(value, so->support.quantization);
 
 	return value;
 }
 
+/*
+ * Return a heap TID from the scan
+ */
+static void
+SetScanResult(IndexScanDesc scan, ItemPointer heaptid)
+{
+	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+	scan->xs_heaptid = *heaptid;
+	scan->xs_recheck = false;
+	scan->xs_recheckorderby = false;
+
+	/*
+	 * Distances between codes are approximate. Report a lower bound so the
+	 * executor reorders returned tuples by their exact distance, and recheck
+	 * range conditions.
+	 */
+	if (so->support.quantization != HNSW_QUANTIZATION_NONE)
+	{
+		if (scan->numberOfOrderBys > 0)
+		{
+			scan->xs_orderbyvals[0] = Float8GetDatum(-get_float8_infinity());
+			scan->xs_orderbynulls[0] = false;
+			scan->xs_recheckorderby = true;
+		}
+		else
+			scan->xs_recheck = true;
+	}
+}
+
 #if defined(HNSW_MEMORY)
 /*
  * Show memory usage
@@ -164,11 +335,24 @@ hnswbeginscan(Relation index, int nkeys, int norderbys)
 	so = (HnswScanOpaque) palloc(sizeof(HnswScanOpaqueData));
 	so->range_query = false;
 	so->range_threshold = 0;
+	so->pendingTids = NULL;
+	so->q.patience = 0;
 	so->typeInfo = HnswGetTypeInfo(index);
 
 	/* Set support functions */
 	HnswInitSupport(&so->support, index);
 
+	/* Keep pages pinned while searching */
+	HnswInitPageCache(&so->pages);
+	so->support.pages = &so->pages;
+
+	/* Set by the scan when distances are approximate */
+	if (norderbys > 0 && so->support.quantization != HNSW_QUANTIZATION_NONE)
+	{
+		scan->xs_orderbyvals = palloc0(sizeof(Datum) * norderbys);
+		scan->xs_orderbynulls = palloc(sizeof(bool) * norderbys);
+	}
+
 	/*
 	 * Use a lower max allocation size than default to allow scanning more
 	 * tuples for iterative search before exceeding work_mem
@@ -198,7 +382,9 @@ hnswrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int no
 	so->first = true;
 	/* v and discarded are allocated in tmpCtx */
 	so->v.tids = NULL;
+	so->v.lease = NULL;
 	so->discarded = NULL;
+	so->pendingTids = NULL;
 	so->tuples = 0;
 	so->previousDistance = -get_float8_infinity();
 	MemoryContextReset(so->tmpCtx);
@@ -228,6 +414,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 	if (so->first)
 	{
 		Datum		value;
+		List	   *pending;
 
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
@@ -250,7 +437,10 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		 */
 		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+		pending = GetPendingItems(scan, value, NULL, NULL, NULL, NULL);
 		so->w = GetScanItems(scan, value);
+		so->w = AddPendingItems(so->w, pending);
+		HnswReleasePageCache(&so->pages);
 
 		/* Release shared lock */
 		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
@@ -281,11 +471,17 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 			/* Reached max number of tuples or memory limit */
 			if (so->tuples >= hnsw_max_scan_tuples || MemoryContextMemAllocated(so->tmpCtx, false) > so->maxMemory)
 			{
-				if (pairingheap_is_empty(so->discarded))
+				HnswSearchCandidate *next = NULL;
+
+				/* Skip copies of candidates already returned */
+				while (!pairingheap_is_empty(so->discarded) && (next == NULL || next->returned))
+					next = HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded));
+
+				if (next == NULL || next->returned)
 					break;
 
 				/* Return remaining tuples */
-				so->w = lappend(so->w, HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded)));
+				so->w = lappend(so->w, next);
 			}
 			else
 			{
@@ -301,6 +497,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
 				so->w = ResumeScanItems(scan);
+				HnswReleasePageCache(&so->pages);
 
 				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
@@ -326,18 +523,21 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 		{
 			so->w = list_delete_last(so->w);
 
-			/* Mark memory as free for next iteration */
+			/*
+			 * Mark memory as free for next iteration. Candidates are in an
+			 * arena and freed with the scan context.
+			 */
 			if (hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF)
-			{
 				pfree(element);
-				pfree(sc);
-			}
 
 			continue;
 		}
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		if (InPendingList(so, element, heaptid))
+			continue;
+
 		if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_STRICT)
 		{
 			if (sc->distance < so->previousDistance)
@@ -348,9 +548,7 @@ hnswgettuple(IndexScanDesc scan, ScanDirection dir)
 
 		MemoryContextSwitchTo(oldCtx);
 
-		scan->xs_heaptid = *heaptid;
-		scan->xs_recheck = false;
-		scan->xs_recheckorderby = false;
+		SetScanResult(scan, heaptid);
 		return true;
 	}
 
@@ -365,7 +563,6 @@ GetBitmapScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value)
 	Relation	index = scan->indexRelation;
 	HnswSupport *support = &so->support;
 	List	   *ep;
-	List	   *w;
 	int			m;
 	HnswElement entryPoint;
 	char	   *base = NULL;
@@ -381,15 +578,9 @@ GetBitmapScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value)
 	if (entryPoint == NULL)
 		return NIL;
 
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
-
-	for (int lc = entryPoint->level; lc >= 1; lc--)
-	{
-		w = HnswSearchLayer(base, q, ep, 1, lc, index, support, m, false, NULL, NULL, NULL, true, NULL);
-		ep = w;
-	}
+	ep = SearchUpperLayers(scan, entryPoint, m);
 
-	return HnswSearchLayerWithBitmap(base, q, ep, hnsw_ef_search, 0, index, support, m, bitmap, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples, IPTRootPage);
+	return HnswSearchLayerWithBitmap(base, q, ep, GetEfSearch(q), 0, index, support, m, bitmap, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples, IPTRootPage);
 }
 
 static List *
@@ -438,6 +629,7 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 	if (so->first)
 	{
 		Datum		value;
+		List	   *pending;
 
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
@@ -460,7 +652,10 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 		 */
 		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+		pending = GetPendingItems(scan, value, bitmap, NULL, NULL, NULL);
 		so->w = GetBitmapScanItems(bitmap, scan, value);
+		so->w = AddPendingItems(so->w, pending);
+		HnswReleasePageCache(&so->pages);
 
 		/* Release shared lock */
 		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
@@ -491,11 +686,17 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 			/* Reached max number of tuples or memory limit */
 			if (so->tuples >= hnsw_max_scan_tuples || MemoryContextMemAllocated(so->tmpCtx, false) > so->maxMemory)
 			{
-				if (pairingheap_is_empty(so->discarded))
+				HnswSearchCandidate *next = NULL;
+
+				/* Skip copies of candidates already returned */
+				while (!pairingheap_is_empty(so->discarded) && (next == NULL || next->returned))
+					next = HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded));
+
+				if (next == NULL || next->returned)
 					break;
 
 				/* Return remaining tuples */
-				so->w = lappend(so->w, HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded)));
+				so->w = lappend(so->w, next);
 			}
 			else
 			{
@@ -511,6 +712,7 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
 				so->w = ResumeBitmapScanItems(bitmap, scan);
+				HnswReleasePageCache(&so->pages);
 
 				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
@@ -531,25 +733,26 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 			return false;
 		}
 
-		Assert(element->heaptidsLength <= 1);
-
 		/* Move to next element if no valid heap TIDs */
 		if (element->heaptidsLength == 0)
 		{
 			so->w = list_delete_last(so->w);
 
-			/* Mark memory as free for next iteration */
+			/*
+			 * Mark memory as free for next iteration. Candidates are in an
+			 * arena and freed with the scan context.
+			 */
 			if (hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF)
-			{
 				pfree(element);
-				pfree(sc);
-			}
 
 			continue;
 		}
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		if (InPendingList(so, element, heaptid))
+			continue;
+
 		if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_STRICT)
 		{
 			if (sc->distance < so->previousDistance)
@@ -560,9 +763,7 @@ bool hnswbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirectio
 
 		MemoryContextSwitchTo(oldCtx);
 
-		scan->xs_heaptid = *heaptid;
-		scan->xs_recheck = false;
-		scan->xs_recheckorderby = false;
+		SetScanResult(scan, heaptid);
 		return true;
 	}
 
@@ -576,7 +777,6 @@ static List *GetPushDownScanItems(IndexScanDesc scan, Datum value, hook_evaluate
 	Relation	index = scan->indexRelation;
 	HnswSupport *support = &so->support;
 	List	   *ep;
-	List	   *w;
 	int			m;
 	HnswElement entryPoint;
 	char	   *base = NULL;
@@ -592,15 +792,9 @@ static List *GetPushDownScanItems(IndexScanDesc scan, Datum value, hook_evaluate
 	if (entryPoint == NULL)
 		return NIL;
 
-	ep = list_make1(HnswEntryCandidate(base, entryPoint, q, index, support, false));
-
-	for (int lc = entryPoint->level; lc >= 1; lc--)
-	{
-		w = HnswSearchLayer(base, q, ep, 1, lc, index, support, m, false, NULL, NULL, NULL, true, NULL);
-		ep = w;
-	}
+	ep = SearchUpperLayers(scan, entryPoint, m);
 
-	return HnswPushDownSearchLayer(base, q, ep, hnsw_ef_search, 0, index, support, m, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples, evaluate_func, qual, econtext, scan, IPTRootPage);
+	return HnswPushDownSearchLayer(base, q, ep, GetEfSearch(q), 0, index, support, m, false, NULL, &so->v, hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF ? &so->discarded : NULL, true, &so->tuples, evaluate_func, qual, econtext, scan, IPTRootPage);
 }
 
 static List *ResumePushDownScanItems(IndexScanDesc scan, hook_evaluateTID evaluate_func, ExprState *qual, ExprContext *econtext)
@@ -648,6 +842,7 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 	if (so->first)
 	{
 		Datum		value;
+		List	   *pending;
 
 		/* Count index scan for stats */
 		pgstat_count_index_scan(scan->indexRelation);
@@ -670,7 +865,10 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 		 */
 		LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
+		pending = GetPendingItems(scan, value, NULL, evaluate, qual, econtext);
 		so->w = GetPushDownScanItems(scan, value, evaluate, qual, econtext);
+		so->w = AddPendingItems(so->w, pending);
+		HnswReleasePageCache(&so->pages);
 
 		/* Release shared lock */
 		UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
@@ -701,11 +899,17 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 			/* Reached max number of tuples or memory limit */
 			if (so->tuples >= hnsw_max_scan_tuples || MemoryContextMemAllocated(so->tmpCtx, false) > so->maxMemory)
 			{
-				if (pairingheap_is_empty(so->discarded))
+				HnswSearchCandidate *next = NULL;
+
+				/* Skip copies of candidates already returned */
+				while (!pairingheap_is_empty(so->discarded) && (next == NULL || next->returned))
+					next = HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded));
+
+				if (next == NULL || next->returned)
 					break;
 
 				/* Return remaining tuples */
-				so->w = lappend(so->w, HnswGetSearchCandidate(w_node, pairingheap_remove_first(so->discarded)));
+				so->w = lappend(so->w, next);
 			}
 			else
 			{
@@ -721,6 +925,7 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 				LockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
 				so->w = ResumePushDownScanItems(scan, evaluate, qual, econtext);
+				HnswReleasePageCache(&so->pages);
 
 				UnlockPage(scan->indexRelation, HNSW_SCAN_LOCK, ShareLock);
 
@@ -741,25 +946,26 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 			return false;
 		}
 
-		Assert(element->heaptidsLength <= 1);
-
 		/* Move to next element if no valid heap TIDs */
 		if (element->heaptidsLength == 0)
 		{
 			so->w = list_delete_last(so->w);
 
-			/* Mark memory as free for next iteration */
+			/*
+			 * Mark memory as free for next iteration. Candidates are in an
+			 * arena and freed with the scan context.
+			 */
 			if (hnsw_iterative_scan != HNSW_ITERATIVE_SCAN_OFF)
-			{
 				pfree(element);
-				pfree(sc);
-			}
 
 			continue;
 		}
 
 		heaptid = &element->heaptids[--element->heaptidsLength];
 
+		if (InPendingList(so, element, heaptid))
+			continue;
+
 		if (hnsw_iterative_scan == HNSW_ITERATIVE_SCAN_STRICT)
 		{
 			if (sc->distance < so->previousDistance)
@@ -770,9 +976,7 @@ bool		hnswpushdownsearch(IndexScanDesc scan, ScanDirection direction, hook_evalu
 
 		MemoryContextSwitchTo(oldCtx);
 
-		scan->xs_heaptid = *heaptid;
-		scan->xs_recheck = false;
-		scan->xs_recheckorderby = false;
+		SetScanResult(scan, heaptid);
 		return true;
 	}
 
@@ -788,6 +992,7 @@ hnswendscan(IndexScanDesc scan)
 {
 	HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
 
+	HnswReleasePageCache(&so->pages);
 	MemoryContextDelete(so->tmpCtx);
 
 	pfree(so);
@@ -7,15 +7,23 @@
 #include "catalog/pg_type_d.h"
 #include "common/hashfn.h"
 #include "fmgr.h"
+#include "halfvec.h"
 #include "hnsw.h"
 #include "hooks.h"
 #include "lib/pairingheap.h"
+#include "miscadmin.h"
 #include "sparsevec.h"
 #include "storage/bufmgr.h"
 #include "utils/datum.h"
 #include "utils/memdebug.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_negative_inner_product(PG_FUNCTION_ARGS);
+
 #if PG_VERSION_NUM < 170000
 static inline uint64
 murmurhash64(uint64 data)
@@ -101,6 +109,17 @@ hash_offset(Size offset)
 #define SH_DEFINE
 #include "lib/simplehash.h"
 
+/* Distance hash table */
+#define SH_PREFIX		distancehash
+#define SH_ELEMENT_TYPE	DistanceHashEntry
+#define SH_KEY_TYPE		uintptr_t
+#define	SH_KEY			ptr
+#define SH_HASH_KEY(tb, key)	hash_pointer(key)
+#define SH_EQUAL(tb, a, b)		(a == b)
+#define	SH_SCOPE		extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
 /*
  * Get the max number of connections in an upper layer for each element in the index
  */
@@ -129,6 +148,75 @@ HnswGetEfConstruction(Relation index)
 	return HNSW_DEFAULT_EF_CONSTRUCTION;
 }
 
+/*
+ * Get the order of elements on index pages
+ */
+HnswLayout
+HnswGetLayout(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return (HnswLayout) opts->layout;
+
+	return HNSW_LAYOUT_INSERTION;
+}
+
+/*
+ * Get whether inserts use the pending list
+ */
+bool
+HnswGetFastUpdate(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+
+	if (opts)
+		return opts->fastupdate;
+
+	return false;
+}
+
+/*
+ * Get the quantization of vectors in the graph
+ *
+ * Uses the metapage once it exists since the option can change after builds.
+ * It does not change until the index is rebuilt, which resets rd_amcache.
+ */
+HnswQuantization
+HnswGetQuantization(Relation index)
+{
+	HnswOptions *opts = (HnswOptions *) index->rd_options;
+	Buffer		buf;
+	HnswMetaPage metap;
+	HnswQuantization quantization;
+
+	if (index->rd_amcache != NULL)
+		return *((HnswQuantization *) index->rd_amcache);
+
+	if (RelationGetNumberOfBlocks(index) == 0)
+	{
+		if (opts)
+			return (HnswQuantization) opts->quantization;
+
+		return HNSW_QUANTIZATION_NONE;
+	}
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	metap = HnswPageGetMeta(BufferGetPage(buf));
+
+	if (unlikely(metap->magicNumber != HNSW_MAGIC_NUMBER))
+		elog(ERROR, "hnsw index is not valid");
+
+	quantization = (HnswQuantization) metap->quantization;
+	UnlockReleaseBuffer(buf);
+
+	index->rd_amcache = MemoryContextAlloc(index->rd_indexcxt, sizeof(HnswQuantization));
+	*((HnswQuantization *) index->rd_amcache) = quantization;
+
+	return quantization;
+}
+
 /*
  * Get proc
  */
@@ -141,6 +229,27 @@ HnswOptionalProcInfo(Relation index, uint16 procnum)
 	return index_getprocinfo(index, 1, procnum);
 }
 
+/*
+ * Get the distance kind for a distance function
+ */
+static HnswDistanceKind
+HnswGetDistanceKind(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance)
+		return HNSW_DISTANCE_VECTOR_L2;
+
+	if (procinfo->fn_addr == vector_negative_inner_product)
+		return HNSW_DISTANCE_VECTOR_IP;
+
+	if (procinfo->fn_addr == halfvec_l2_squared_distance)
+		return HNSW_DISTANCE_HALFVEC_L2;
+
+	if (procinfo->fn_addr == halfvec_negative_inner_product)
+		return HNSW_DISTANCE_HALFVEC_IP;
+
+	return HNSW_DISTANCE_FMGR;
+}
+
 /*
  * Init support functions
  */
@@ -150,6 +259,100 @@ HnswInitSupport(HnswSupport * support, Relation index)
 	support->procinfo = index_getprocinfo(index, 1, HNSW_DISTANCE_PROC);
 	support->collation = index->rd_indcollation[0];
 	support->normprocinfo = HnswOptionalProcInfo(index, HNSW_NORM_PROC);
+	support->distance = HnswGetDistanceKind(support->procinfo);
+	support->quantization = HnswGetQuantization(index);
+	support->pages = NULL;
+	support->distances = NULL;
+
+	/* Distances in the graph are between codes */
+	if (support->quantization != HNSW_QUANTIZATION_NONE)
+	{
+		bool		sq8 = support->quantization == HNSW_QUANTIZATION_SQ8;
+
+		if (support->distance == HNSW_DISTANCE_VECTOR_L2)
+			support->distance = sq8 ? HNSW_DISTANCE_SQ8_L2 : HNSW_DISTANCE_BINARY_L2;
+		else if (support->distance == HNSW_DISTANCE_VECTOR_IP)
+			support->distance = sq8 ? HNSW_DISTANCE_SQ8_IP : HNSW_DISTANCE_BINARY_IP;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("quantization requires vector_l2_ops, vector_ip_ops, or vector_cosine_ops")));
+	}
+}
+
+/*
+ * Init page cache
+ */
+void
+HnswInitPageCache(HnswPageCache * pages)
+{
+	pages->nblocks = 0;
+	pages->elementBuf = InvalidBuffer;
+	pages->neighborBuf = InvalidBuffer;
+	IPTInitSearchCache(&pages->ipt);
+}
+
+/*
+ * Release pages kept pinned by the cache
+ */
+void
+HnswReleasePageCache(HnswPageCache * pages)
+{
+	if (BufferIsValid(pages->elementBuf))
+		ReleaseBuffer(pages->elementBuf);
+	if (BufferIsValid(pages->neighborBuf))
+		ReleaseBuffer(pages->neighborBuf);
+
+	pages->elementBuf = InvalidBuffer;
+	pages->neighborBuf = InvalidBuffer;
+	IPTReleaseSearchCache(&pages->ipt);
+}
+
+/*
+ * Read and share lock a page, reusing the pin in *cached when possible
+ */
+static Buffer
+HnswReadPage(Relation index, BlockNumber blkno, HnswPageCache * pages, Buffer *cached)
+{
+	Buffer		buf;
+
+	if (pages == NULL)
+	{
+		if (blkno >= RelationGetNumberOfBlocks(index))
+			ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("blk is not valid")));
+
+		buf = ReadBuffer(index, blkno);
+	}
+	else
+	{
+		/* Only check the size again when it may have grown */
+		if (blkno >= pages->nblocks)
+		{
+			pages->nblocks = RelationGetNumberOfBlocks(index);
+
+			if (blkno >= pages->nblocks)
+				ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("blk is not valid")));
+		}
+
+		/* Keeps the pin when the block is the same */
+		*cached = ReleaseAndReadBuffer(*cached, index, blkno);
+		buf = *cached;
+	}
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	return buf;
+}
+
+/*
+ * Unlock a page read with HnswReadPage
+ */
+static void
+HnswUnlockPage(Buffer buf, HnswPageCache * pages)
+{
+	if (pages == NULL)
+		UnlockReleaseBuffer(buf);
+	else
+		LockBuffer(buf, BUFFER_LOCK_UNLOCK);
 }
 
 /*
@@ -271,6 +474,24 @@ HnswAddHeapTid(HnswElement element, ItemPointer heaptid)
 	element->heaptids[element->heaptidsLength++] = *heaptid;
 }
 
+/*
+ * Get the value of an element in the map from element TIDs to heap TIDs
+ *
+ * The map holds one heap TID per element, so filters read the element tuple
+ * for elements with duplicates
+ */
+ItemPointerData
+HnswHeapTidMapValue(ItemPointer heaptids, int length)
+{
+	ItemPointerData tid;
+
+	if (length == 1)
+		return heaptids[0];
+
+	ItemPointerSet(&tid, InvalidBlockNumber, FirstOffsetNumber);
+	return tid;
+}
+
 /*
  * Allocate an element from block and offset numbers
  */
@@ -340,6 +561,21 @@ HnswGetEntryPoint(Relation index)
 	return entryPoint;
 }
 
+/*
+ * Extend the metapage to the current fields
+ *
+ * Older metapages end before newer fields, and generic WAL does not keep
+ * changes past pd_lower
+ */
+void
+HnswExtendMetaPage(Page page)
+{
+	HnswMetaPage metap = HnswPageGetMeta(page);
+
+	((PageHeader) page)->pd_lower =
+		((char *) metap + sizeof(HnswMetaPageData)) - (char *) page;
+}
+
 /*
  * Update the metapage info
  */
@@ -348,7 +584,13 @@ HnswUpdateMetaPageInfo(Page page, int updateEntry, HnswElement entryPoint, Block
 {
 	HnswMetaPage metap = HnswPageGetMeta(page);
 
+	HnswExtendMetaPage(page);
+
+	/* Invalidate cached upper layers */
 	if (updateEntry)
+		metap->upperVersion++;
+
+	if (updateEntry == HNSW_UPDATE_ENTRY_GREATER || updateEntry == HNSW_UPDATE_ENTRY_ALWAYS)
 	{
 		if (entryPoint == NULL)
 		{
@@ -403,6 +645,61 @@ HnswUpdateMetaPage(Relation index, int updateEntry, HnswElement entryPoint, Bloc
 	UnlockReleaseBuffer(buf);
 }
 
+/*
+ * Set the entry point if it has not changed since it was read
+ *
+ * The element only replaces it if higher. Returns false and the current entry
+ * point if another insert changed it, so the caller can link to it first.
+ */
+bool
+HnswSwapEntryPoint(Relation index, HnswElement expected, HnswElement element, HnswElement * current, bool building)
+{
+	Buffer		buf;
+	Page		page;
+	HnswMetaPage metap;
+	GenericXLogState *state;
+
+	buf = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	metap = HnswPageGetMeta(BufferGetPage(buf));
+
+	if (expected == NULL ? BlockNumberIsValid(metap->entryBlkno) :
+		(metap->entryBlkno != expected->blkno || metap->entryOffno != expected->offno))
+	{
+		if (BlockNumberIsValid(metap->entryBlkno))
+		{
+			*current = HnswInitElementFromBlock(metap->entryBlkno, metap->entryOffno);
+			(*current)->level = metap->entryLevel;
+		}
+		else
+			*current = NULL;
+
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	if (building)
+	{
+		state = NULL;
+		page = BufferGetPage(buf);
+	}
+	else
+	{
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buf, 0);
+	}
+
+	HnswUpdateMetaPageInfo(page, HNSW_UPDATE_ENTRY_GREATER, element, InvalidBlockNumber, InvalidBlockNumber);
+
+	if (building)
+		MarkBufferDirty(buf);
+	else
+		GenericXLogFinish(state);
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
 /*
  * Form index value
  */
@@ -425,6 +722,10 @@ HnswFormIndexValue(Datum *out, Datum *values, bool *isnull, const HnswTypeInfo *
 		value = HnswNormValue(typeInfo, support->collation, value);
 	}
 
+	/* Store a code instead of the vector */
+	if (support->quantization != HNSW_QUANTIZATION_NONE)
+		value = HnswQuantizeValue(value, support->quantization);
+
 	*out = value;
 
 	return true;
@@ -537,13 +838,53 @@ HnswLoadElementFromTuple(HnswElement element, HnswElementTuple etup, bool loadHe
 	}
 }
 
+/*
+ * Calculate the distances from a value to many values
+ *
+ * Known distance functions are called directly with the query detoasted once
+ */
+void
+HnswGetDistances(Datum a, Datum *values, int n, HnswSupport * support, double *distances)
+{
+	vector_distance_count += n;
+
+	switch (support->distance)
+	{
+		case HNSW_DISTANCE_VECTOR_L2:
+			VectorL2SquaredDistances(DatumGetVector(a), values, n, distances);
+			break;
+		case HNSW_DISTANCE_VECTOR_IP:
+			VectorNegativeInnerProducts(DatumGetVector(a), values, n, distances);
+			break;
+		case HNSW_DISTANCE_HALFVEC_L2:
+			HalfvecL2SquaredDistances(DatumGetHalfVector(a), values, n, distances);
+			break;
+		case HNSW_DISTANCE_HALFVEC_IP:
+			HalfvecNegativeInnerProducts(DatumGetHalfVector(a), values, n, distances);
+			break;
+		case HNSW_DISTANCE_SQ8_L2:
+		case HNSW_DISTANCE_SQ8_IP:
+		case HNSW_DISTANCE_BINARY_L2:
+		case HNSW_DISTANCE_BINARY_IP:
+			HnswCodeDistances(a, values, n, support->distance, distances);
+			break;
+		default:
+			for (int i = 0; i < n; i++)
+				distances[i] = DatumGetFloat8(FunctionCall2Coll(support->procinfo, support->collation, a, values[i]));
+			break;
+	}
+}
+
 /*
  * Calculate the distance between values
  */
 static inline double
 HnswGetDistance(Datum a, Datum b, HnswSupport * support)
 {
-	return DatumGetFloat8(FunctionCall2Coll(support->procinfo, support->collation, a, b));
+	double		distance;
+
+	HnswGetDistances(a, &b, 1, support, &distance);
+	return distance;
 }
 
 /*
@@ -557,12 +898,7 @@ HnswLoadElementImpl(BlockNumber blkno, OffsetNumber offno, double *distance, Hns
 	HnswElementTuple etup;
 
 	/* Read vector */
-	if (blkno >= RelationGetNumberOfBlocks(index))
-	{
-		ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
-	}
-	buf = ReadBuffer(index, blkno);
-	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	buf = HnswReadPage(index, blkno, support->pages, support->pages ? &support->pages->elementBuf : NULL);
 	page = BufferGetPage(buf);
 
 	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
@@ -587,7 +923,7 @@ HnswLoadElementImpl(BlockNumber blkno, OffsetNumber offno, double *distance, Hns
 		HnswLoadElementFromTuple(*element, etup, true, loadVec);
 	}
 
-	UnlockReleaseBuffer(buf);
+	HnswUnlockPage(buf, support->pages);
 }
 
 /*
@@ -620,6 +956,7 @@ HnswInitSearchCandidate(char *base, HnswElement element, double distance)
 
 	HnswPtrStore(base, sc->element, element);
 	sc->distance = distance;
+	sc->returned = false;
 	return sc;
 }
 
@@ -641,62 +978,309 @@ HnswEntryCandidate(char *base, HnswElement entryPoint, HnswQuery * q, Relation i
 }
 
 /*
- * Compare candidate distances
+ * Compare discarded candidate distances
  */
 static int
-CompareNearestCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+CompareNearestDiscardedCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
 {
-	if (HnswGetSearchCandidateConst(c_node, a)->distance < HnswGetSearchCandidateConst(c_node, b)->distance)
+	if (HnswGetSearchCandidateConst(w_node, a)->distance < HnswGetSearchCandidateConst(w_node, b)->distance)
 		return 1;
 
-	if (HnswGetSearchCandidateConst(c_node, a)->distance > HnswGetSearchCandidateConst(c_node, b)->distance)
+	if (HnswGetSearchCandidateConst(w_node, a)->distance > HnswGetSearchCandidateConst(w_node, b)->distance)
 		return -1;
 
 	return 0;
 }
 
 /*
- * Compare discarded candidate distances
+ * Initialize a heap
  */
-static int
-CompareNearestDiscardedCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+static void
+HnswHeapInit(HnswHeap * heap, int capacity, bool furthest)
 {
-	if (HnswGetSearchCandidateConst(w_node, a)->distance < HnswGetSearchCandidateConst(w_node, b)->distance)
-		return 1;
+	heap->items = palloc(sizeof(HnswHeapItem) * capacity);
+	heap->length = 0;
+	heap->capacity = capacity;
+	heap->furthest = furthest;
+}
 
-	if (HnswGetSearchCandidateConst(w_node, a)->distance > HnswGetSearchCandidateConst(w_node, b)->distance)
-		return -1;
+/*
+ * Check if a distance comes before another in a heap
+ */
+static inline bool
+HnswHeapBefore(HnswHeap * heap, double a, double b)
+{
+	return heap->furthest ? a > b : a < b;
+}
 
-	return 0;
+/*
+ * Check if a heap is empty
+ */
+static inline bool
+HnswHeapIsEmpty(HnswHeap * heap)
+{
+	return heap->length == 0;
 }
 
 /*
- * Compare candidate distances
+ * Get the first candidate of a heap
  */
-static int
-CompareFurthestCandidates(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+static inline HnswSearchCandidate *
+HnswHeapFirst(HnswHeap * heap)
 {
-	if (HnswGetSearchCandidateConst(w_node, a)->distance < HnswGetSearchCandidateConst(w_node, b)->distance)
-		return -1;
+	return heap->length > 0 ? heap->items[0].sc : NULL;
+}
 
-	if (HnswGetSearchCandidateConst(w_node, a)->distance > HnswGetSearchCandidateConst(w_node, b)->distance)
-		return 1;
+/*
+ * Add a candidate to a heap
+ */
+static void
+HnswHeapPush(HnswHeap * heap, HnswSearchCandidate * sc)
+{
+	int			i;
 
-	return 0;
+	if (heap->length == heap->capacity)
+	{
+		heap->capacity *= 2;
+		heap->items = repalloc(heap->items, sizeof(HnswHeapItem) * heap->capacity);
+	}
+
+	/* Sift up */
+	i = heap->length++;
+	while (i > 0)
+	{
+		int			parent = (i - 1) / 2;
+
+		if (!HnswHeapBefore(heap, sc->distance, heap->items[parent].distance))
+			break;
+
+		heap->items[i] = heap->items[parent];
+		i = parent;
+	}
+
+	heap->items[i].distance = sc->distance;
+	heap->items[i].sc = sc;
+}
+
+/*
+ * Remove the first candidate of a heap
+ */
+static HnswSearchCandidate *
+HnswHeapPop(HnswHeap * heap)
+{
+	HnswSearchCandidate *first = heap->items[0].sc;
+	HnswHeapItem last = heap->items[--heap->length];
+	int			i = 0;
+
+	/* Sift down */
+	for (;;)
+	{
+		int			child = 2 * i + 1;
+
+		if (child >= heap->length)
+			break;
+
+		if (child + 1 < heap->length && HnswHeapBefore(heap, heap->items[child + 1].distance, heap->items[child].distance))
+			child++;
+
+		if (!HnswHeapBefore(heap, heap->items[child].distance, last.distance))
+			break;
+
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+
+	heap->items[i] = last;
+	return first;
+}
+
+/*
+ * Allocate a search candidate from an arena
+ */
+static HnswSearchCandidate *
+HnswArenaCandidate(HnswCandidateArena * arena, char *base, HnswElement element, double distance)
+{
+	HnswSearchCandidate *sc;
+
+	/* Candidates outlive the search, so chunks are never freed early */
+	if (arena->used == arena->size)
+	{
+		arena->size = arena->chunk == NULL ? HNSW_HEAP_INITIAL_CAPACITY : Min(arena->size * 2, 1024);
+		arena->chunk = palloc(sizeof(HnswSearchCandidate) * arena->size);
+		arena->used = 0;
+	}
+
+	sc = &arena->chunk[arena->used++];
+	HnswPtrStore(base, sc->element, element);
+	sc->distance = distance;
+	sc->returned = false;
+	return sc;
+}
+
+/*
+ * Visited stamps for disk searches
+ *
+ * Indexed by block and offset, so checks are one load and compare. The array
+ * is reused across searches in the backend, and bumping the epoch replaces
+ * clearing it. Only one search can hold it at a time.
+ */
+typedef struct HnswVisitedStamps
+{
+	MemoryContext ctx;
+	uint16	   *stamps;
+	BlockNumber nblocks;
+	uint16		epoch;
+	struct HnswVisitedLease *owner;
+}			HnswVisitedStamps;
+
+typedef struct HnswVisitedLease
+{
+	MemoryContextCallback callback;
+}			HnswVisitedLease;
+
+static HnswVisitedStamps visitedStamps;
+
+/*
+ * Release visited stamps
+ */
+static void
+HnswReleaseVisited(void *arg)
+{
+	if (visitedStamps.owner == arg)
+		visitedStamps.owner = NULL;
+}
+
+/*
+ * Lease visited stamps
+ *
+ * Returns NULL if another search holds them. The lease is released when the
+ * current memory context is reset, so errors and open scans are handled.
+ */
+static HnswVisitedLease *
+HnswLeaseVisited(void)
+{
+	HnswVisitedLease *lease;
+
+	if (visitedStamps.owner != NULL)
+		return NULL;
+
+	if (visitedStamps.ctx == NULL)
+		visitedStamps.ctx = AllocSetContextCreate(TopMemoryContext,
+												  "Hnsw visited stamps",
+												  ALLOCSET_DEFAULT_SIZES);
+
+	/* Zero means not visited, so clear on wraparound */
+	visitedStamps.epoch++;
+	if (visitedStamps.epoch == 0)
+	{
+		if (visitedStamps.stamps != NULL)
+			MemSet(visitedStamps.stamps, 0, sizeof(uint16) * HNSW_VISITED_SLOTS * visitedStamps.nblocks);
+
+		visitedStamps.epoch = 1;
+	}
+
+	lease = palloc(sizeof(HnswVisitedLease));
+	lease->callback.func = HnswReleaseVisited;
+	lease->callback.arg = lease;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &lease->callback);
+
+	visitedStamps.owner = lease;
+	return lease;
+}
+
+/*
+ * Grow visited stamps to cover a block
+ *
+ * Returns false if the block is past the limit set by work_mem
+ */
+static bool
+HnswGrowVisited(BlockNumber blkno)
+{
+	Size		blockSize = sizeof(uint16) * HNSW_VISITED_SLOTS;
+	BlockNumber maxBlocks = Min((Size) work_mem * 1024L / blockSize, MaxBlockNumber);
+	BlockNumber nblocks;
+	uint16	   *stamps;
+
+	if (blkno >= maxBlocks)
+		return false;
+
+	nblocks = Max(blkno + 1, 1024);
+	if (visitedStamps.nblocks < maxBlocks / 2)
+		nblocks = Max(nblocks, visitedStamps.nblocks * 2);
+	nblocks = Min(nblocks, maxBlocks);
+
+	stamps = MemoryContextAllocExtended(visitedStamps.ctx, blockSize * nblocks, MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+	if (visitedStamps.stamps != NULL)
+	{
+		memcpy(stamps, visitedStamps.stamps, blockSize * visitedStamps.nblocks);
+		pfree(visitedStamps.stamps);
+	}
+
+	visitedStamps.stamps = stamps;
+	visitedStamps.nblocks = nblocks;
+	return true;
+}
+
+/*
+ * Init visited
+ */
+static inline void
+InitVisited(char *base, visited_hash * v, bool inMemory, int ef, int m)
+{
+	if (!inMemory)
+	{
+		v->lease = HnswLeaseVisited();
+		v->tids = v->lease == NULL ? tidhash_create(CurrentMemoryContext, ef * m * 2, NULL) : NULL;
+	}
+	else
+	{
+		v->lease = NULL;
+
+		if (base != NULL)
+			v->offsets = offsethash_create(CurrentMemoryContext, ef * m * 2, NULL);
+		else
+			v->pointers = pointerhash_create(CurrentMemoryContext, ef * m * 2, NULL);
+	}
 }
 
-/*
- * Init visited
- */
-static inline void
-InitVisited(char *base, visited_hash * v, bool inMemory, int ef, int m)
-{
-	if (!inMemory)
-		v->tids = tidhash_create(CurrentMemoryContext, ef * m * 2, NULL);
-	else if (base != NULL)
-		v->offsets = offsethash_create(CurrentMemoryContext, ef * m * 2, NULL);
-	else
-		v->pointers = pointerhash_create(CurrentMemoryContext, ef * m * 2, NULL);
+/*
+ * Free visited if it does not outlive the search
+ */
+static inline void
+FreeVisited(visited_hash * v)
+{
+	if (v->lease != NULL)
+		HnswReleaseVisited(v->lease);
+}
+
+/*
+ * Add an index TID to visited
+ */
+static inline void
+AddTidToVisited(visited_hash * v, ItemPointerData indextid, bool *found)
+{
+	if (v->lease != NULL)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumberNoCheck(&indextid);
+		OffsetNumber offno = ItemPointerGetOffsetNumberNoCheck(&indextid);
+
+		Assert(visitedStamps.owner == v->lease);
+
+		if (offno <= HNSW_VISITED_SLOTS && (blkno < visitedStamps.nblocks || HnswGrowVisited(blkno)))
+		{
+			uint16	   *stamp = &visitedStamps.stamps[(Size) blkno * HNSW_VISITED_SLOTS + offno - 1];
+
+			*found = *stamp == visitedStamps.epoch;
+			*stamp = visitedStamps.epoch;
+			return;
+		}
+
+		/* Pages with many small tuples or past the limit */
+		if (v->tids == NULL)
+			v->tids = tidhash_create(CurrentMemoryContext, 256, NULL);
+	}
+
+	tidhash_insert(v->tids, indextid, found);
 }
 
 /*
@@ -711,7 +1295,7 @@ AddToVisited(char *base, visited_hash * v, HnswElementPtr elementPtr, bool inMem
 		ItemPointerData indextid;
 
 		ItemPointerSet(&indextid, element->blkno, element->offno);
-		tidhash_insert(v->tids, indextid, found);
+		AddTidToVisited(v, indextid, found);
 	}
 	else if (base != NULL)
 	{
@@ -777,19 +1361,14 @@ HnswLoadUnvisitedFromMemory(char *base, HnswElement element, HnswUnvisited * unv
  * Load neighbor index TIDs
  */
 bool
-HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, int m, int lm, int lc)
+HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation index, HnswPageCache * pages, int m, int lm, int lc)
 {
 	Buffer		buf;
 	Page		page;
 	HnswNeighborTuple ntup;
 	int			start;
 
-	if (element->neighborPage >= RelationGetNumberOfBlocks(index))
-	{
-		ereport(ERROR,(errcode(ERRCODE_DATA_EXCEPTION),errmsg("blk is not valid")));
-	}
-	buf = ReadBuffer(index, element->neighborPage);
-	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	buf = HnswReadPage(index, element->neighborPage, pages, pages ? &pages->neighborBuf : NULL);
 	page = BufferGetPage(buf);
 
 	ntup = (HnswNeighborTuple) PageGetItem(page, PageGetItemId(page, element->neighborOffno));
@@ -800,7 +1379,7 @@ HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation i
 	 */
 	if (ntup->version != element->version || ntup->count != (element->level + 2) * m)
 	{
-		UnlockReleaseBuffer(buf);
+		HnswUnlockPage(buf, pages);
 		return false;
 	}
 
@@ -808,7 +1387,7 @@ HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation i
 	start = (element->level - lc) * m;
 	memcpy(indextids, ntup->indextids + start, lm * sizeof(ItemPointerData));
 
-	UnlockReleaseBuffer(buf);
+	HnswUnlockPage(buf, pages);
 	return true;
 }
 
@@ -816,13 +1395,13 @@ HnswLoadNeighborTids(HnswElement element, ItemPointerData *indextids, Relation i
  * Load unvisited neighbors from disk
  */
 static void
-HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *unvisitedLength, visited_hash * v, Relation index, int m, int lm, int lc)
+HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *unvisitedLength, visited_hash * v, Relation index, HnswPageCache * pages, int m, int lm, int lc)
 {
 	ItemPointerData indextids[HNSW_MAX_M * 2];
 
 	*unvisitedLength = 0;
 
-	if (!HnswLoadNeighborTids(element, indextids, index, m, lm, lc))
+	if (!HnswLoadNeighborTids(element, indextids, index, pages, m, lm, lc))
 		return;
 
 	for (int i = 0; i < lm; i++)
@@ -833,7 +1412,7 @@ HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *u
 		if (!ItemPointerIsValid(indextid))
 			break;
 
-		tidhash_insert(v->tids, *indextid, &found);
+		AddTidToVisited(v, *indextid, &found);
 
 		if (!found)
 		{
@@ -844,6 +1423,159 @@ HnswLoadUnvisitedFromDisk(HnswElement element, HnswUnvisited * unvisited, int *u
 	}
 }
 
+/*
+ * Get the distances of unvisited neighbors on disk at once
+ *
+ * Values are copied while each page is locked and compared in one batch.
+ * Versions detect elements replaced before they are loaded.
+ */
+static void
+HnswGetUnvisitedDistances(HnswQuery * q, HnswUnvisited * unvisited, int unvisitedLength, Relation index, HnswSupport * support, char **scratch, Size *scratchSize, Datum *values, uint8 *versions, bool *deleted, double *distances)
+{
+	Size		offsets[HNSW_MAX_M * 2];
+	int			indexes[HNSW_MAX_M * 2];
+	double		batchDistances[HNSW_MAX_M * 2];
+	Size		used = 0;
+	int			n = 0;
+
+	for (int i = 0; i < unvisitedLength; i++)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&unvisited[i].tid);
+		OffsetNumber offno = ItemPointerGetOffsetNumber(&unvisited[i].tid);
+		Buffer		buf;
+		Page		page;
+		HnswElementTuple etup;
+		Size		size;
+
+		buf = HnswReadPage(index, blkno, support->pages, support->pages ? &support->pages->elementBuf : NULL);
+		page = BufferGetPage(buf);
+		etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, offno));
+
+		Assert(HnswIsElementTuple(etup));
+
+		versions[i] = etup->version;
+		deleted[i] = etup->deleted;
+
+		/* Values of deleted elements are zeroed */
+		if (deleted[i])
+		{
+			HnswUnlockPage(buf, support->pages);
+			continue;
+		}
+
+		size = VARSIZE_ANY(&etup->data);
+		if (used + MAXALIGN(size) > *scratchSize)
+		{
+			*scratchSize = Max(*scratchSize * 2, used + MAXALIGN(size));
+			*scratch = *scratch == NULL ? palloc(*scratchSize) : repalloc(*scratch, *scratchSize);
+		}
+
+		memcpy(*scratch + used, &etup->data, size);
+		HnswUnlockPage(buf, support->pages);
+
+		offsets[n] = used;
+		indexes[n++] = i;
+		used += MAXALIGN(size);
+	}
+
+	for (int i = 0; i < n; i++)
+		values[i] = PointerGetDatum(*scratch + offsets[i]);
+
+	if (DatumGetPointer(q->value) == NULL)
+	{
+		for (int i = 0; i < n; i++)
+			batchDistances[i] = 0;
+	}
+	else
+		HnswGetDistances(q->value, values, n, support, batchDistances);
+
+	for (int i = 0; i < n; i++)
+		distances[indexes[i]] = batchDistances[i];
+}
+
+/*
+ * Prefetch the element pages of unvisited neighbors
+ */
+static void
+HnswPrefetchUnvisited(Relation index, HnswUnvisited * unvisited, int unvisitedLength)
+{
+	if (effective_io_concurrency == 0)
+		return;
+
+	for (int i = 0; i < unvisitedLength; i++)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&unvisited[i].tid);
+		bool		seen = false;
+
+		/* Neighbors are often on the same pages */
+		for (int j = 0; j < i; j++)
+		{
+			if (ItemPointerGetBlockNumber(&unvisited[j].tid) == blkno)
+			{
+				seen = true;
+				break;
+			}
+		}
+
+		if (!seen)
+			PrefetchBuffer(index, MAIN_FORKNUM, blkno);
+	}
+}
+
+/*
+ * Prefetch the neighbor page of the next candidate
+ */
+static void
+HnswPrefetchNextCandidate(char *base, Relation index, HnswHeap * C)
+{
+	HnswElement element;
+
+	if (effective_io_concurrency == 0 || HnswHeapIsEmpty(C))
+		return;
+
+	element = HnswPtrAccess(base, HnswHeapFirst(C)->element);
+	PrefetchBuffer(index, MAIN_FORKNUM, element->neighborPage);
+}
+
+/*
+ * Check if W has not changed for enough expansions to stop early
+ */
+static inline bool
+IsSearchStable(HnswQuery * q, int lc, int *stale, bool *added)
+{
+	if (lc > 0 || q->patience == 0)
+		return false;
+
+	*stale = *added ? 0 : *stale + 1;
+	*added = false;
+	return *stale > q->patience;
+}
+
+/*
+ * Keep candidates that were not expanded for iterative scans
+ *
+ * Called when a search stops early. Some of them are returned in W, so they
+ * are added again as copies that are only expanded when the scan resumes.
+ */
+static void
+DeferCandidates(char *base, HnswCandidateArena * arena, HnswSearchCandidate * c, HnswHeap * C, pairingheap *discarded)
+{
+	HnswSearchCandidate *e;
+
+	e = HnswArenaCandidate(arena, base, HnswPtrAccess(base, c->element), c->distance);
+	e->returned = true;
+	pairingheap_add(discarded, &e->w_node);
+
+	for (int i = 0; i < C->length; i++)
+	{
+		HnswSearchCandidate *sc = C->items[i].sc;
+
+		e = HnswArenaCandidate(arena, base, HnswPtrAccess(base, sc->element), sc->distance);
+		e->returned = true;
+		pairingheap_add(discarded, &e->w_node);
+	}
+}
+
 /*
  * Algorithm 2 from paper
  */
@@ -851,9 +1583,12 @@ List *
 HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation index, HnswSupport * support, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples)
 {
 	List	   *w = NIL;
-	pairingheap *C = pairingheap_allocate(CompareNearestCandidates, NULL);
-	pairingheap *W = pairingheap_allocate(CompareFurthestCandidates, NULL);
+	HnswHeap	C;
+	HnswHeap	W;
+	HnswCandidateArena arena = {0};
 	int			wlen = 0;
+	int			stale = 0;
+	bool		added = true;
 	visited_hash vh;
 	ListCell   *lc2;
 	HnswNeighborArray *localNeighborhood = NULL;
@@ -862,6 +1597,15 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 	HnswUnvisited *unvisited = palloc(lm * sizeof(HnswUnvisited));
 	int			unvisitedLength;
 	bool		inMemory = index == NULL;
+	Datum	   *values = palloc(lm * sizeof(Datum));
+	double	   *distances = palloc(lm * sizeof(double));
+	uint8	   *versions = NULL;
+	bool	   *deleted = NULL;
+	char	   *scratch = NULL;
+	Size		scratchSize = 0;
+
+	HnswHeapInit(&C, Max(ef, HNSW_HEAP_INITIAL_CAPACITY), false);
+	HnswHeapInit(&W, ef + 1, true);
 
 	if (v == NULL)
 	{
@@ -883,6 +1627,11 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 		neighborhoodSize = HNSW_NEIGHBOR_ARRAY_SIZE(lm);
 		localNeighborhood = palloc(neighborhoodSize);
 	}
+	else
+	{
+		versions = palloc(lm * sizeof(uint8));
+		deleted = palloc(lm * sizeof(bool));
+	}
 
 	/* Add entry points to v, C, and W */
 	foreach(lc2, ep)
@@ -899,8 +1648,13 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				(*tuples)++;
 		}
 
-		pairingheap_add(C, &sc->c_node);
-		pairingheap_add(W, &sc->w_node);
+		HnswHeapPush(&C, sc);
+
+		/* Already returned before an early stop */
+		if (sc->returned)
+			continue;
+
+		HnswHeapPush(&W, sc);
 
 		/*
 		 * Do not count elements being deleted towards ef when vacuuming. It
@@ -911,26 +1665,51 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 			wlen++;
 	}
 
-	while (!pairingheap_is_empty(C))
+	while (!HnswHeapIsEmpty(&C))
 	{
-		HnswSearchCandidate *c = HnswGetSearchCandidate(c_node, pairingheap_remove_first(C));
-		HnswSearchCandidate *f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+		HnswSearchCandidate *c = HnswHeapPop(&C);
+		HnswSearchCandidate *f = HnswHeapFirst(&W);
 		HnswElement cElement;
 
-		if (c->distance > f->distance)
+		/* W is empty when every entry point was already returned */
+		if (f != NULL && c->distance > f->distance)
+			break;
+
+		if (IsSearchStable(q, lc, &stale, &added))
+		{
+			if (discarded != NULL)
+				DeferCandidates(base, &arena, c, &C, *discarded);
 			break;
+		}
 
 		cElement = HnswPtrAccess(base, c->element);
 
 		if (inMemory)
 			HnswLoadUnvisitedFromMemory(base, cElement, unvisited, &unvisitedLength, v, lc, localNeighborhood, neighborhoodSize);
 		else
-			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, m, lm, lc);
+		{
+			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, support->pages, m, lm, lc);
+
+			/* Start reads before computing distances */
+			HnswPrefetchUnvisited(index, unvisited, unvisitedLength);
+			HnswPrefetchNextCandidate(base, index, &C);
+		}
 
 		/* OK to count elements instead of tuples */
 		if (tuples != NULL)
 			(*tuples) += unvisitedLength;
 
+		/* Calculate distances for the neighborhood at once */
+		if (inMemory)
+		{
+			for (int i = 0; i < unvisitedLength; i++)
+				values[i] = HnswGetValue(base, unvisited[i].element);
+
+			HnswGetDistances(q->value, values, unvisitedLength, support, distances);
+		}
+		else
+			HnswGetUnvisitedDistances(q, unvisited, unvisitedLength, index, support, &scratch, &scratchSize, values, versions, deleted, distances);
+
 		for (int i = 0; i < unvisitedLength; i++)
 		{
 			HnswElement eElement;
@@ -938,12 +1717,12 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 			double		eDistance;
 			bool		alwaysAdd = wlen < ef;
 
-			f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+			f = HnswHeapFirst(&W);
 
 			if (inMemory)
 			{
 				eElement = unvisited[i].element;
-				eDistance = GetElementDistance(base, eElement, q, support);
+				eDistance = distances[i];
 			}
 			else
 			{
@@ -951,20 +1730,29 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				BlockNumber blkno = ItemPointerGetBlockNumber(indextid);
 				OffsetNumber offno = ItemPointerGetOffsetNumber(indextid);
 
+				if (deleted[i])
+					continue;
+
+				eDistance = distances[i];
+
 				/* Avoid any allocations if not adding */
+				if (!(alwaysAdd || discarded != NULL || eDistance < f->distance))
+					continue;
+
 				eElement = NULL;
-				HnswLoadElementImpl(blkno, offno, &eDistance, q, index, support, inserting, alwaysAdd || discarded != NULL ? NULL : &f->distance, &eElement);
+				HnswLoadElementImpl(blkno, offno, NULL, q, index, support, inserting, NULL, &eElement);
 
-				if (eElement == NULL)
+				/* Replaced after the distance was calculated */
+				if (eElement->version != versions[i])
 					continue;
 			}
 
-			if (eElement == NULL || !(eDistance < f->distance || alwaysAdd))
+			if (eElement == NULL || !(alwaysAdd || eDistance < f->distance))
 			{
 				if (discarded != NULL)
 				{
 					/* Create a new candidate */
-					e = HnswInitSearchCandidate(base, eElement, eDistance);
+					e = HnswArenaCandidate(&arena, base, eElement, eDistance);
 					pairingheap_add(*discarded, &e->w_node);
 				}
 
@@ -976,9 +1764,10 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				continue;
 
 			/* Create a new candidate */
-			e = HnswInitSearchCandidate(base, eElement, eDistance);
-			pairingheap_add(C, &e->c_node);
-			pairingheap_add(W, &e->w_node);
+			e = HnswArenaCandidate(&arena, base, eElement, eDistance);
+			HnswHeapPush(&C, e);
+			HnswHeapPush(&W, e);
+			added = true;
 
 			/*
 			 * Do not count elements being deleted towards ef when vacuuming.
@@ -992,7 +1781,7 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 				/* No need to decrement wlen */
 				if (wlen > ef)
 				{
-					HnswSearchCandidate *d = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+					HnswSearchCandidate *d = HnswHeapPop(&W);
 
 					if (discarded != NULL)
 						pairingheap_add(*discarded, &d->w_node);
@@ -1002,26 +1791,55 @@ HnswSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation in
 	}
 
 	/* Add each element of W to w */
-	while (!pairingheap_is_empty(W))
+	while (!HnswHeapIsEmpty(&W))
 	{
-		HnswSearchCandidate *sc = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+		HnswSearchCandidate *sc = HnswHeapPop(&W);
 
 		w = lappend(w, sc);
 	}
 
+	if (v == &vh)
+		FreeVisited(v);
+
 	return w;
 }
 
+/*
+ * Keep the heap TIDs of an element that are in the bitmap
+ *
+ * Returns whether any heap TIDs are kept
+ */
+static bool
+FilterHeapTidsWithBitmap(HnswElement element, itempointer_hash * bitmap)
+{
+	int			length = 0;
+
+	for (int i = 0; i < element->heaptidsLength; i++)
+	{
+		if (itempointer_lookup(bitmap, element->heaptids[i]))
+			element->heaptids[length++] = element->heaptids[i];
+	}
+
+	element->heaptidsLength = length;
+	return length > 0;
+}
+
 /*
  * Algorithm 2 from paper
+ *
+ * Elements that are loaded only keep heap TIDs in the bitmap, so duplicates
+ * that do not match are not returned
  */
 List *
 HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation index, HnswSupport * support, int m, itempointer_hash *bitmap, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples, BlockNumber IPTRootPage)
 {
 	List	   *w = NIL;
-	pairingheap *C = pairingheap_allocate(CompareNearestCandidates, NULL);
-	pairingheap *W = pairingheap_allocate(CompareFurthestCandidates, NULL);
+	HnswHeap	C;
+	HnswHeap	W;
+	HnswCandidateArena arena = {0};
 	int			wlen = 0;
+	int			stale = 0;
+	bool		added = true;
 	float		alpha = 0.05;
 	visited_hash vh;
 	ListCell   *lc2;
@@ -1032,6 +1850,9 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 	int			unvisitedLength;
 	bool		inMemory = index == NULL;
 
+	HnswHeapInit(&C, Max(ef, HNSW_HEAP_INITIAL_CAPACITY), false);
+	HnswHeapInit(&W, ef + 1, true);
+
 	if (v == NULL)
 	{
 		v = &vh;
@@ -1069,10 +1890,10 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 				(*tuples)++;
 		}
 
-		pairingheap_add(C, &sc->c_node);
-		if (itempointer_lookup(bitmap, entryPoint->heaptids[0]))
+		HnswHeapPush(&C, sc);
+		if (!sc->returned && FilterHeapTidsWithBitmap(entryPoint, bitmap))
 		{
-			pairingheap_add(W, &sc->w_node);
+			HnswHeapPush(&W, sc);
 			/*
 			* Do not count elements being deleted towards ef when vacuuming. It
 			* would be ideal to do this for inserts as well, but this could
@@ -1083,26 +1904,33 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 		}
 	}
 
-	while (!pairingheap_is_empty(C))
+	while (!HnswHeapIsEmpty(&C))
 	{
-		HnswSearchCandidate *c = HnswGetSearchCandidate(c_node, pairingheap_remove_first(C));
+		HnswSearchCandidate *c = HnswHeapPop(&C);
 		HnswSearchCandidate *f = NULL;
 		HnswElement cElement;
 
-		if (!pairingheap_is_empty(W))
+		if (!HnswHeapIsEmpty(&W))
 		{
-			f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+			f = HnswHeapFirst(&W);
 		}
 
 		if (f && c->distance > f->distance)
 			break;
 
+		if (IsSearchStable(q, lc, &stale, &added))
+		{
+			if (discarded != NULL)
+				DeferCandidates(base, &arena, c, &C, *discarded);
+			break;
+		}
+
 		cElement = HnswPtrAccess(base, c->element);
 
 		if (inMemory)
 			HnswLoadUnvisitedFromMemory(base, cElement, unvisited, &unvisitedLength, v, lc, localNeighborhood, neighborhoodSize);
 		else
-			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, m, lm, lc);
+			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, support->pages, m, lm, lc);
 
 		/* OK to count elements instead of tuples */
 		if (tuples != NULL)
@@ -1115,17 +1943,20 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 			double		eDistance;
 			bool		alwaysAdd = wlen < ef;
 			double      random_num = RandomDouble();
-			ItemPointerData heaptid = IPTSearch(index, IPTRootPage, unvisited[i].tid);
-			bool        satisfy = itempointer_lookup(bitmap, heaptid);
+			ItemPointerData heaptid = IPTSearch(index, IPTRootPage, unvisited[i].tid, support->pages ? &support->pages->ipt : NULL);
+			bool		satisfy;
+
+			/* Elements with duplicates are checked once loaded */
+			satisfy = HnswHeapTidMapIsMulti(heaptid) || itempointer_lookup(bitmap, heaptid);
 
 			if ((!satisfy) && random_num > alpha)
 			{
 				continue;
 			}
 
-			if (!pairingheap_is_empty(W))
+			if (!HnswHeapIsEmpty(&W))
 			{
-				f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+				f = HnswHeapFirst(&W);
 			}
 
 			if (inMemory)
@@ -1145,6 +1976,8 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 
 				if (eElement == NULL)
 					continue;
+
+				satisfy = FilterHeapTidsWithBitmap(eElement, bitmap);
 			}
 
 
@@ -1158,7 +1991,7 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 				if (discarded != NULL)
 				{
 					/* Create a new candidate */
-					e = HnswInitSearchCandidate(base, eElement, eDistance);
+					e = HnswArenaCandidate(&arena, base, eElement, eDistance);
 					pairingheap_add(*discarded, &e->w_node);
 				}
 
@@ -1170,8 +2003,8 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 				continue;
 
 			/* Create a new candidate */
-			e = HnswInitSearchCandidate(base, eElement, eDistance);
-			pairingheap_add(C, &e->c_node);
+			e = HnswArenaCandidate(&arena, base, eElement, eDistance);
+			HnswHeapPush(&C, e);
 
 			if (!satisfy)
 			{
@@ -1183,7 +2016,8 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 			 * could affect insert performance.
 			 */
 			
-			pairingheap_add(W, &e->w_node);
+			HnswHeapPush(&W, e);
+			added = true;
 			if (CountElement(skipElement, eElement))
 			{
 				wlen++;
@@ -1191,7 +2025,7 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 				/* No need to decrement wlen */
 				if (wlen > ef)
 				{
-					HnswSearchCandidate *d = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+					HnswSearchCandidate *d = HnswHeapPop(&W);
 
 					if (discarded != NULL)
 						pairingheap_add(*discarded, &d->w_node);
@@ -1203,23 +2037,102 @@ HnswSearchLayerWithBitmap(char *base, HnswQuery * q, List *ep, int ef, int lc, R
 	}
 
 	/* Add each element of W to w */
-	while (!pairingheap_is_empty(W))
+	while (!HnswHeapIsEmpty(&W))
 	{
-		HnswSearchCandidate *sc = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+		HnswSearchCandidate *sc = HnswHeapPop(&W);
 
 		w = lappend(w, sc);
 	}
 
+	if (v == &vh)
+		FreeVisited(v);
+
 	return w;
 }
 
+/*
+ * Get the heap TIDs of an element for a filter
+ *
+ * The map has the heap TID of elements without duplicates, so only elements
+ * with duplicates are read
+ */
+static int
+GetFilterHeapTids(Relation index, HnswSupport * support, BlockNumber IPTRootPage, ItemPointer indextid, ItemPointerData *heaptids)
+{
+	ItemPointerData heaptid = IPTSearch(index, IPTRootPage, *indextid, support->pages ? &support->pages->ipt : NULL);
+	Buffer		buf;
+	Page		page;
+	HnswElementTuple etup;
+	int			length = 0;
+
+	if (!HnswHeapTidMapIsMulti(heaptid))
+	{
+		heaptids[0] = heaptid;
+		return 1;
+	}
+
+	buf = HnswReadPage(index, ItemPointerGetBlockNumber(indextid), support->pages, support->pages ? &support->pages->elementBuf : NULL);
+	page = BufferGetPage(buf);
+	etup = (HnswElementTuple) PageGetItem(page, PageGetItemId(page, ItemPointerGetOffsetNumber(indextid)));
+
+	Assert(HnswIsElementTuple(etup));
+
+	for (int i = 0; i < HNSW_HEAPTIDS; i++)
+	{
+		/* Can stop at first invalid */
+		if (!ItemPointerIsValid(&etup->heaptids[i]))
+			break;
+
+		heaptids[length++] = etup->heaptids[i];
+	}
+
+	HnswUnlockPage(buf, support->pages);
+
+	return length;
+}
+
+/*
+ * Keep the heap TIDs of an element that passed the filter
+ *
+ * Returns whether any heap TIDs are kept
+ */
+static bool
+FilterHeapTidsWithResults(HnswElement element, ItemPointerData *tids, bool *results, int length)
+{
+	int			kept = 0;
+
+	for (int i = 0; i < element->heaptidsLength; i++)
+	{
+		for (int j = 0; j < length; j++)
+		{
+			if (results[j] && ItemPointerEquals(&element->heaptids[i], &tids[j]))
+			{
+				element->heaptids[kept++] = element->heaptids[i];
+				break;
+			}
+		}
+	}
+
+	element->heaptidsLength = kept;
+	return kept > 0;
+}
+
+/*
+ * Search a layer, evaluating the filter for the heap TIDs of candidates
+ *
+ * All heap TIDs of an element are evaluated, and elements that are loaded
+ * only keep those that passed
+ */
 List *
 HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Relation index, HnswSupport * support, int m, bool inserting, HnswElement skipElement, visited_hash * v, pairingheap **discarded, bool initVisited, int64 *tuples, hook_evaluateTID evaluate_func, ExprState *qual, ExprContext *econtext, IndexScanDesc scan, BlockNumber IPTRootPage)
 {
 	List	   *w = NIL;
-	pairingheap *C = pairingheap_allocate(CompareNearestCandidates, NULL);
-	pairingheap *W = pairingheap_allocate(CompareFurthestCandidates, NULL);
+	HnswHeap	C;
+	HnswHeap	W;
+	HnswCandidateArena arena = {0};
 	int			wlen = 0;
+	int			stale = 0;
+	bool		added = true;
 	float		alpha = 0.05;
 	visited_hash vh;
 	ListCell   *lc2;
@@ -1230,11 +2143,19 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 	int			unvisitedLength;
 	bool		inMemory = index == NULL;
 
-	int 		length = 0;
-	ItemPointerData *reserved_ipd_list = palloc0(sizeof(ItemPointerData)*lm);
-	ItemPointer *reserved_itempointer_list = palloc0(sizeof(ItemPointer)*lm);
-	bool		*reserved_result_list = palloc0(sizeof(ItemPointer)*lm);
-	HnswSearchCandidate **reserved_candidate_lists = palloc0(sizeof(HnswSearchCandidate*)*lm);
+	int			maxCandidates = Max(lm, list_length(ep));
+	int			length = 0;
+	int			candidates = 0;
+
+	/* Heap TIDs to evaluate, with the first of each candidate in tidStarts */
+	ItemPointerData *reserved_ipd_list = palloc0(sizeof(ItemPointerData) * maxCandidates * HNSW_HEAPTIDS);
+	ItemPointer *reserved_itempointer_list = palloc0(sizeof(ItemPointer) * maxCandidates * HNSW_HEAPTIDS);
+	bool	   *reserved_result_list = palloc0(sizeof(bool) * maxCandidates * HNSW_HEAPTIDS);
+	int		   *tidStarts = palloc0(sizeof(int) * (maxCandidates + 1));
+	HnswSearchCandidate **reserved_candidate_lists = palloc0(sizeof(HnswSearchCandidate *) * maxCandidates);
+
+	HnswHeapInit(&C, Max(ef, HNSW_HEAP_INITIAL_CAPACITY), false);
+	HnswHeapInit(&W, ef + 1, true);
 
 	if (v == NULL)
 	{
@@ -1273,54 +2194,70 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 				(*tuples)++;
 		}
 
-		pairingheap_add(C, &sc->c_node);
-		reserved_itempointer_list[length] = &entryPoint->heaptids[0];
-		reserved_result_list[length] = false;
-		reserved_candidate_lists[length] = sc;
-		length++;
-		// if (itempointer_lookup(bitmap, entryPoint->heaptids[0]))
-		// {
-		// 	pairingheap_add(W, &sc->w_node);
-		// 	/*
-		// 	* Do not count elements being deleted towards ef when vacuuming. It
-		// 	* would be ideal to do this for inserts as well, but this could
-		// 	* affect insert performance.
-		// 	*/
-		// 	if (CountElement(skipElement, HnswPtrAccess(base, sc->element)))
-		// 		wlen++;
-		// }
+		HnswHeapPush(&C, sc);
+
+		/* Already returned before an early stop */
+		if (sc->returned)
+			continue;
+
+		tidStarts[candidates] = length;
+		reserved_candidate_lists[candidates++] = sc;
+		for (int i = 0; i < entryPoint->heaptidsLength; i++)
+			reserved_ipd_list[length++] = entryPoint->heaptids[i];
 	}
+	tidStarts[candidates] = length;
 
-	evaluate_func(reserved_itempointer_list, reserved_result_list, length, scan, qual, econtext);
 	for (int i = 0; i < length; i++)
 	{
-		if (reserved_result_list[i])
+		reserved_itempointer_list[i] = &reserved_ipd_list[i];
+		reserved_result_list[i] = false;
+	}
+	evaluate_func(reserved_itempointer_list, reserved_result_list, length, scan, qual, econtext);
+
+	for (int i = 0; i < candidates; i++)
+	{
+		HnswElement entryPoint = HnswPtrAccess(base, reserved_candidate_lists[i]->element);
+		int			start = tidStarts[i];
+
+		if (FilterHeapTidsWithResults(entryPoint, &reserved_ipd_list[start], &reserved_result_list[start], tidStarts[i + 1] - start))
 		{
-			pairingheap_add(W, &reserved_candidate_lists[i]->w_node);
+			HnswHeapPush(&W, reserved_candidate_lists[i]);
 			wlen++;
 		}
 	}
 
-	while (!pairingheap_is_empty(C))
+	while (!HnswHeapIsEmpty(&C))
 	{
-		HnswSearchCandidate *c = HnswGetSearchCandidate(c_node, pairingheap_remove_first(C));
+		HnswSearchCandidate *c = HnswHeapPop(&C);
 		HnswSearchCandidate *f = NULL;
 		HnswElement cElement;
 
-		if (!pairingheap_is_empty(W))
+		if (!HnswHeapIsEmpty(&W))
 		{
-			f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+			f = HnswHeapFirst(&W);
 		}
 
 		if (f && c->distance > f->distance)
 			break;
 
+		if (IsSearchStable(q, lc, &stale, &added))
+		{
+			if (discarded != NULL)
+				DeferCandidates(base, &arena, c, &C, *discarded);
+			break;
+		}
+
 		cElement = HnswPtrAccess(base, c->element);
 
 		if (inMemory)
 			HnswLoadUnvisitedFromMemory(base, cElement, unvisited, &unvisitedLength, v, lc, localNeighborhood, neighborhoodSize);
 		else
-			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, m, lm, lc);
+		{
+			HnswLoadUnvisitedFromDisk(cElement, unvisited, &unvisitedLength, v, index, support->pages, m, lm, lc);
+
+			/* Start reads while the filter is evaluated */
+			HnswPrefetchUnvisited(index, unvisited, unvisitedLength);
+		}
 
 		/* OK to count elements instead of tuples */
 		if (tuples != NULL)
@@ -1329,16 +2266,15 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 		length = 0;
 		for (int i = 0; i < unvisitedLength; i++)
 		{
-			// HnswElement eElement = NULL;
-			// ItemPointer indextid = &unvisited[i].indextid;
-			// BlockNumber blkno = ItemPointerGetBlockNumber(indextid);
-			// OffsetNumber offno = ItemPointerGetOffsetNumber(indextid);
-			// HnswLoadElementImpl(blkno, offno, NULL, q, index, support, true, NULL, &eElement);
-			// unvisited[i].element = eElement;
-			reserved_ipd_list[length] = IPTSearch(index, IPTRootPage, unvisited[i].tid);
-			reserved_itempointer_list[length] = &reserved_ipd_list[length]; // TODO
-			reserved_result_list[length] = false;
-			length++;
+			tidStarts[i] = length;
+			length += GetFilterHeapTids(index, support, IPTRootPage, &unvisited[i].tid, &reserved_ipd_list[length]);
+		}
+		tidStarts[unvisitedLength] = length;
+
+		for (int i = 0; i < length; i++)
+		{
+			reserved_itempointer_list[i] = &reserved_ipd_list[i];
+			reserved_result_list[i] = false;
 		}
 		evaluate_func(reserved_itempointer_list, reserved_result_list, length, scan, qual, econtext);
 
@@ -1350,16 +2286,22 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 			ItemPointer indextid;
 			bool		alwaysAdd = wlen < ef;
 			double		random_num = RandomDouble();
+			int			start = tidStarts[i];
+			int			count = tidStarts[i + 1] - start;
+			bool		satisfy = false;
+
+			for (int j = start; j < start + count; j++)
+				satisfy |= reserved_result_list[j];
 
-			if ((!reserved_result_list[i]) && random_num > alpha)
+			if ((!satisfy) && random_num > alpha)
 			{
 				continue;
 			}
 
 
-			if (!pairingheap_is_empty(W))
+			if (!HnswHeapIsEmpty(&W))
 			{
-				f = HnswGetSearchCandidate(w_node, pairingheap_first(W));
+				f = HnswHeapFirst(&W);
 			}
 
 			
@@ -1367,14 +2309,17 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 			indextid = &unvisited[i].tid;
 			HnswLoadElementImpl(ItemPointerGetBlockNumber(indextid), ItemPointerGetOffsetNumber(indextid), &eDistance, q, index, support, inserting, alwaysAdd || discarded != NULL ? NULL : &f->distance, &eElement);
 			// eDistance = GetElementDistance(base, eElement, q, support);
-			
+
+			/* Only keep heap TIDs that passed, including for discarded candidates */
+			if (eElement != NULL)
+				satisfy = FilterHeapTidsWithResults(eElement, &reserved_ipd_list[start], &reserved_result_list[start], count);
 
 			if (eElement == NULL || !((f && eDistance < f->distance) || alwaysAdd))
 			{
 				if (discarded != NULL)
 				{
 					/* Create a new candidate */
-					e = HnswInitSearchCandidate(base, eElement, eDistance);
+					e = HnswArenaCandidate(&arena, base, eElement, eDistance);
 					pairingheap_add(*discarded, &e->w_node);
 				}
 
@@ -1386,10 +2331,10 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 				continue;
 
 			/* Create a new candidate */
-			e = HnswInitSearchCandidate(base, eElement, eDistance);
-			pairingheap_add(C, &e->c_node);
+			e = HnswArenaCandidate(&arena, base, eElement, eDistance);
+			HnswHeapPush(&C, e);
 
-			if (!reserved_result_list[i])
+			if (!satisfy)
 			{
 				continue;
 			}
@@ -1399,7 +2344,8 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 			 * could affect insert performance.
 			 */
 			
-			pairingheap_add(W, &e->w_node);
+			HnswHeapPush(&W, e);
+			added = true;
 			if (CountElement(skipElement, eElement))
 			{
 				wlen++;
@@ -1407,7 +2353,7 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 				/* No need to decrement wlen */
 				if (wlen > ef)
 				{
-					HnswSearchCandidate *d = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+					HnswSearchCandidate *d = HnswHeapPop(&W);
 
 					if (discarded != NULL)
 						pairingheap_add(*discarded, &d->w_node);
@@ -1419,13 +2365,16 @@ HnswPushDownSearchLayer(char *base, HnswQuery * q, List *ep, int ef, int lc, Rel
 	}
 
 	/* Add each element of W to w */
-	while (!pairingheap_is_empty(W))
+	while (!HnswHeapIsEmpty(&W))
 	{
-		HnswSearchCandidate *sc = HnswGetSearchCandidate(w_node, pairingheap_remove_first(W));
+		HnswSearchCandidate *sc = HnswHeapPop(&W);
 
 		w = lappend(w, sc);
 	}
 
+	if (v == &vh)
+		FreeVisited(v);
+
 	return w;
 }
 
@@ -1477,27 +2426,93 @@ CompareCandidateDistancesOffset(const ListCell *a, const ListCell *b)
 	return 0;
 }
 
+/*
+ * Get the distance between two elements if one is being inserted and the
+ * other was a candidate for it
+ */
+static inline bool
+GetCachedDistance(HnswDistanceCache * cache, HnswElement a, HnswElement b, float *distance)
+{
+	DistanceHashEntry *entry;
+
+	if (cache == NULL)
+		return false;
+
+	if (a == cache->element)
+		entry = distancehash_lookup(cache->distances, (uintptr_t) b);
+	else if (b == cache->element)
+		entry = distancehash_lookup(cache->distances, (uintptr_t) a);
+	else
+		return false;
+
+	if (entry == NULL)
+		return false;
+
+	*distance = entry->distance;
+	return true;
+}
+
+/*
+ * Check if any value is as close to e as q
+ */
+static bool
+CheckAnyCloser(Datum eValue, Datum *values, int n, HnswSupport * support, float eDistance)
+{
+	double		distances[HNSW_PRUNE_BATCH_SIZE];
+
+	HnswGetDistances(eValue, values, n, support, distances);
+
+	for (int i = 0; i < n; i++)
+	{
+		if ((float) distances[i] <= eDistance)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Check if an element is closer to q than any element from R
+ *
+ * Distances are computed in small batches, so most of the work of an early
+ * exit is still skipped
  */
 static bool
 CheckElementCloser(char *base, HnswCandidate * e, List *r, HnswSupport * support)
 {
 	HnswElement eElement = HnswPtrAccess(base, e->element);
 	Datum		eValue = HnswGetValue(base, eElement);
+	Datum		values[HNSW_PRUNE_BATCH_SIZE];
+	int			n = 0;
 	ListCell   *lc2;
 
 	foreach(lc2, r)
 	{
 		HnswCandidate *ri = lfirst(lc2);
 		HnswElement riElement = HnswPtrAccess(base, ri->element);
-		Datum		riValue = HnswGetValue(base, riElement);
-		float		distance = HnswGetDistance(eValue, riValue, support);
+		float		distance;
 
-		if (distance <= e->distance)
-			return false;
+		if (GetCachedDistance(support->distances, eElement, riElement, &distance))
+		{
+			if (distance <= e->distance)
+				return false;
+
+			continue;
+		}
+
+		values[n++] = HnswGetValue(base, riElement);
+		if (n == HNSW_PRUNE_BATCH_SIZE)
+		{
+			if (CheckAnyCloser(eValue, values, n, support, e->distance))
+				return false;
+
+			n = 0;
+		}
 	}
 
+	if (n > 0 && CheckAnyCloser(eValue, values, n, support, e->distance))
+		return false;
+
 	return true;
 }
 
@@ -1717,6 +2732,27 @@ PrecomputeHash(char *base, HnswElement element)
 		element->hash = hash_offset(HnswPtrOffset(ptr));
 }
 
+/*
+ * Cache the distances of search candidates to the element being inserted
+ *
+ * Pruning the neighbors of its neighbors needs many of the same distances
+ */
+static void
+AddCachedDistances(char *base, HnswDistanceCache * cache, List *w)
+{
+	ListCell   *lc2;
+
+	foreach(lc2, w)
+	{
+		HnswSearchCandidate *sc = lfirst(lc2);
+		DistanceHashEntry *entry;
+		bool		found;
+
+		entry = distancehash_insert(cache->distances, (uintptr_t) HnswPtrAccess(base, sc->element), &found);
+		entry->distance = sc->distance;
+	}
+}
+
 /*
  * Algorithm 1 from paper
  */
@@ -1730,13 +2766,22 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 	HnswQuery	q;
 	HnswElement skipElement = existing ? element : NULL;
 	bool		inMemory = index == NULL;
+	HnswDistanceCache *cache = inMemory ? support->distances : NULL;
 
 	q.value = HnswGetValue(base, element);
+	q.patience = 0;
 
 	/* Precompute hash */
 	if (inMemory)
 		PrecomputeHash(base, element);
 
+	/* Replace distances to the previous element */
+	if (cache != NULL)
+	{
+		cache->element = element;
+		cache->distances = distancehash_create(CurrentMemoryContext, efConstruction * 2, NULL);
+	}
+
 	/* No neighbors if no entry point */
 	if (entryPoint == NULL)
 		return;
@@ -1750,6 +2795,9 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 	{
 		w = HnswSearchLayer(base, &q, ep, 1, lc, index, support, m, true, skipElement, NULL, NULL, true, NULL);
 		ep = w;
+
+		if (cache != NULL)
+			AddCachedDistances(base, cache, w);
 	}
 
 	if (level > entryLevel)
@@ -1769,6 +2817,9 @@ HnswFindElementNeighbors(char *base, HnswElement element, HnswElement entryPoint
 
 		w = HnswSearchLayer(base, &q, ep, efConstruction, lc, index, support, m, true, skipElement, NULL, NULL, true, NULL);
 
+		if (cache != NULL)
+			AddCachedDistances(base, cache, w);
+
 		/* Convert search candidates to candidates */
 		foreach(lc2, w)
 		{
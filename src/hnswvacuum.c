@@ -5,6 +5,8 @@
 #include "access/generic_xlog.h"
 #include "commands/vacuum.h"
 #include "hnsw.h"
+#include "miscadmin.h"
+#include "postmaster/autovacuum.h"
 #include "storage/bufmgr.h"
 #include "storage/lmgr.h"
 #include "utils/memutils.h"
@@ -13,6 +15,10 @@
 #define vacuum_delay_point() vacuum_delay_point(false)
 #endif
 
+#if PG_VERSION_NUM < 170000
+#define AmAutoVacuumWorkerProcess() IsAutoVacuumWorkerProcess()
+#endif
+
 /*
  * Check if deleted list contains an index TID
  */
@@ -445,10 +451,16 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 	Relation	index = vacuumstate->index;
 	BufferAccessStrategy bas = vacuumstate->bas;
 
+	/*
+	 * Invalidate cached upper layers first, since they may still link to
+	 * elements about to be deleted
+	 */
+	HnswUpdateMetaPage(index, HNSW_UPDATE_UPPER, NULL, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM, false);
+
 	/*
 	 * Wait for index scans to complete. Scans before this point may contain
 	 * tuples about to be deleted. Scans after this point will not, since the
-	 * graph has been repaired.
+	 * graph has been repaired and cached upper layers are reloaded.
 	 */
 	LockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
 	UnlockPage(index, HNSW_SCAN_LOCK, ExclusiveLock);
@@ -567,8 +579,11 @@ MarkDeleted(HnswVacuumState * vacuumstate)
 		UnlockReleaseBuffer(buf);
 	}
 
-	/* Update insert page last, after everything has been marked as deleted */
-	HnswUpdateMetaPage(index, 0, NULL, insertPage, InvalidBlockNumber, MAIN_FORKNUM, false);
+	/*
+	 * Update insert page last, after everything has been marked as deleted.
+	 * Deleted elements are also invalidated in cached upper layers.
+	 */
+	HnswUpdateMetaPage(index, HNSW_UPDATE_UPPER, NULL, insertPage, InvalidBlockNumber, MAIN_FORKNUM, false);
 }
 
 /*
@@ -623,6 +638,9 @@ hnswbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 {
 	HnswVacuumState vacuumstate;
 
+	/* Move pending tuples into the graph so dead ones are removed below */
+	HnswMergePending(info->index, true);
+
 	InitVacuumState(&vacuumstate, info, stats, callback, callback_state);
 
 	/* Pass 1: Remove heap TIDs */
@@ -648,12 +666,21 @@ hnswvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
 	Relation	rel = info->index;
 
 	if (info->analyze_only)
+	{
+		/* Autoanalyze compacts the pending list in the background */
+		if (AmAutoVacuumWorkerProcess())
+			HnswMergePending(rel, false);
+
 		return stats;
+	}
 
 	/* stats is NULL if ambulkdelete not called */
 	/* OK to return NULL if index not changed */
 	if (stats == NULL)
+	{
+		HnswMergePending(rel, true);
 		return NULL;
+	}
 
 	stats->num_pages = RelationGetNumberOfBlocks(rel);
 
@@ -35,6 +35,7 @@
 #define PARALLEL_KEY_TUPLESORT			UINT64CONST(0xA000000000000002)
 #define PARALLEL_KEY_IVFFLAT_CENTERS	UINT64CONST(0xA000000000000003)
 #define PARALLEL_KEY_QUERY_TEXT			UINT64CONST(0xA000000000000004)
+#define PARALLEL_KEY_BUILD_STATS		UINT64CONST(0xA000000000000005)
 
 /*
  * Add sample
@@ -170,6 +171,8 @@ AddTupleToSort(Relation index, ItemPointer tid, Datum *values, IvfflatBuildState
 		}
 	}
 
+	vector_distance_count += centers->length;
+
 #ifdef IVFFLAT_KMEANS_DEBUG
 	buildstate->inertia += minDistance;
 	buildstate->listSums[closestCenter] += minDistance;
@@ -184,6 +187,8 @@ AddTupleToSort(Relation index, ItemPointer tid, Datum *values, IvfflatBuildState
 	slot->tts_isnull[1] = false;
 	slot->tts_values[2] = value;
 	slot->tts_isnull[2] = false;
+	slot->tts_values[3] = Float8GetDatum(minDistance);
+	slot->tts_isnull[3] = false;
 	ExecStoreVirtualTuple(slot);
 
 	/*
@@ -226,7 +231,7 @@ BuildCallback(Relation index, ItemPointer tid, Datum *values,
  * Get index tuple from sort state
  */
 static inline void
-GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list)
+GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot, IndexTuple *itup, int *list, double *distance)
 {
 	if (tuplesort_gettupleslot(sortstate, true, false, slot, NULL))
 	{
@@ -235,6 +240,7 @@ GetNextTuple(Tuplesortstate *sortstate, TupleDesc tupdesc, TupleTableSlot *slot,
 
 		*list = DatumGetInt32(slot_getattr(slot, 1, &isnull));
 		value = slot_getattr(slot, 3, &isnull);
+		*distance = DatumGetFloat8(slot_getattr(slot, 4, &isnull));
 
 		/* Form the index tuple */
 		*itup = index_form_tuple(tupdesc, &value, &isnull);
@@ -252,16 +258,19 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 {
 	int			list;
 	IndexTuple	itup = NULL;	/* silence compiler warning */
+	double		distance = 0;
 	int64		inserted = 0;
+	bool		hasRadius = IvfflatHasMetricDistance(buildstate->procinfo, buildstate->normprocinfo);
 
 	TupleTableSlot *slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsMinimalTuple);
 	TupleDesc	tupdesc = buildstate->tupdesc;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_LOAD);
+	VectorBuildStatsPhase("loading tuples");
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_TOTAL, buildstate->indtuples);
 
-	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+	GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, &distance);
 
 	for (int i = 0; i < buildstate->centers->length; i++)
 	{
@@ -270,6 +279,7 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 		GenericXLogState *state;
 		BlockNumber startPage;
 		BlockNumber insertPage;
+		IvfflatListStatsData stats;
 
 		/* Can take a while, so ensure we can interrupt */
 		/* Needs to be called when no buffer locks are held */
@@ -280,6 +290,9 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 		startPage = BufferGetBlockNumber(buf);
 
+		stats.count = 0;
+		stats.radius = hasRadius ? 0 : -1;
+
 		/* Get all tuples for list */
 		while (list == i)
 		{
@@ -295,9 +308,13 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 			pfree(itup);
 
+			stats.count++;
+			if (hasRadius)
+				stats.radius = Max(stats.radius, IvfflatRadius(IvfflatMetricDistance(buildstate->procinfo, buildstate->normprocinfo, distance)));
+
 			pgstat_progress_update_param(PROGRESS_CREATEIDX_TUPLES_DONE, ++inserted);
 
-			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list);
+			GetNextTuple(buildstate->sortstate, tupdesc, slot, &itup, &list, &distance);
 		}
 
 		insertPage = BufferGetBlockNumber(buf);
@@ -306,7 +323,13 @@ InsertTuples(Relation index, IvfflatBuildState * buildstate, ForkNumber forkNum)
 
 		/* Set the start and insert pages */
 		IvfflatUpdateList(index, buildstate->listInfo[i], insertPage, InvalidBlockNumber, startPage, forkNum);
+
+		/* Set the stats */
+		if (stats.count > 0)
+			IvfflatUpdateListStats(index, buildstate->listInfo[i], &stats, forkNum);
 	}
+
+	VectorBuildStatsTuples(inserted);
 }
 
 /*
@@ -357,10 +380,11 @@ InitBuildState(IvfflatBuildState * buildstate, Relation heap, Relation index, In
 				 errmsg("dimensions must be greater than one for this opclass")));
 
 	/* Create tuple description for sorting */
-	buildstate->sortdesc = CreateTemplateTupleDesc(3);
+	buildstate->sortdesc = CreateTemplateTupleDesc(4);
 	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 1, "list", INT4OID, -1, 0);
 	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
 	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 3, "vector", TupleDescAttr(buildstate->tupdesc, 0)->atttypid, -1, 0);
+	TupleDescInitEntry(buildstate->sortdesc, (AttrNumber) 4, "distance", FLOAT8OID, -1, 0);
 
 	buildstate->slot = MakeSingleTupleTableSlot(buildstate->sortdesc, &TTSOpsVirtual);
 
@@ -405,7 +429,8 @@ ComputeCenters(IvfflatBuildState * buildstate)
 {
 	int			numSamples;
 
-	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_KMEANS);
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_SAMPLE);
+	VectorBuildStatsPhase("sampling table");
 
 	/* Target 50 samples per list, with at least 10000 samples */
 	/* The number of samples has a large effect on index build time */
@@ -433,7 +458,13 @@ ComputeCenters(IvfflatBuildState * buildstate)
 		}
 	}
 
+	VectorBuildStatsTuples(buildstate->samples->length);
+	VectorBuildStatsMemory(VECTOR_ARRAY_SIZE(buildstate->samples->maxlen, buildstate->samples->itemsize));
+
 	/* Calculate centers */
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_KMEANS);
+	VectorBuildStatsPhase("performing k-means");
+	VectorBuildStatsTuples(buildstate->samples->length);
 	IvfflatBench("k-means", IvfflatKmeans(buildstate->index, buildstate->samples, buildstate->centers, buildstate->typeInfo));
 
 	/* Free samples before we allocate more memory */
@@ -460,6 +491,8 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
 	metap->version = IVFFLAT_VERSION;
 	metap->dimensions = dimensions;
 	metap->lists = lists;
+	metap->freePage = InvalidBlockNumber;
+	metap->generation = 0;
 	((PageHeader) page)->pd_lower =
 		((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
 
@@ -471,7 +504,7 @@ CreateMetaPage(Relation index, int dimensions, int lists, ForkNumber forkNum)
  */
 static void
 CreateListPages(Relation index, VectorArray centers, int dimensions,
-				int lists, ForkNumber forkNum, ListInfo * *listInfo)
+				int lists, bool hasRadius, ForkNumber forkNum, ListInfo * *listInfo)
 {
 	Buffer		buf;
 	Page		page;
@@ -479,7 +512,8 @@ CreateListPages(Relation index, VectorArray centers, int dimensions,
 	Size		listSize;
 	IvfflatList list;
 
-	listSize = MAXALIGN(IVFFLAT_LIST_SIZE(centers->itemsize));
+	/* Stats are stored after the center */
+	listSize = MAXALIGN(IVFFLAT_LIST_SIZE(centers->itemsize)) + MAXALIGN(sizeof(IvfflatListStatsData));
 	list = palloc0(listSize);
 
 	buf = IvfflatNewBuffer(index, forkNum);
@@ -488,6 +522,7 @@ CreateListPages(Relation index, VectorArray centers, int dimensions,
 	for (int i = 0; i < lists; i++)
 	{
 		OffsetNumber offno;
+		IvfflatListStats stats;
 
 		/* Zero memory for each list */
 		MemSet(list, 0, listSize);
@@ -496,6 +531,9 @@ CreateListPages(Relation index, VectorArray centers, int dimensions,
 		list->startPage = InvalidBlockNumber;
 		list->insertPage = InvalidBlockNumber;
 		memcpy(&list->center, VectorArrayGet(centers, i), VARSIZE_ANY(VectorArrayGet(centers, i)));
+		stats = (IvfflatListStats) ((char *) list + IVFFLAT_LIST_STATS_OFFSET(list));
+		stats->count = 0;
+		stats->radius = hasRadius ? 0 : -1;
 
 		/* Ensure free space */
 		if (PageGetFreeSpace(page) < listSize)
@@ -575,6 +613,25 @@ InitBuildSortState(TupleDesc tupdesc, int memory, SortCoordinate coordinate)
 	return tuplesort_begin_heap(tupdesc, 1, attNums, sortOperators, sortCollations, nullsFirstFlags, memory, coordinate, false);
 }
 
+/*
+ * Record memory and spills of a sort
+ *
+ * Parallel sorts always write runs to temporary files, so they do not count
+ * as spills
+ */
+static void
+RecordSortStats(Tuplesortstate *sortstate, bool parallel)
+{
+	TuplesortInstrumentation stats;
+
+	tuplesort_get_stats(sortstate, &stats);
+
+	if (stats.spaceType == SORT_SPACE_TYPE_MEMORY)
+		VectorBuildStatsMemory(stats.spaceUsed * 1024);
+	else if (!parallel)
+		VectorBuildStatsSpill();
+}
+
 /*
  * Within leader, wait for end of heap scan
  */
@@ -621,6 +678,7 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, S
 	TableScanDesc scan;
 	double		reltuples;
 	IndexInfo  *indexInfo;
+	const char *prevPhase;
 
 	/* Initialize local tuplesort coordination state */
 	coordinate = palloc0(sizeof(SortCoordinateData));
@@ -642,8 +700,13 @@ IvfflatParallelScanAndSort(IvfflatSpool * ivfspool, IvfflatShared * ivfshared, S
 									   true, progress, BuildCallback,
 									   (void *) &buildstate, scan);
 
+	VectorBuildStatsTuples(buildstate.indtuples);
+
 	/* Execute this worker's part of the sort */
+	prevPhase = VectorBuildStatsPhase("sorting tuples");
 	tuplesort_performsort(ivfspool->sortstate);
+	RecordSortStats(ivfspool->sortstate, true);
+	VectorBuildStatsPhase(prevPhase);
 
 	/* Record statistics */
 	SpinLockAcquire(&ivfshared->mutex);
@@ -725,8 +788,11 @@ IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc)
 	ivfcenters = shm_toc_lookup(toc, PARALLEL_KEY_IVFFLAT_CENTERS, false);
 
 	/* Perform sorting */
+	VectorBuildStatsBegin(indexRel);
+	VectorBuildStatsPhase("assigning tuples");
 	sortmem = maintenance_work_mem / ivfshared->scantuplesortstates;
 	IvfflatParallelScanAndSort(ivfspool, ivfshared, sharedsort, ivfcenters, sortmem, false);
+	VectorBuildStatsPublish(shm_toc_lookup(toc, PARALLEL_KEY_BUILD_STATS, false));
 
 	/* Close relations within worker */
 	index_close(indexRel, indexLockmode);
@@ -742,6 +808,9 @@ IvfflatEndParallel(IvfflatLeader * ivfleader)
 	/* Shutdown worker processes */
 	WaitForParallelWorkersToFinish(ivfleader->pcxt);
 
+	/* Add stats of workers before shared memory goes away */
+	VectorBuildStatsCollect(ivfleader->buildstats);
+
 	/* Free last reference to MVCC snapshot, if one was used */
 	if (IsMVCCSnapshot(ivfleader->snapshot))
 		UnregisterSnapshot(ivfleader->snapshot);
@@ -792,9 +861,11 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	Size		estivfshared;
 	Size		estsort;
 	Size		estcenters;
+	Size		estbuildstats;
 	IvfflatShared *ivfshared;
 	Sharedsort *sharedsort;
 	char	   *ivfcenters;
+	VectorBuildSharedStats *buildstats;
 	IvfflatLeader *ivfleader = (IvfflatLeader *) palloc0(sizeof(IvfflatLeader));
 	bool		leaderparticipates = true;
 	int			querylen;
@@ -823,7 +894,9 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	shm_toc_estimate_chunk(&pcxt->estimator, estsort);
 	estcenters = buildstate->centers->itemsize * buildstate->centers->maxlen;
 	shm_toc_estimate_chunk(&pcxt->estimator, estcenters);
-	shm_toc_estimate_keys(&pcxt->estimator, 3);
+	estbuildstats = VECTOR_BUILD_SHARED_STATS_SIZE(request);
+	shm_toc_estimate_chunk(&pcxt->estimator, estbuildstats);
+	shm_toc_estimate_keys(&pcxt->estimator, 4);
 
 	/* Finally, estimate PARALLEL_KEY_QUERY_TEXT space */
 	if (debug_query_string)
@@ -876,9 +949,13 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	ivfcenters = shm_toc_allocate(pcxt->toc, estcenters);
 	memcpy(ivfcenters, buildstate->centers->items, estcenters);
 
+	buildstats = (VectorBuildSharedStats *) shm_toc_allocate(pcxt->toc, estbuildstats);
+	VectorBuildStatsInitShared(buildstats, request);
+
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_SHARED, ivfshared);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_TUPLESORT, sharedsort);
 	shm_toc_insert(pcxt->toc, PARALLEL_KEY_IVFFLAT_CENTERS, ivfcenters);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_BUILD_STATS, buildstats);
 
 	/* Store query string for workers */
 	if (debug_query_string)
@@ -900,6 +977,7 @@ IvfflatBeginParallel(IvfflatBuildState * buildstate, bool isconcurrent, int requ
 	ivfleader->sharedsort = sharedsort;
 	ivfleader->snapshot = snapshot;
 	ivfleader->ivfcenters = ivfcenters;
+	ivfleader->buildstats = buildstats;
 
 	/* If no workers were successfully launched, back out (do serial build) */
 	if (pcxt->nworkers_launched == 0)
@@ -932,6 +1010,7 @@ AssignTuples(IvfflatBuildState * buildstate)
 	SortCoordinate coordinate = NULL;
 
 	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_ASSIGN);
+	VectorBuildStatsPhase("assigning tuples");
 
 	/* Calculate parallel workers */
 	if (buildstate->heap != NULL)
@@ -959,8 +1038,11 @@ AssignTuples(IvfflatBuildState * buildstate)
 		if (buildstate->ivfleader)
 			buildstate->reltuples = ParallelHeapScan(buildstate);
 		else
+		{
 			buildstate->reltuples = table_index_build_scan(buildstate->heap, buildstate->index, buildstate->indexInfo,
 														   true, true, BuildCallback, (void *) buildstate, NULL);
+			VectorBuildStatsTuples(buildstate->indtuples);
+		}
 
 #ifdef IVFFLAT_KMEANS_DEBUG
 		PrintKmeansMetrics(buildstate);
@@ -978,7 +1060,10 @@ CreateEntryPages(IvfflatBuildState * buildstate, ForkNumber forkNum)
 	IvfflatBench("assign tuples", AssignTuples(buildstate));
 
 	/* Sort */
+	pgstat_progress_update_param(PROGRESS_CREATEIDX_SUBPHASE, PROGRESS_IVFFLAT_PHASE_SORT);
+	VectorBuildStatsPhase("sorting tuples");
 	IvfflatBench("sort tuples", tuplesort_performsort(buildstate->sortstate));
+	RecordSortStats(buildstate->sortstate, buildstate->ivfleader != NULL);
 
 	/* Load */
 	IvfflatBench("load tuples", InsertTuples(buildstate->index, buildstate, forkNum));
@@ -989,6 +1074,8 @@ CreateEntryPages(IvfflatBuildState * buildstate, ForkNumber forkNum)
 	/* End parallel build */
 	if (buildstate->ivfleader)
 		IvfflatEndParallel(buildstate->ivfleader);
+
+	VectorBuildStatsPhase(NULL);
 }
 
 /*
@@ -998,13 +1085,16 @@ static void
 BuildIndex(Relation heap, Relation index, IndexInfo *indexInfo,
 		   IvfflatBuildState * buildstate, ForkNumber forkNum)
 {
+	VectorBuildStatsBegin(index);
+
 	InitBuildState(buildstate, heap, index, indexInfo);
 
 	ComputeCenters(buildstate);
 
 	/* Create pages */
 	CreateMetaPage(index, buildstate->dimensions, buildstate->lists, forkNum);
-	CreateListPages(index, buildstate->centers, buildstate->dimensions, buildstate->lists, forkNum, &buildstate->listInfo);
+	CreateListPages(index, buildstate->centers, buildstate->dimensions, buildstate->lists,
+					IvfflatHasMetricDistance(buildstate->procinfo, buildstate->normprocinfo), forkNum, &buildstate->listInfo);
 	CreateEntryPages(buildstate, forkNum);
 
 	/* Write WAL for initialization fork since GenericXLog functions do not */
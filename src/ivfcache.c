@@ -0,0 +1,257 @@
+#include "postgres.h"
+
+#include "ivfflat.h"
+#include "storage/bufmgr.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+PGDLLEXPORT Datum vector_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum vector_negative_inner_product(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_l2_squared_distance(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum halfvec_negative_inner_product(PG_FUNCTION_ARGS);
+
+static HTAB *centroidCache = NULL;
+static Size centroidCacheSize = 0;
+
+/*
+ * Free a cache entry
+ */
+static void
+RemoveCacheEntry(IvfflatCentroidCache * entry)
+{
+	centroidCacheSize -= entry->size;
+	MemoryContextDelete(entry->ctx);
+	hash_search(centroidCache, &entry->indexOid, HASH_REMOVE, NULL);
+}
+
+/*
+ * Free all cache entries
+ */
+static void
+ResetCentroidCache(void)
+{
+	HASH_SEQ_STATUS status;
+	IvfflatCentroidCache *entry;
+
+	hash_seq_init(&status, centroidCache);
+	while ((entry = (IvfflatCentroidCache *) hash_seq_search(&status)) != NULL)
+		RemoveCacheEntry(entry);
+
+	Assert(centroidCacheSize == 0);
+}
+
+/*
+ * Invalidate entries when the index is rebuilt, truncated, or dropped
+ */
+static void
+CentroidCacheRelcacheCallback(Datum arg, Oid relid)
+{
+	IvfflatCentroidCache *entry;
+
+	if (centroidCache == NULL)
+		return;
+
+	if (!OidIsValid(relid))
+	{
+		ResetCentroidCache();
+		return;
+	}
+
+	entry = (IvfflatCentroidCache *) hash_search(centroidCache, &relid, HASH_FIND, NULL);
+	if (entry != NULL)
+		RemoveCacheEntry(entry);
+}
+
+/*
+ * Get the distance kind for the cached matrix
+ */
+IvfflatCacheDistance
+IvfflatGetCacheDistance(FmgrInfo *procinfo)
+{
+	if (procinfo->fn_addr == vector_l2_squared_distance || procinfo->fn_addr == halfvec_l2_squared_distance)
+		return IVFFLAT_CACHE_DISTANCE_L2;
+
+	if (procinfo->fn_addr == vector_negative_inner_product || procinfo->fn_addr == halfvec_negative_inner_product)
+		return IVFFLAT_CACHE_DISTANCE_IP;
+
+	return IVFFLAT_CACHE_DISTANCE_FMGR;
+}
+
+/*
+ * Load centers from list pages
+ *
+ * Returns false if lists were added after the metapage was read
+ */
+static bool
+LoadCentroidCache(Relation index, IvfflatCentroidCache * cache, const IvfflatTypeInfo * typeInfo)
+{
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	int			listCount = 0;
+
+	cache->startPages = palloc(sizeof(BlockNumber) * cache->lists);
+	cache->centers = VectorArrayInit(cache->lists, cache->dimensions, typeInfo->itemSize(cache->dimensions));
+
+	/* Search all list pages */
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+
+			if (VARSIZE_ANY(&list->center) > cache->centers->itemsize)
+				elog(ERROR, "ivfflat index is not valid");
+
+			if (listCount == cache->lists)
+			{
+				UnlockReleaseBuffer(cbuf);
+				return false;
+			}
+
+			cache->startPages[listCount] = list->startPage;
+			VectorArraySet(cache->centers, listCount, (Pointer) &list->center);
+			listCount++;
+		}
+
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	cache->lists = listCount;
+	cache->centers->length = listCount;
+
+	/* Convert centers to a contiguous matrix */
+	if (cache->distance != IVFFLAT_CACHE_DISTANCE_FMGR)
+	{
+		cache->matrix = palloc_extended(sizeof(float) * listCount * cache->dimensions, MCXT_ALLOC_ZERO | MCXT_ALLOC_HUGE);
+
+		for (int i = 0; i < listCount; i++)
+			typeInfo->sumCenter(VectorArrayGet(cache->centers, i), cache->matrix + ((int64) i * cache->dimensions));
+	}
+	else
+		cache->matrix = NULL;
+
+	return true;
+}
+
+/*
+ * Get cached centers for an index, loading them if needed
+ *
+ * Returns NULL if the cache is disabled or the centers do not fit
+ */
+IvfflatCentroidCache *
+IvfflatGetCentroidCache(Relation index, const IvfflatTypeInfo * typeInfo, FmgrInfo *procinfo, int lists, int dimensions, uint32 generation)
+{
+	Oid			indexOid = RelationGetRelid(index);
+	IvfflatCentroidCache *entry;
+	IvfflatCentroidCache cache;
+	Size		maxSize = (Size) ivfflat_centroid_cache_mem * 1024L;
+	Size		estimatedSize;
+	MemoryContext oldCtx;
+	bool		found;
+
+	if (maxSize == 0)
+		return NULL;
+
+	/* Estimate before reading any pages */
+	estimatedSize = sizeof(BlockNumber) * lists + VECTOR_ARRAY_SIZE(lists, typeInfo->itemSize(dimensions));
+	if (IvfflatGetCacheDistance(procinfo) != IVFFLAT_CACHE_DISTANCE_FMGR)
+		estimatedSize += sizeof(float) * lists * dimensions;
+
+	if (estimatedSize > maxSize)
+		return NULL;
+
+	if (centroidCache == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		if (CacheMemoryContext == NULL)
+			CreateCacheMemoryContext();
+
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(IvfflatCentroidCache);
+		hash_ctl.hcxt = CacheMemoryContext;
+		centroidCache = hash_create("Ivfflat centroid cache", 16, &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(CentroidCacheRelcacheCallback, (Datum) 0);
+	}
+
+	entry = (IvfflatCentroidCache *) hash_search(centroidCache, &indexOid, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		/* Metapage changed without relcache invalidation */
+		if (entry->lists == lists && entry->dimensions == dimensions && entry->generation == generation && entry->procinfoOid == procinfo->fn_oid)
+			return entry;
+
+		RemoveCacheEntry(entry);
+	}
+
+	/* Load into query memory so an error does not leak cache memory */
+	MemSet(&cache, 0, sizeof(IvfflatCentroidCache));
+	cache.indexOid = indexOid;
+	cache.lists = lists;
+	cache.dimensions = dimensions;
+	cache.generation = generation;
+	cache.procinfoOid = procinfo->fn_oid;
+	cache.distance = IvfflatGetCacheDistance(procinfo);
+	cache.size = estimatedSize;
+	cache.ctx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Ivfflat centroid cache entry",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	oldCtx = MemoryContextSwitchTo(cache.ctx);
+	if (!LoadCentroidCache(index, &cache, typeInfo))
+	{
+		MemoryContextSwitchTo(oldCtx);
+		MemoryContextDelete(cache.ctx);
+		return NULL;
+	}
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Make room */
+	if (centroidCacheSize + cache.size > maxSize)
+		ResetCentroidCache();
+
+	MemoryContextSetParent(cache.ctx, CacheMemoryContext);
+
+	entry = (IvfflatCentroidCache *) hash_search(centroidCache, &indexOid, HASH_ENTER, &found);
+	Assert(!found);
+	memcpy(entry, &cache, sizeof(IvfflatCentroidCache));
+	centroidCacheSize += entry->size;
+
+	return entry;
+}
+
+/*
+ * Convert a query to the layout of the cached matrix
+ *
+ * Returns NULL if distances must use the support function
+ */
+float *
+IvfflatCentroidCacheQuery(IvfflatCentroidCache * cache, const IvfflatTypeInfo * typeInfo, Datum value)
+{
+	float	   *query;
+
+	if (cache->matrix == NULL || DatumGetPointer(value) == NULL)
+		return NULL;
+
+	/* Let the support function report mismatched dimensions */
+	if (VARSIZE_ANY(DatumGetPointer(value)) != VARSIZE_ANY(VectorArrayGet(cache->centers, 0)))
+		return NULL;
+
+	query = palloc0(sizeof(float) * cache->dimensions);
+	typeInfo->sumCenter(DatumGetPointer(value), query);
+	return query;
+}
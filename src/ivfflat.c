@@ -19,6 +19,8 @@
 int			ivfflat_probes;
 int			ivfflat_iterative_scan;
 int			ivfflat_max_probes;
+int			ivfflat_centroid_cache_mem;
+double		ivfflat_probe_distance_gap;
 static relopt_kind ivfflat_relopt_kind;
 
 static const struct config_enum_entry ivfflat_iterative_scan_options[] = {
@@ -50,6 +52,16 @@ IvfflatInit(void)
 							NULL, &ivfflat_max_probes,
 							IVFFLAT_MAX_LISTS, IVFFLAT_MIN_LISTS, IVFFLAT_MAX_LISTS, PGC_USERSET, 0, NULL, NULL, NULL);
 
+	/* Shared by all ivfflat indexes in the backend */
+	DefineCustomIntVariable("ivfflat.centroid_cache_mem", "Sets the max memory to use for caching centers",
+							"Zero disables the cache.", &ivfflat_centroid_cache_mem,
+							65536, 0, MAX_KILOBYTES, PGC_USERSET, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	/* Lists are probed while within (1 + gap) times the closest center distance */
+	DefineCustomRealVariable("ivfflat.probe_distance_gap", "Sets the max relative distance gap to the closest list for probes",
+							 "Zero disables adaptive probes.", &ivfflat_probe_distance_gap,
+							 0, 0, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
+
 	MarkGUCPrefixReserved("ivfflat");
 }
 
@@ -63,10 +75,14 @@ ivfflatbuildphasename(int64 phasenum)
 	{
 		case PROGRESS_CREATEIDX_SUBPHASE_INITIALIZE:
 			return "initializing";
+		case PROGRESS_IVFFLAT_PHASE_SAMPLE:
+			return "sampling table";
 		case PROGRESS_IVFFLAT_PHASE_KMEANS:
 			return "performing k-means";
 		case PROGRESS_IVFFLAT_PHASE_ASSIGN:
 			return "assigning tuples";
+		case PROGRESS_IVFFLAT_PHASE_SORT:
+			return "sorting tuples";
 		case PROGRESS_IVFFLAT_PHASE_LOAD:
 			return "loading tuples";
 		default:
@@ -91,8 +107,8 @@ ivfflatcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	double		spc_seq_page_cost;
 	Relation	index;
 
-	/* Never use index without order */
-	if (path->indexorderbys == NULL)
+	/* Never use index without order or range condition */
+	if (path->indexorderbys == NULL && path->indexclauses == NULL)
 	{
 		*indexStartupCost = get_float8_infinity();
 		*indexTotalCost = get_float8_infinity();
@@ -111,7 +127,7 @@ ivfflatcostestimate(PlannerInfo *root, IndexPath *path, double loop_count,
 	genericcostestimate(root, path, loop_count, &costs);
 
 	index = index_open(path->indexinfo->indexoid, NoLock);
-	IvfflatGetMetaPageInfo(index, &lists, NULL);
+	IvfflatGetMetaPageInfo(index, &lists, NULL, NULL);
 	index_close(index, NoLock);
 
 	/* Get the ratio of lists that we need to visit */
@@ -6,6 +6,7 @@
 #include "access/genam.h"
 #include "access/generic_xlog.h"
 #include "access/parallel.h"
+#include "buildstats.h"
 #include "lib/pairingheap.h"
 #include "nodes/execnodes.h"
 #include "port.h"				/* for random() */
@@ -50,12 +51,17 @@
 #define PROGRESS_IVFFLAT_PHASE_KMEANS	2
 #define PROGRESS_IVFFLAT_PHASE_ASSIGN	3
 #define PROGRESS_IVFFLAT_PHASE_LOAD		4
+#define PROGRESS_IVFFLAT_PHASE_SORT		5
+#define PROGRESS_IVFFLAT_PHASE_SAMPLE	6
 
 #define IVFFLAT_LIST_SIZE(size)	(offsetof(IvfflatListData, center) + size)
 
 #define IvfflatPageGetOpaque(page)	((IvfflatPageOpaque) PageGetSpecialPointer(page))
 #define IvfflatPageGetMeta(page)	((IvfflatMetaPageData *) PageGetContents(page))
 
+/* Metapages of indexes built before the free list existed have zeros */
+#define IvfflatFreeBlockIsValid(blkno)	(BlockNumberIsValid(blkno) && (blkno) != IVFFLAT_METAPAGE_BLKNO)
+
 #ifdef IVFFLAT_BENCH
 #define IvfflatBench(name, code) \
 	do { \
@@ -83,6 +89,8 @@
 extern int	ivfflat_probes;
 extern int	ivfflat_iterative_scan;
 extern int	ivfflat_max_probes;
+extern int	ivfflat_centroid_cache_mem;
+extern double ivfflat_probe_distance_gap;
 
 typedef enum IvfflatIterativeScanMode
 {
@@ -156,6 +164,7 @@ typedef struct IvfflatLeader
 	Sharedsort *sharedsort;
 	Snapshot	snapshot;
 	char	   *ivfcenters;
+	VectorBuildSharedStats *buildstats;
 }			IvfflatLeader;
 
 typedef struct IvfflatTypeInfo
@@ -224,6 +233,8 @@ typedef struct IvfflatMetaPageData
 	uint32		version;
 	uint16		dimensions;
 	uint16		lists;
+	BlockNumber freePage;		/* entry pages of rewritten lists to reuse */
+	uint32		generation;		/* incremented when lists are rewritten */
 }			IvfflatMetaPageData;
 
 typedef IvfflatMetaPageData * IvfflatMetaPage;
@@ -246,11 +257,23 @@ typedef struct IvfflatListData
 
 typedef IvfflatListData * IvfflatList;
 
+/* Stored after the center, so lists from older indexes may not have them */
+typedef struct IvfflatListStatsData
+{
+	int64		count;			/* number of tuples, refreshed by vacuum */
+	float		radius;			/* max metric distance to center, -1 if unknown */
+}			IvfflatListStatsData;
+
+typedef IvfflatListStatsData * IvfflatListStats;
+
+#define IVFFLAT_LIST_STATS_OFFSET(list)	MAXALIGN(IVFFLAT_LIST_SIZE(VARSIZE_ANY(&(list)->center)))
+
 typedef struct IvfflatScanList
 {
 	pairingheap_node ph_node;
 	BlockNumber startPage;
 	double		distance;
+	float		radius;
 }			IvfflatScanList;
 
 typedef struct IvfflatScanOpaqueData
@@ -258,7 +281,10 @@ typedef struct IvfflatScanOpaqueData
 	const		IvfflatTypeInfo *typeInfo;
 	int			probes;
 	int			maxProbes;
+	int			numLists;
 	int			dimensions;
+	uint32		generation;
+	bool		iterative;
 	bool		first;
 	Datum		value;
 	MemoryContext tmpCtx;
@@ -279,12 +305,47 @@ typedef struct IvfflatScanOpaqueData
 	/* Lists */
 	pairingheap *listQueue;
 	BlockNumber *listPages;
+	double	   *listDistances;
+	float	   *listRadii;
+	int			listCount;
 	int			listIndex;
+	int			nextProbes;
 	IvfflatScanList *lists;
+
+	/* Range queries */
+	bool		rangeQuery;
+	float		rangeThreshold;
+	BlockNumber rangePage;
+	ItemPointerData *rangeTids;
+	int			rangeTidsLength;
+	int			rangeTidsIndex;
 }			IvfflatScanOpaqueData;
 
 typedef IvfflatScanOpaqueData * IvfflatScanOpaque;
 
+typedef enum IvfflatCacheDistance
+{
+	IVFFLAT_CACHE_DISTANCE_FMGR,
+	IVFFLAT_CACHE_DISTANCE_L2,
+	IVFFLAT_CACHE_DISTANCE_IP
+}			IvfflatCacheDistance;
+
+/* Backend-local copy of the centers of an index */
+typedef struct IvfflatCentroidCache
+{
+	Oid			indexOid;		/* hash key */
+	Oid			procinfoOid;
+	int			lists;
+	int			dimensions;
+	uint32		generation;
+	IvfflatCacheDistance distance;
+	Size		size;
+	MemoryContext ctx;
+	BlockNumber *startPages;
+	VectorArray centers;
+	float	   *matrix;			/* lists x dimensions, NULL for fmgr */
+}			IvfflatCentroidCache;
+
 #define VECTOR_ARRAY_SIZE(_length, _size) (sizeof(VectorArrayData) + (_length) * MAXALIGN(_size))
 
 /* Use functions instead of macros to avoid double evaluation */
@@ -301,23 +362,64 @@ VectorArraySet(VectorArray arr, int offset, Pointer val)
 	memcpy(VectorArrayGet(arr, offset), val, VARSIZE_ANY(val));
 }
 
+/*
+ * Distance from a converted query to a cached center
+ *
+ * Simple loops so the compiler can vectorize them
+ */
+static inline double
+IvfflatCentroidCacheDistance(IvfflatCentroidCache * cache, float *query, int i)
+{
+	float	   *center = cache->matrix + ((int64) i * cache->dimensions);
+	float		distance = 0.0;
+
+	if (cache->distance == IVFFLAT_CACHE_DISTANCE_L2)
+	{
+		for (int k = 0; k < cache->dimensions; k++)
+		{
+			float		diff = query[k] - center[k];
+
+			distance += diff * diff;
+		}
+
+		return (double) distance;
+	}
+
+	for (int k = 0; k < cache->dimensions; k++)
+		distance += query[k] * center[k];
+
+	return (double) -distance;
+}
+
 /* Methods */
 VectorArray VectorArrayInit(int maxlen, int dimensions, Size itemsize);
 void		VectorArrayFree(VectorArray arr);
 void		IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo);
+void		IvfflatMiniBatchKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo);
 FmgrInfo   *IvfflatOptionalProcInfo(Relation index, uint16 procnum);
 Datum		IvfflatNormValue(const IvfflatTypeInfo * typeInfo, Oid collation, Datum value);
 bool		IvfflatCheckNorm(FmgrInfo *procinfo, Oid collation, Datum value);
 int			IvfflatGetLists(Relation index);
-void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions);
+void		IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions, uint32 *generation);
 void		IvfflatUpdateList(Relation index, ListInfo listInfo, BlockNumber insertPage, BlockNumber originalInsertPage, BlockNumber startPage, ForkNumber forkNum);
+IvfflatListStats IvfflatGetListStats(Page page, OffsetNumber offno);
+void		IvfflatUpdateListStats(Relation index, ListInfo listInfo, IvfflatListStats stats, ForkNumber forkNum);
+void		IvfflatGrowListRadius(Relation index, ListInfo listInfo, float radius);
+bool		IvfflatHasMetricDistance(FmgrInfo *procinfo, FmgrInfo *normprocinfo);
+double		IvfflatMetricDistance(FmgrInfo *procinfo, FmgrInfo *normprocinfo, double distance);
+float		IvfflatRadius(double distance);
 void		IvfflatCommitBuffer(Buffer buf, GenericXLogState *state);
 void		IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state, ForkNumber forkNum);
 Buffer		IvfflatNewBuffer(Relation index, ForkNumber forkNum);
+void		IvfflatExtendMetaPage(Page page);
+Buffer		IvfflatNewEntryBuffer(Relation index);
 void		IvfflatInitPage(Buffer buf, Page page);
 void		IvfflatInitRegisterPage(Relation index, Buffer *buf, Page *page, GenericXLogState **state);
 void		IvfflatInit(void);
 const		IvfflatTypeInfo *IvfflatGetTypeInfo(Relation index);
+IvfflatCacheDistance IvfflatGetCacheDistance(FmgrInfo *procinfo);
+IvfflatCentroidCache *IvfflatGetCentroidCache(Relation index, const IvfflatTypeInfo * typeInfo, FmgrInfo *procinfo, int lists, int dimensions, uint32 generation);
+float	   *IvfflatCentroidCacheQuery(IvfflatCentroidCache * cache, const IvfflatTypeInfo * typeInfo, Datum value);
 PGDLLEXPORT void IvfflatParallelBuildMain(dsm_segment *seg, shm_toc *toc);
 
 /* Index access methods */
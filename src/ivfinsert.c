@@ -5,13 +5,12 @@
 #include "access/generic_xlog.h"
 #include "ivfflat.h"
 #include "storage/bufmgr.h"
-#include "storage/lmgr.h"
 #include "utils/memutils.h"
 
 /*
  * Find the list that minimizes the distance function
  */
-static void
+static double
 FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo * listInfo)
 {
 	double		minDistance = DBL_MAX;
@@ -59,6 +58,8 @@ FindInsertPage(Relation index, Datum *values, BlockNumber *insertPage, ListInfo
 
 		UnlockReleaseBuffer(cbuf);
 	}
+
+	return minDistance;
 }
 
 /*
@@ -78,6 +79,7 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 	BlockNumber insertPage = InvalidBlockNumber;
 	ListInfo	listInfo;
 	BlockNumber originalInsertPage;
+	double		distance;
 
 	/* Detoast once for all calls */
 	value = PointerGetDatum(PG_DETOAST_DATUM(values[0]));
@@ -95,10 +97,10 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 	}
 
 	/* Ensure index is valid */
-	IvfflatGetMetaPageInfo(index, NULL, NULL);
+	IvfflatGetMetaPageInfo(index, NULL, NULL, NULL);
 
 	/* Find the insert page - sets the page and list info */
-	FindInsertPage(index, &value, &insertPage, &listInfo);
+	distance = FindInsertPage(index, &value, &insertPage, &listInfo);
 	Assert(BlockNumberIsValid(insertPage));
 	originalInsertPage = insertPage;
 
@@ -136,9 +138,7 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 			Page		newpage;
 
 			/* Add a new page */
-			LockRelationForExtension(index, ExclusiveLock);
-			newbuf = IvfflatNewBuffer(index, MAIN_FORKNUM);
-			UnlockRelationForExtension(index, ExclusiveLock);
+			newbuf = IvfflatNewEntryBuffer(index);
 
 			/* Init new page */
 			newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
@@ -173,6 +173,9 @@ InsertTuple(Relation index, Datum *values, bool *isnull, ItemPointer heap_tid, R
 	/* Update the insert page */
 	if (insertPage != originalInsertPage)
 		IvfflatUpdateList(index, listInfo, insertPage, originalInsertPage, InvalidBlockNumber, MAIN_FORKNUM);
+
+	/* Update the list radius after the item is on the page, which vacuum relies on */
+	IvfflatGrowListRadius(index, listInfo, IvfflatRadius(IvfflatMetricDistance(index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC), normprocinfo, distance)));
 }
 
 /*
@@ -68,6 +68,8 @@ InitCenters(Relation index, VectorArray samples, VectorArray centers, float *low
 			sum += weight[j];
 		}
 
+		vector_distance_count += numSamples;
+
 		/* Only compute lower bound on last iteration */
 		if (i + 1 == numCenters)
 			break;
@@ -375,6 +377,8 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 			}
 		}
 
+		vector_distance_count += (int64) numCenters * (numCenters - 1) / 2;
+
 		/* For all centers c, compute s(c) */
 		for (int64 j = 0; j < numCenters; j++)
 		{
@@ -428,6 +432,7 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 				if (rj)
 				{
 					dxcx = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, closestCenters[j]))));
+					vector_distance_count++;
 
 					/* d(x,c(x)) computed, which is a form of d(x,c) */
 					lowerBound[j * numCenters + closestCenters[j]] = dxcx;
@@ -443,6 +448,8 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 				{
 					float		dxc = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, k))));
 
+					vector_distance_count++;
+
 					/* d(x,c) calculated */
 					lowerBound[j * numCenters + k] = dxc;
 
@@ -465,6 +472,7 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 		/* Step 5 */
 		for (int j = 0; j < numCenters; j++)
 			newcdist[j] = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, PointerGetDatum(VectorArrayGet(centers, j)), PointerGetDatum(VectorArrayGet(newCenters, j))));
+		vector_distance_count += numCenters;
 
 		for (int64 j = 0; j < numSamples; j++)
 		{
@@ -493,6 +501,98 @@ ElkanKmeans(Relation index, VectorArray samples, VectorArray centers, const Ivff
 	}
 }
 
+/*
+ * Use mini-batch k-means
+ *
+ * https://dl.acm.org/doi/10.1145/1772690.1772862
+ */
+static void
+MiniBatchKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+{
+	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
+	Oid			collation;
+	int			dimensions = centers->dim;
+	int			numCenters = centers->maxlen;
+	int			numSamples = samples->length;
+	int			batchSize = Min(numSamples, 1024);
+	int			maxIterations = 100;
+	float	   *lowerBound;
+	float	   *agg;
+	float	   *x;
+	int64	   *centerCounts;
+	int		   *batch;
+	int		   *closestCenters;
+
+	/* Set support functions */
+	procinfo = index_getprocinfo(index, 1, IVFFLAT_KMEANS_DISTANCE_PROC);
+	normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	collation = index->rd_indcollation[0];
+
+	/* Allocate space */
+	lowerBound = palloc_extended(sizeof(float) * numSamples * numCenters, MCXT_ALLOC_HUGE);
+	agg = palloc_extended(sizeof(float) * numCenters * dimensions, MCXT_ALLOC_ZERO | MCXT_ALLOC_HUGE);
+	x = palloc(sizeof(float) * dimensions);
+	centerCounts = palloc0(sizeof(int64) * numCenters);
+	batch = palloc(sizeof(int) * batchSize);
+	closestCenters = palloc(sizeof(int) * batchSize);
+
+	/* Pick initial centers */
+	InitCenters(index, samples, centers, lowerBound);
+
+	for (int j = 0; j < numCenters; j++)
+		typeInfo->sumCenter(VectorArrayGet(centers, j), agg + ((int64) j * dimensions));
+
+	for (int iteration = 0; iteration < maxIterations; iteration++)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* Assign a random batch to the closest centers */
+		for (int b = 0; b < batchSize; b++)
+		{
+			Datum		vec;
+			double		minDistance = DBL_MAX;
+
+			batch[b] = RandomInt() % numSamples;
+			vec = PointerGetDatum(VectorArrayGet(samples, batch[b]));
+			closestCenters[b] = 0;
+
+			for (int j = 0; j < numCenters; j++)
+			{
+				double		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, vec, PointerGetDatum(VectorArrayGet(centers, j))));
+
+				if (distance < minDistance)
+				{
+					minDistance = distance;
+					closestCenters[b] = j;
+				}
+			}
+		}
+
+		vector_distance_count += (int64) batchSize * numCenters;
+
+		/* Move centers toward samples with a per-center learning rate */
+		for (int b = 0; b < batchSize; b++)
+		{
+			float	   *center = agg + ((int64) closestCenters[b] * dimensions);
+			float		eta = 1.0 / ++centerCounts[closestCenters[b]];
+
+			for (int k = 0; k < dimensions; k++)
+				x[k] = 0.0;
+
+			typeInfo->sumCenter(VectorArrayGet(samples, batch[b]), x);
+
+			for (int k = 0; k < dimensions; k++)
+				center[k] = (1 - eta) * center[k] + eta * x[k];
+		}
+
+		UpdateCenters(agg, centers, typeInfo);
+
+		if (normprocinfo != NULL)
+			NormCenters(typeInfo, collation, centers);
+	}
+}
+
 /*
  * Ensure no NaN or infinite values
  */
@@ -574,6 +674,33 @@ IvfflatKmeans(Relation index, VectorArray samples, VectorArray centers, const Iv
 
 	CheckCenters(index, centers, typeInfo);
 
+	VectorBuildStatsMemory(MemoryContextMemAllocated(kmeansCtx, true));
+
+	MemoryContextSwitchTo(oldCtx);
+	MemoryContextDelete(kmeansCtx);
+}
+
+/*
+ * Perform mini-batch k-means centering
+ *
+ * Used to split lists, where fewer distance calculations matter more than
+ * the quality of the centers
+ */
+void
+IvfflatMiniBatchKmeans(Relation index, VectorArray samples, VectorArray centers, const IvfflatTypeInfo * typeInfo)
+{
+	MemoryContext kmeansCtx = AllocSetContextCreate(CurrentMemoryContext,
+													"Ivfflat kmeans temporary context",
+													ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldCtx = MemoryContextSwitchTo(kmeansCtx);
+
+	if (samples->length == 0)
+		RandomCenters(index, centers, typeInfo);
+	else
+		MiniBatchKmeans(index, samples, centers, typeInfo);
+
+	CheckCenters(index, centers, typeInfo);
+
 	MemoryContextSwitchTo(oldCtx);
 	MemoryContextDelete(kmeansCtx);
 }
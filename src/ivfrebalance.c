@@ -0,0 +1,853 @@
+#include "postgres.h"
+
+#include <float.h>
+
+#include "access/generic_xlog.h"
+#include "access/table.h"
+#include "catalog/index.h"
+#include "catalog/pg_class_d.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "utils/acl.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+/* Maximum number of samples to split a list */
+#define IVFFLAT_REBALANCE_SAMPLES 10000
+
+typedef struct RebalanceList
+{
+	ListInfo	listInfo;
+	BlockNumber startPage;
+	int64		count;
+	bool		changed;
+}			RebalanceList;
+
+typedef struct RebalanceState
+{
+	/* Info */
+	Relation	index;
+	const		IvfflatTypeInfo *typeInfo;
+	TupleDesc	tupdesc;
+	int			dimensions;
+
+	/* Support functions */
+	FmgrInfo   *procinfo;
+	FmgrInfo   *normprocinfo;
+	FmgrInfo   *kmeansnormprocinfo;
+	Oid			collation;
+
+	/* Lists */
+	RebalanceList *lists;
+	VectorArray centers;
+	int			maxLists;
+	BlockNumber lastListPage;
+
+	/* Memory */
+	MemoryContext tmpCtx;
+}			RebalanceState;
+
+typedef struct ListWriter
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	BlockNumber startPage;
+	BlockNumber insertPage;
+	Pointer		center;
+	IvfflatListStatsData stats;
+}			ListWriter;
+
+/*
+ * Count the items in a list
+ */
+static int64
+CountListItems(Relation index, BlockNumber searchPage)
+{
+	int64		count = 0;
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+
+		buf = ReadBuffer(index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		count += PageGetMaxOffsetNumber(page);
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+
+	return count;
+}
+
+/*
+ * Load lists from list pages
+ */
+static void
+LoadLists(RebalanceState * rs)
+{
+	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
+	VectorArray centers = rs->centers;
+
+	rs->lastListPage = IVFFLAT_HEAD_BLKNO;
+
+	while (BlockNumberIsValid(nextblkno))
+	{
+		Buffer		cbuf;
+		Page		cpage;
+		OffsetNumber maxoffno;
+
+		cbuf = ReadBuffer(rs->index, nextblkno);
+		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
+		cpage = BufferGetPage(cbuf);
+
+		maxoffno = PageGetMaxOffsetNumber(cpage);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			RebalanceList *rl = &rs->lists[centers->length];
+
+			if (centers->length == rs->maxLists || VARSIZE_ANY(&list->center) > centers->itemsize)
+				elog(ERROR, "ivfflat index is not valid");
+
+			rl->listInfo.blkno = nextblkno;
+			rl->listInfo.offno = offno;
+			rl->startPage = list->startPage;
+			rl->changed = false;
+			VectorArraySet(centers, centers->length, (Pointer) &list->center);
+			centers->length++;
+		}
+
+		rs->lastListPage = nextblkno;
+		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
+
+		UnlockReleaseBuffer(cbuf);
+	}
+
+	/* Count items, since counts in list stats are only refreshed by vacuum */
+	for (int i = 0; i < centers->length; i++)
+		rs->lists[i].count = CountListItems(rs->index, rs->lists[i].startPage);
+}
+
+/*
+ * Get the value of an index tuple
+ */
+static Datum
+GetTupleValue(RebalanceState * rs, IndexTuple itup)
+{
+	bool		isnull;
+
+	return PointerGetDatum(PG_DETOAST_DATUM(index_getattr(itup, 1, rs->tupdesc, &isnull)));
+}
+
+/*
+ * Sample the vectors of a list
+ */
+static void
+SampleList(RebalanceState * rs, BlockNumber searchPage, VectorArray samples)
+{
+	int64		seen = 0;
+
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(rs->index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+			MemoryContext oldCtx = MemoryContextSwitchTo(rs->tmpCtx);
+			Datum		value = GetTupleValue(rs, itup);
+			bool		skip = false;
+
+			/* Spherical k-means expects unit vectors */
+			if (rs->kmeansnormprocinfo != NULL)
+			{
+				if (IvfflatCheckNorm(rs->kmeansnormprocinfo, rs->collation, value))
+					value = IvfflatNormValue(rs->typeInfo, rs->collation, value);
+				else
+					skip = true;
+			}
+
+			/* Reservoir sampling */
+			if (!skip)
+			{
+				if (samples->length < samples->maxlen)
+				{
+					VectorArraySet(samples, samples->length, DatumGetPointer(value));
+					samples->length++;
+				}
+				else
+				{
+					int64		k = (int64) (RandomDouble() * (seen + 1));
+
+					if (k < samples->maxlen)
+						VectorArraySet(samples, k, DatumGetPointer(value));
+				}
+
+				seen++;
+			}
+
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(rs->tmpCtx);
+		}
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Start a new chain of entry pages
+ */
+static void
+InitListWriter(RebalanceState * rs, ListWriter * writer, Pointer center)
+{
+	writer->buf = IvfflatNewEntryBuffer(rs->index);
+	IvfflatInitRegisterPage(rs->index, &writer->buf, &writer->page, &writer->state);
+	writer->startPage = BufferGetBlockNumber(writer->buf);
+	writer->insertPage = InvalidBlockNumber;
+	writer->center = center;
+	writer->stats.count = 0;
+	writer->stats.radius = IvfflatHasMetricDistance(rs->procinfo, rs->normprocinfo) ? 0 : -1;
+}
+
+/*
+ * Add an item to a chain
+ */
+static void
+AddListItem(RebalanceState * rs, ListWriter * writer, IndexTuple itup, double distance)
+{
+	Size		itemsz = MAXALIGN(IndexTupleSize(itup));
+
+	/* Chain is not visible until the switch, so the order does not matter */
+	if (PageGetFreeSpace(writer->page) < itemsz)
+	{
+		Buffer		newbuf = IvfflatNewEntryBuffer(rs->index);
+
+		IvfflatPageGetOpaque(writer->page)->nextblkno = BufferGetBlockNumber(newbuf);
+		IvfflatCommitBuffer(writer->buf, writer->state);
+
+		writer->buf = newbuf;
+		IvfflatInitRegisterPage(rs->index, &writer->buf, &writer->page, &writer->state);
+	}
+
+	if (PageAddItem(writer->page, (Item) itup, itemsz, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(rs->index));
+
+	writer->stats.count++;
+	if (writer->stats.radius >= 0)
+		writer->stats.radius = Max(writer->stats.radius, IvfflatRadius(IvfflatMetricDistance(rs->procinfo, rs->normprocinfo, distance)));
+}
+
+/*
+ * Finish a chain
+ */
+static void
+FinishListWriter(ListWriter * writer)
+{
+	writer->insertPage = BufferGetBlockNumber(writer->buf);
+	IvfflatCommitBuffer(writer->buf, writer->state);
+}
+
+/*
+ * Copy the items of a list to the chains with the closest centers
+ */
+static void
+CopyListItems(RebalanceState * rs, BlockNumber searchPage, ListWriter * writers, int numWriters)
+{
+	while (BlockNumberIsValid(searchPage))
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber maxoffno;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBuffer(rs->index, searchPage);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+
+		maxoffno = PageGetMaxOffsetNumber(page);
+
+		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+			MemoryContext oldCtx = MemoryContextSwitchTo(rs->tmpCtx);
+			Datum		value = GetTupleValue(rs, itup);
+			double		minDistance = DBL_MAX;
+			int			closest = 0;
+
+			for (int i = 0; i < numWriters; i++)
+			{
+				double		distance = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, value, PointerGetDatum(writers[i].center)));
+
+				if (distance < minDistance)
+				{
+					minDistance = distance;
+					closest = i;
+				}
+			}
+
+			MemoryContextSwitchTo(oldCtx);
+			MemoryContextReset(rs->tmpCtx);
+
+			AddListItem(rs, &writers[closest], itup, minDistance);
+		}
+
+		searchPage = IvfflatPageGetOpaque(page)->nextblkno;
+
+		UnlockReleaseBuffer(buf);
+	}
+}
+
+/*
+ * Point a list item to a new chain
+ */
+static void
+SetList(Page page, OffsetNumber offno, ListWriter * writer)
+{
+	IvfflatList list = (IvfflatList) PageGetItem(page, PageGetItemId(page, offno));
+	IvfflatListStats stats;
+
+	if (VARSIZE_ANY(writer->center) != VARSIZE_ANY(&list->center))
+		elog(ERROR, "safety check failed");
+
+	memcpy(&list->center, writer->center, VARSIZE_ANY(writer->center));
+	list->startPage = writer->startPage;
+	list->insertPage = writer->insertPage;
+
+	stats = IvfflatGetListStats(page, offno);
+	if (stats != NULL)
+		*stats = writer->stats;
+}
+
+/*
+ * Add a list item for a new chain
+ */
+static void
+AppendList(RebalanceState * rs, GenericXLogState *state, Page metapage, Page *lastPage, Buffer *newbuf, ListWriter * writer, RebalanceList * rl)
+{
+	Size		listSize = MAXALIGN(IVFFLAT_LIST_SIZE(VARSIZE_ANY(writer->center))) + MAXALIGN(sizeof(IvfflatListStatsData));
+	IvfflatList list = palloc0(listSize);
+	Page		page = *lastPage;
+	OffsetNumber offno;
+
+	list->startPage = writer->startPage;
+	list->insertPage = writer->insertPage;
+	memcpy(&list->center, writer->center, VARSIZE_ANY(writer->center));
+	*((IvfflatListStats) ((char *) list + IVFFLAT_LIST_STATS_OFFSET(list))) = writer->stats;
+
+	/* Add a list page if needed */
+	if (PageGetFreeSpace(page) < listSize)
+	{
+		Page		newpage;
+
+		*newbuf = IvfflatNewBuffer(rs->index, MAIN_FORKNUM);
+		newpage = GenericXLogRegisterBuffer(state, *newbuf, GENERIC_XLOG_FULL_IMAGE);
+		IvfflatInitPage(*newbuf, newpage);
+
+		IvfflatPageGetOpaque(page)->nextblkno = BufferGetBlockNumber(*newbuf);
+		rs->lastListPage = BufferGetBlockNumber(*newbuf);
+		page = newpage;
+		*lastPage = newpage;
+	}
+
+	offno = PageAddItem(page, (Item) list, listSize, InvalidOffsetNumber, false, false);
+	if (offno == InvalidOffsetNumber)
+		elog(ERROR, "failed to add index item to \"%s\"", RelationGetRelationName(rs->index));
+
+	rl->listInfo.blkno = rs->lastListPage;
+	rl->listInfo.offno = offno;
+	IvfflatPageGetMeta(metapage)->lists++;
+
+	pfree(list);
+}
+
+/*
+ * Compare block numbers
+ */
+static int
+CompareBlockNumbers(const void *a, const void *b)
+{
+	BlockNumber ba = *((const BlockNumber *) a);
+	BlockNumber bb = *((const BlockNumber *) b);
+
+	if (ba < bb)
+		return -1;
+	if (ba > bb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Get the position of a block
+ */
+static int
+FindBlock(BlockNumber *blknos, int numBlocks, BlockNumber blkno)
+{
+	for (int i = 0; i < numBlocks; i++)
+	{
+		if (blknos[i] == blkno)
+			return i;
+	}
+
+	elog(ERROR, "block not found");
+	return -1;
+}
+
+/*
+ * Point lists to their new chains in a single WAL record
+ *
+ * A list without a block number is appended, which needs the last list page
+ * (and a new list page if it is full). The metapage is always needed for
+ * the generation, which tells cached centers to reload.
+ */
+static void
+SwitchLists(RebalanceState * rs, RebalanceList * *lists, ListWriter * writers, int numLists)
+{
+	BlockNumber blknos[MAX_GENERIC_XLOG_PAGES];
+	Buffer		bufs[MAX_GENERIC_XLOG_PAGES];
+	Page		pages[MAX_GENERIC_XLOG_PAGES];
+	Buffer		newbuf = InvalidBuffer;
+	int			numBlocks = 0;
+	int			uniqueBlocks = 0;
+	GenericXLogState *state;
+
+	blknos[numBlocks++] = IVFFLAT_METAPAGE_BLKNO;
+	for (int i = 0; i < numLists; i++)
+	{
+		if (BlockNumberIsValid(lists[i]->listInfo.blkno))
+			blknos[numBlocks++] = lists[i]->listInfo.blkno;
+		else
+			blknos[numBlocks++] = rs->lastListPage;
+	}
+
+	/* Lock in block order */
+	qsort(blknos, numBlocks, sizeof(BlockNumber), CompareBlockNumbers);
+
+	for (int i = 0; i < numBlocks; i++)
+	{
+		if (uniqueBlocks == 0 || blknos[i] != blknos[uniqueBlocks - 1])
+			blknos[uniqueBlocks++] = blknos[i];
+	}
+	numBlocks = uniqueBlocks;
+
+	state = GenericXLogStart(rs->index);
+	for (int j = 0; j < numBlocks; j++)
+	{
+		bufs[j] = ReadBuffer(rs->index, blknos[j]);
+		LockBuffer(bufs[j], BUFFER_LOCK_EXCLUSIVE);
+		pages[j] = GenericXLogRegisterBuffer(state, bufs[j], 0);
+	}
+
+	/* Metapage is always first */
+	Assert(blknos[0] == IVFFLAT_METAPAGE_BLKNO);
+	IvfflatExtendMetaPage(pages[0]);
+	IvfflatPageGetMeta(pages[0])->generation++;
+
+	for (int i = 0; i < numLists; i++)
+	{
+		if (BlockNumberIsValid(lists[i]->listInfo.blkno))
+		{
+			int			j = FindBlock(blknos, numBlocks, lists[i]->listInfo.blkno);
+
+			SetList(pages[j], lists[i]->listInfo.offno, &writers[i]);
+		}
+		else
+		{
+			int			j = FindBlock(blknos, numBlocks, rs->lastListPage);
+
+			AppendList(rs, state, pages[0], &pages[j], &newbuf, &writers[i], lists[i]);
+		}
+	}
+
+	GenericXLogFinish(state);
+
+	for (int j = 0; j < numBlocks; j++)
+		UnlockReleaseBuffer(bufs[j]);
+
+	if (BufferIsValid(newbuf))
+		UnlockReleaseBuffer(newbuf);
+}
+
+/*
+ * Add old chains to the free list in a single WAL record
+ *
+ * Scans must not be able to read them
+ */
+static void
+FreeChains(RebalanceState * rs, BlockNumber *startPages, int numChains)
+{
+	Buffer		metabuf;
+	Buffer		bufs[MAX_GENERIC_XLOG_PAGES - 1];
+	Page		metapage;
+	IvfflatMetaPage metap;
+	GenericXLogState *state;
+
+	Assert(numChains < MAX_GENERIC_XLOG_PAGES);
+
+	metabuf = ReadBuffer(rs->index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(rs->index);
+	metapage = GenericXLogRegisterBuffer(state, metabuf, 0);
+	IvfflatExtendMetaPage(metapage);
+	metap = IvfflatPageGetMeta(metapage);
+
+	for (int i = 0; i < numChains; i++)
+	{
+		BlockNumber blkno = startPages[i];
+		Page		page;
+
+		/* Find the last page */
+		for (;;)
+		{
+			bufs[i] = ReadBuffer(rs->index, blkno);
+			LockBuffer(bufs[i], BUFFER_LOCK_EXCLUSIVE);
+			blkno = IvfflatPageGetOpaque(BufferGetPage(bufs[i]))->nextblkno;
+
+			if (!BlockNumberIsValid(blkno))
+				break;
+
+			UnlockReleaseBuffer(bufs[i]);
+		}
+
+		page = GenericXLogRegisterBuffer(state, bufs[i], 0);
+
+		/* Link to the next chain or the previous free pages */
+		if (i + 1 < numChains)
+			IvfflatPageGetOpaque(page)->nextblkno = startPages[i + 1];
+		else
+			IvfflatPageGetOpaque(page)->nextblkno = IvfflatFreeBlockIsValid(metap->freePage) ? metap->freePage : InvalidBlockNumber;
+	}
+
+	metap->freePage = startPages[0];
+
+	/* Commit */
+	GenericXLogFinish(state);
+	for (int i = 0; i < numChains; i++)
+		UnlockReleaseBuffer(bufs[i]);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/*
+ * Get the list whose center is closest to a list
+ */
+static int
+FindClosestList(RebalanceState * rs, int list, int exclude)
+{
+	Datum		center = PointerGetDatum(VectorArrayGet(rs->centers, list));
+	double		minDistance = DBL_MAX;
+	int			closest = -1;
+
+	for (int i = 0; i < rs->centers->length; i++)
+	{
+		double		distance;
+
+		if (i == list || i == exclude)
+			continue;
+
+		distance = DatumGetFloat8(FunctionCall2Coll(rs->procinfo, rs->collation, center, PointerGetDatum(VectorArrayGet(rs->centers, i))));
+
+		if (distance < minDistance)
+		{
+			minDistance = distance;
+			closest = i;
+		}
+	}
+
+	return closest;
+}
+
+/*
+ * Split a list in two
+ *
+ * The second half goes to a new list, or replaces a small list that is
+ * merged into its closest list
+ */
+static bool
+SplitList(RebalanceState * rs, int split, int merge)
+{
+	Relation	index = rs->index;
+	RebalanceList *lists[3];
+	ListWriter	writers[3];
+	BlockNumber oldChains[3];
+	int			numOldChains = 0;
+	int			numLists = 2;
+	int			into = -1;
+	int			target;
+	VectorArray samples;
+	VectorArray newCenters;
+	int64		numSamples;
+	Size		itemsize = rs->centers->itemsize;
+	Size		maxSamples = (Size) maintenance_work_mem * 1024L / itemsize;
+
+	/* Stay within maintenance_work_mem */
+	numSamples = Min(rs->lists[split].count, IVFFLAT_REBALANCE_SAMPLES);
+	if ((Size) numSamples > maxSamples)
+		numSamples = maxSamples;
+
+	if (numSamples < 2)
+		return false;
+
+	if (merge >= 0)
+		into = FindClosestList(rs, merge, split);
+
+	/* Otherwise, add a list */
+	if (into < 0 && rs->centers->length == rs->maxLists)
+		return false;
+
+	/* Sample the list */
+	samples = VectorArrayInit(numSamples, rs->dimensions, itemsize);
+	SampleList(rs, rs->lists[split].startPage, samples);
+
+	if (samples->length < 2)
+	{
+		VectorArrayFree(samples);
+		return false;
+	}
+
+	newCenters = VectorArrayInit(2, rs->dimensions, itemsize);
+	IvfflatMiniBatchKmeans(index, samples, newCenters, rs->typeInfo);
+	VectorArrayFree(samples);
+
+	if (into >= 0)
+		target = merge;
+	else
+	{
+		target = rs->centers->length;
+		rs->lists[target].listInfo.blkno = InvalidBlockNumber;
+		rs->lists[target].startPage = InvalidBlockNumber;
+	}
+
+	lists[0] = &rs->lists[split];
+	lists[1] = &rs->lists[target];
+	InitListWriter(rs, &writers[0], VectorArrayGet(newCenters, 0));
+	InitListWriter(rs, &writers[1], VectorArrayGet(newCenters, 1));
+	CopyListItems(rs, rs->lists[split].startPage, writers, 2);
+
+	if (into >= 0)
+	{
+		lists[2] = &rs->lists[into];
+		InitListWriter(rs, &writers[2], VectorArrayGet(rs->centers, into));
+		CopyListItems(rs, rs->lists[into].startPage, &writers[2], 1);
+		CopyListItems(rs, rs->lists[merge].startPage, &writers[2], 1);
+		numLists++;
+	}
+
+	for (int i = 0; i < numLists; i++)
+		FinishListWriter(&writers[i]);
+
+	SwitchLists(rs, lists, writers, numLists);
+
+	/* No scan can be reading the old chains, since the index is locked */
+	for (int i = 0; i < numLists; i++)
+	{
+		if (BlockNumberIsValid(lists[i]->startPage))
+			oldChains[numOldChains++] = lists[i]->startPage;
+	}
+	if (numOldChains > 0)
+		FreeChains(rs, oldChains, numOldChains);
+
+	/* Update in-memory lists */
+	if (target == rs->centers->length)
+		rs->centers->length++;
+
+	for (int i = 0; i < numLists; i++)
+	{
+		lists[i]->startPage = writers[i].startPage;
+		lists[i]->count = writers[i].stats.count;
+		lists[i]->changed = true;
+	}
+
+	VectorArraySet(rs->centers, split, VectorArrayGet(newCenters, 0));
+	VectorArraySet(rs->centers, target, VectorArrayGet(newCenters, 1));
+	VectorArrayFree(newCenters);
+
+	return true;
+}
+
+/*
+ * Compare lists by count
+ */
+static int
+CompareListCounts(const void *a, const void *b, void *arg)
+{
+	RebalanceList *lists = (RebalanceList *) arg;
+	int64		ca = lists[*((const int *) a)].count;
+	int64		cb = lists[*((const int *) b)].count;
+
+	if (ca < cb)
+		return -1;
+	if (ca > cb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Split large lists and merge small lists
+ */
+static int
+RebalanceLists(RebalanceState * rs, double splitFactor, double mergeFactor)
+{
+	int			numLists = rs->centers->length;
+	int		   *order = palloc(sizeof(int) * numLists);
+	int64		total = 0;
+	double		average;
+	int			smallest = 0;
+	int			splits = 0;
+
+	for (int i = 0; i < numLists; i++)
+	{
+		order[i] = i;
+		total += rs->lists[i].count;
+	}
+
+	if (total == 0)
+		return 0;
+
+	average = (double) total / numLists;
+
+	qsort_arg(order, numLists, sizeof(int), CompareListCounts, rs->lists);
+
+	/* Split the largest lists first */
+	for (int largest = numLists - 1; largest >= 0; largest--)
+	{
+		int			split = order[largest];
+		int			merge = -1;
+
+		if (rs->lists[split].count <= splitFactor * average)
+			break;
+
+		/* Merge the smallest list that has not changed */
+		while (smallest < largest && merge < 0)
+		{
+			int			i = order[smallest++];
+
+			if (rs->lists[i].count >= mergeFactor * average)
+				smallest = largest;
+			else if (!rs->lists[i].changed)
+				merge = i;
+		}
+
+		if (SplitList(rs, split, merge))
+			splits++;
+	}
+
+	pfree(order);
+
+	return splits;
+}
+
+/*
+ * Rebalance the lists of an index without rebuilding it
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(ivfflat_rebalance);
+Datum
+ivfflat_rebalance(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	double		splitFactor = PG_GETARG_FLOAT8(1);
+	double		mergeFactor = PG_GETARG_FLOAT8(2);
+	Oid			heapOid;
+	Relation	heap;
+	Relation	index;
+	RebalanceState rs;
+	int			lists;
+	int			splits;
+
+	if (!(splitFactor > 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("split_factor must be greater than 1")));
+
+	if (!(mergeFactor >= 0 && mergeFactor < 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("merge_factor must be between 0 and 1")));
+
+	heapOid = IndexGetRelation(indexOid, true);
+	if (!OidIsValid(heapOid))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", get_rel_name(indexOid))));
+
+	/*
+	 * Conflicts with vacuum and other rebalances. Block scans and inserts
+	 * on the index, since a scan that reads lists before and after a switch
+	 * could see a row twice or miss it. Take the strongest lock up front,
+	 * since upgrading it later can deadlock.
+	 */
+	heap = table_open(heapOid, ShareUpdateExclusiveLock);
+	index = index_open(indexOid, AccessExclusiveLock);
+
+	if (index->rd_indam->ambuild != ivfflatbuild)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an ivfflat index", RelationGetRelationName(index))));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexOid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexOid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(index));
+
+	if (RELATION_IS_OTHER_TEMP(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot rebalance temporary indexes of other sessions")));
+
+	/* Ensure index is valid */
+	IvfflatGetMetaPageInfo(index, &lists, &rs.dimensions, NULL);
+
+	rs.index = index;
+	rs.typeInfo = IvfflatGetTypeInfo(index);
+	rs.tupdesc = RelationGetDescr(index);
+	rs.procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	rs.normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
+	rs.kmeansnormprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_KMEANS_NORM_PROC);
+	rs.collation = index->rd_indcollation[0];
+
+	/* Each split adds at most one list */
+	rs.maxLists = Min(lists * 2, IVFFLAT_MAX_LISTS);
+	rs.lists = palloc(sizeof(RebalanceList) * rs.maxLists);
+	rs.centers = VectorArrayInit(rs.maxLists, rs.dimensions, rs.typeInfo->itemSize(rs.dimensions));
+	rs.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+									  "Ivfflat rebalance temporary context",
+									  ALLOCSET_DEFAULT_SIZES);
+
+	LoadLists(&rs);
+	splits = RebalanceLists(&rs, splitFactor, mergeFactor);
+
+	/* Reload cached centers */
+	if (splits > 0)
+		CacheInvalidateRelcache(index);
+
+	MemoryContextDelete(rs.tmpCtx);
+	VectorArrayFree(rs.centers);
+	pfree(rs.lists);
+
+	index_close(index, NoLock);
+	table_close(heap, NoLock);
+
+	PG_RETURN_INT32(splits);
+}
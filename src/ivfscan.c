@@ -5,6 +5,7 @@
 #include "access/relscan.h"
 #include "catalog/pg_operator_d.h"
 #include "catalog/pg_type_d.h"
+#include "executor/executor.h"
 #include "lib/pairingheap.h"
 #include "ivfflat.h"
 #include "miscadmin.h"
@@ -30,6 +31,135 @@ CompareLists(const pairingheap_node *a, const pairingheap_node *b, void *arg)
 	return 0;
 }
 
+/*
+ * Add list to heap if among closest
+ */
+static inline void
+AddScanList(IvfflatScanOpaque so, BlockNumber startPage, double distance, float radius, int *listCount, double *maxDistance)
+{
+	if (*listCount < so->maxProbes)
+	{
+		IvfflatScanList *scanlist;
+
+		scanlist = &so->lists[*listCount];
+		scanlist->startPage = startPage;
+		scanlist->distance = distance;
+		scanlist->radius = radius;
+		(*listCount)++;
+
+		/* Add to heap */
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Calculate max distance */
+		if (*listCount == so->maxProbes)
+			*maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
+	}
+	else if (distance < *maxDistance)
+	{
+		IvfflatScanList *scanlist;
+
+		/* Remove */
+		scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+
+		/* Reuse */
+		scanlist->startPage = startPage;
+		scanlist->distance = distance;
+		scanlist->radius = radius;
+		pairingheap_add(so->listQueue, &scanlist->ph_node);
+
+		/* Update max distance */
+		*maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
+	}
+}
+
+/*
+ * Get lists from cached centers
+ */
+static void
+GetCachedScanLists(IndexScanDesc scan, IvfflatCentroidCache * cache, Datum value, int *listCount, double *maxDistance)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	float	   *query = IvfflatCentroidCacheQuery(cache, so->typeInfo, value);
+
+	if (query != NULL)
+	{
+		for (int i = 0; i < cache->lists; i++)
+			AddScanList(so, cache->startPages[i], IvfflatCentroidCacheDistance(cache, query, i), -1, listCount, maxDistance);
+
+		pfree(query);
+	}
+	else
+	{
+		for (int i = 0; i < cache->lists; i++)
+		{
+			double		distance;
+
+			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(VectorArrayGet(cache->centers, i)), value));
+			AddScanList(so, cache->startPages[i], distance, -1, listCount, maxDistance);
+		}
+	}
+}
+
+/*
+ * Skip lists whose centers are much farther than the closest center
+ */
+static void
+AdaptProbes(IvfflatScanOpaque so)
+{
+	double		closest = IvfflatMetricDistance(so->procinfo, so->normprocinfo, so->listDistances[0]);
+	double		maxDistance = (1 + ivfflat_probe_distance_gap) * closest;
+	int			probes;
+
+	if (closest < 0)
+		return;
+
+	for (probes = 1; probes < so->nextProbes && probes < so->listCount; probes++)
+	{
+		if (IvfflatMetricDistance(so->procinfo, so->normprocinfo, so->listDistances[probes]) > maxDistance)
+			break;
+	}
+
+	/* Iterative scans can still probe the remaining lists */
+	so->nextProbes = probes;
+	if (!so->iterative)
+		so->listCount = probes;
+}
+
+/*
+ * Select lists that can have items within range
+ */
+static void
+SelectRangeLists(IvfflatScanOpaque so)
+{
+	int			listCount = 0;
+
+	for (int i = 0; i < so->listCount; i++)
+	{
+		/* Probe lists whose centers are within the range, and at least probes lists */
+		if (so->listRadii[i] < 0)
+		{
+			listCount = Min(so->probes, so->listCount);
+
+			while (listCount < so->listCount && IvfflatMetricDistance(so->procinfo, so->normprocinfo, so->listDistances[listCount]) <= so->rangeThreshold)
+				listCount++;
+
+			so->listCount = listCount;
+			return;
+		}
+	}
+
+	/* By the triangle inequality, other lists have no items within range */
+	for (int i = 0; i < so->listCount; i++)
+	{
+		double		distance = IvfflatMetricDistance(so->procinfo, so->normprocinfo, so->listDistances[i]);
+
+		if (distance - so->listRadii[i] <= so->rangeThreshold)
+			so->listPages[listCount++] = so->listPages[i];
+	}
+
+	so->listCount = listCount;
+}
+
 /*
  * Get lists and sort by distance
  */
@@ -40,6 +170,19 @@ GetScanLists(IndexScanDesc scan, Datum value)
 	BlockNumber nextblkno = IVFFLAT_HEAD_BLKNO;
 	int			listCount = 0;
 	double		maxDistance = DBL_MAX;
+	IvfflatCentroidCache *cache;
+
+	/* Skip list pages if centers are cached */
+	/* Range queries need current radii, which are not cached */
+	if (so->rangeQuery)
+		cache = NULL;
+	else
+		cache = IvfflatGetCentroidCache(scan->indexRelation, so->typeInfo, so->procinfo, so->numLists, so->dimensions, so->generation);
+	if (cache != NULL)
+	{
+		GetCachedScanLists(scan, cache, value, &listCount, &maxDistance);
+		nextblkno = InvalidBlockNumber;
+	}
 
 	/* Search all list pages */
 	while (BlockNumberIsValid(nextblkno))
@@ -57,42 +200,13 @@ GetScanLists(IndexScanDesc scan, Datum value)
 		for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
 		{
 			IvfflatList list = (IvfflatList) PageGetItem(cpage, PageGetItemId(cpage, offno));
+			IvfflatListStats stats = IvfflatGetListStats(cpage, offno);
 			double		distance;
 
 			/* Use procinfo from the index instead of scan key for performance */
 			distance = DatumGetFloat8(so->distfunc(so->procinfo, so->collation, PointerGetDatum(&list->center), value));
 
-			if (listCount < so->maxProbes)
-			{
-				IvfflatScanList *scanlist;
-
-				scanlist = &so->lists[listCount];
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				listCount++;
-
-				/* Add to heap */
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
-
-				/* Calculate max distance */
-				if (listCount == so->maxProbes)
-					maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
-			}
-			else if (distance < maxDistance)
-			{
-				IvfflatScanList *scanlist;
-
-				/* Remove */
-				scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
-
-				/* Reuse */
-				scanlist->startPage = list->startPage;
-				scanlist->distance = distance;
-				pairingheap_add(so->listQueue, &scanlist->ph_node);
-
-				/* Update max distance */
-				maxDistance = GetScanList(pairingheap_first(so->listQueue))->distance;
-			}
+			AddScanList(so, list->startPage, distance, stats != NULL ? stats->radius : -1, &listCount, &maxDistance);
 		}
 
 		nextblkno = IvfflatPageGetOpaque(cpage)->nextblkno;
@@ -101,9 +215,23 @@ GetScanLists(IndexScanDesc scan, Datum value)
 	}
 
 	for (int i = listCount - 1; i >= 0; i--)
-		so->listPages[i] = GetScanList(pairingheap_remove_first(so->listQueue))->startPage;
+	{
+		IvfflatScanList *scanlist = GetScanList(pairingheap_remove_first(so->listQueue));
+
+		so->listPages[i] = scanlist->startPage;
+		so->listDistances[i] = scanlist->distance;
+		so->listRadii[i] = scanlist->radius;
+	}
 
 	Assert(pairingheap_is_empty(so->listQueue));
+
+	so->listCount = listCount;
+	so->nextProbes = so->probes;
+
+	if (so->rangeQuery)
+		SelectRangeLists(so);
+	else if (ivfflat_probe_distance_gap > 0 && listCount > 0 && DatumGetPointer(value) != NULL)
+		AdaptProbes(so);
 }
 
 /*
@@ -120,7 +248,7 @@ GetScanItems(IndexScanDesc scan, Datum value)
 	tuplesort_reset(so->sortstate);
 
 	/* Search closest probes lists */
-	while (so->listIndex < so->maxProbes && (++batchProbes) <= so->probes)
+	while (so->listIndex < so->listCount && (++batchProbes) <= so->nextProbes)
 	{
 		BlockNumber searchPage = so->listPages[so->listIndex++];
 
@@ -168,6 +296,8 @@ GetScanItems(IndexScanDesc scan, Datum value)
 		}
 	}
 
+	so->nextProbes = so->probes;
+
 	tuplesort_performsort(so->sortstate);
 
 #if defined(IVFFLAT_MEMORY)
@@ -184,6 +314,27 @@ ZeroDistance(FmgrInfo *flinfo, Oid collation, Datum arg1, Datum arg2)
 	return Float8GetDatum(0.0);
 }
 
+/*
+ * Get the query and threshold from range query params
+ */
+static Datum
+GetRangeQueryValue(IvfflatScanOpaque so, Datum params)
+{
+	HeapTupleHeader tuple = DatumGetHeapTupleHeader(params);
+	Datum		threshold;
+	Datum		value;
+	bool		isnull[2];
+
+	threshold = GetAttributeByName(tuple, "threshold", &isnull[0]);
+	value = GetAttributeByName(tuple, "query", &isnull[1]);
+
+	if (isnull[0] || isnull[1])
+		elog(ERROR, "range query threshold and vector cannot be null");
+
+	so->rangeThreshold = DatumGetFloat4(threshold);
+	return PointerGetDatum(PG_DETOAST_DATUM(value));
+}
+
 /*
  * Get scan value
  */
@@ -191,18 +342,32 @@ static Datum
 GetScanValue(IndexScanDesc scan)
 {
 	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	ScanKey		key;
 	Datum		value;
 
-	if (scan->orderByData->sk_flags & SK_ISNULL)
+	/* Range queries have a where condition but no order */
+	so->rangeQuery = scan->orderByData == NULL;
+	key = so->rangeQuery ? scan->keyData : scan->orderByData;
+
+	if (key->sk_flags & SK_ISNULL)
 	{
 		value = PointerGetDatum(NULL);
 		so->distfunc = ZeroDistance;
 	}
 	else
 	{
-		value = scan->orderByData->sk_argument;
+		value = key->sk_argument;
 		so->distfunc = FunctionCall2Coll;
 
+		if (so->rangeQuery)
+		{
+			MemoryContext oldCtx = MemoryContextSwitchTo(so->tmpCtx);
+
+			value = GetRangeQueryValue(so, value);
+
+			MemoryContextSwitchTo(oldCtx);
+		}
+
 		/* Value should not be compressed or toasted */
 		Assert(!VARATT_IS_COMPRESSED(DatumGetPointer(value)));
 		Assert(!VARATT_IS_EXTENDED(DatumGetPointer(value)));
@@ -221,6 +386,80 @@ GetScanValue(IndexScanDesc scan)
 	return value;
 }
 
+/*
+ * Load items within range from the next page
+ */
+static void
+LoadRangePage(IndexScanDesc scan)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
+	/* Allow for rounding, since the executor rechecks the operator */
+	double		maxDistance = (double) so->rangeThreshold * so->rangeThreshold * (1 + 1e-5);
+	Buffer		buf;
+	Page		page;
+	OffsetNumber maxoffno;
+
+	so->rangeTidsLength = 0;
+	so->rangeTidsIndex = 0;
+
+	buf = ReadBufferExtended(scan->indexRelation, MAIN_FORKNUM, so->rangePage, RBM_NORMAL, so->bas);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoffno = PageGetMaxOffsetNumber(page);
+
+	for (OffsetNumber offno = FirstOffsetNumber; offno <= maxoffno; offno = OffsetNumberNext(offno))
+	{
+		IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, offno));
+		Datum		datum;
+		bool		isnull;
+
+		datum = index_getattr(itup, 1, tupdesc, &isnull);
+
+		/* Use procinfo from the index instead of scan key for performance */
+		if (DatumGetFloat8(so->distfunc(so->procinfo, so->collation, datum, so->value)) <= maxDistance)
+			so->rangeTids[so->rangeTidsLength++] = itup->t_tid;
+	}
+
+	so->rangePage = IvfflatPageGetOpaque(page)->nextblkno;
+
+	UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Get the next item within range
+ *
+ * Items are returned in list order without sorting
+ */
+static bool
+GetNextRangeItem(IndexScanDesc scan)
+{
+	IvfflatScanOpaque so = (IvfflatScanOpaque) scan->opaque;
+
+	while (so->rangeTidsIndex == so->rangeTidsLength)
+	{
+		if (!BlockNumberIsValid(so->rangePage))
+		{
+			if (so->listIndex == so->listCount)
+				return false;
+
+			so->rangePage = so->listPages[so->listIndex++];
+			continue;
+		}
+
+		/* Can take a while, so ensure we can interrupt */
+		CHECK_FOR_INTERRUPTS();
+
+		LoadRangePage(scan);
+	}
+
+	/* Only the first key is used, and the distance is not the operator */
+	scan->xs_heaptid = so->rangeTids[so->rangeTidsIndex++];
+	scan->xs_recheck = true;
+	scan->xs_recheckorderby = false;
+	return true;
+}
+
 /*
  * Initialize scan sort state
  */
@@ -245,16 +484,20 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	IvfflatScanOpaque so;
 	int			lists;
 	int			dimensions;
+	uint32		generation;
 	int			probes = ivfflat_probes;
 	int			maxProbes;
 	MemoryContext oldCtx;
 
 	scan = RelationGetIndexScan(index, nkeys, norderbys);
 
-	/* Get lists and dimensions from metapage */
-	IvfflatGetMetaPageInfo(index, &lists, &dimensions);
+	/* Get lists, dimensions, and generation from metapage */
+	IvfflatGetMetaPageInfo(index, &lists, &dimensions, &generation);
 
-	if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF)
+	/* Range queries can probe any list whose center is within range */
+	if (norderbys == 0)
+		maxProbes = lists;
+	else if (ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF)
 		maxProbes = Max(ivfflat_max_probes, probes);
 	else
 		maxProbes = probes;
@@ -270,7 +513,10 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 	so->first = true;
 	so->probes = probes;
 	so->maxProbes = maxProbes;
+	so->numLists = lists;
 	so->dimensions = dimensions;
+	so->generation = generation;
+	so->iterative = ivfflat_iterative_scan != IVFFLAT_ITERATIVE_SCAN_OFF;
 
 	/* Set support functions */
 	so->procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
@@ -304,9 +550,20 @@ ivfflatbeginscan(Relation index, int nkeys, int norderbys)
 
 	so->listQueue = pairingheap_allocate(CompareLists, scan);
 	so->listPages = palloc(maxProbes * sizeof(BlockNumber));
+	so->listDistances = palloc(maxProbes * sizeof(double));
+	so->listRadii = palloc(maxProbes * sizeof(float));
+	so->listCount = 0;
 	so->listIndex = 0;
+	so->nextProbes = probes;
 	so->lists = palloc(maxProbes * sizeof(IvfflatScanList));
 
+	so->rangeQuery = false;
+	so->rangeThreshold = 0;
+	so->rangePage = InvalidBlockNumber;
+	so->rangeTids = palloc(MaxIndexTuplesPerPage * sizeof(ItemPointerData));
+	so->rangeTidsLength = 0;
+	so->rangeTidsIndex = 0;
+
 	MemoryContextSwitchTo(oldCtx);
 
 	scan->opaque = so;
@@ -325,6 +582,9 @@ ivfflatrescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int
 	so->first = true;
 	pairingheap_reset(so->listQueue);
 	so->listIndex = 0;
+	so->rangePage = InvalidBlockNumber;
+	so->rangeTidsLength = 0;
+	so->rangeTidsIndex = 0;
 
 	if (keys && scan->numberOfKeys > 0)
 		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
@@ -357,8 +617,8 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 		pgstat_count_index_scan(scan->indexRelation);
 
 		/* Safety check */
-		if (scan->orderByData == NULL)
-			elog(ERROR, "cannot scan ivfflat index without order");
+		if (scan->orderByData == NULL && scan->keyData == NULL)
+			elog(ERROR, "cannot scan ivfflat index without order or where condition");
 
 		/* Requires MVCC-compliant snapshot as not able to pin during sorting */
 		/* https://www.postgresql.org/docs/current/index-locking.html */
@@ -366,15 +626,25 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 			elog(ERROR, "non-MVCC snapshots are not supported with ivfflat");
 
 		value = GetScanValue(scan);
-		IvfflatBench("GetScanLists", GetScanLists(scan, value));
-		IvfflatBench("GetScanItems", GetScanItems(scan, value));
 		so->first = false;
 		so->value = value;
+
+		/* Range operator is strict */
+		if (so->rangeQuery && DatumGetPointer(value) == NULL)
+			so->listCount = 0;
+		else
+			IvfflatBench("GetScanLists", GetScanLists(scan, value));
+
+		if (!so->rangeQuery)
+			IvfflatBench("GetScanItems", GetScanItems(scan, value));
 	}
 
+	if (so->rangeQuery)
+		return GetNextRangeItem(scan);
+
 	while (!tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
 	{
-		if (so->listIndex == so->maxProbes)
+		if (so->listIndex == so->listCount)
 			return false;
 
 		IvfflatBench("GetScanItems", GetScanItems(scan, so->value));
@@ -383,7 +653,8 @@ ivfflatgettuple(IndexScanDesc scan, ScanDirection dir)
 	heaptid = (ItemPointer) DatumGetPointer(slot_getattr(so->mslot, 2, &isnull));
 
 	scan->xs_heaptid = *heaptid;
-	scan->xs_recheck = false;
+	/* Where conditions are not applied when ordering */
+	scan->xs_recheck = scan->numberOfKeys > 0;
 	scan->xs_recheckorderby = false;
 	return true;
 }
@@ -399,7 +670,7 @@ GetBitmapScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value)
 	tuplesort_reset(so->sortstate);
 
 	/* Search closest probes lists */
-	while (so->listIndex < so->maxProbes && (++batchProbes) <= so->probes)
+	while (so->listIndex < so->listCount && (++batchProbes) <= so->nextProbes)
 	{
 		BlockNumber searchPage = so->listPages[so->listIndex++];
 
@@ -451,6 +722,8 @@ GetBitmapScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value)
 		}
 	}
 
+	so->nextProbes = so->probes;
+
 	tuplesort_performsort(so->sortstate);
 
 #if defined(IVFFLAT_MEMORY)
@@ -496,7 +769,7 @@ ivfflatbitmapsearch(itempointer_hash* bitmap, IndexScanDesc scan, ScanDirection
 
 	while (!tuplesort_gettupleslot(so->sortstate, true, false, so->mslot, NULL))
 	{
-		if (so->listIndex == so->maxProbes)
+		if (so->listIndex == so->listCount)
 			return false;
 
 		IvfflatBench("GetBitmapScanItems", GetBitmapScanItems(bitmap, scan, so->value));
@@ -521,7 +794,7 @@ GetPushDownScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value,
 	tuplesort_reset(so->sortstate);
 
 	/* Search closest probes lists */
-	while (so->listIndex < so->maxProbes && (++batchProbes) <= so->probes)
+	while (so->listIndex < so->listCount && (++batchProbes) <= so->nextProbes)
 	{
 		BlockNumber searchPage = so->listPages[so->listIndex++];
 
@@ -573,6 +846,8 @@ GetPushDownScanItems(itempointer_hash* bitmap, IndexScanDesc scan, Datum value,
 		}
 	}
 
+	so->nextProbes = so->probes;
+
 	tuplesort_performsort(so->sortstate);
 
 #if defined(IVFFLAT_MEMORY)
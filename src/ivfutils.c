@@ -1,5 +1,8 @@
 #include "postgres.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "access/generic_xlog.h"
 #include "bitvec.h"
 #include "catalog/pg_type.h"
@@ -8,6 +11,7 @@
 #include "halfvec.h"
 #include "ivfflat.h"
 #include "storage/bufmgr.h"
+#include "storage/lmgr.h"
 
 /*
  * Allocate a vector array
@@ -94,6 +98,65 @@ IvfflatNewBuffer(Relation index, ForkNumber forkNum)
 	return buf;
 }
 
+/*
+ * Extend the metapage to the current fields
+ *
+ * Older metapages end before newer fields, and generic WAL does not keep
+ * changes past pd_lower
+ */
+void
+IvfflatExtendMetaPage(Page page)
+{
+	IvfflatMetaPage metap = IvfflatPageGetMeta(page);
+
+	((PageHeader) page)->pd_lower =
+		((char *) metap + sizeof(IvfflatMetaPageData)) - (char *) page;
+}
+
+/*
+ * New buffer for an entry page, reusing a free page if possible
+ *
+ * A reused page leaves the free list in its own WAL record, so a crash
+ * before it is linked leaks it, like a page added by extension
+ */
+Buffer
+IvfflatNewEntryBuffer(Relation index)
+{
+	Buffer		metabuf;
+	Buffer		buf;
+	Page		page;
+	IvfflatMetaPage metap;
+	GenericXLogState *state;
+
+	metabuf = ReadBuffer(index, IVFFLAT_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	metap = IvfflatPageGetMeta(BufferGetPage(metabuf));
+
+	if (!IvfflatFreeBlockIsValid(metap->freePage))
+	{
+		UnlockReleaseBuffer(metabuf);
+
+		LockRelationForExtension(index, ExclusiveLock);
+		buf = IvfflatNewBuffer(index, MAIN_FORKNUM);
+		UnlockRelationForExtension(index, ExclusiveLock);
+
+		return buf;
+	}
+
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, metabuf, 0);
+	IvfflatExtendMetaPage(page);
+	metap = IvfflatPageGetMeta(page);
+
+	buf = ReadBuffer(index, metap->freePage);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	metap->freePage = IvfflatPageGetOpaque(BufferGetPage(buf))->nextblkno;
+
+	IvfflatCommitBuffer(metabuf, state);
+
+	return buf;
+}
+
 /*
  * Init page
  */
@@ -159,7 +222,7 @@ IvfflatAppendPage(Relation index, Buffer *buf, Page *page, GenericXLogState **st
  * Get the metapage info
  */
 void
-IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
+IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions, uint32 *generation)
 {
 	Buffer		buf;
 	Page		page;
@@ -179,6 +242,9 @@ IvfflatGetMetaPageInfo(Relation index, int *lists, int *dimensions)
 	if (dimensions != NULL)
 		*dimensions = metap->dimensions;
 
+	if (generation != NULL)
+		*generation = metap->generation;
+
 	UnlockReleaseBuffer(buf);
 }
 
@@ -229,6 +295,154 @@ IvfflatUpdateList(Relation index, ListInfo listInfo,
 	}
 }
 
+/*
+ * Get the stats of a list, or NULL if the list does not have them
+ */
+IvfflatListStats
+IvfflatGetListStats(Page page, OffsetNumber offno)
+{
+	ItemId		itemid = PageGetItemId(page, offno);
+	IvfflatList list = (IvfflatList) PageGetItem(page, itemid);
+	Size		offset = IVFFLAT_LIST_STATS_OFFSET(list);
+
+	if (ItemIdGetLength(itemid) < offset + sizeof(IvfflatListStatsData))
+		return NULL;
+
+	return (IvfflatListStats) ((char *) list + offset);
+}
+
+/*
+ * Add to the stats of a list
+ *
+ * The count is added and the radius can only grow
+ */
+void
+IvfflatUpdateListStats(Relation index, ListInfo listInfo, IvfflatListStats stats, ForkNumber forkNum)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	IvfflatListStats listStats;
+
+	buf = ReadBufferExtended(index, forkNum, listInfo.blkno, RBM_NORMAL, NULL);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	listStats = IvfflatGetListStats(page, listInfo.offno);
+
+	/* Lists from older indexes do not have stats */
+	if (listStats == NULL)
+	{
+		GenericXLogAbort(state);
+		UnlockReleaseBuffer(buf);
+		return;
+	}
+
+	listStats->count += stats->count;
+	listStats->radius = Max(listStats->radius, stats->radius);
+
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Grow the radius of a list for an inserted item
+ *
+ * The stats are read under a share lock, so inserts only write the list page
+ * when the radius grows. Counts are not updated, and vacuum refreshes them.
+ */
+void
+IvfflatGrowListRadius(Relation index, ListInfo listInfo, float radius)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	IvfflatListStats listStats;
+	bool		grows;
+
+	buf = ReadBuffer(index, listInfo.blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	listStats = IvfflatGetListStats(BufferGetPage(buf), listInfo.offno);
+
+	/* Lists from older indexes do not have stats */
+	grows = listStats != NULL && radius > listStats->radius;
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+	if (!grows)
+	{
+		ReleaseBuffer(buf);
+		return;
+	}
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	listStats = IvfflatGetListStats(page, listInfo.offno);
+
+	/* Check again since the lock was released */
+	if (radius <= listStats->radius)
+	{
+		GenericXLogAbort(state);
+		UnlockReleaseBuffer(buf);
+		return;
+	}
+
+	listStats->radius = radius;
+
+	IvfflatCommitBuffer(buf, state);
+}
+
+/*
+ * Check if list distances can be converted to a metric
+ */
+bool
+IvfflatHasMetricDistance(FmgrInfo *procinfo, FmgrInfo *normprocinfo)
+{
+	/* Inner product is only a metric for unit vectors */
+	return IvfflatGetCacheDistance(procinfo) != IVFFLAT_CACHE_DISTANCE_IP || normprocinfo != NULL;
+}
+
+/*
+ * Convert a list distance to a metric distance
+ *
+ * Returns a negative value if the distance does not satisfy the
+ * triangle inequality
+ */
+double
+IvfflatMetricDistance(FmgrInfo *procinfo, FmgrInfo *normprocinfo, double distance)
+{
+	if (!IvfflatHasMetricDistance(procinfo, normprocinfo))
+		return -1;
+
+	switch (IvfflatGetCacheDistance(procinfo))
+	{
+		case IVFFLAT_CACHE_DISTANCE_L2:
+			return sqrt(distance);
+		case IVFFLAT_CACHE_DISTANCE_IP:
+			/* Chord distance between unit vectors for cosine */
+			return sqrt(Max(2 + 2 * distance, 0));
+		default:
+			/* Hamming and Jaccard distance */
+			return distance;
+	}
+}
+
+/*
+ * Round a metric distance up to a radius
+ */
+float
+IvfflatRadius(double distance)
+{
+	float		radius = (float) distance;
+
+	if (distance < 0)
+		return -1;
+
+	if (radius < distance)
+		radius = nextafterf(radius, FLT_MAX);
+
+	return radius;
+}
+
 PGDLLEXPORT Datum l2_normalize(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum halfvec_l2_normalize(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum sparsevec_l2_normalize(PG_FUNCTION_ARGS);
@@ -4,11 +4,66 @@
 #include "commands/vacuum.h"
 #include "ivfflat.h"
 #include "storage/bufmgr.h"
+#include "utils/memutils.h"
 
 #if PG_VERSION_NUM >= 180000
 #define vacuum_delay_point() vacuum_delay_point(false)
 #endif
 
+/* An entry page of a list and its last offset after deletes */
+typedef struct IvfflatVacuumPage
+{
+	BlockNumber blkno;
+	OffsetNumber maxoffno;
+}			IvfflatVacuumPage;
+
+/*
+ * Replace the stats of a list
+ *
+ * Inserts only write the list page when the radius grows, so inserts made
+ * during the scan are found by checking the entry pages again while the list
+ * page is locked. Inserts after that see the new radius. The radius is only
+ * replaced when there were none.
+ */
+static void
+ReplaceListStats(Relation index, ListInfo listInfo, IvfflatListStats stats, IvfflatVacuumPage * pages, int npages, BufferAccessStrategy bas)
+{
+	Buffer		buf;
+	Page		page;
+	GenericXLogState *state;
+	IvfflatListStats listStats;
+	bool		inserted = false;
+
+	buf = ReadBuffer(index, listInfo.blkno);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	listStats = IvfflatGetListStats(page, listInfo.offno);
+
+	for (int i = 0; i < npages && !inserted; i++)
+	{
+		Buffer		ebuf;
+		Page		epage;
+
+		ebuf = ReadBufferExtended(index, MAIN_FORKNUM, pages[i].blkno, RBM_NORMAL, bas);
+		LockBuffer(ebuf, BUFFER_LOCK_SHARE);
+		epage = BufferGetPage(ebuf);
+
+		/* Inserts add offsets or pages */
+		if (PageGetMaxOffsetNumber(epage) > pages[i].maxoffno)
+			inserted = true;
+		else if (i == npages - 1 && BlockNumberIsValid(IvfflatPageGetOpaque(epage)->nextblkno))
+			inserted = true;
+
+		UnlockReleaseBuffer(ebuf);
+	}
+
+	listStats->count = stats->count;
+	listStats->radius = inserted ? Max(listStats->radius, stats->radius) : stats->radius;
+
+	IvfflatCommitBuffer(buf, state);
+}
+
 /*
  * Bulk delete tuples from the index
  */
@@ -19,6 +74,16 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 	Relation	index = info->index;
 	BlockNumber blkno = IVFFLAT_HEAD_BLKNO;
 	BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+	FmgrInfo   *procinfo = index_getprocinfo(index, 1, IVFFLAT_DISTANCE_PROC);
+	FmgrInfo   *normprocinfo = IvfflatOptionalProcInfo(index, IVFFLAT_NORM_PROC);
+	Oid			collation = index->rd_indcollation[0];
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	bool		hasRadius = IvfflatHasMetricDistance(procinfo, normprocinfo);
+	int			maxpages = 64;
+	IvfflatVacuumPage *pages = palloc(sizeof(IvfflatVacuumPage) * maxpages);
+	MemoryContext tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+												 "Ivfflat vacuum temporary context",
+												 ALLOCSET_DEFAULT_SIZES);
 
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
@@ -32,11 +97,15 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 		OffsetNumber cmaxoffno;
 		BlockNumber listPages[MaxOffsetNumber];
 		ListInfo	listInfo;
+		PGAlignedBlock listCopy;
 
 		cbuf = ReadBuffer(index, blkno);
 		LockBuffer(cbuf, BUFFER_LOCK_SHARE);
 		cpage = BufferGetPage(cbuf);
 
+		/* Keep centers and stats after the lock is released */
+		memcpy(listCopy.data, cpage, BLCKSZ);
+
 		cmaxoffno = PageGetMaxOffsetNumber(cpage);
 
 		/* Iterate over lists */
@@ -56,6 +125,13 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 		{
 			BlockNumber searchPage = listPages[coffno - FirstOffsetNumber];
 			BlockNumber insertPage = InvalidBlockNumber;
+			IvfflatList list = (IvfflatList) PageGetItem((Page) listCopy.data, PageGetItemId((Page) listCopy.data, coffno));
+			IvfflatListStats oldStats = IvfflatGetListStats((Page) listCopy.data, coffno);
+			IvfflatListStatsData newStats;
+			int			npages = 0;
+
+			newStats.count = 0;
+			newStats.radius = hasRadius ? 0 : -1;
 
 			/* Iterate over entry pages */
 			while (BlockNumberIsValid(searchPage))
@@ -98,7 +174,27 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 						stats->tuples_removed++;
 					}
 					else
+					{
 						stats->num_index_tuples++;
+
+						if (oldStats != NULL)
+						{
+							newStats.count++;
+
+							if (hasRadius)
+							{
+								MemoryContext oldCtx = MemoryContextSwitchTo(tmpCtx);
+								bool		isnull;
+								Datum		value = PointerGetDatum(PG_DETOAST_DATUM(index_getattr(itup, 1, tupdesc, &isnull)));
+								double		distance = DatumGetFloat8(FunctionCall2Coll(procinfo, collation, value, PointerGetDatum(&list->center)));
+
+								newStats.radius = Max(newStats.radius, IvfflatRadius(IvfflatMetricDistance(procinfo, normprocinfo, distance)));
+
+								MemoryContextSwitchTo(oldCtx);
+								MemoryContextReset(tmpCtx);
+							}
+						}
+					}
 				}
 
 				/* Set to first free page */
@@ -117,6 +213,20 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 				else
 					GenericXLogAbort(state);
 
+				/* Remember pages to check for concurrent inserts */
+				if (oldStats != NULL)
+				{
+					if (npages == maxpages)
+					{
+						maxpages *= 2;
+						pages = repalloc(pages, sizeof(IvfflatVacuumPage) * maxpages);
+					}
+
+					pages[npages].blkno = BufferGetBlockNumber(buf);
+					pages[npages].maxoffno = PageGetMaxOffsetNumber(BufferGetPage(buf));
+					npages++;
+				}
+
 				UnlockReleaseBuffer(buf);
 			}
 
@@ -131,10 +241,19 @@ ivfflatbulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
 				listInfo.offno = coffno;
 				IvfflatUpdateList(index, listInfo, insertPage, InvalidBlockNumber, InvalidBlockNumber, MAIN_FORKNUM);
 			}
+
+			/* Replace stats, which may be stale after deletes */
+			if (oldStats != NULL)
+			{
+				listInfo.offno = coffno;
+				ReplaceListStats(index, listInfo, &newStats, pages, npages, bas);
+			}
 		}
 	}
 
 	FreeAccessStrategy(bas);
+	MemoryContextDelete(tmpCtx);
+	pfree(pages);
 
 	return stats;
 }
@@ -0,0 +1,213 @@
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/relscan.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/index.h"
+#include "executor/executor.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "hnsw.h"
+#include "ivfflat.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+typedef struct KnnBatchResult
+{
+	ItemPointerData tid;
+	double		distance;
+}			KnnBatchResult;
+
+/*
+ * Compare result distances
+ */
+static int
+CompareKnnBatchResults(const void *a, const void *b)
+{
+	const		KnnBatchResult *ra = (const KnnBatchResult *) a;
+	const		KnnBatchResult *rb = (const KnnBatchResult *) b;
+
+	if (ra->distance < rb->distance)
+		return -1;
+
+	if (ra->distance > rb->distance)
+		return 1;
+
+	return ItemPointerCompare((ItemPointer) &ra->tid, (ItemPointer) &rb->tid);
+}
+
+/*
+ * Find the nearest rows for many query vectors with one index scan
+ *
+ * The scan is rescanned for each query, so pinned pages, the metapage, and
+ * cached upper layers or centers are shared between queries
+ */
+FUNCTION_PREFIX PG_FUNCTION_INFO_V1(vector_knn_batch);
+Datum
+vector_knn_batch(PG_FUNCTION_ARGS)
+{
+	Oid			indexOid = PG_GETARG_OID(0);
+	ArrayType  *queries = PG_GETARG_ARRAYTYPE_P(1);
+	int32		k = PG_GETARG_INT32(2);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldCtx;
+	Oid			heapOid;
+	Relation	heap;
+	Relation	index;
+	AttrNumber	attnum;
+	Oid			opcintype;
+	Oid			collation;
+	Oid			op;
+	RegProcedure opfunc;
+	FmgrInfo	distinfo;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Datum	   *values;
+	bool	   *nulls;
+	int			nqueries;
+	IndexScanDesc scan;
+	TupleTableSlot *slot;
+	KnnBatchResult *results;
+	int			maxResults;
+	AclResult	aclresult;
+
+	if (k <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("k must be greater than 0")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	heapOid = IndexGetRelation(indexOid, true);
+	if (!OidIsValid(heapOid))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw or ivfflat index", get_rel_name(indexOid))));
+
+	heap = table_open(heapOid, AccessShareLock);
+	index = index_open(indexOid, AccessShareLock);
+
+	if (index->rd_indam->ambuild != hnswbuild && index->rd_indam->ambuild != ivfflatbuild)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not an hnsw or ivfflat index", RelationGetRelationName(index))));
+
+	aclresult = pg_class_aclcheck(heapOid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, OBJECT_TABLE, RelationGetRelationName(heap));
+
+	/* Distances are computed from the heap column */
+	attnum = index->rd_index->indkey.values[0];
+	if (attnum == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("expression indexes are not supported")));
+
+	opcintype = index->rd_opcintype[0];
+	if (ARR_ELEMTYPE(queries) != opcintype)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("queries must have the same type as the index")));
+
+	/* Use the ordering operator of the operator class */
+	op = get_opfamily_member(index->rd_opfamily[0], opcintype, opcintype, 1);
+	if (!OidIsValid(op))
+		elog(ERROR, "missing ordering operator for index \"%s\"", RelationGetRelationName(index));
+
+	opfunc = get_opcode(op);
+	fmgr_info(opfunc, &distinfo);
+	collation = index->rd_indcollation[0];
+
+	get_typlenbyvalalign(opcintype, &typlen, &typbyval, &typalign);
+	deconstruct_array(queries, opcintype, typlen, typbyval, typalign, &values, &nulls, &nqueries);
+
+	/* Materialize results */
+	oldCtx = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldCtx);
+
+	/* Candidates in approximate order are reranked, up to ef_search */
+	maxResults = Max(k, hnsw_ef_search);
+	results = palloc(sizeof(KnnBatchResult) * maxResults);
+	slot = table_slot_create(heap, NULL);
+
+#if PG_VERSION_NUM >= 180000
+	scan = index_beginscan(heap, index, GetActiveSnapshot(), NULL, 0, 1);
+#else
+	scan = index_beginscan(heap, index, GetActiveSnapshot(), 0, 1);
+#endif
+
+	for (int i = 0; i < nqueries; i++)
+	{
+		ScanKeyData orderby;
+		int			count = 0;
+		int			limit = k;
+
+		if (nulls[i])
+			continue;
+
+		ScanKeyEntryInitialize(&orderby, SK_ORDER_BY, 1, 1, InvalidOid, collation, opfunc, values[i]);
+		index_rescan(scan, NULL, 0, &orderby, 1);
+
+		while (count < limit && index_getnext_slot(scan, ForwardScanDirection, slot))
+		{
+			bool		isnull;
+			Datum		value = slot_getattr(slot, attnum, &isnull);
+
+			if (isnull)
+				continue;
+
+			results[count].tid = slot->tts_tid;
+			results[count].distance = DatumGetFloat8(FunctionCall2Coll(&distinfo, collation, value, values[i]));
+			count++;
+
+			/* Scans with quantization return candidates in approximate order */
+			if (scan->xs_recheckorderby)
+				limit = maxResults;
+		}
+
+		/* Keep the nearest by exact distance */
+		qsort(results, count, sizeof(KnnBatchResult), CompareKnnBatchResults);
+		count = Min(count, k);
+
+		for (int j = 0; j < count; j++)
+		{
+			Datum		outValues[3];
+			bool		outNulls[3] = {false, false, false};
+
+			outValues[0] = Int32GetDatum(i + 1);
+			outValues[1] = PointerGetDatum(&results[j].tid);
+			outValues[2] = Float8GetDatum(results[j].distance);
+			tuplestore_putvalues(tupstore, tupdesc, outValues, outNulls);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	index_endscan(scan);
+	ExecDropSingleTupleTableSlot(slot);
+
+	index_close(index, AccessShareLock);
+	table_close(heap, AccessShareLock);
+
+	return (Datum) 0;
+}
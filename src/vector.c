@@ -646,6 +646,139 @@ vector_negative_inner_product(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8((double) -VectorInnerProduct(a->dim, a->x, b->x));
 }
 
+VECTOR_TARGET_CLONES static void
+VectorL2SquaredDistance4(int dim, float *ax, float **bx, double *distances)
+{
+	float	   *b0 = bx[0];
+	float	   *b1 = bx[1];
+	float	   *b2 = bx[2];
+	float	   *b3 = bx[3];
+	float		d0 = 0.0;
+	float		d1 = 0.0;
+	float		d2 = 0.0;
+	float		d3 = 0.0;
+
+	/* Auto-vectorized, with each load of ax used four times */
+	for (int i = 0; i < dim; i++)
+	{
+		float		axi = ax[i];
+		float		diff0 = axi - b0[i];
+		float		diff1 = axi - b1[i];
+		float		diff2 = axi - b2[i];
+		float		diff3 = axi - b3[i];
+
+		d0 += diff0 * diff0;
+		d1 += diff1 * diff1;
+		d2 += diff2 * diff2;
+		d3 += diff3 * diff3;
+	}
+
+	distances[0] = (double) d0;
+	distances[1] = (double) d1;
+	distances[2] = (double) d2;
+	distances[3] = (double) d3;
+}
+
+VECTOR_TARGET_CLONES static void
+VectorInnerProduct4(int dim, float *ax, float **bx, double *distances)
+{
+	float	   *b0 = bx[0];
+	float	   *b1 = bx[1];
+	float	   *b2 = bx[2];
+	float	   *b3 = bx[3];
+	float		d0 = 0.0;
+	float		d1 = 0.0;
+	float		d2 = 0.0;
+	float		d3 = 0.0;
+
+	/* Auto-vectorized, with each load of ax used four times */
+	for (int i = 0; i < dim; i++)
+	{
+		float		axi = ax[i];
+
+		d0 += axi * b0[i];
+		d1 += axi * b1[i];
+		d2 += axi * b2[i];
+		d3 += axi * b3[i];
+	}
+
+	distances[0] = (double) d0;
+	distances[1] = (double) d1;
+	distances[2] = (double) d2;
+	distances[3] = (double) d3;
+}
+
+/*
+ * Get the L2 squared distances from a vector to many vectors
+ *
+ * Vectors in an index have the same dimensions, so they are checked once
+ */
+void
+VectorL2SquaredDistances(Vector * a, Datum *values, int n, double *distances)
+{
+	float	   *bx[4];
+	int			i = 0;
+
+	if (n == 0)
+		return;
+
+	CheckDims(a, DatumGetVector(values[0]));
+
+	for (; i + 4 <= n; i += 4)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Assert(DatumGetVector(values[i + j])->dim == a->dim);
+			bx[j] = DatumGetVector(values[i + j])->x;
+		}
+
+		VectorL2SquaredDistance4(a->dim, a->x, bx, &distances[i]);
+	}
+
+	for (; i < n; i++)
+	{
+		Assert(DatumGetVector(values[i])->dim == a->dim);
+		distances[i] = (double) VectorL2SquaredDistance(a->dim, a->x, DatumGetVector(values[i])->x);
+	}
+}
+
+/*
+ * Get the negative inner products of a vector with many vectors
+ *
+ * Vectors in an index have the same dimensions, so they are checked once
+ */
+void
+VectorNegativeInnerProducts(Vector * a, Datum *values, int n, double *distances)
+{
+	float	   *bx[4];
+	int			i = 0;
+
+	if (n == 0)
+		return;
+
+	CheckDims(a, DatumGetVector(values[0]));
+
+	for (; i + 4 <= n; i += 4)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Assert(DatumGetVector(values[i + j])->dim == a->dim);
+			bx[j] = DatumGetVector(values[i + j])->x;
+		}
+
+		VectorInnerProduct4(a->dim, a->x, bx, &distances[i]);
+
+		for (int j = 0; j < 4; j++)
+			distances[i + j] = -distances[i + j];
+	}
+
+	for (; i < n; i++)
+	{
+		Assert(DatumGetVector(values[i])->dim == a->dim);
+		distances[i] = (double) -VectorInnerProduct(a->dim, a->x, DatumGetVector(values[i])->x);
+	}
+}
+
 VECTOR_TARGET_CLONES static double
 VectorCosineSimilarity(int dim, float *ax, float *bx)
 {
@@ -1341,7 +1474,7 @@ range_l2_distance(PG_FUNCTION_ARGS)
 	b = DatumGetVector(vecDatum);
 	CheckDims(a, b);
 	dis = VectorL2SquaredDistance(a->dim, a->x, b->x);
-	PG_RETURN_BOOL(dis <= DatumGetFloat4(threshold*threshold));
+	PG_RETURN_BOOL(dis <= DatumGetFloat4(threshold) * DatumGetFloat4(threshold));
 }
 
 PG_FUNCTION_INFO_V1(ANN_dwithin);
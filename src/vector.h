@@ -19,6 +19,8 @@ typedef struct Vector
 Vector	   *InitVector(int dim);
 void		PrintVector(char *msg, Vector * vector);
 int			vector_cmp_internal(Vector * a, Vector * b);
+void		VectorL2SquaredDistances(Vector * a, Datum *values, int n, double *distances);
+void		VectorNegativeInnerProducts(Vector * a, Datum *values, int n, double *distances);
 
 /* TODO Move to better place */
 #if PG_VERSION_NUM >= 160000
@@ -70,6 +70,13 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 SET hnsw.iterative_scan = relaxed_order;
 SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
+DELETE FROM t WHERE val = '[1,1,1]';
+VACUUM t;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+SET hnsw.iterative_scan = strict_order;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
 TRUNCATE t;
 SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
@@ -77,6 +84,26 @@ RESET hnsw.iterative_scan;
 RESET hnsw.ef_search;
 DROP TABLE t;
 
+-- adaptive ef_search
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) SELECT ARRAY[i, i % 7, i % 3] FROM generate_series(1, 100) i;
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+
+SELECT * FROM t ORDER BY val <-> '[50.2,3,1]' LIMIT 5;
+
+SET hnsw.ef_search_mode = adaptive;
+SELECT * FROM t ORDER BY val <-> '[50.2,3,1]' LIMIT 5;
+
+SET hnsw.ef_search = 4;
+SET hnsw.iterative_scan = relaxed_order;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[50.2,3,1]') t2;
+
+RESET hnsw.iterative_scan;
+RESET hnsw.ef_search;
+RESET hnsw.ef_search_mode;
+DROP TABLE t;
+
 -- unlogged
 
 CREATE UNLOGGED TABLE t (val vector(3));
@@ -87,6 +114,67 @@ SELECT * FROM t ORDER BY val <-> '[3,3,3]';
 
 DROP TABLE t;
 
+-- quantization
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantization = 'sq8');
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP INDEX t_val_idx;
+CREATE INDEX ON t USING hnsw (val vector_cosine_ops) WITH (quantization = 'binary');
+
+SELECT * FROM t ORDER BY val <=> '[1,2,3]';
+
+CREATE INDEX ON t USING hnsw (val vector_l1_ops) WITH (quantization = 'sq8');
+
+DROP TABLE t;
+
+-- batch
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops);
+
+SELECT b.query_idx, t.val FROM vector_knn_batch('t_val_idx', ARRAY['[3,3,3]', NULL, '[0,0,0]']::vector[], 2) b INNER JOIN t ON t.ctid = b.tid ORDER BY b.query_idx, b.distance;
+SELECT * FROM vector_knn_batch('t_val_idx', '{}', 0);
+SELECT * FROM vector_knn_batch('t_val_idx', ARRAY['[1,2]']::vector[], 1);
+
+CREATE INDEX quantized_idx ON t USING hnsw (val vector_cosine_ops) WITH (quantization = 'binary');
+SELECT t.val FROM vector_knn_batch('quantized_idx', ARRAY['[1,2,3]']::vector[], 1) b INNER JOIN t ON t.ctid = b.tid;
+
+DROP TABLE t;
+
+-- layout
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (layout = 'bfs');
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+DROP TABLE t;
+
+-- fastupdate
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (fastupdate = on);
+
+INSERT INTO t (val) VALUES ('[1,2,4]'), (NULL);
+
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT hnsw_merge_pending('t_val_idx');
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+SELECT hnsw_merge_pending('t_val_idx');
+
+DROP TABLE t;
+
 -- options
 
 CREATE TABLE t (val vector(3));
@@ -95,12 +183,18 @@ CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 101);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 3);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (ef_construction = 1001);
 CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (m = 16, ef_construction = 31);
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (quantization = 'pq');
+CREATE INDEX ON t USING hnsw (val vector_l2_ops) WITH (layout = 'random');
 
 SHOW hnsw.ef_search;
 
 SET hnsw.ef_search = 0;
 SET hnsw.ef_search = 1001;
 
+SHOW hnsw.ef_search_mode;
+
+SET hnsw.ef_search_mode = on;
+
 SHOW hnsw.iterative_scan;
 
 SET hnsw.iterative_scan = on;
@@ -114,4 +208,8 @@ SHOW hnsw.scan_mem_multiplier;
 SET hnsw.scan_mem_multiplier = 0;
 SET hnsw.scan_mem_multiplier = 1001;
 
+SHOW hnsw.pending_list_limit;
+
+SET hnsw.pending_list_limit = 63;
+
 DROP TABLE t;
@@ -66,6 +66,80 @@ RESET ivfflat.iterative_scan;
 RESET ivfflat.max_probes;
 DROP TABLE t;
 
+-- adaptive probes
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 3);
+
+SET ivfflat.probes = 3;
+SET ivfflat.probe_distance_gap = 0.2;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+SET ivfflat.probe_distance_gap = 1;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+SET ivfflat.probe_distance_gap = 3;
+SELECT * FROM t ORDER BY val <-> '[3,3,3]';
+
+RESET ivfflat.probes;
+RESET ivfflat.probe_distance_gap;
+DROP TABLE t;
+
+-- range
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[1,2,3]'), ('[1,1,1]'), (NULL);
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 1);
+
+INSERT INTO t (val) VALUES ('[1,2,4]');
+
+SELECT * FROM t WHERE val <<->> GenerateRangeQueryParams('[1,1,1]', 1.5);
+SELECT COUNT(*) FROM t WHERE val <<->> GenerateRangeQueryParams('[1,1,1]', 2.5);
+SELECT COUNT(*) FROM t WHERE val <<->> GenerateRangeQueryParams('[1,1,1]', 0);
+SELECT * FROM t WHERE val <<->> GenerateRangeQueryParams('[1,1,1]', 2.5) AND val <<->> GenerateRangeQueryParams('[0,0,0]', 2) ORDER BY val;
+
+DROP TABLE t;
+
+-- rebalance
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[10,10,10]');
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 2);
+
+INSERT INTO t (val) SELECT ARRAY[i % 5, i % 3, 0] FROM generate_series(1, 100) i;
+
+SELECT ivfflat_rebalance('t_val_idx', 1.5, 0.25);
+SELECT ivfflat_rebalance('t_val_idx', 1);
+
+SET ivfflat.probes = 3;
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[3,3,3]') t2;
+
+RESET ivfflat.probes;
+DROP TABLE t;
+
+-- center cache
+
+CREATE TABLE t (val vector(3));
+INSERT INTO t (val) VALUES ('[0,0,0]'), ('[0,0,1]'), ('[10,10,10]'), ('[10,10,11]');
+CREATE INDEX ON t USING ivfflat (val vector_l2_ops) WITH (lists = 2);
+
+SET ivfflat.probes = 1;
+SELECT * FROM t ORDER BY val <-> '[10,10,10]';
+
+TRUNCATE t;
+INSERT INTO t (val) VALUES ('[20,20,20]'), ('[20,20,21]'), ('[30,30,30]'), ('[30,30,31]');
+REINDEX INDEX t_val_idx;
+SELECT * FROM t ORDER BY val <-> '[30,30,30]';
+
+INSERT INTO t (val) SELECT ARRAY[30, 30, 30 + i % 2] FROM generate_series(1, 28) i;
+INSERT INTO t (val) SELECT ARRAY[40, 40, 40 + i % 2] FROM generate_series(1, 30) i;
+SELECT ivfflat_rebalance('t_val_idx', 1.5, 0.25);
+SELECT COUNT(*) FROM (SELECT * FROM t ORDER BY val <-> '[40,40,40]') t2;
+
+RESET ivfflat.probes;
+DROP TABLE t;
+
 -- unlogged
 
 CREATE UNLOGGED TABLE t (val vector(3));
@@ -96,4 +170,11 @@ SHOW ivfflat.max_probes;
 SET ivfflat.max_probes = 0;
 SET ivfflat.max_probes = 32769;
 
+SHOW ivfflat.centroid_cache_mem;
+
+SHOW ivfflat.probe_distance_gap;
+
+SET ivfflat.probe_distance_gap = -1;
+SET ivfflat.probe_distance_gap = 1001;
+
 DROP TABLE t;
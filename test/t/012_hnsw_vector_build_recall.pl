@@ -124,6 +124,50 @@ for my $i (0 .. $#operators)
 	like($stderr, qr/hnsw graph no longer fits into maintenance_work_mem/);
 
 	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Build index in partitions
+	($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET max_parallel_maintenance_workers = 0;
+		SET maintenance_work_mem = '1MB';
+		SET hnsw.partitioned_build = on;
+		CREATE INDEX idx ON tst USING hnsw (v $opclass);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/flushing hnsw graph partition 2/);
+
+	# Test approximate results
+	test_recall($min - 0.05, $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
+
+	# Build index in parallel with compact vectors
+	($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+		SET client_min_messages = DEBUG;
+		SET min_parallel_table_scan_size = 1;
+		SET hnsw.compact_build = on;
+		CREATE INDEX idx ON tst USING hnsw (v $opclass);
+	));
+	is($ret, 0, $stderr);
+	like($stderr, qr/using \d+ parallel workers/);
+
+	# Test approximate results
+	test_recall($min - 0.05, $operator);
+
+	$node->safe_psql("postgres", "DROP INDEX idx;");
 }
 
+# Test vacuum reaches pages of all partitions
+$node->safe_psql("postgres", "CREATE TABLE tst2 AS SELECT * FROM tst;");
+$node->safe_psql("postgres", qq(
+	SET max_parallel_maintenance_workers = 0;
+	SET maintenance_work_mem = '1MB';
+	SET hnsw.partitioned_build = on;
+	CREATE INDEX idx2 ON tst2 USING hnsw (v vector_l2_ops);
+));
+$node->safe_psql("postgres", "DELETE FROM tst2 WHERE i % 2 = 0;");
+my ($ret, $stdout, $stderr) = $node->psql("postgres", "VACUUM (VERBOSE, INDEX_CLEANUP ON) tst2;");
+is($ret, 0, $stderr);
+like($stderr, qr/index "idx2" now contains 5000 row versions/);
+
 done_testing();
@@ -0,0 +1,87 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Ensures one tuple per pending page
+my $dim = 1900;
+
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(
+autovacuum = off
+hnsw.pending_list_limit = 64
+));
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (v vector($dim));");
+$node->safe_psql("postgres", "CREATE INDEX ON tst USING hnsw (v vector_l2_ops) WITH (fastupdate = on);");
+
+sub count_rows
+{
+	my $count = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.ef_search = 1000;
+		SELECT COUNT(*) FROM (SELECT v FROM tst ORDER BY v <-> (SELECT v FROM tst LIMIT 1)) t;
+	));
+	return $count;
+}
+
+# Inserts merge the oldest pages while the list is over the limit
+$node->pgbench(
+	"--no-vacuum --client=10 --transactions=10",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent INSERTs",
+	{
+		"045_hnsw_fastupdate" => "INSERT INTO tst SELECT ARRAY[$array_sql] FROM generate_series(1, 5) i;"
+	}
+);
+
+# Rows are returned from both the graph and the pending list
+cmp_ok(count_rows(), ">=", 495);
+
+# Steps only merge down to the limit
+my $pending = $node->safe_psql("postgres", "SELECT hnsw_merge_pending('tst_v_idx');");
+cmp_ok($pending, ">", 0);
+
+is($node->safe_psql("postgres", "SELECT hnsw_merge_pending('tst_v_idx');"), 0);
+cmp_ok(count_rows(), ">=", 495);
+
+# Vacuum merges the pending list before removing dead tuples
+$node->safe_psql("postgres", "INSERT INTO tst SELECT ARRAY[$array_sql] FROM generate_series(1, 5) i;");
+$node->safe_psql("postgres", "DELETE FROM tst WHERE ctid IN (SELECT ctid FROM tst LIMIT 100);");
+$node->safe_psql("postgres", "VACUUM tst;");
+is($node->safe_psql("postgres", "SELECT hnsw_merge_pending('tst_v_idx');"), 0);
+cmp_ok(count_rows(), ">=", 400);
+
+# Merges that are canceled can be restarted
+$node->safe_psql("postgres", qq(
+	SET hnsw.pending_list_limit = '1GB';
+	INSERT INTO tst SELECT ARRAY[$array_sql] FROM generate_series(1, 200) i;
+));
+for my $timeout (1 .. 5)
+{
+	$node->psql("postgres", qq(
+		SET statement_timeout = ${timeout};
+		SELECT hnsw_merge_pending('tst_v_idx');
+	));
+}
+$node->safe_psql("postgres", "SELECT hnsw_merge_pending('tst_v_idx');");
+my $counts = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	SET hnsw.ef_search = 1000;
+	SELECT COUNT(*), COUNT(DISTINCT ctid) FROM (SELECT ctid FROM tst ORDER BY v <-> (SELECT v FROM tst LIMIT 1)) t;
+));
+my ($count, $distinct) = split(/\|/, $counts);
+is($count, $distinct);
+cmp_ok($count, ">=", 595);
+
+done_testing();
@@ -0,0 +1,106 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(autovacuum = off));
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 3000) i;"
+);
+
+# Fail the build at a given row
+$node->safe_psql("postgres", qq(
+	CREATE FUNCTION fail_at(v vector, i int4) RETURNS vector AS \$\$
+	BEGIN
+		IF i = COALESCE(NULLIF(current_setting('test.fail_at', true), ''), '0')::int4 THEN
+			RAISE EXCEPTION 'interrupted';
+		END IF;
+		RETURN v;
+	END
+	\$\$ LANGUAGE plpgsql IMMUTABLE;
+));
+
+sub count_rows
+{
+	return $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SET hnsw.ef_search = 1000;
+		SET hnsw.iterative_scan = relaxed_order;
+		SET hnsw.max_scan_tuples = 100000;
+		SELECT COUNT(*) FROM (SELECT i FROM tst ORDER BY fail_at(v, i)::vector($dim) <-> '[0,0,0]' LIMIT 100000) t;
+	));
+}
+
+# Interrupt a build with checkpoints
+my ($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET hnsw.build_checkpoint_tuples = 500;
+	SET test.fail_at = 2500;
+	CREATE INDEX CONCURRENTLY idx ON tst USING hnsw ((fail_at(v, i)::vector($dim)) vector_l2_ops);
+));
+isnt($ret, 0);
+like($stderr, qr/interrupted/);
+like($stderr, qr/hnsw build checkpoint at heap block \d+/);
+is($node->safe_psql("postgres", "SELECT indisvalid FROM pg_index WHERE indexrelid = 'idx'::regclass;"), "f");
+
+# Change rows before resuming
+$node->safe_psql("postgres", "INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(3001, 3100) i;");
+$node->safe_psql("postgres", "UPDATE tst SET v = ARRAY[$array_sql] WHERE i <= 10;");
+
+# Resume from the last checkpoint
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SELECT hnsw_resume_build('idx');
+));
+is($ret, 0, $stderr);
+like($stderr, qr/resuming hnsw build at heap block \d+/);
+cmp_ok($stdout, ">", 0);
+cmp_ok($stdout, "<", 3100);
+is($node->safe_psql("postgres", "SELECT indisvalid FROM pg_index WHERE indexrelid = 'idx'::regclass;"), "t");
+
+# Index is used and has all rows
+my $explain = $node->safe_psql("postgres", qq(
+	SET enable_seqscan = off;
+	EXPLAIN SELECT i FROM tst ORDER BY fail_at(v, i)::vector($dim) <-> '[0,0,0]' LIMIT 10;
+));
+like($explain, qr/Index Scan using idx/);
+is(count_rows(), "3100");
+
+# Completed builds cannot be resumed
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_resume_build('idx');");
+like($stderr, qr/is not an interrupted build/);
+
+# Interrupt another build
+($ret, $stdout, $stderr) = $node->psql("postgres", qq(
+	SET client_min_messages = DEBUG;
+	SET hnsw.build_checkpoint_tuples = 500;
+	SET test.fail_at = 2500;
+	CREATE INDEX CONCURRENTLY idx2 ON tst USING hnsw ((fail_at(v, i)::vector($dim)) vector_l2_ops);
+));
+isnt($ret, 0);
+like($stderr, qr/hnsw build checkpoint at heap block \d+/);
+
+# Vacuum may reuse heap TIDs of checkpointed rows
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i <= 10;");
+$node->safe_psql("postgres", "VACUUM tst;");
+$node->poll_query_until("postgres", "SELECT vacuum_count = 1 FROM pg_stat_user_tables WHERE relname = 'tst';");
+
+# Builds cannot be resumed after a vacuum
+($ret, $stdout, $stderr) = $node->psql("postgres", "SELECT hnsw_resume_build('idx2');");
+isnt($ret, 0);
+like($stderr, qr/may have been vacuumed since the build checkpoint/);
+is($node->safe_psql("postgres", "SELECT indisvalid FROM pg_index WHERE indexrelid = 'idx2'::regclass;"), "f");
+
+done_testing();
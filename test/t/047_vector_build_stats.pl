@@ -0,0 +1,85 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 10000) i;"
+);
+
+# Stats are kept for the last build in the session
+sub build_stats
+{
+	my ($settings, $index_sql, $stats_sql) = @_;
+	return $node->safe_psql("postgres", qq(
+		SET client_min_messages = WARNING;
+		$settings
+		$index_sql
+		$stats_sql
+	));
+}
+
+# Serial hnsw build
+my $stats = build_stats(
+	"SET max_parallel_maintenance_workers = 0;",
+	"CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);",
+	"SELECT phase, tuples, distances > 0, memory > 0, spills FROM vector_build_stats WHERE participant = 0 ORDER BY phase;"
+);
+like($stats, qr/^loading tuples\|10000\|t\|t\|0$/m);
+like($stats, qr/^writing pages\|10000\|/m);
+like($stats, qr/^mapping heap tids\|10000\|/m);
+is($node->safe_psql("postgres", "SELECT COUNT(*) FROM vector_build_stats;"), "0");
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Partitioned hnsw build
+$stats = build_stats(
+	"SET max_parallel_maintenance_workers = 0; SET maintenance_work_mem = '1MB'; SET hnsw.partitioned_build = on;",
+	"CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);",
+	"SELECT spills > 0 FROM vector_build_stats WHERE phase = 'loading tuples';"
+);
+like($stats, qr/^t$/m);
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Parallel hnsw build
+$stats = build_stats(
+	"SET min_parallel_table_scan_size = 1;",
+	"CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);",
+	"SELECT index, COUNT(DISTINCT participant) > 1, SUM(tuples) FROM vector_build_stats WHERE phase = 'loading tuples' GROUP BY index;"
+);
+like($stats, qr/^idx\|t\|10000$/m);
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Serial ivfflat build
+$stats = build_stats(
+	"SET max_parallel_maintenance_workers = 0;",
+	"CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);",
+	"SELECT phase, tuples, distances > 0 FROM vector_build_stats ORDER BY phase;"
+);
+like($stats, qr/^sampling table\|10000\|f$/m);
+like($stats, qr/^performing k-means\|10000\|t$/m);
+like($stats, qr/^assigning tuples\|10000\|t$/m);
+like($stats, qr/^sorting tuples\|0\|f$/m);
+like($stats, qr/^loading tuples\|10000\|f$/m);
+$node->safe_psql("postgres", "DROP INDEX idx;");
+
+# Parallel ivfflat build
+$stats = build_stats(
+	"SET min_parallel_table_scan_size = 1;",
+	"CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);",
+	"SELECT COUNT(DISTINCT participant) > 1, SUM(tuples), SUM(distances) FROM vector_build_stats WHERE phase = 'assigning tuples';"
+);
+like($stats, qr/^t\|10000\|100000$/m);
+
+done_testing();
@@ -0,0 +1,64 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->start;
+
+# Create table
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim), c int4);");
+
+sub insert_vectors
+{
+	$node->safe_psql("postgres",
+		"INSERT INTO tst SELECT i, ARRAY[$array_sql], i % 10 FROM generate_series(1, 1000) i;"
+	);
+
+	# Duplicates share elements, and only half of them match the filter
+	for my $i (1001 .. 1020)
+	{
+		$node->safe_psql("postgres", "INSERT INTO tst VALUES ($i, '[1,1,1]', $i % 2);");
+	}
+}
+
+sub test_duplicates
+{
+	my ($c) = @_;
+	my $res = $node->safe_psql("postgres", qq(
+		SET enable_seqscan = off;
+		SELECT string_agg(i::text, ',' ORDER BY i) FROM (SELECT i FROM tst WHERE c = $c ORDER BY v <-> '[1,1,1]' LIMIT 10) t;
+	));
+	my $expected = join(",", grep { $_ % 2 == $c } (1001 .. 1020));
+	is($res, $expected);
+}
+
+# Test duplicates with build
+insert_vectors();
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops);");
+test_duplicates(0);
+test_duplicates(1);
+
+# Test duplicates with an attribute index
+$node->safe_psql("postgres", "CREATE INDEX attribute_idx ON tst (c);");
+$node->safe_psql("postgres", "ANALYZE tst;");
+test_duplicates(0);
+test_duplicates(1);
+$node->safe_psql("postgres", "DROP INDEX attribute_idx;");
+
+# Reset
+$node->safe_psql("postgres", "TRUNCATE tst;");
+
+# Test duplicates with inserts
+insert_vectors();
+test_duplicates(0);
+test_duplicates(1);
+
+done_testing();
@@ -0,0 +1,60 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(autovacuum = off));
+$node->start;
+
+# Create table with two clusters, one list each
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random() * 0.1 + (i % 2) * 10, random() * 0.1 + (i % 2) * 10, random() * 0.1 + (i % 2) * 10] FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 2);");
+
+# The query is closer to the other center, so the list of the far item
+# is only probed when its radius covers the item
+my $query = "GenerateRangeQueryParams('[4.95,4.95,4.95]', 0.5)";
+
+sub count_range
+{
+	my ($index) = @_;
+	my $settings = $index ? "SET enable_seqscan = off; SET ivfflat.probes = 1;" : "SET enable_indexscan = off; SET enable_bitmapscan = off;";
+	return $node->safe_psql("postgres", qq(
+		$settings
+		SELECT COUNT(*) FROM tst WHERE v <<->> $query;
+	));
+}
+
+# Radius grows on insert
+$node->safe_psql("postgres", "INSERT INTO tst VALUES (0, '[5.15,5.15,5.15]');");
+is(count_range(1), "1");
+
+# Vacuum refreshes stats
+$node->safe_psql("postgres", "DELETE FROM tst WHERE i = 0;");
+$node->safe_psql("postgres", "VACUUM tst;");
+is(count_range(1), "0");
+$node->safe_psql("postgres", "INSERT INTO tst VALUES (0, '[5.15,5.15,5.15]');");
+is(count_range(1), "1");
+
+# Inserts during vacuum are kept
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=50",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent inserts and vacuum",
+	{
+		"049_ivfflat_list_stats_insert" => "INSERT INTO tst VALUES (1, ARRAY[5.1 + random() * 0.1, 5.1 + random() * 0.1, 5.1 + random() * 0.1]); DELETE FROM tst WHERE i = 1 AND random() < 0.5;",
+		"049_ivfflat_list_stats_vacuum" => "VACUUM tst;"
+	}
+);
+is(count_range(1), count_range(0));
+
+done_testing();
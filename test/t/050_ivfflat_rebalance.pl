@@ -0,0 +1,47 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(autovacuum = off));
+$node->start;
+
+# Create table and index
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector(3));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[random(), random(), random()] FROM generate_series(1, 10000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING ivfflat (v vector_l2_ops) WITH (lists = 10);");
+$node->safe_psql("postgres", "SELECT ivfflat_rebalance('idx', 1.1, 0.9);");
+
+my $size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+
+# Scans see every row once while lists are rewritten
+$node->pgbench(
+	"--no-vacuum --client=5 --transactions=50",
+	0,
+	[qr{actually processed}],
+	[qr{^$}],
+	"concurrent scans and rebalance",
+	{
+		"050_ivfflat_rebalance_scan" => q(SET enable_seqscan = off;
+SET ivfflat.probes = 100;
+SELECT COUNT(DISTINCT i) AS d, COUNT(*) AS c FROM (SELECT i FROM tst ORDER BY v <-> '[0.5,0.5,0.5]') t \gset
+\if :d != 10000 OR :c != 10000
+SELECT 1 / 0;
+\endif
+),
+		"050_ivfflat_rebalance" => "SELECT ivfflat_rebalance('idx', 1.1, 0.9);"
+	}
+);
+
+# Pages of old lists are reused
+my $new_size = $node->safe_psql("postgres", "SELECT pg_relation_size('idx');");
+cmp_ok($new_size, "<", $size * 2);
+
+done_testing();
@@ -0,0 +1,50 @@
+use strict;
+use warnings FATAL => 'all';
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $dim = 3;
+my $array_sql = join(",", ('random()') x $dim);
+
+# Initialize node
+my $node = PostgreSQL::Test::Cluster->new('node');
+$node->init;
+$node->append_conf('postgresql.conf', qq(autovacuum = off));
+$node->start;
+
+# Create table and index with several upper layers
+$node->safe_psql("postgres", "CREATE EXTENSION vector;");
+$node->safe_psql("postgres", "CREATE TABLE tst (i int4, v vector($dim));");
+$node->safe_psql("postgres",
+	"INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1, 1000) i;"
+);
+$node->safe_psql("postgres", "CREATE INDEX idx ON tst USING hnsw (v vector_l2_ops) WITH (m = 4);");
+
+my $matches = 0;
+for (1 .. 10)
+{
+	my @r = map { rand() } (1 .. $dim);
+	my $query = "[" . join(",", @r) . "]";
+
+	# Deletes and new entry points invalidate the cache of the session
+	my $res = $node->safe_psql("postgres", qq(
+		SET hnsw.upper_cache_mem = '1MB';
+		SET enable_seqscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT 1;
+		DELETE FROM tst WHERE i % 2 = 0;
+		VACUUM tst;
+		INSERT INTO tst SELECT i, ARRAY[$array_sql] FROM generate_series(1000, 1100) i;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT 1;
+	));
+	my @lines = split("\n", $res);
+
+	my $expected = $node->safe_psql("postgres", qq(
+		SET enable_indexscan = off;
+		SELECT i FROM tst ORDER BY v <-> '$query' LIMIT 1;
+	));
+	$matches++ if $lines[-1] eq $expected;
+}
+cmp_ok($matches, ">=", 9);
+
+done_testing();